@@ -23,26 +23,23 @@
 #include <netdutils/BackoffSequence.h>
 #include <netdutils/DumpWriter.h>
 #include <netdutils/InternetAddresses.h>
-#include <netdutils/ThreadUtil.h>
-#include <thread>
 #include <utility>
 
 #include <arpa/inet.h>
 
 #include "DnsResolver.h"
+#include "TaskScheduler.h"
 #include "getaddrinfo.h"
 #include "netd_resolv/resolv.h"
 #include "stats.pb.h"
 
 namespace android {
 
-using android::base::StringPrintf;
 using android::net::NetworkDnsEventReported;
 using netdutils::DumpWriter;
 using netdutils::IPAddress;
 using netdutils::IPPrefix;
 using netdutils::ScopedAddrinfo;
-using netdutils::setThreadName;
 
 namespace net {
 
@@ -63,52 +60,43 @@ void Dns64Configuration::startPrefixDiscovery(unsigned netId) {
     // Emplace a copy of |cfg| in the map.
     mDns64Configs.emplace(std::make_pair(netId, cfg));
 
+    auto backoff = std::make_shared<netdutils::BackoffSequence<>>(
+            netdutils::BackoffSequence<>::Builder()
+                    .withInitialRetransmissionTime(std::chrono::seconds(1))
+                    .withMaximumRetransmissionTime(std::chrono::seconds(3600))
+                    .build());
+
+    // A discovery still waiting for a retry would only find out that it is outdated then.
+    TaskScheduler::getInstance()->cancel(netId, kDiscoveryTaskTag);
     // Note that capturing |cfg| in this lambda creates a copy.
-    std::thread discovery_thread([this, cfg, netId] {
-        setThreadName(StringPrintf("Nat64Pfx_%u", netId).c_str());
-
-        // Make a mutable copy rather than mark the whole lambda mutable.
-        // No particular reason.
-        Dns64Config evalCfg(cfg);
-
-        auto backoff = netdutils::BackoffSequence<>::Builder()
-                               .withInitialRetransmissionTime(std::chrono::seconds(1))
-                               .withMaximumRetransmissionTime(std::chrono::seconds(3600))
-                               .build();
-
-        while (true) {
-            if (!this->shouldContinueDiscovery(evalCfg)) break;
-
-            android_net_context netcontext{};
-            mGetNetworkContextCallback(evalCfg.netId, 0, &netcontext);
-
-            // Prefix discovery must bypass private DNS because in strict mode
-            // the server generally won't know the NAT64 prefix.
-            netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
-            if (doRfc7050PrefixDiscovery(netcontext, &evalCfg)) {
-                this->recordDns64Config(evalCfg);
-                break;
-            }
-
-            if (!this->shouldContinueDiscovery(evalCfg)) break;
-
-            if (!backoff.hasNextTimeout()) break;
-            {
-                std::unique_lock<std::mutex> cvGuard(mMutex);
-                // TODO: Consider some chrono math, combined with wait_until()
-                // perhaps, to prevent early re-resolves from the removal of
-                // other netids with IPv6-only nameservers.
-                mCv.wait_for(cvGuard, backoff.getNextTimeout());
-            }
-        }
-    });
-    discovery_thread.detach();
+    TaskScheduler::getInstance()->schedule(
+            netId, kDiscoveryTaskTag, std::chrono::milliseconds(0),
+            [this, cfg, backoff]() -> std::optional<std::chrono::milliseconds> {
+                if (!this->shouldContinueDiscovery(cfg)) return std::nullopt;
+
+                // Make a mutable copy for doRfc7050PrefixDiscovery() to fill in.
+                Dns64Config evalCfg(cfg);
+                android_net_context netcontext{};
+                mGetNetworkContextCallback(evalCfg.netId, 0, &netcontext);
+
+                // Prefix discovery must bypass private DNS because in strict mode
+                // the server generally won't know the NAT64 prefix.
+                netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
+                if (doRfc7050PrefixDiscovery(netcontext, &evalCfg)) {
+                    this->recordDns64Config(evalCfg);
+                    return std::nullopt;
+                }
+
+                if (!this->shouldContinueDiscovery(evalCfg)) return std::nullopt;
+                if (!backoff->hasNextTimeout()) return std::nullopt;
+                return backoff->getNextTimeout();
+            });
 }
 
 void Dns64Configuration::stopPrefixDiscovery(unsigned netId) {
     std::lock_guard guard(mMutex);
     removeDns64Config(netId);
-    mCv.notify_all();
+    TaskScheduler::getInstance()->cancel(netId, kDiscoveryTaskTag);
 }
 
 IPPrefix Dns64Configuration::getPrefix64Locked(unsigned netId) const REQUIRES(mMutex) {
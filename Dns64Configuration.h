@@ -18,7 +18,6 @@
 #define DNS_DNS64CONFIGURATION_H_
 
 #include <netinet/in.h>
-#include <condition_variable>
 #include <cstdlib>
 #include <mutex>
 #include <unordered_map>
@@ -40,7 +39,7 @@ namespace net {
  * nameserver is added or the network is deleted.)
  *
  * Each time prefix discovery is started, a new discoveryId is generated so
- * that running resolution threads can notice they are no longer the most
+ * that running resolution tasks can notice they are no longer the most
  * recent resolution attempt. This results in the backoff schedule of resolution
  * being reset.
  *
@@ -102,6 +101,8 @@ class Dns64Configuration {
     };
 
     static constexpr int kNoDiscoveryId = 0;
+    // Tag of the discovery tasks in the TaskScheduler.
+    static constexpr char kDiscoveryTaskTag[] = "Nat64Prefix";
 
     enum { PREFIX_REMOVED, PREFIX_ADDED };
 
@@ -120,7 +121,6 @@ class Dns64Configuration {
     void removeDns64Config(unsigned netId) REQUIRES(mMutex);
 
     mutable std::mutex mMutex;
-    std::condition_variable mCv;
     unsigned int mNextId GUARDED_BY(mMutex);
     std::unordered_map<unsigned, Dns64Config> mDns64Configs GUARDED_BY(mMutex);
     const GetNetworkContextCallback mGetNetworkContextCallback;
@@ -24,6 +24,7 @@
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <resolv.h>  // b64_pton()
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,10 @@
 #define LOG_TAG "resolv"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <tuple>
 #include <vector>
 
 #include <android-base/stringprintf.h>
@@ -49,8 +54,11 @@
 #include <sysutils/SocketClient.h>
 
 #include "DnsResolver.h"
+#include "Experiments.h"
+#include "LookupCoalescer.h"
 #include "NetdPermissions.h"
 #include "PrivateDnsConfiguration.h"
+#include "QueryTrace.h"
 #include "ResolverEventReporter.h"
 #include "dnsproxyd_protocol/DnsProxydProtocol.h"  // NETID_USE_LOCAL_NAMESERVERS
 #include "getaddrinfo.h"
@@ -77,6 +85,17 @@ constexpr int MAX_QUERIES_PER_UID = 256;
 
 android::netdutils::OperationLimiter<uid_t> queryLimiter(MAX_QUERIES_PER_UID);
 
+// Starts a query of |uid|, unless it has too many outstanding already.
+bool startQuery(uid_t uid) {
+    ScopedQueryStage stage(QueryStage::QUERY_LIMITER);
+    return queryLimiter.start(uid);
+}
+
+// The number of getaddrinfo requests received, and how many of them were answered inline by the
+// listener thread without dispatching a handler thread.
+std::atomic<uint64_t> sGetAddrInfoCount = 0;
+std::atomic<uint64_t> sGetAddrInfoInlineCount = 0;
+
 void logArguments(int argc, char** argv) {
     if (!WOULD_LOG(VERBOSE)) return;
     for (int i = 0; i < argc; i++) {
@@ -117,9 +136,9 @@ constexpr bool requestingUseLocalNameservers(unsigned flags) {
 
 bool queryingViaTls(unsigned dns_netid) {
     const auto privateDnsStatus = gPrivateDnsConfiguration.getStatus(dns_netid);
-    switch (privateDnsStatus.mode) {
+    switch (privateDnsStatus->mode) {
         case PrivateDnsMode::OPPORTUNISTIC:
-            return !privateDnsStatus.validatedServers().empty();
+            return !privateDnsStatus->validatedServers().empty();
         case PrivateDnsMode::STRICT:
             return true;
         default:
@@ -144,7 +163,7 @@ bool hasPermissionToBypassPrivateDns(uid_t uid) {
     return false;
 }
 
-void maybeFixupNetContext(android_net_context* ctx, pid_t pid) {
+void maybeFixupNetContext(android_net_context* ctx, SocketClient* client) {
     if (requestingUseLocalNameservers(ctx->flags) && !hasPermissionToBypassPrivateDns(ctx->uid)) {
         // Not permitted; clear the flag.
         ctx->flags &= ~NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
@@ -158,7 +177,9 @@ void maybeFixupNetContext(android_net_context* ctx, pid_t pid) {
             ctx->flags |= NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS;
         }
     }
-    ctx->pid = pid;
+    ctx->pid = client->getPid();
+    // Lets the resolver abandon the lookup if the client hangs up before getting the answer.
+    ctx->client_fd = client->getSocket();
 }
 
 void addIpAddrWithinLimit(std::vector<std::string>* ip_addrs, const sockaddr* addr,
@@ -247,6 +268,9 @@ int resNSendToAiError(int err, int rcode) {
     if (err > 0) {
         return rcodeToAiError(rcode);
     }
+    if (rcode == RCODE_DEADLINE_EXCEEDED) {
+        return NETD_RESOLV_DEADLINE_EXCEEDED;
+    }
     if (err == -ETIMEDOUT) {
         return NETD_RESOLV_TIMEOUT;
     }
@@ -294,7 +318,7 @@ bool parseQuery(const uint8_t* msg, size_t msgLen, uint16_t* query_id, int* rr_t
 // Note: Even if it returns PDM_OFF, it doesn't mean there's no DoT stats in the message
 // because Private DNS mode can change at any time.
 PrivateDnsModes getPrivateDnsModeForMetrics(uint32_t netId) {
-    switch (gPrivateDnsConfiguration.getStatus(netId).mode) {
+    switch (gPrivateDnsConfiguration.getStatus(netId)->mode) {
         case PrivateDnsMode::OFF:
             // It can also be due to netId not found.
             return PrivateDnsModes::PDM_OFF;
@@ -342,7 +366,7 @@ void maybeLogQuery(int eventType, const android_net_context& netContext,
             const int timeTakenMs = event.latency_micros() / 1000;
             DnsQueryLog::Record record(netContext.dns_netid, netContext.uid, netContext.pid,
                                        query_name, ip_addrs, timeTakenMs);
-            gDnsResolv->dnsQueryLog().push(std::move(record));
+            gDnsResolv->dnsQueryLog().push(record);
             return;
         }
     }
@@ -475,6 +499,7 @@ bool isValidNat64Prefix(const netdutils::IPPrefix prefix) {
 }
 
 bool synthesizeNat64PrefixWithARecord(const netdutils::IPPrefix& prefix, struct hostent* hp) {
+    ScopedQueryStage stage(QueryStage::DNS64);
     if (hp == nullptr) return false;
     if (!onlyNonSpecialUseIPv4Addresses(hp)) return false;
     if (!isValidNat64Prefix(prefix)) return false;
@@ -510,6 +535,7 @@ bool synthesizeNat64PrefixWithARecord(const netdutils::IPPrefix& prefix, struct
 }
 
 bool synthesizeNat64PrefixWithARecord(const netdutils::IPPrefix& prefix, addrinfo* result) {
+    ScopedQueryStage stage(QueryStage::DNS64);
     if (result == nullptr) return false;
     if (!onlyNonSpecialUseIPv4Addresses(result)) return false;
     if (!isValidNat64Prefix(prefix)) return false;
@@ -553,6 +579,84 @@ std::string makeThreadName(unsigned netId, uint32_t uid) {
     return android::base::StringPrintf("Dns_%u_%u", netId, multiuser_get_app_id(uid));
 }
 
+bool lookupCoalescingEnabled() {
+    return Experiments::getInstance()->getFlag("lookup_coalescing", 0);
+}
+
+// Returns when a client sharing another client's lookup on |netId| stops waiting for it.
+std::chrono::steady_clock::time_point coalescedLookupDeadline(unsigned netId) {
+    return std::chrono::steady_clock::now() +
+           std::chrono::milliseconds(resolv_cache_get_deadline_msec(netId));
+}
+
+// Returns whether the client on |fd| has closed its end, as in ResState::isCancelled().
+bool clientHungUp(int fd) {
+    pollfd fds = {.fd = fd, .events = 0};
+    return poll(&fds, 1, 0) == 1 && (fds.revents & (POLLHUP | POLLERR));
+}
+
+// Identifies a getaddrinfo request for coalescing. The UID is deliberately not part of the key
+// so that identical requests from different apps share one lookup; everything else that can
+// affect the answer (networks, marks, flags and hints) is.
+struct GetAddrInfoKey {
+    unsigned dnsNetId;
+    uint32_t appMark;
+    uint32_t dnsMark;
+    uint32_t flags;
+    std::string host;
+    std::string service;
+    int aiFlags;
+    int aiFamily;
+    int aiSocktype;
+    int aiProtocol;
+
+    bool operator<(const GetAddrInfoKey& o) const {
+        return std::tie(dnsNetId, appMark, dnsMark, flags, host, service, aiFlags, aiFamily,
+                        aiSocktype, aiProtocol) < std::tie(o.dnsNetId, o.appMark, o.dnsMark,
+                                                           o.flags, o.host, o.service, o.aiFlags,
+                                                           o.aiFamily, o.aiSocktype, o.aiProtocol);
+    }
+};
+
+struct GetAddrInfoResult {
+    GetAddrInfoResult() = default;
+    GetAddrInfoResult(const GetAddrInfoResult&) = delete;
+    GetAddrInfoResult& operator=(const GetAddrInfoResult&) = delete;
+    ~GetAddrInfoResult() { freeaddrinfo(ai); }
+
+    int32_t rv = 0;
+    addrinfo* ai = nullptr;
+    // The queries the lookup sent, reported again by each client sharing it.
+    DnsQueryEvents dnsQueryEvents;
+};
+
+struct GetHostByNameKey {
+    unsigned dnsNetId;
+    uint32_t appMark;
+    uint32_t dnsMark;
+    uint32_t flags;
+    std::string name;
+    int af;
+
+    bool operator<(const GetHostByNameKey& o) const {
+        return std::tie(dnsNetId, appMark, dnsMark, flags, name, af) <
+               std::tie(o.dnsNetId, o.appMark, o.dnsMark, o.flags, o.name, o.af);
+    }
+};
+
+// hp, if not null, points to hbuf, whose pointers point into buf.
+struct GetHostByNameResult {
+    int32_t rv = 0;
+    hostent hbuf;
+    char buf[MAXPACKET];
+    hostent* hp = nullptr;
+    // The queries the lookup sent, reported again by each client sharing it.
+    DnsQueryEvents dnsQueryEvents;
+};
+
+LookupCoalescer<GetAddrInfoKey, GetAddrInfoResult> sGetAddrInfoCoalescer;
+LookupCoalescer<GetHostByNameKey, GetHostByNameResult> sGetHostByNameCoalescer;
+
 }  // namespace
 
 DnsProxyListener::DnsProxyListener() : FrameworkListener(SOCKET_NAME) {
@@ -563,6 +667,18 @@ DnsProxyListener::DnsProxyListener() : FrameworkListener(SOCKET_NAME) {
     registerCmd(new GetDnsNetIdCommand());
 }
 
+void DnsProxyListener::dump(netdutils::DumpWriter& dw) const {
+    const uint64_t total = sGetAddrInfoCount;
+    const uint64_t inlined = sGetAddrInfoInlineCount;
+    dw.println("getaddrinfo requests: %" PRIu64 ", answered inline: %" PRIu64 " (%.1f%%)", total,
+               inlined, total ? 100.0 * inlined / total : 0.0);
+    dw.println("Coalesced lookups: getaddrinfo %" PRIu64 "/%" PRIu64 ", gethostbyname %" PRIu64
+               "/%" PRIu64,
+               sGetAddrInfoCoalescer.coalescedCount(), sGetAddrInfoCoalescer.leaderCount(),
+               sGetHostByNameCoalescer.coalescedCount(), sGetHostByNameCoalescer.leaderCount());
+    QueryTraceStats::getInstance()->dump(dw);
+}
+
 DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(SocketClient* c, char* host, char* service,
                                                          addrinfo* hints,
                                                          const android_net_context& netcontext)
@@ -593,7 +709,7 @@ static bool sendLenAndData(SocketClient* c, const int len, const void* data) {
 }
 
 // Returns true on success
-static bool sendhostent(SocketClient* c, hostent* hp) {
+static bool sendhostent(SocketClient* c, const hostent* hp) {
     bool success = true;
     int i;
     if (hp->h_name != nullptr) {
@@ -620,7 +736,7 @@ static bool sendhostent(SocketClient* c, hostent* hp) {
     return success;
 }
 
-static bool sendaddrinfo(SocketClient* c, addrinfo* ai) {
+static bool sendaddrinfo(SocketClient* c, const addrinfo* ai) {
     // struct addrinfo {
     //      int     ai_flags;       /* AI_PASSIVE, AI_CANONNAME, AI_NUMERICHOST */
     //      int     ai_family;      /* PF_xxx */
@@ -676,7 +792,7 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
     if (ipv6WantedButNoData) {
         // If caller wants IPv6 answers but no data, try to query IPv4 answers for synthesis
         const uid_t uid = mClient->getUid();
-        if (queryLimiter.start(uid)) {
+        if (startQuery(uid)) {
             mHints->ai_family = AF_INET;
             // Don't need to do freeaddrinfo(res) before starting new DNS lookup because previous
             // DNS lookup is failed with error EAI_NODATA.
@@ -706,23 +822,68 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
 }
 
 void DnsProxyListener::GetAddrInfoHandler::run() {
+    ScopedQueryTrace trace(&mTrace);
     LOG(DEBUG) << "GetAddrInfoHandler::run: {" << mNetContext.app_netid << " "
                << mNetContext.app_mark << " " << mNetContext.dns_netid << " "
                << mNetContext.dns_mark << " " << mNetContext.uid << " " << mNetContext.flags << "}";
 
-    addrinfo* result = nullptr;
+    addrinfo* result = nullptr;                                // owned, if not coalesced
+    std::shared_ptr<const GetAddrInfoResult> coalescedResult;  // shared with other handlers
     Stopwatch s;
-    maybeFixupNetContext(&mNetContext, mClient->getPid());
+    maybeFixupNetContext(&mNetContext, mClient);
     const uid_t uid = mClient->getUid();
     int32_t rv = 0;
     NetworkDnsEventReported event;
     initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
-        if (evaluate_domain_name(mNetContext, mHost)) {
-            rv = resolv_getaddrinfo(mHost, mService, mHints, &mNetContext, &result,
-                                    &event);
-        } else {
+    const auto lookup = [this, &event](addrinfo** res) {
+        int32_t ret = resolv_getaddrinfo(mHost, mService, mHints, &mNetContext, res, &event);
+        doDns64Synthesis(&ret, res, &event);
+        return ret;
+    };
+    if (startQuery(uid)) {
+        if (!evaluate_domain_name(mNetContext, mHost)) {
             rv = EAI_SYSTEM;
+        } else if (mHost != nullptr && lookupCoalescingEnabled()) {
+            // Other clients may share this lookup, so it must not be abandoned if this one leaves.
+            // If this one only shares another client's lookup, it can stop waiting instead.
+            const int clientFd = mNetContext.client_fd;
+            mNetContext.client_fd = -1;
+            // Build the key before the lookup, as DNS64 synthesis may modify mHints.
+            const GetAddrInfoKey key = {
+                    .dnsNetId = mNetContext.dns_netid,
+                    .appMark = mNetContext.app_mark,
+                    .dnsMark = mNetContext.dns_mark,
+                    .flags = mNetContext.flags,
+                    .host = mHost,
+                    .service = mService ? mService : "",
+                    .aiFlags = mHints ? mHints->ai_flags : 0,
+                    .aiFamily = mHints ? mHints->ai_family : AF_UNSPEC,
+                    .aiSocktype = mHints ? mHints->ai_socktype : 0,
+                    .aiProtocol = mHints ? mHints->ai_protocol : 0,
+            };
+            bool coalesced = false;
+            coalescedResult = sGetAddrInfoCoalescer.run(
+                    key,
+                    [&lookup, &event](GetAddrInfoResult* r) {
+                        r->rv = lookup(&r->ai);
+                        r->dnsQueryEvents = event.dns_query_events();
+                    },
+                    coalescedLookupDeadline(mNetContext.dns_netid),
+                    [clientFd]() { return clientHungUp(clientFd); }, &coalesced);
+            if (coalescedResult == nullptr) {
+                LOG(INFO) << "GetAddrInfoHandler::run: UID " << uid
+                          << " gave up waiting for an in-flight lookup";
+                rv = EAI_AGAIN;
+            } else {
+                rv = coalescedResult->rv;
+                if (coalesced) {
+                    LOG(DEBUG) << "GetAddrInfoHandler::run: UID " << uid
+                               << " shared an in-flight lookup";
+                    *event.mutable_dns_query_events() = coalescedResult->dnsQueryEvents;
+                }
+            }
+        } else {
+            rv = lookup(&result);
         }
         queryLimiter.finish(uid);
     } else {
@@ -733,37 +894,70 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
                    << ", max concurrent queries reached";
     }
 
+    const addrinfo* answer = coalescedResult ? coalescedResult->ai : result;
+    sendAndReport(rv, answer, saturate_cast<int32_t>(s.timeTakenUs()), &event);
+    freeaddrinfo(result);
+    mClient->decRef();
+}
+
+bool DnsProxyListener::GetAddrInfoHandler::runLocally() {
+    if (mHost == nullptr) return false;
+
+    Stopwatch s;
+    // An address literal names no domain, so neither the domain name policy nor the network
+    // context fixup, which only affect how DNS queries are sent, apply to it.
+    addrinfo* result = nullptr;
+    if (!resolv_getaddrinfo_numeric(mHost, mService, mHints, &result)) return false;
+
+    ScopedQueryTrace trace(&mTrace);
+
+    LOG(DEBUG) << "GetAddrInfoHandler::runLocally: answered without DNS query";
+    int32_t rv = 0;
+    NetworkDnsEventReported event;
+    initDnsEvent(&event, mNetContext);
+    // Only in-place synthesis can happen here, as rv is 0.
     doDns64Synthesis(&rv, &result, &event);
-    const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
-    event.set_latency_micros(latencyUs);
-    event.set_event_type(EVENT_GETADDRINFO);
-    event.set_hints_ai_flags((mHints ? mHints->ai_flags : 0));
+    sendAndReport(rv, result, saturate_cast<int32_t>(s.timeTakenUs()), &event);
+    freeaddrinfo(result);
+    return true;
+}
+
+void DnsProxyListener::GetAddrInfoHandler::sendAndReport(int32_t rv, const addrinfo* answer,
+                                                         int32_t latencyUs,
+                                                         NetworkDnsEventReported* event) {
+    const uid_t uid = mClient->getUid();
+    event->set_latency_micros(latencyUs);
+    event->set_event_type(EVENT_GETADDRINFO);
+    event->set_hints_ai_flags((mHints ? mHints->ai_flags : 0));
 
     bool success = true;
-    if (rv) {
-        // getaddrinfo failed
-        success = !mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
-    } else {
-        success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
-        addrinfo* ai = result;
-        while (ai && success) {
-            success = sendBE32(mClient, 1) && sendaddrinfo(mClient, ai);
-            ai = ai->ai_next;
+    {
+        ScopedQueryStage stage(QueryStage::IPC_WRITE);
+        if (rv) {
+            // getaddrinfo failed
+            success = !mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv,
+                                              sizeof(rv));
+        } else {
+            success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
+            const addrinfo* ai = answer;
+            while (ai && success) {
+                success = sendBE32(mClient, 1) && sendaddrinfo(mClient, ai);
+                ai = ai->ai_next;
+            }
+            success = success && sendBE32(mClient, 0);
         }
-        success = success && sendBE32(mClient, 0);
     }
 
     if (!success) {
-        PLOG(WARNING) << "GetAddrInfoHandler::run: Error writing DNS result to client uid " << uid
-                      << " pid " << mClient->getPid();
+        PLOG(WARNING) << "GetAddrInfoHandler::" << __func__
+                      << ": Error writing DNS result to client uid " << uid << " pid "
+                      << mClient->getPid();
     }
 
     std::vector<std::string> ip_addrs;
-    const int total_ip_addr_count = extractGetAddrInfoAnswers(result, &ip_addrs);
-    reportDnsEvent(INetdEventListener::EVENT_GETADDRINFO, mNetContext, latencyUs, rv, event, mHost,
-                   ip_addrs, total_ip_addr_count);
-    freeaddrinfo(result);
-    mClient->decRef();
+    const int total_ip_addr_count = extractGetAddrInfoAnswers(answer, &ip_addrs);
+    reportDnsEvent(INetdEventListener::EVENT_GETADDRINFO, mNetContext, latencyUs, rv, *event,
+                   mHost, ip_addrs, total_ip_addr_count);
 }
 
 std::string DnsProxyListener::GetAddrInfoHandler::threadName() {
@@ -843,6 +1037,12 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
 
     DnsProxyListener::GetAddrInfoHandler* handler =
             new DnsProxyListener::GetAddrInfoHandler(cli, name, service, hints, netcontext);
+    sGetAddrInfoCount++;
+    if (handler->runLocally()) {
+        sGetAddrInfoInlineCount++;
+        delete handler;
+        return 0;
+    }
     tryThreadOrError(cli, handler);
     return 0;
 }
@@ -903,12 +1103,13 @@ DnsProxyListener::ResNSendHandler::~ResNSendHandler() {
 }
 
 void DnsProxyListener::ResNSendHandler::run() {
+    ScopedQueryTrace trace(&mTrace);
     LOG(DEBUG) << "ResNSendHandler::run: " << mFlags << " / {" << mNetContext.app_netid << " "
                << mNetContext.app_mark << " " << mNetContext.dns_netid << " "
                << mNetContext.dns_mark << " " << mNetContext.uid << " " << mNetContext.flags << "}";
 
     Stopwatch s;
-    maybeFixupNetContext(&mNetContext, mClient->getPid());
+    maybeFixupNetContext(&mNetContext, mClient);
 
     // Decode
     std::vector<uint8_t> msg(MAXPACKET, 0);
@@ -941,7 +1142,7 @@ void DnsProxyListener::ResNSendHandler::run() {
     int nsendAns = -1;
     NetworkDnsEventReported event;
     initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
+    if (startQuery(uid)) {
         if (evaluate_domain_name(mNetContext, rr_name.c_str())) {
             nsendAns = resolv_res_nsend(&mNetContext, msg.data(), msgLen, ansBuf.data(), MAXPACKET,
                                         &rcode, static_cast<ResNsendFlags>(mFlags), &event);
@@ -962,9 +1163,12 @@ void DnsProxyListener::ResNSendHandler::run() {
 
     // Fail, send -errno
     if (nsendAns < 0) {
-        if (!sendBE32(mClient, nsendAns)) {
-            PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send errno to uid " << uid
-                          << " pid " << mClient->getPid();
+        {
+            ScopedQueryStage stage(QueryStage::IPC_WRITE);
+            if (!sendBE32(mClient, nsendAns)) {
+                PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send errno to uid "
+                              << uid << " pid " << mClient->getPid();
+            }
         }
         if (rr_type == ns_t_a || rr_type == ns_t_aaaa) {
             reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, mNetContext, latencyUs,
@@ -973,19 +1177,22 @@ void DnsProxyListener::ResNSendHandler::run() {
         return;
     }
 
-    // Send rcode
-    if (!sendBE32(mClient, rcode)) {
-        PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send rcode to uid " << uid
-                      << " pid " << mClient->getPid();
-        return;
-    }
+    {
+        ScopedQueryStage stage(QueryStage::IPC_WRITE);
+        // Send rcode
+        if (!sendBE32(mClient, rcode)) {
+            PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send rcode to uid " << uid
+                          << " pid " << mClient->getPid();
+            return;
+        }
 
-    // Restore query id and send answer
-    if (!setQueryId(ansBuf.data(), nsendAns, original_query_id) ||
-        !sendLenAndData(mClient, nsendAns, ansBuf.data())) {
-        PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send answer to uid " << uid
-                      << " pid " << mClient->getPid();
-        return;
+        // Restore query id and send answer
+        if (!setQueryId(ansBuf.data(), nsendAns, original_query_id) ||
+            !sendLenAndData(mClient, nsendAns, ansBuf.data())) {
+            PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send answer to uid "
+                          << uid << " pid " << mClient->getPid();
+            return;
+        }
     }
 
     if (rr_type == ns_t_a || rr_type == ns_t_aaaa) {
@@ -1122,7 +1329,7 @@ void DnsProxyListener::GetHostByNameHandler::doDns64Synthesis(int32_t* rv, hoste
 
     // If caller wants IPv6 answers but no data, try to query IPv4 answers for synthesis
     const uid_t uid = mClient->getUid();
-    if (queryLimiter.start(uid)) {
+    if (startQuery(uid)) {
         *rv = resolv_gethostbyname(mName, AF_INET, hbuf, buf, buflen, &mNetContext, hpp, event);
         queryLimiter.finish(uid);
         if (*rv) {
@@ -1142,21 +1349,65 @@ void DnsProxyListener::GetHostByNameHandler::doDns64Synthesis(int32_t* rv, hoste
 }
 
 void DnsProxyListener::GetHostByNameHandler::run() {
+    ScopedQueryTrace trace(&mTrace);
     Stopwatch s;
-    maybeFixupNetContext(&mNetContext, mClient->getPid());
+    maybeFixupNetContext(&mNetContext, mClient);
     const uid_t uid = mClient->getUid();
-    hostent* hp = nullptr;
+    const hostent* hp = nullptr;
     hostent hbuf;
     char tmpbuf[MAXPACKET];
+    std::shared_ptr<const GetHostByNameResult> coalescedResult;  // shared with other handlers
     int32_t rv = 0;
     NetworkDnsEventReported event;
     initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
-        if (evaluate_domain_name(mNetContext, mName)) {
-            rv = resolv_gethostbyname(mName, mAf, &hbuf, tmpbuf, sizeof tmpbuf, &mNetContext, &hp,
-                                      &event);
-        } else {
+    const auto lookup = [this, &event](hostent* hbuf, char* buf, size_t buflen, hostent** hpp) {
+        int32_t ret = resolv_gethostbyname(mName, mAf, hbuf, buf, buflen, &mNetContext, hpp,
+                                           &event);
+        doDns64Synthesis(&ret, hbuf, buf, buflen, hpp, &event);
+        return ret;
+    };
+    if (startQuery(uid)) {
+        if (!evaluate_domain_name(mNetContext, mName)) {
             rv = EAI_SYSTEM;
+        } else if (mName != nullptr && lookupCoalescingEnabled()) {
+            // Other clients may share this lookup, so it must not be abandoned if this one leaves.
+            // If this one only shares another client's lookup, it can stop waiting instead.
+            const int clientFd = mNetContext.client_fd;
+            mNetContext.client_fd = -1;
+            const GetHostByNameKey key = {
+                    .dnsNetId = mNetContext.dns_netid,
+                    .appMark = mNetContext.app_mark,
+                    .dnsMark = mNetContext.dns_mark,
+                    .flags = mNetContext.flags,
+                    .name = mName,
+                    .af = mAf,
+            };
+            bool coalesced = false;
+            coalescedResult = sGetHostByNameCoalescer.run(
+                    key,
+                    [&lookup, &event](GetHostByNameResult* r) {
+                        r->rv = lookup(&r->hbuf, r->buf, sizeof(r->buf), &r->hp);
+                        r->dnsQueryEvents = event.dns_query_events();
+                    },
+                    coalescedLookupDeadline(mNetContext.dns_netid),
+                    [clientFd]() { return clientHungUp(clientFd); }, &coalesced);
+            if (coalescedResult == nullptr) {
+                LOG(INFO) << "GetHostByNameHandler::run: UID " << uid
+                          << " gave up waiting for an in-flight lookup";
+                rv = EAI_AGAIN;
+            } else {
+                rv = coalescedResult->rv;
+                hp = coalescedResult->hp;
+                if (coalesced) {
+                    LOG(DEBUG) << "GetHostByNameHandler::run: UID " << uid
+                               << " shared an in-flight lookup";
+                    *event.mutable_dns_query_events() = coalescedResult->dnsQueryEvents;
+                }
+            }
+        } else {
+            hostent* res = nullptr;
+            rv = lookup(&hbuf, tmpbuf, sizeof tmpbuf, &res);
+            hp = res;
         }
         queryLimiter.finish(uid);
     } else {
@@ -1165,7 +1416,6 @@ void DnsProxyListener::GetHostByNameHandler::run() {
                    << ", max concurrent queries reached";
     }
 
-    doDns64Synthesis(&rv, &hbuf, tmpbuf, sizeof tmpbuf, &hp, &event);
     const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
     event.set_latency_micros(latencyUs);
     event.set_event_type(EVENT_GETHOSTBYNAME);
@@ -1173,12 +1423,16 @@ void DnsProxyListener::GetHostByNameHandler::run() {
     LOG(DEBUG) << "GetHostByNameHandler::run: result: " << gai_strerror(rv);
 
     bool success = true;
-    if (hp) {
-        // hp is not nullptr iff. rv is 0.
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
-    } else {
-        success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, nullptr, 0) == 0;
+    {
+        ScopedQueryStage stage(QueryStage::IPC_WRITE);
+        if (hp) {
+            // hp is not nullptr iff. rv is 0.
+            success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
+            success &= sendhostent(mClient, hp);
+        } else {
+            success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, nullptr,
+                                             0) == 0;
+        }
     }
 
     if (!success) {
@@ -1289,7 +1543,7 @@ void DnsProxyListener::GetHostByAddrHandler::doDns64ReverseLookup(hostent* hbuf,
     }
 
     const uid_t uid = mClient->getUid();
-    if (queryLimiter.start(uid)) {
+    if (startQuery(uid)) {
         // Remove NAT64 prefix and do reverse DNS query
         struct in_addr v4addr = {.s_addr = v6addr.s6_addr32[3]};
         resolv_gethostbyaddr(&v4addr, sizeof(v4addr), AF_INET, hbuf, buf, buflen, &mNetContext, hpp,
@@ -1310,8 +1564,9 @@ void DnsProxyListener::GetHostByAddrHandler::doDns64ReverseLookup(hostent* hbuf,
 }
 
 void DnsProxyListener::GetHostByAddrHandler::run() {
+    ScopedQueryTrace trace(&mTrace);
     Stopwatch s;
-    maybeFixupNetContext(&mNetContext, mClient->getPid());
+    maybeFixupNetContext(&mNetContext, mClient);
     const uid_t uid = mClient->getUid();
     hostent* hp = nullptr;
     hostent hbuf;
@@ -1319,7 +1574,7 @@ void DnsProxyListener::GetHostByAddrHandler::run() {
     int32_t rv = 0;
     NetworkDnsEventReported event;
     initDnsEvent(&event, mNetContext);
-    if (queryLimiter.start(uid)) {
+    if (startQuery(uid)) {
         rv = resolv_gethostbyaddr(mAddress, mAddressLen, mAddressFamily, &hbuf, tmpbuf,
                                   sizeof tmpbuf, &mNetContext, &hp, &event);
         queryLimiter.finish(uid);
@@ -1337,11 +1592,15 @@ void DnsProxyListener::GetHostByAddrHandler::run() {
     LOG(DEBUG) << "GetHostByAddrHandler::run: result: " << gai_strerror(rv);
 
     bool success = true;
-    if (hp) {
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
-    } else {
-        success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, nullptr, 0) == 0;
+    {
+        ScopedQueryStage stage(QueryStage::IPC_WRITE);
+        if (hp) {
+            success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
+            success &= sendhostent(mClient, hp);
+        } else {
+            success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, nullptr,
+                                             0) == 0;
+        }
     }
 
     if (!success) {
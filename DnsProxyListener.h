@@ -19,9 +19,12 @@
 #include <string>
 
 #include <netd_resolv/resolv.h>  // android_net_context
+#include <netdutils/DumpWriter.h>
 #include <sysutils/FrameworkCommand.h>
 #include <sysutils/FrameworkListener.h>
 
+#include "QueryTrace.h"
+
 struct addrinfo;
 struct hostent;
 
@@ -37,6 +40,8 @@ class DnsProxyListener : public FrameworkListener {
 
     static constexpr const char* SOCKET_NAME = "dnsproxyd";
 
+    void dump(netdutils::DumpWriter& dw) const;
+
   private:
     class GetAddrInfoCmd : public FrameworkCommand {
       public:
@@ -56,14 +61,22 @@ class DnsProxyListener : public FrameworkListener {
         void run();
         std::string threadName();
 
+        // Answers the request on the calling thread if the host is an address literal, which
+        // takes no lookup at all. Returns false, with nothing sent to the client, if the request
+        // has to be run() on a separate thread.
+        bool runLocally();
+
       private:
         void doDns64Synthesis(int32_t* rv, addrinfo** res, NetworkDnsEventReported* event);
+        void sendAndReport(int32_t rv, const addrinfo* answer, int32_t latencyUs,
+                           NetworkDnsEventReported* event);
 
         SocketClient* mClient;  // ref counted
         char* mHost;            // owned. TODO: convert to std::string.
         char* mService;         // owned. TODO: convert to std::string.
         addrinfo* mHints;       // owned
         android_net_context mNetContext;
+        QueryTrace mTrace;
     };
 
     /* ------ gethostbyname ------*/
@@ -91,6 +104,7 @@ class DnsProxyListener : public FrameworkListener {
         char* mName;            // owned. TODO: convert to std::string.
         int mAf;
         android_net_context mNetContext;
+        QueryTrace mTrace;
     };
 
     /* ------ gethostbyaddr ------*/
@@ -119,6 +133,7 @@ class DnsProxyListener : public FrameworkListener {
         int mAddressLen;        // length of address to look up
         int mAddressFamily;     // address family
         android_net_context mNetContext;
+        QueryTrace mTrace;
     };
 
     /* ------ resnsend ------*/
@@ -143,6 +158,7 @@ class DnsProxyListener : public FrameworkListener {
         std::string mMsg;
         uint32_t mFlags;
         android_net_context mNetContext;
+        QueryTrace mTrace;
     };
 
     /* ------ getdnsnetid ------*/
@@ -17,32 +17,50 @@
 
 #include "DnsQueryLog.h"
 
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
 #include <android-base/stringprintf.h>
 
 namespace android::net {
 
 namespace {
 
-std::string maskHostname(const std::string& hostname) {
-    // Boundary issue is handled in substr().
-    return hostname.substr(0, 1) + "***";
+// Parse the address |ip| into |dst|, ignoring any scope ID, without allocating.
+bool parseIp(int family, const std::string& ip, void* dst) {
+    char buf[INET6_ADDRSTRLEN];
+    const size_t len = std::min(ip.find('%'), ip.size());
+    if (len >= sizeof(buf)) return false;
+    ip.copy(buf, len);
+    buf[len] = '\0';
+    return inet_pton(family, buf, dst) == 1;
+}
+
+// Return the masked string of |addr|, keeping the characters up to the first |separator|.
+std::string maskIp(int family, const void* addr, char separator) {
+    char buf[INET6_ADDRSTRLEN];
+    if (inet_ntop(family, addr, buf, sizeof(buf)) == nullptr) return "***";
+    const std::string ip(buf);
+    return ip.substr(0, ip.find(separator) + 1) + "***";
+}
+
+std::string maskHostname(const char* hostname) {
+    return std::string(hostname, hostname[0] == '\0' ? 0 : 1) + "***";
 }
 
 // Return the string of masked addresses of the first v4 address and the first v6 address.
-std::string maskIps(const std::vector<std::string>& ips) {
+std::string maskIps(const DnsQueryLog::Record& record) {
     std::string ret;
-    bool v4Found = false, v6Found = false;
-    for (const auto& ip : ips) {
-        if (auto pos = ip.find_first_of(':'); pos != ip.npos && !v6Found) {
-            ret += ip.substr(0, pos + 1) + "***, ";
-            v6Found = true;
-        } else if (auto pos = ip.find_first_of('.'); pos != ip.npos && !v4Found) {
-            ret += ip.substr(0, pos + 1) + "***, ";
-            v4Found = true;
-        }
-        if (v6Found && v4Found) break;
+    if (record.hasV4) ret += maskIp(AF_INET, &record.v4, '.');
+    if (record.hasV6) {
+        if (!ret.empty()) ret += ", ";
+        ret += maskIp(AF_INET6, &record.v6, ':');
     }
-    return ret.empty() ? "" : ret.substr(0, ret.length() - 2);
+    return ret;
 }
 
 // Return the readable string format "hr:min:sec.ms".
@@ -58,12 +76,61 @@ std::string timestampToString(const std::chrono::system_clock::time_point& ts) {
 
 }  // namespace
 
-void DnsQueryLog::push(Record&& record) {
-    std::lock_guard guard(mLock);
-    mQueue.push_back(std::move(record));
-    if (mQueue.size() > mCapacity) {
-        mQueue.pop_front();
+DnsQueryLog::Record::Record(uint32_t netId, uid_t uid, pid_t pid, const std::string& hostname,
+                            const std::vector<std::string>& addrs, int timeTaken)
+    : netId(netId),
+      uid(uid),
+      pid(pid),
+      timestamp(std::chrono::system_clock::now()),
+      hostname(),
+      hasV4(false),
+      hasV6(false),
+      v4(),
+      v6(),
+      timeTaken(timeTaken) {
+    hostname.copy(this->hostname, sizeof(this->hostname) - 1);
+    for (const auto& ip : addrs) {
+        if (!hasV6 && ip.find(':') != ip.npos) {
+            hasV6 = parseIp(AF_INET6, ip, &v6);
+        } else if (!hasV4 && ip.find('.') != ip.npos) {
+            hasV4 = parseIp(AF_INET, ip, &v4);
+        }
+        if (hasV4 && hasV6) break;
+    }
+}
+
+DnsQueryLog::DnsQueryLog(size_t size, std::chrono::milliseconds time)
+    : mCapacity(size), mSlots(new Slot[size]), mValidityTimeMs(time) {
+    static_assert(std::is_trivially_copyable_v<Record>);
+}
+
+void DnsQueryLog::push(const Record& record) {
+    if (mCapacity == 0) return;
+
+    const uint64_t n = mPushed.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = mSlots[n % mCapacity];
+    const uint64_t sequence = 2 * (n / mCapacity + 1);
+
+    // Only wait for a push which is writing to the slot right now, which takes no time.
+    uint64_t current = slot.sequence.load(std::memory_order_relaxed);
+    while (true) {
+        if (current >= sequence) return;
+        if (current % 2 != 0) {
+            std::this_thread::yield();
+            current = slot.sequence.load(std::memory_order_relaxed);
+        } else if (slot.sequence.compare_exchange_weak(current, sequence - 1,
+                                                       std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t words[kRecordWords] = {};
+    std::memcpy(words, &record, sizeof(record));
+    for (size_t i = 0; i < kRecordWords; i++) {
+        slot.words[i].store(words[i], std::memory_order_relaxed);
     }
+    slot.sequence.store(sequence, std::memory_order_release);
 }
 
 void DnsQueryLog::dump(netdutils::DumpWriter& dw) const {
@@ -71,12 +138,26 @@ void DnsQueryLog::dump(netdutils::DumpWriter& dw) const {
     netdutils::ScopedIndent indentStats(dw);
     const auto now = std::chrono::system_clock::now();
 
-    std::lock_guard guard(mLock);
-    for (const auto& record : mQueue) {
+    // Go through the last mCapacity records pushed, oldest first.  The records which are still
+    // being written, or which get overwritten while being copied, are skipped.
+    const uint64_t pushed = mPushed.load(std::memory_order_relaxed);
+    for (uint64_t n = pushed - std::min<uint64_t>(pushed, mCapacity); n < pushed; n++) {
+        const Slot& slot = mSlots[n % mCapacity];
+        const uint64_t sequence = 2 * (n / mCapacity + 1);
+        if (slot.sequence.load(std::memory_order_acquire) != sequence) continue;
+        uint64_t words[kRecordWords];
+        for (size_t i = 0; i < kRecordWords; i++) {
+            words[i] = slot.words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+        Record record;
+        std::memcpy(&record, words, sizeof(record));
         if (now - record.timestamp > mValidityTimeMs) continue;
 
         const std::string maskedHostname = maskHostname(record.hostname);
-        const std::string maskedIpsStr = maskIps(record.addrs);
+        const std::string maskedIpsStr = maskIps(record);
         const std::string time = timestampToString(record.timestamp);
         dw.println("time=%s netId=%u uid=%u pid=%d hostname=%s answer=[%s] (%dms)", time.c_str(),
                    record.netId, record.uid, record.pid, maskedHostname.c_str(),
@@ -17,50 +17,76 @@
 
 #pragma once
 
-#include <deque>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
-#include <android-base/thread_annotations.h>
 #include <netdutils/DumpWriter.h>
 
 namespace android::net {
 
 // A circular buffer based class used for query logging. It's thread-safe for concurrent access.
+// Records are fixed-size, and copied into preallocated slots without taking a lock, so that
+// logging doesn't allocate or make queries wait on each other. Formatting is left to dump().
 class DnsQueryLog {
   public:
     static constexpr std::string_view DUMP_KEYWORD = "querylog";
 
+    // The size of the hostname kept in a record, including the terminating null.  The dump
+    // only shows the first character anyway.
+    static constexpr size_t kHostnameSize = 32;
+
+    // Trivially copyable, so that it can be copied in and out of the log a word at a time.
     struct Record {
+        // Keeps the first IPv4 and the first IPv6 address of |addrs|, which are what the dump
+        // shows.
         Record(uint32_t netId, uid_t uid, pid_t pid, const std::string& hostname,
-               const std::vector<std::string>& addrs, int timeTaken)
-            : netId(netId),
-              uid(uid),
-              pid(pid),
-              hostname(hostname),
-              addrs(addrs),
-              timeTaken(timeTaken) {}
-        const uint32_t netId;
-        const uid_t uid;
-        const pid_t pid;
-        const std::chrono::system_clock::time_point timestamp = std::chrono::system_clock::now();
-        const std::string hostname;
-        const std::vector<std::string> addrs;
-        const int timeTaken;
+               const std::vector<std::string>& addrs, int timeTaken);
+        Record() = default;
+
+        uint32_t netId;
+        uid_t uid;
+        pid_t pid;
+        std::chrono::system_clock::time_point timestamp;
+        char hostname[kHostnameSize];
+        bool hasV4;
+        bool hasV6;
+        in_addr v4;
+        in6_addr v6;
+        int timeTaken;
     };
 
     // Allow the tests to set the capacity and the validaty time in milliseconds.
     DnsQueryLog(size_t size = kDefaultLogSize,
-                std::chrono::milliseconds time = kDefaultValidityMinutes)
-        : mCapacity(size), mValidityTimeMs(time) {}
+                std::chrono::milliseconds time = kDefaultValidityMinutes);
 
-    void push(Record&& record) EXCLUDES(mLock);
-    void dump(netdutils::DumpWriter& dw) const EXCLUDES(mLock);
+    void push(const Record& record);
+    void dump(netdutils::DumpWriter& dw) const;
 
   private:
-    mutable std::mutex mLock;
-    std::deque<Record> mQueue GUARDED_BY(mLock);
+    // Records are copied in and out of the slots a word at a time with relaxed atomic accesses,
+    // so that dump() can copy a record while it is being written, and tell from the sequence
+    // number of the slot that the copy is torn.
+    static constexpr size_t kRecordWords =
+            (sizeof(Record) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    // The sequence number of a slot is odd while a record is being written to it, and is
+    // 2 * (n / mCapacity + 1) once the n-th record pushed is written to it.  A record only
+    // overwrites older records, so a push which gets overtaken by a later one is dropped.
+    struct Slot {
+        std::atomic<uint64_t> sequence = 0;
+        std::atomic<uint64_t> words[kRecordWords] = {};
+    };
+
+    // The number of records pushed so far.
+    std::atomic<uint64_t> mPushed = 0;
     const size_t mCapacity;
+    const std::unique_ptr<Slot[]> mSlots;
     const std::chrono::milliseconds mValidityTimeMs;
 
     // The capacity of the circular buffer.
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "DnsQueryLog.h"
+
+namespace android::net {
+
+namespace {
+
+const std::vector<std::string> kAddrs = {"127.0.0.1", "::1"};
+
+// The log is shared by all the threads of a run, as in the resolver, where it is pushed to by
+// every thread which answers a query.
+void BM_Push(benchmark::State& state) {
+    static DnsQueryLog queryLog;
+    const DnsQueryLog::Record record(30, 1000, 1000, "www.example.com", kAddrs, 10);
+    for (auto _ : state) {
+        queryLog.push(record);
+    }
+}
+BENCHMARK(BM_Push);
+// Contended pushes.  Real time, as the threads push at the same time.
+BENCHMARK(BM_Push)->ThreadRange(2, 16)->UseRealTime();
+
+}  // namespace
+
+}  // namespace android::net
+
+BENCHMARK_MAIN();
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <atomic>
 #include <regex>
 #include <thread>
 
@@ -73,14 +74,32 @@ TEST_F(DnsQueryLogTest, Push) {
             DnsQueryLog::Record(33, 1000, 1000, "example.com", serversV4V6, 10),
     };
     DnsQueryLog queryLog;
-    for (auto& r : records) {
-        queryLog.push(std::move(r));
+    for (const auto& r : records) {
+        queryLog.push(r);
     }
 
     std::string output = captureDumpOutput(queryLog);
     verifyDumpOutput(output, {30, 31, 32, 33});
 }
 
+TEST_F(DnsQueryLogTest, MaskedDump) {
+    const std::string longHostname(100, 'a');
+    DnsQueryLog queryLog;
+    queryLog.push(DnsQueryLog::Record(30, 1000, 1000, longHostname, serversV4V6, 10));
+    queryLog.push(DnsQueryLog::Record(31, 1000, 1000, "", {"fe80:1::2%testnet"}, 10));
+
+    // Only the first character of the hostname and the first part of the first v4 and v6
+    // addresses are shown.
+    const std::string output = captureDumpOutput(queryLog);
+    EXPECT_NE(output.find("netId=30 uid=1000 pid=1000 hostname=a*** answer=[127.***, 2001:***] "
+                          "(10ms)"),
+              std::string::npos)
+            << output;
+    EXPECT_NE(output.find("netId=31 uid=1000 pid=1000 hostname=*** answer=[fe80:***] (10ms)"),
+              std::string::npos)
+            << output;
+}
+
 TEST_F(DnsQueryLogTest, PushStressTest) {
     const int threadNum = 100;
     const int pushNum = 1000;
@@ -93,7 +112,7 @@ TEST_F(DnsQueryLogTest, PushStressTest) {
         thread = std::thread([&]() {
             for (int i = 0; i < pushNum; i++) {
                 DnsQueryLog::Record record(30, 1000, 1000, "www.example.com", serversV4, 10);
-                queryLog.push(std::move(record));
+                queryLog.push(record);
             }
         });
     }
@@ -106,6 +125,37 @@ TEST_F(DnsQueryLogTest, PushStressTest) {
     verifyDumpOutput(output, std::vector(size, 30));
 }
 
+TEST_F(DnsQueryLogTest, DumpWhilePushing) {
+    const int threadNum = 8;
+    const size_t size = 50;
+    DnsQueryLog queryLog(size);
+    std::atomic<bool> done = false;
+    std::vector<std::thread> threads(threadNum);
+    for (auto& thread : threads) {
+        thread = std::thread([&]() {
+            const DnsQueryLog::Record record(30, 1000, 1000, "www.example.com", serversV4V6, 10);
+            while (!done) queryLog.push(record);
+        });
+    }
+
+    // The records being written are skipped, and no torn record is shown.
+    for (int i = 0; i < 100; i++) {
+        const std::string output = captureDumpOutput(queryLog);
+        std::vector<std::string> lines = android::base::Split(output, "\n");
+        for (const auto& line : lines) {
+            if (line.find("netId=") == std::string::npos) continue;
+            EXPECT_NE(line.find("netId=30 uid=1000 pid=1000 hostname=w*** "
+                                "answer=[127.***, 2001:***] (10ms)"),
+                      std::string::npos)
+                    << line;
+        }
+    }
+    done = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 TEST_F(DnsQueryLogTest, ZeroSize) {
     const size_t size = 0;
     DnsQueryLog::Record r1(30, 1000, 1000, "www.example1.com", serversV4V6, 10);
@@ -113,9 +163,9 @@ TEST_F(DnsQueryLogTest, ZeroSize) {
     DnsQueryLog::Record r3(32, 1000, 1000, "www.example3.com", serversV4V6, 10);
 
     DnsQueryLog queryLog(size);
-    queryLog.push(std::move(r1));
-    queryLog.push(std::move(r2));
-    queryLog.push(std::move(r3));
+    queryLog.push(r1);
+    queryLog.push(r2);
+    queryLog.push(r3);
 
     std::string output = captureDumpOutput(queryLog);
     verifyDumpOutput(output, {});
@@ -130,10 +180,10 @@ TEST_F(DnsQueryLogTest, CapacityFull) {
     const std::vector<int> expectedNetIds = {31, 32, 33};
 
     DnsQueryLog queryLog(size);
-    queryLog.push(std::move(r1));
-    queryLog.push(std::move(r2));
-    queryLog.push(std::move(r3));
-    queryLog.push(std::move(r4));
+    queryLog.push(r1);
+    queryLog.push(r2);
+    queryLog.push(r3);
+    queryLog.push(r4);
 
     std::string output = captureDumpOutput(queryLog);
     verifyDumpOutput(output, expectedNetIds);
@@ -142,7 +192,7 @@ TEST_F(DnsQueryLogTest, CapacityFull) {
 TEST_F(DnsQueryLogTest, ValidityTime) {
     DnsQueryLog::Record r1(30, 1000, 1000, "www.example.com", serversV4, 10);
     DnsQueryLog queryLog(3, 100ms);
-    queryLog.push(std::move(r1));
+    queryLog.push(r1);
 
     // Dump the output and verify the correctness by checking netId.
     std::string output = captureDumpOutput(queryLog);
@@ -156,7 +206,7 @@ TEST_F(DnsQueryLogTest, ValidityTime) {
 
     // Push another record to ensure it still works.
     DnsQueryLog::Record r2(31, 1000, 1000, "example.com", serversV4V6, 10);
-    queryLog.push(std::move(r2));
+    queryLog.push(r2);
     output = captureDumpOutput(queryLog);
     verifyDumpOutput(output, {31});
 }
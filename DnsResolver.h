@@ -36,6 +36,7 @@ class DnsResolver {
     void operator=(DnsResolver const&) = delete;
 
     DnsQueryLog& dnsQueryLog() { return mQueryLog; }
+    const DnsProxyListener& dnsProxyListener() const { return mDnsProxyListener; }
 
     ResolverController resolverCtrl;
 
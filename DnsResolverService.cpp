@@ -33,6 +33,7 @@
 #include "Experiments.h"
 #include "NetdPermissions.h"  // PERM_*
 #include "ResolverEventReporter.h"
+#include "TaskScheduler.h"
 #include "resolv_cache.h"
 
 using aidl::android::net::ResolverParamsParcel;
@@ -118,6 +119,9 @@ binder_status_t DnsResolverService::dump(int fd, const char** args, uint32_t num
         dw.blankline();
     }
     Experiments::getInstance()->dump(dw);
+    TaskScheduler::getInstance()->dump(dw);
+    dw.blankline();
+    gDnsResolv->dnsProxyListener().dump(dw);
     return STATUS_OK;
 }
 
@@ -216,6 +220,17 @@ binder_status_t DnsResolverService::dump(int fd, const char** args, uint32_t num
     return statusFromErrcode(res);
 }
 
+::ndk::ScopedAStatus DnsResolverService::getServerLatencies(int32_t netId, int32_t protocol,
+                                                           std::vector<std::string>* servers,
+                                                           std::vector<int32_t>* latencies) {
+    // Locking happens in res_cache.cpp functions.
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
+
+    int res = gDnsResolv->resolverCtrl.getServerLatencies(netId, protocol, servers, latencies);
+
+    return statusFromErrcode(res);
+}
+
 ::ndk::ScopedAStatus DnsResolverService::startPrefix64Discovery(int32_t netId) {
     // Locking happens in Dns64Configuration.
     ENFORCE_NETWORK_STACK_PERMISSIONS();
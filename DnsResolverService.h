@@ -48,6 +48,9 @@ class DnsResolverService : public aidl::android::net::BnDnsResolver {
             std::vector<std::string>* tlsServers, std::vector<int32_t>* params,
             std::vector<int32_t>* stats,
             std::vector<int32_t>* wait_for_pending_req_timeout_count) override;
+    ::ndk::ScopedAStatus getServerLatencies(int32_t netId, int32_t protocol,
+                                            std::vector<std::string>* servers,
+                                            std::vector<int32_t>* latencies) override;
     ::ndk::ScopedAStatus destroyNetworkCache(int32_t netId) override;
     ::ndk::ScopedAStatus createNetworkCache(int32_t netId) override;
     ::ndk::ScopedAStatus flushNetworkCache(int32_t netId) override;
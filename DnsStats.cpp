@@ -19,6 +19,8 @@
 
 #include "DnsStats.h"
 
+#include <algorithm>
+
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 
@@ -52,6 +54,7 @@ std::string rcodeToName(int rcode) {
         case NS_R_NXRRSET: return "NXRRSET";
         case NS_R_NOTAUTH: return "NOTAUTH";
         case NS_R_NOTZONE: return "NOTZONE";
+        case NS_R_DEADLINE_EXCEEDED: return "DEADLINE_EXCEEDED";
         case NS_R_INTERNAL_ERROR: return "INTERNAL_ERROR";
         case NS_R_TIMEOUT: return "TIMEOUT";
         default: return StringPrintf("UNKNOWN(%d)", rcode);
@@ -59,6 +62,33 @@ std::string rcodeToName(int rcode) {
     // clang-format on
 }
 
+// Returns the expected time to get an answer from a server: the mean time of an attempt on an
+// existing connection, divided by the chance that an attempt gets an answer.  If |connected| is
+// false, the cost of connecting is added.  Returns 0 if there's no data.
+microseconds expectedLatency(const StatsData& data, bool connected) {
+    if (data.total == 0) return microseconds(0);
+
+    int failures = 0;
+    for (const int rcode : {NS_R_TIMEOUT, NS_R_INTERNAL_ERROR, NS_R_DEADLINE_EXCEEDED}) {
+        failures += data.rcodeCounts[rcode];
+    }
+    // Don't let a server which never answered look infinitely bad, so that it can recover.
+    const double successRate = std::max(double(data.total - failures) / data.total, 0.05);
+
+    const int warmTotal = data.total - data.connectedTotal;
+    const microseconds warmLatency = data.latencyUs - data.connectedLatencyUs;
+    const microseconds meanAttempt = (warmTotal > 0) ? warmLatency / warmTotal
+                                                     : data.latencyUs / data.total;
+    microseconds latency = duration_cast<microseconds>(meanAttempt / successRate);
+
+    if (!connected && data.connectedTotal > 0 && warmTotal > 0) {
+        const microseconds connectCost =
+                data.connectedLatencyUs / data.connectedTotal - warmLatency / warmTotal;
+        latency += std::max(connectCost, microseconds(0));
+    }
+    return latency;
+}
+
 bool ensureNoInvalidIp(const std::vector<IPSockAddr>& servers) {
     for (const auto& server : servers) {
         if (server.ip() == INVALID_IPADDRESS || server.port() == 0) {
@@ -71,10 +101,13 @@ bool ensureNoInvalidIp(const std::vector<IPSockAddr>& servers) {
 
 }  // namespace
 
-// The comparison ignores the last update time.
+// The comparison ignores the last update time, and the RTT distribution, which follows from the
+// records like the RTT sum.
 bool StatsData::operator==(const StatsData& o) const {
-    return std::tie(serverSockAddr, total, rcodeCounts, latencyUs) ==
-           std::tie(o.serverSockAddr, o.total, o.rcodeCounts, o.latencyUs);
+    return std::tie(serverSockAddr, total, rcodeCounts, latencyUs, connectedTotal,
+                    connectedLatencyUs) == std::tie(o.serverSockAddr, o.total, o.rcodeCounts,
+                                                    o.latencyUs, o.connectedTotal,
+                                                    o.connectedLatencyUs);
 }
 
 std::string StatsData::toString() const {
@@ -83,39 +116,63 @@ std::string StatsData::toString() const {
     const auto now = std::chrono::steady_clock::now();
     const int meanLatencyMs = duration_cast<milliseconds>(latencyUs).count() / total;
     const int lastUpdateSec = duration_cast<seconds>(now - lastUpdate).count();
+    const auto percentileMs = [this](double percent) {
+        return int(duration_cast<milliseconds>(latencies.percentile(percent)).count());
+    };
     std::string buf;
-    for (const auto& [rcode, counts] : rcodeCounts) {
-        if (counts != 0) {
-            buf += StringPrintf("%s:%d ", rcodeToName(rcode).c_str(), counts);
+    for (size_t rcode = 0; rcode < rcodeCounts.size(); rcode++) {
+        if (rcodeCounts[rcode] != 0) {
+            buf += StringPrintf("%s:%d ", rcodeToName(rcode).c_str(), rcodeCounts[rcode]);
         }
     }
-    return StringPrintf("%s (%d, %dms, [%s], %ds)", serverSockAddr.ip().toString().c_str(), total,
-                        meanLatencyMs, buf.c_str(), lastUpdateSec);
+    return StringPrintf("%s (%d, %dms, %d/%d/%dms, [%s], %ds)",
+                        serverSockAddr.ip().toString().c_str(), total, meanLatencyMs,
+                        percentileMs(50), percentileMs(90), percentileMs(99), buf.c_str(),
+                        lastUpdateSec);
 }
 
 StatsRecords::StatsRecords(const IPSockAddr& ipSockAddr, size_t size)
-    : mCapacity(size), mStatsData(ipSockAddr) {}
+    : mCapacity(size), mStatsData(ipSockAddr) {
+    mRecords.reserve(size);
+}
 
 void StatsRecords::push(const Record& record) {
     updateStatsData(record, true);
-    mRecords.push_back(record);
-
-    if (mRecords.size() > mCapacity) {
-        updateStatsData(mRecords.front(), false);
-        mRecords.pop_front();
+    if (mRecords.size() < mCapacity) {
+        mRecords.push_back(record);
+        return;
     }
+    if (mCapacity == 0) {
+        updateStatsData(record, false);
+        return;
+    }
+    updateStatsData(mRecords[mNext], false);
+    mRecords[mNext] = record;
+    mNext = (mNext + 1) % mCapacity;
 }
 
 void StatsRecords::updateStatsData(const Record& record, const bool add) {
+    // Only the rcodes which fit in a byte are counted by rcode.
     const int rcode = record.rcode;
+    const bool knownRcode = rcode >= 0 && rcode < int(StatsData::kRcodeCount);
     if (add) {
         mStatsData.total += 1;
-        mStatsData.rcodeCounts[rcode] += 1;
+        if (knownRcode) mStatsData.rcodeCounts[rcode] += 1;
         mStatsData.latencyUs += record.latencyUs;
+        mStatsData.latencies.add(record.latencyUs);
+        if (record.connected) {
+            mStatsData.connectedTotal += 1;
+            mStatsData.connectedLatencyUs += record.latencyUs;
+        }
     } else {
         mStatsData.total -= 1;
-        mStatsData.rcodeCounts[rcode] -= 1;
+        if (knownRcode) mStatsData.rcodeCounts[rcode] -= 1;
         mStatsData.latencyUs -= record.latencyUs;
+        mStatsData.latencies.remove(record.latencyUs);
+        if (record.connected) {
+            mStatsData.connectedTotal -= 1;
+            mStatsData.connectedLatencyUs -= record.latencyUs;
+        }
     }
     mStatsData.lastUpdate = std::chrono::steady_clock::now();
 }
@@ -125,7 +182,7 @@ bool DnsStats::setServers(const std::vector<netdutils::IPSockAddr>& servers, Pro
 
     ServerStatsMap& statsMap = mStats[protocol];
     for (const auto& server : servers) {
-        statsMap.try_emplace(server, StatsRecords(server, kLogSize));
+        statsMap.try_emplace(server, server, kLogSize);
     }
 
     // Clean up the map to eliminate the nodes not belonging to the given list of servers.
@@ -141,6 +198,11 @@ bool DnsStats::setServers(const std::vector<netdutils::IPSockAddr>& servers, Pro
 
     cleanup(&statsMap);
 
+    auto& raceWins = mRaceWins[protocol];
+    for (auto it = raceWins.begin(); it != raceWins.end();) {
+        it = (statsMap.find(it->first) == statsMap.end()) ? raceWins.erase(it) : std::next(it);
+    }
+
     return true;
 }
 
@@ -152,6 +214,7 @@ bool DnsStats::addStats(const IPSockAddr& ipSockAddr, const DnsQueryEvent& recor
             const StatsRecords::Record rec = {
                     .rcode = record.rcode(),
                     .latencyUs = microseconds(record.latency_micros()),
+                    .connected = record.connected(),
             };
             statsRecords.push(rec);
             return true;
@@ -160,6 +223,62 @@ bool DnsStats::addStats(const IPSockAddr& ipSockAddr, const DnsQueryEvent& recor
     return false;
 }
 
+std::vector<IPSockAddr> DnsStats::rankServers(Protocol protocol,
+                                              const std::vector<IPSockAddr>& servers,
+                                              const std::set<IPSockAddr>& connected) {
+    const ServerStatsMap& statsMap = mStats[protocol];
+    Ranking& ranking = mRankings[protocol];
+    ranking.entries.clear();
+    ranking.exploring = false;
+    ranking.count++;
+
+    for (const auto& server : servers) {
+        const bool isConnected = connected.find(server) != connected.end();
+        microseconds latency(0);
+        if (const auto it = statsMap.find(server); it != statsMap.end()) {
+            latency = expectedLatency(it->second.getStatsData(), isConnected);
+        }
+        ranking.entries.push_back({server, latency, isConnected});
+    }
+    std::stable_sort(ranking.entries.begin(), ranking.entries.end(),
+                     [](const Ranking::Entry& a, const Ranking::Entry& b) {
+                         return a.expectedLatency < b.expectedLatency;
+                     });
+
+    // Once in a while, try the server whose stats are the oldest, so that a server which was
+    // slow for a while gets a chance to show that it recovered.
+    if (ranking.entries.size() > 1 && ranking.count % kExplorationInterval == 0) {
+        auto oldest = ranking.entries.end();
+        for (auto it = ranking.entries.begin() + 1; it != ranking.entries.end(); ++it) {
+            const auto stats = statsMap.find(it->server);
+            if (stats == statsMap.end()) continue;
+            if (oldest == ranking.entries.end() ||
+                stats->second.getStatsData().lastUpdate <
+                        statsMap.find(oldest->server)->second.getStatsData().lastUpdate) {
+                oldest = it;
+            }
+        }
+        if (oldest != ranking.entries.end()) {
+            std::rotate(ranking.entries.begin(), oldest, oldest + 1);
+            ranking.exploring = true;
+        }
+    }
+
+    std::vector<IPSockAddr> ret;
+    ret.reserve(ranking.entries.size());
+    for (const auto& entry : ranking.entries) {
+        ret.push_back(entry.server);
+    }
+    return ret;
+}
+
+void DnsStats::addRaceWin(const IPSockAddr& winner, Protocol protocol) {
+    // Only count servers which are still in use, so that the map can't grow without bound.
+    const ServerStatsMap& statsMap = mStats[protocol];
+    if (statsMap.find(winner) == statsMap.end()) return;
+    mRaceWins[protocol][winner]++;
+}
+
 std::vector<StatsData> DnsStats::getStats(Protocol protocol) const {
     std::vector<StatsData> ret;
 
@@ -183,7 +302,8 @@ void DnsStats::dump(DumpWriter& dw) {
         }
     };
 
-    dw.println("Server statistics: (total, RTT avg, {rcode:counts}, last update)");
+    dw.println(
+            "Server statistics: (total, RTT avg, RTT p50/p90/p99, {rcode:counts}, last update)");
     ScopedIndent indentStats(dw);
 
     dw.println("over UDP");
@@ -196,4 +316,36 @@ void DnsStats::dump(DumpWriter& dw) {
     dumpStatsMap(mStats[PROTO_TCP]);
 }
 
+void DnsStats::dumpRankings(DumpWriter& dw) {
+    const auto dumpRanking = [&](const Ranking& ranking) {
+        ScopedIndent indentLog(dw);
+        if (ranking.entries.empty()) {
+            dw.println("<not ranked yet>");
+            return;
+        }
+        for (size_t i = 0; i < ranking.entries.size(); i++) {
+            const auto& entry = ranking.entries[i];
+            dw.println("%s %dms%s%s", entry.server.ip().toString().c_str(),
+                       int(duration_cast<milliseconds>(entry.expectedLatency).count()),
+                       entry.connected ? "" : " (new connection)",
+                       (i == 0 && ranking.exploring) ? " (exploring)" : "");
+        }
+    };
+
+    dw.println("Server ranking: (expected latency)");
+    ScopedIndent indentRanking(dw);
+
+    dw.println("over TLS");
+    dumpRanking(mRankings[PROTO_DOT]);
+
+    const auto& raceWins = mRaceWins[PROTO_DOT];
+    if (!raceWins.empty()) {
+        dw.println("Race wins over TLS:");
+        ScopedIndent indentWins(dw);
+        for (const auto& [server, wins] : raceWins) {
+            dw.println("%s %d", server.ip().toString().c_str(), wins);
+        }
+    }
+}
+
 }  // namespace android::net
@@ -17,15 +17,17 @@
 
 #pragma once
 
+#include <array>
 #include <chrono>
-#include <deque>
 #include <map>
+#include <set>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
 #include <netdutils/DumpWriter.h>
 #include <netdutils/InternetAddresses.h>
 
+#include "LatencyHistogram.h"
 #include "ResolverStats.h"
 #include "stats.pb.h"
 
@@ -43,14 +45,24 @@ struct StatsData {
     // The most recent number of records being accumulated.
     int total = 0;
 
-    // The map used to store the number of each rcode.
-    std::map<int, int> rcodeCounts;
+    // The number of each rcode, indexed by rcode.  RCODEs take 4 bits on the wire; the ones above
+    // are the NS_R_* codes of errors on our side.
+    static constexpr size_t kRcodeCount = 256;
+    std::array<int, kRcodeCount> rcodeCounts = {};
 
     // The aggregated RTT in microseconds.
     // For DNS-over-TCP, it includes TCP handshake.
     // For DNS-over-TLS, it might include TCP handshake plus SSL handshake.
     std::chrono::microseconds latencyUs = {};
 
+    // The number of records, and their aggregated RTT, for queries which had to connect to the
+    // server first.
+    int connectedTotal = 0;
+    std::chrono::microseconds connectedLatencyUs = {};
+
+    // The distribution of the RTTs, for percentiles.
+    LatencyHistogram latencies;
+
     // The last update timestamp.
     std::chrono::time_point<std::chrono::steady_clock> lastUpdate;
 
@@ -64,11 +76,14 @@ struct StatsData {
 };
 
 // A circular buffer based class used to store the statistics for a server with a protocol.
+// The records are kept in a buffer allocated once, and pushing one updates the aggregates in
+// constant time.
 class StatsRecords {
   public:
     struct Record {
         int rcode;
         std::chrono::microseconds latencyUs;
+        bool connected = false;
     };
 
     StatsRecords(const netdutils::IPSockAddr& ipSockAddr, size_t size);
@@ -80,7 +95,9 @@ class StatsRecords {
   private:
     void updateStatsData(const Record& record, const bool add);
 
-    std::deque<Record> mRecords;
+    std::vector<Record> mRecords;
+    // The oldest record, which the next push replaces once mRecords is full.
+    size_t mNext = 0;
     size_t mCapacity;
     StatsData mStatsData;
 };
@@ -98,18 +115,49 @@ class DnsStats {
     // Return true if |record| is successfully added into |server|'s stats; otherwise, return false.
     bool addStats(const netdutils::IPSockAddr& server, const DnsQueryEvent& record);
 
+    // Return |servers| sorted by the expected time to get an answer from them over |protocol|,
+    // best first.  Servers which aren't in |connected| are charged the cost of connecting.
+    // Servers without stats come first, so that they get measured, and one ranking in
+    // kExplorationInterval moves the least recently measured server to the front.  Servers with
+    // the same expected time keep their order.
+    std::vector<netdutils::IPSockAddr> rankServers(
+            Protocol protocol, const std::vector<netdutils::IPSockAddr>& servers,
+            const std::set<netdutils::IPSockAddr>& connected);
+
+    // Count a race between servers over |protocol| that |winner| won.
+    void addRaceWin(const netdutils::IPSockAddr& winner, Protocol protocol);
+
     void dump(netdutils::DumpWriter& dw);
 
-    // For testing.
+    // Dump the latest result of rankServers(), and the race wins, for DNS-over-TLS.
+    void dumpRankings(netdutils::DumpWriter& dw);
+
+    // Return a copy of the stats of the servers over |protocol|.
     std::vector<StatsData> getStats(Protocol protocol) const;
 
     // TODO: Compatible support for getResolverInfo().
     // TODO: Support getSortedServers().
 
     static constexpr size_t kLogSize = 128;
+    static constexpr int kExplorationInterval = 20;
 
   private:
+    struct Ranking {
+        struct Entry {
+            netdutils::IPSockAddr server;
+            std::chrono::microseconds expectedLatency;
+            bool connected;
+        };
+        std::vector<Entry> entries;
+        // Whether the first entry was moved to the front for exploration.
+        bool exploring = false;
+        // The number of rankings done so far.
+        int count = 0;
+    };
+
     std::map<Protocol, ServerStatsMap> mStats;
+    std::map<Protocol, Ranking> mRankings;
+    std::map<Protocol, std::map<netdutils::IPSockAddr, int>> mRaceWins;
 };
 
 }  // namespace android::net
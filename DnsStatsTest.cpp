@@ -15,6 +15,7 @@
  */
 
 #include <array>
+#include <thread>
 
 #include <android-base/test_utils.h>
 #include <gmock/gmock.h>
@@ -46,7 +47,9 @@ StatsData makeStatsData(const IPSockAddr& server, const int total, const millise
     StatsData ret(server);
     ret.total = total;
     ret.latencyUs = latencyMs;
-    ret.rcodeCounts = rcodeCounts;
+    for (const auto& [rcode, count] : rcodeCounts) {
+        ret.rcodeCounts[rcode] = count;
+    }
     return ret;
 }
 
@@ -82,6 +85,35 @@ TEST_F(StatsRecordsTest, PushRecord) {
               makeStatsData(server, 3, 750ms, {{NS_R_NO_ERROR, 0}, {NS_R_TIMEOUT, 3}}));
 }
 
+TEST_F(StatsRecordsTest, LatencyPercentiles) {
+    const IPSockAddr server = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+    constexpr size_t size = 100;
+    StatsRecords sr(server, size);
+    for (int i = 1; i <= 100; i++) {
+        sr.push({NS_R_NO_ERROR, milliseconds(i)});
+    }
+    // The percentiles are exact up to the width of a histogram bucket.
+    const auto expectNear = [](milliseconds expected, std::chrono::microseconds actual) {
+        EXPECT_NEAR(std::chrono::microseconds(expected).count(), actual.count(),
+                    expected.count() * 1000 / LatencyHistogram::kSubBuckets);
+    };
+    const LatencyHistogram& latencies = sr.getStatsData().latencies;
+    EXPECT_EQ(100, latencies.count());
+    expectNear(50ms, latencies.percentile(50));
+    expectNear(90ms, latencies.percentile(90));
+    expectNear(99ms, latencies.percentile(99));
+
+    // Only the latest records count.
+    for (int i = 0; i < 100; i++) {
+        sr.push({NS_R_TIMEOUT, 1000ms});
+        if (i == 49) expectNear(1000ms, sr.getStatsData().latencies.percentile(51));
+    }
+    EXPECT_EQ(100, sr.getStatsData().latencies.count());
+    expectNear(1000ms, sr.getStatsData().latencies.percentile(1));
+    EXPECT_EQ(100, sr.getStatsData().rcodeCounts[NS_R_TIMEOUT]);
+    EXPECT_EQ(0, sr.getStatsData().rcodeCounts[NS_R_NO_ERROR]);
+}
+
 class DnsStatsTest : public ::testing::Test {
   protected:
     std::string captureDumpOutput() {
@@ -379,4 +411,70 @@ TEST_F(DnsStatsTest, AddStatsRecords_100000) {
     verifyDumpOutput(expectedStats, expectedStats, expectedStats);
 }
 
+TEST_F(DnsStatsTest, RankServers) {
+    const std::vector<IPSockAddr> servers = {
+            IPSockAddr::toIPSockAddr("127.0.0.1", 853),
+            IPSockAddr::toIPSockAddr("127.0.0.2", 853),
+            IPSockAddr::toIPSockAddr("127.0.0.3", 853),
+    };
+    const std::set<IPSockAddr> allConnected(servers.begin(), servers.end());
+    EXPECT_TRUE(mDnsStats.setServers(servers, PROTO_DOT));
+
+    // Without stats, the order is kept.
+    EXPECT_EQ(servers, mDnsStats.rankServers(PROTO_DOT, servers, allConnected));
+
+    // The faster server comes first, and the one which hasn't been measured before both.
+    const auto slow = makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 50ms);
+    const auto fast = makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 10ms);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(mDnsStats.addStats(servers[0], slow));
+        EXPECT_TRUE(mDnsStats.addStats(servers[1], fast));
+    }
+    EXPECT_EQ((std::vector{servers[2], servers[1], servers[0]}),
+              mDnsStats.rankServers(PROTO_DOT, servers, allConnected));
+
+    // Handshakes are only charged to servers without a connection.
+    auto connectedEvent = makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 300ms);
+    connectedEvent.set_connected(true);
+    EXPECT_TRUE(mDnsStats.addStats(servers[1], connectedEvent));
+    EXPECT_EQ((std::vector{servers[2], servers[1], servers[0]}),
+              mDnsStats.rankServers(PROTO_DOT, servers, allConnected));
+    EXPECT_EQ((std::vector{servers[2], servers[0], servers[1]}),
+              mDnsStats.rankServers(PROTO_DOT, servers, {servers[0]}));
+
+    // A server which times out half of the time is worse than a slower but reliable one.
+    const auto timeout = makeDnsQueryEvent(PROTO_DOT, NS_R_TIMEOUT, 1000ms);
+    const auto medium = makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 20ms);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_TRUE(mDnsStats.addStats(servers[1], timeout));
+        EXPECT_TRUE(mDnsStats.addStats(servers[2], medium));
+    }
+    EXPECT_EQ((std::vector{servers[2], servers[0], servers[1]}),
+              mDnsStats.rankServers(PROTO_DOT, servers, allConnected));
+}
+
+TEST_F(DnsStatsTest, RankServersExploration) {
+    const std::vector<IPSockAddr> servers = {
+            IPSockAddr::toIPSockAddr("127.0.0.1", 853),
+            IPSockAddr::toIPSockAddr("127.0.0.2", 853),
+            IPSockAddr::toIPSockAddr("127.0.0.3", 853),
+    };
+    const std::set<IPSockAddr> allConnected(servers.begin(), servers.end());
+    EXPECT_TRUE(mDnsStats.setServers(servers, PROTO_DOT));
+
+    // servers[1] has the oldest stats.
+    EXPECT_TRUE(mDnsStats.addStats(servers[1], makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 90ms)));
+    std::this_thread::sleep_for(10ms);
+    EXPECT_TRUE(mDnsStats.addStats(servers[2], makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 50ms)));
+    EXPECT_TRUE(mDnsStats.addStats(servers[0], makeDnsQueryEvent(PROTO_DOT, NS_R_NO_ERROR, 10ms)));
+
+    const std::vector<IPSockAddr> best = {servers[0], servers[2], servers[1]};
+    for (int i = 1; i < DnsStats::kExplorationInterval; i++) {
+        EXPECT_EQ(best, mDnsStats.rankServers(PROTO_DOT, servers, allConnected));
+    }
+    EXPECT_EQ((std::vector{servers[1], servers[0], servers[2]}),
+              mDnsStats.rankServers(PROTO_DOT, servers, allConnected));
+    EXPECT_EQ(best, mDnsStats.rankServers(PROTO_DOT, servers, allConnected));
+}
+
 }  // namespace android::net
@@ -18,9 +18,17 @@
 
 #include "DnsTlsDispatcher.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <set>
+
+#include <Fwmark.h>
 #include <netdutils/Stopwatch.h>
+#include <netdutils/ThreadUtil.h>
 
 #include "DnsTlsSocketFactory.h"
+#include "Experiments.h"
+#include "QueryTrace.h"
 #include "resolv_cache.h"
 #include "resolv_private.h"
 #include "stats.pb.h"
@@ -30,20 +38,53 @@
 namespace android {
 namespace net {
 
+using android::base::ScopedLockAssertion;
 using android::netdutils::IPSockAddr;
+using android::netdutils::setThreadName;
 using android::netdutils::Stopwatch;
 using netdutils::Slice;
 
+DnsTlsDispatcher::DnsTlsDispatcher() : DnsTlsDispatcher(std::make_unique<DnsTlsSocketFactory>()) {}
+
+DnsTlsDispatcher::DnsTlsDispatcher(std::unique_ptr<IDnsTlsSocketFactory> factory)
+    : mFactory(std::move(factory)) {
+    mCleanupThread = std::thread(&DnsTlsDispatcher::cleanupLoop, this);
+}
+
+DnsTlsDispatcher::~DnsTlsDispatcher() {
+    {
+        std::lock_guard guard(mLock);
+        mStopping = true;
+    }
+    mCleanupCv.notify_one();
+    mCleanupThread.join();
+}
+
 // static
-std::mutex DnsTlsDispatcher::sLock;
+unsigned DnsTlsDispatcher::normalizeMark(unsigned mark) {
+    // Which network a connection uses, and whether it can be routed into a VPN, depend on
+    // netId and protectedFromVpn.  The routing rules of netd also match the permission bits,
+    // e.g. to let only privileged sockets use a restricted network, so they are kept too.
+    // explicitlySelected only matters when a socket picks its network.
+    Fwmark fwmark;
+    fwmark.intValue = mark;
+    Fwmark normalized;
+    normalized.netId = fwmark.netId;
+    normalized.protectedFromVpn = fwmark.protectedFromVpn;
+    normalized.permission = fwmark.permission;
+    return normalized.intValue;
+}
 
-DnsTlsDispatcher::DnsTlsDispatcher() {
-    mFactory.reset(new DnsTlsSocketFactory());
+// static
+DnsTlsDispatcher& DnsTlsDispatcher::getInstance() {
+    static DnsTlsDispatcher* const instance = new DnsTlsDispatcher();
+    return *instance;
 }
 
 std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedServerList(
-        const std::list<DnsTlsServer> &tlsServers, unsigned mark) const {
-    // Our preferred DnsTlsServer order is:
+        const std::list<DnsTlsServer>& tlsServers, unsigned mark, unsigned netId) {
+    // Servers are ranked by the expected latency measured in DnsStats.  Among servers which
+    // are equally good, or not measured yet, our preferred DnsTlsServer order is:
     //     1) reuse existing IPv6 connections
     //     2) reuse existing IPv4 connections
     //     3) establish new IPv6 connections
@@ -56,11 +97,15 @@ std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedServerList(
     // Pull out any servers for which we might have existing connections and
     // place them at the from the list of servers to try.
     {
-        std::lock_guard guard(sLock);
-
         for (const auto& tlsServer : tlsServers) {
-            const Key key = std::make_pair(mark, tlsServer);
-            if (mStore.find(key) != mStore.end()) {
+            const Key key(normalizeMark(mark), tlsServer);
+            Shard& shard = getShard(key);
+            bool existing;
+            {
+                std::lock_guard guard(shard.lock);
+                existing = (shard.store.find(key) != shard.store.end());
+            }
+            if (existing) {
                 switch (tlsServer.ss.ss_family) {
                     case AF_INET:
                         existing4.push_back(tlsServer);
@@ -82,59 +127,185 @@ std::list<DnsTlsServer> DnsTlsDispatcher::getOrderedServerList(
         }
     }
 
+    std::set<IPSockAddr> connected;
+    for (const auto& server : existing6) connected.insert(IPSockAddr::toIPSockAddr(server.ss));
+    for (const auto& server : existing4) connected.insert(IPSockAddr::toIPSockAddr(server.ss));
+
     auto& out = existing6;
     out.splice(out.cend(), existing4);
     out.splice(out.cend(), new6);
     out.splice(out.cend(), new4);
-    return out;
+
+    std::vector<IPSockAddr> servers;
+    for (const auto& server : out) servers.push_back(IPSockAddr::toIPSockAddr(server.ss));
+    const std::vector<IPSockAddr> ranked =
+            resolv_stats_rank_servers(netId, PROTO_DOT, servers, connected);
+
+    std::list<DnsTlsServer> sorted;
+    for (const auto& addr : ranked) {
+        const auto it = std::find_if(out.begin(), out.end(), [&addr](const DnsTlsServer& s) {
+            return IPSockAddr::toIPSockAddr(s.ss) == addr;
+        });
+        if (it != out.end()) sorted.splice(sorted.cend(), out, it);
+    }
+    // Anything the ranking didn't return keeps its place at the end.
+    sorted.splice(sorted.cend(), out);
+    return sorted;
+}
+
+namespace {
+
+// Counts completed queries, so that a caller can wait for the first of several.
+class CompletionCounter : public DnsTlsQueryMap::Listener {
+  public:
+    void onComplete() override {
+        std::lock_guard guard(mLock);
+        mCount++;
+        mCv.notify_all();
+    }
+
+    // Waits until more than |seen| queries have completed, or until |timeout|.  Returns the
+    // number of completed queries.
+    int waitForMoreThan(int seen, std::chrono::steady_clock::time_point timeout) {
+        std::unique_lock lock(mLock);
+        ScopedLockAssertion assume_lock(mLock);
+        while (mCount <= seen) {
+            if (mCv.wait_until(lock, timeout) == std::cv_status::timeout) break;
+        }
+        return mCount;
+    }
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCv;
+    int mCount GUARDED_BY(mLock) = 0;
+};
+
+// How often a query which waits for a response checks whether its client has hung up.
+constexpr std::chrono::milliseconds kStopCheckInterval{100};
+
+// Returns true if the lookup of |statp|, if any, has nobody or no time left to wait for.
+bool shouldStop(const ResState* statp) {
+    return statp != nullptr && (statp->isCancelled() || statp->deadlineExceeded());
+}
+
+// Waits for |waiter| until |timeout|, and as long as the lookup of |statp|, if any, goes on.
+// Returns ready if the query completed, or else timeout.
+std::future_status waitFor(DnsTlsTransport::Waiter& waiter,
+                           std::chrono::steady_clock::time_point timeout, const ResState* statp) {
+    if (statp != nullptr) timeout = std::min(timeout, statp->deadline);
+    for (;;) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= timeout || shouldStop(statp)) return std::future_status::timeout;
+        const auto until =
+                (statp != nullptr) ? std::min(timeout, now + kStopCheckInterval) : timeout;
+        if (waiter.wait_for(until - now) == std::future_status::ready) {
+            return std::future_status::ready;
+        }
+    }
+}
+
+// Records the outcome of a query to |server| in the event of |statp|, and in DnsStats.
+// |answer| is only used if |code| is success.  Abandoned queries aren't recorded, as the server
+// wasn't given its full time to answer.
+void recordQueryEvent(res_state statp, const DnsTlsServer& server, int serverIndex,
+                      const Slice query, DnsTlsTransport::Response code, const Slice answer,
+                      int64_t latencyUs, bool connected) {
+    if (code == DnsTlsTransport::Response::abandoned) return;
+
+    DnsQueryEvent* dnsQueryEvent = statp->event->mutable_dns_query_events()->add_dns_query_event();
+    dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(latencyUs));
+    dnsQueryEvent->set_dns_server_index(serverIndex);
+    dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(server.ss.ss_family));
+    dnsQueryEvent->set_protocol(PROTO_DOT);
+    dnsQueryEvent->set_type(getQueryType(query.base(), query.size()));
+    dnsQueryEvent->set_connected(connected);
+
+    switch (code) {
+        case DnsTlsTransport::Response::success:
+            if (answer.size() < sizeof(HEADER)) {
+                dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
+                break;
+            }
+            dnsQueryEvent->set_rcode(
+                    static_cast<NsRcode>(reinterpret_cast<HEADER*>(answer.base())->rcode));
+            break;
+        case DnsTlsTransport::Response::limit_error:
+        case DnsTlsTransport::Response::internal_error:
+            dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
+            break;
+        case DnsTlsTransport::Response::network_error:
+        case DnsTlsTransport::Response::timeout:
+            // Sync from res_tls_send in res_send.cpp
+            dnsQueryEvent->set_rcode(NS_R_TIMEOUT);
+            break;
+        case DnsTlsTransport::Response::abandoned:
+            break;
+            // No "default" statement.
+    }
+    resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
 }
 
+}  // namespace
+
 DnsTlsTransport::Response DnsTlsDispatcher::query(const std::list<DnsTlsServer>& tlsServers,
                                                   res_state statp, const Slice query,
                                                   const Slice ans, int* resplen) {
-    const std::list<DnsTlsServer> orderedServers(getOrderedServerList(tlsServers, statp->_mark));
+    const std::list<DnsTlsServer> orderedServers(
+            getOrderedServerList(tlsServers, statp->_mark, statp->netid));
 
     if (orderedServers.empty()) LOG(WARNING) << "Empty DnsTlsServer list";
 
     DnsTlsTransport::Response code = DnsTlsTransport::Response::internal_error;
     int serverCount = 0;
-    for (const auto& server : orderedServers) {
-        DnsQueryEvent* dnsQueryEvent =
-                statp->event->mutable_dns_query_events()->add_dns_query_event();
+    auto server = orderedServers.begin();
+    if (orderedServers.size() >= 2 && Experiments::getInstance()->getFlag("dot_race_mode", 0) &&
+        startRace(statp->netid)) {
+        const DnsTlsServer& first = *server++;
+        const DnsTlsServer& second = *server++;
+        // There's nothing to fail over to if these are the last servers.
+        const bool canTimeOut = orderedServers.size() > 2;
+        code = raceQuery(first, second, statp, query, ans, resplen, canTimeOut);
+        endRace(statp->netid);
+        if (code == DnsTlsTransport::Response::success ||
+            code == DnsTlsTransport::Response::limit_error) {
+            return code;
+        }
+        if (shouldStop(statp)) {
+            LOG(DEBUG) << "Lookup cancelled or out of time, not trying other servers";
+            return code;
+        }
+        serverCount = 2;
+    }
 
+    for (; server != orderedServers.end(); ++server) {
         bool connectTriggered = false;
+        // There's nothing to fail over to from the last server, so wait for it as long as it
+        // takes.
+        const bool canTimeOut = (serverCount + 1 < static_cast<int>(orderedServers.size()));
         Stopwatch queryStopwatch;
-        code = this->query(server, statp->_mark, query, ans, resplen, &connectTriggered);
-
-        dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(queryStopwatch.timeTakenUs()));
-        dnsQueryEvent->set_dns_server_index(serverCount++);
-        dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(server.ss.ss_family));
-        dnsQueryEvent->set_protocol(PROTO_DOT);
-        dnsQueryEvent->set_type(getQueryType(query.base(), query.size()));
-        dnsQueryEvent->set_connected(connectTriggered);
+        code = this->query(*server, statp->_mark, query, ans, resplen, &connectTriggered,
+                           canTimeOut, statp);
+        recordQueryEvent(statp, *server, serverCount++, query, code, ans,
+                         queryStopwatch.timeTakenUs(), connectTriggered);
+        if (code != DnsTlsTransport::Response::success && shouldStop(statp)) {
+            LOG(DEBUG) << "Lookup cancelled or out of time, not trying other servers";
+            return code;
+        }
 
         switch (code) {
             // These response codes are valid responses and not expected to
             // change if another server is queried.
             case DnsTlsTransport::Response::success:
-                dnsQueryEvent->set_rcode(
-                        static_cast<NsRcode>(reinterpret_cast<HEADER*>(ans.base())->rcode));
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
-                return code;
             case DnsTlsTransport::Response::limit_error:
-                dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
+            // Nobody waits for another server.
+            case DnsTlsTransport::Response::abandoned:
                 return code;
             // These response codes might differ when trying other servers, so
             // keep iterating to see if we can get a different (better) result.
             case DnsTlsTransport::Response::network_error:
-                // Sync from res_tls_send in res_send.cpp
-                dnsQueryEvent->set_rcode(NS_R_TIMEOUT);
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
-                break;
+            case DnsTlsTransport::Response::timeout:
             case DnsTlsTransport::Response::internal_error:
-                dnsQueryEvent->set_rcode(NS_R_INTERNAL_ERROR);
-                resolv_stats_add(statp->netid, IPSockAddr::toIPSockAddr(server.ss), dnsQueryEvent);
                 break;
             // No "default" statement.
         }
@@ -143,37 +314,183 @@ DnsTlsTransport::Response DnsTlsDispatcher::query(const std::list<DnsTlsServer>&
     return code;
 }
 
-DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, unsigned mark,
-                                                  const Slice query, const Slice ans, int* resplen,
-                                                  bool* connectTriggered) {
-    // TODO: This can cause the resolver to create multiple connections to the same DoT server
-    // merely due to different mark, such as the bit explicitlySelected unset.
-    // See if we can save them and just create one connection for one DoT server.
-    const Key key = std::make_pair(mark, server);
-    Transport* xport;
-    {
-        std::lock_guard guard(sLock);
-        auto it = mStore.find(key);
-        if (it == mStore.end()) {
-            xport = new Transport(server, mark, mFactory.get());
-            mStore[key].reset(xport);
+DnsTlsTransport::Response DnsTlsDispatcher::raceQuery(const DnsTlsServer& first,
+                                                      const DnsTlsServer& second, res_state statp,
+                                                      const Slice query, const Slice ans,
+                                                      int* resplen, bool canTimeOut) {
+    struct Leg {
+        const DnsTlsServer& server;
+        Transport* xport = nullptr;
+        DnsTlsTransport::Waiter waiter;
+        std::chrono::steady_clock::time_point start;
+        int connectCounter = 0;
+        bool done = false;
+        DnsTlsTransport::Result result = {};
+    };
+    Leg legs[] = {{.server = first}, {.server = second}};
+    CompletionCounter completions;
+    int started = 0;
+    int finished = 0;
+    Leg* winner = nullptr;
+
+    const auto startLeg = [&](Leg& leg) {
+        leg.xport = acquireTransport(leg.server, statp->_mark);
+        leg.connectCounter = leg.xport->transport.getConnectCounter();
+        leg.start = std::chrono::steady_clock::now();
+        leg.waiter = leg.xport->transport.query(query);
+        leg.waiter.setListener(&completions);
+        started++;
+    };
+    // Collects the results which have arrived, and picks the first success as the winner.
+    const auto collect = [&]() {
+        for (int i = 0; i < started; i++) {
+            Leg& leg = legs[i];
+            if (leg.done || leg.waiter.wait_for(std::chrono::seconds(0)) !=
+                                    std::future_status::ready) {
+                continue;
+            }
+            leg.done = true;
+            finished++;
+            leg.result = leg.waiter.get();
+            const auto latency = std::chrono::steady_clock::now() - leg.start;
+            recordQueryEvent(statp, leg.server, i, query, leg.result.code,
+                             netdutils::makeSlice(leg.result.response),
+                             std::chrono::duration_cast<std::chrono::microseconds>(latency).count(),
+                             leg.xport->transport.getConnectCounter() > leg.connectCounter);
+            if (winner == nullptr && leg.result.code == DnsTlsTransport::Response::success) {
+                winner = &leg;
+            }
+        }
+    };
+
+    // Waits until another query completes, or until |timeout|, and as long as the lookup goes on.
+    // Returns false if no query completed.
+    int seen = 0;
+    const auto waitForCompletion = [&](std::chrono::steady_clock::time_point timeout) {
+        ScopedQueryStage stage(QueryStage::NETWORK_RTT);
+        timeout = std::min(timeout, statp->deadline);
+        for (;;) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= timeout || shouldStop(statp)) return false;
+            const int count =
+                    completions.waitForMoreThan(seen, std::min(timeout, now + kStopCheckInterval));
+            if (count > seen) {
+                seen = count;
+                return true;
+            }
+        }
+    };
+
+    startLeg(legs[0]);
+    waitForCompletion(legs[0].start + legs[0].xport->transport.getRaceDelay());
+    collect();
+    if (winner == nullptr && !shouldStop(statp)) {
+        LOG(DEBUG) << "Racing the query on a second server";
+        startLeg(legs[1]);
+    }
+    // Like in the sequential mode, the last servers are waited for as long as the lookup goes
+    // on, and others until their transport's timeout.
+    auto timeout = std::chrono::steady_clock::time_point::max();
+    if (canTimeOut) {
+        timeout = std::chrono::steady_clock::time_point::min();
+        for (int i = 0; i < started; i++) {
+            timeout = std::max(timeout, legs[i].start + legs[i].xport->transport.getTimeout());
+        }
+    }
+    while (winner == nullptr && finished < started && waitForCompletion(timeout)) {
+        collect();
+    }
+
+    // The queries which are still pending are given up on.
+    const bool timedOut = std::chrono::steady_clock::now() >= timeout;
+    for (int i = 0; i < started; i++) {
+        Leg& leg = legs[i];
+        if (winner != nullptr || leg.done) continue;
+        if (timedOut) {
+            LOG(DEBUG) << "Raced query timed out";
+            leg.xport->transport.onTimeout();
+            leg.result = {.code = DnsTlsTransport::Response::timeout};
         } else {
-            xport = it->second.get();
+            leg.result = {.code = DnsTlsTransport::Response::abandoned};
         }
-        ++xport->useCount;
+        const auto latency = std::chrono::steady_clock::now() - leg.start;
+        recordQueryEvent(statp, leg.server, i, query, leg.result.code, Slice(),
+                         std::chrono::duration_cast<std::chrono::microseconds>(latency).count(),
+                         leg.xport->transport.getConnectCounter() > leg.connectCounter);
     }
 
-    // Don't call this function and hold sLock at the same time because of the following reason:
-    // TLS handshake requires a lock which is also needed by this function, if the handshake gets
-    // stuck, this function also gets blocked.
-    const int connectCounter = xport->transport.getConnectCounter();
+    DnsTlsTransport::Response code = legs[started - 1].result.code;
+    if (winner != nullptr) {
+        code = copyResponse(winner->result, ans, resplen);
+        if (started > 1) {
+            resolv_stats_add_race_win(statp->netid, IPSockAddr::toIPSockAddr(winner->server.ss),
+                                      PROTO_DOT);
+        }
+    }
 
-    LOG(DEBUG) << "Sending query of length " << query.size();
-    auto res = xport->transport.query(query);
-    LOG(DEBUG) << "Awaiting response";
-    const auto& result = res.get();
-    *connectTriggered = (xport->transport.getConnectCounter() > connectCounter);
+    // The losing query isn't cancelled, but nobody waits for it anymore.
+    for (int i = 0; i < started; i++) {
+        legs[i].waiter = DnsTlsTransport::Waiter();
+        releaseTransport(legs[i].xport);
+    }
+    return code;
+}
+
+bool DnsTlsDispatcher::startRace(unsigned netId) {
+    const int maxRaces = Experiments::getInstance()->getFlag("dot_race_max_parallel", kMaxRaces);
+    std::lock_guard guard(mLock);
+    int& races = mRaces[netId];
+    if (races >= maxRaces) {
+        return false;
+    }
+    races++;
+    return true;
+}
 
+void DnsTlsDispatcher::endRace(unsigned netId) {
+    std::lock_guard guard(mLock);
+    if (--mRaces[netId] <= 0) {
+        mRaces.erase(netId);
+    }
+}
+
+DnsTlsDispatcher::Transport* DnsTlsDispatcher::acquireTransport(const DnsTlsServer& server,
+                                                               unsigned mark) {
+    // The transport is created with the mark of its first user, but shared by all the marks
+    // which route the same way.
+    const Key key(normalizeMark(mark), server);
+    Shard& shard = getShard(key);
+    std::lock_guard guard(shard.lock);
+    auto it = shard.store.find(key);
+    if (it == shard.store.end()) {
+        std::shared_ptr<DnsTlsSessionCache> cache;
+        {
+            std::lock_guard cacheGuard(mLock);
+            auto& sessionCache = mSessionCaches[server];
+            if (!sessionCache) sessionCache = std::make_shared<DnsTlsSessionCache>();
+            cache = sessionCache;
+        }
+        it = shard.store
+                     .emplace(key, std::make_unique<Transport>(server, mark, mFactory.get(),
+                                                               std::move(cache)))
+                     .first;
+    }
+    Transport* xport = it->second.get();
+    xport->useCount.fetch_add(1, std::memory_order_relaxed);
+    return xport;
+}
+
+// static
+void DnsTlsDispatcher::releaseTransport(Transport* xport) {
+    // lastUsed has to be set before the transport looks idle to cleanup().
+    xport->lastUsed.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                          std::memory_order_relaxed);
+    xport->useCount.fetch_sub(1, std::memory_order_release);
+}
+
+// static
+DnsTlsTransport::Response DnsTlsDispatcher::copyResponse(const DnsTlsTransport::Result& result,
+                                                         const Slice ans, int* resplen) {
     DnsTlsTransport::Response code = result.code;
     if (code == DnsTlsTransport::Response::success) {
         if (result.response.size() > ans.size()) {
@@ -187,34 +504,154 @@ DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, un
     } else {
         LOG(DEBUG) << "Query failed: " << (unsigned int)code;
     }
+    return code;
+}
+
+DnsTlsTransport::Response DnsTlsDispatcher::query(const DnsTlsServer& server, unsigned mark,
+                                                  const Slice query, const Slice ans, int* resplen,
+                                                  bool* connectTriggered, bool canTimeOut,
+                                                  const ResState* statp) {
+    Transport* xport = acquireTransport(server, mark);
+
+    // Don't call this function and hold a lock of the dispatcher at the same time because of the
+    // following reason:
+    // TLS handshake requires a lock which is also needed by this function, if the handshake gets
+    // stuck, this function also gets blocked.
+    const int connectCounter = xport->transport.getConnectCounter();
 
-    auto now = std::chrono::steady_clock::now();
+    LOG(DEBUG) << "Sending query of length " << query.size();
+    DnsTlsTransport::Result result;
     {
-        std::lock_guard guard(sLock);
-        --xport->useCount;
-        xport->lastUsed = now;
-        cleanup(now);
+        // The waiter must be gone before the transport is released.
+        auto res = xport->transport.query(query);
+        LOG(DEBUG) << "Awaiting response";
+        ScopedQueryStage stage(QueryStage::NETWORK_RTT);
+        if (!canTimeOut && statp == nullptr) {
+            result = res.get();
+        } else {
+            const auto now = std::chrono::steady_clock::now();
+            const auto timeout = canTimeOut ? now + xport->transport.getTimeout()
+                                            : std::chrono::steady_clock::time_point::max();
+            if (waitFor(res, timeout, statp) == std::future_status::ready) {
+                result = res.get();
+            } else {
+                // Only a timeout of the transport says something about the server.
+                if (std::chrono::steady_clock::now() >= timeout) {
+                    LOG(DEBUG) << "Query timed out";
+                    xport->transport.onTimeout();
+                    result = {.code = DnsTlsTransport::Response::timeout};
+                } else {
+                    LOG(DEBUG) << "Stopped waiting for the query";
+                    result = {.code = DnsTlsTransport::Response::abandoned};
+                }
+            }
+        }
     }
+    *connectTriggered = (xport->transport.getConnectCounter() > connectCounter);
+
+    const DnsTlsTransport::Response code = copyResponse(result, ans, resplen);
+    releaseTransport(xport);
     return code;
 }
 
-// This timeout effectively controls how long to keep SSL session tickets.
+std::optional<DnsTlsSessionCache::Stats> DnsTlsDispatcher::getSessionStats(
+        const DnsTlsServer& server) {
+    std::lock_guard guard(mLock);
+    const auto it = mSessionCaches.find(server);
+    if (it == mSessionCaches.end()) return std::nullopt;
+    return it->second->getStats();
+}
+
+std::optional<DnsTlsTransport::Stats> DnsTlsDispatcher::getTransportStats(
+        const DnsTlsServer& server) {
+    // The transports are held like for a query, since reading their stats may wait for a
+    // handshake, which must not block the shards.
+    std::vector<Transport*> xports;
+    for (Shard& shard : mShards) {
+        std::lock_guard guard(shard.lock);
+        for (const auto& [key, xport] : shard.store) {
+            if (!(key.server == server)) continue;
+            xport->useCount.fetch_add(1, std::memory_order_relaxed);
+            xports.push_back(xport.get());
+        }
+    }
+    std::optional<DnsTlsTransport::Stats> total;
+    for (Transport* xport : xports) {
+        const DnsTlsTransport::Stats stats = xport->transport.getStats();
+        // Unlike releaseTransport(), this leaves lastUsed alone: reading stats isn't a use.
+        xport->useCount.fetch_sub(1, std::memory_order_release);
+        if (!total) {
+            total = stats;
+            continue;
+        }
+        total->connects += stats.connects;
+        total->reconnects += stats.reconnects;
+        total->idleTimeout = std::max(total->idleTimeout, stats.idleTimeout);
+    }
+    return total;
+}
+
+bool DnsTlsDispatcher::validate(const DnsTlsServer& server, unsigned netId, unsigned mark) {
+    Transport* xport = acquireTransport(server, mark);
+    const bool success = xport->transport.validate(netId);
+    releaseTransport(xport);
+    return success;
+}
+
+// How long an unused transport is kept at least.  Its session cache can stay longer.
 static constexpr std::chrono::minutes IDLE_TIMEOUT(5);
-void DnsTlsDispatcher::cleanup(std::chrono::time_point<std::chrono::steady_clock> now) {
-    // To avoid scanning mStore after every query, return early if a cleanup has been
-    // performed recently.
-    if (now - mLastCleanup < IDLE_TIMEOUT) {
-        return;
-    }
-    for (auto it = mStore.begin(); it != mStore.end();) {
-        auto& s = it->second;
-        if (s->useCount == 0 && now - s->lastUsed > IDLE_TIMEOUT) {
-            it = mStore.erase(it);
+// Transports which are queried less often are kept for twice their usual query interval, up to
+// this, so that their RTT and query rate estimates are still there for the next query.
+static constexpr std::chrono::minutes MAX_IDLE_TIMEOUT(30);
+void DnsTlsDispatcher::cleanup(std::chrono::steady_clock::time_point now) {
+    using std::chrono::steady_clock;
+    // Idle transports are moved out of the shards, and only destroyed once no lock is held,
+    // since destroying a transport waits for its connection to close.
+    std::vector<std::unique_ptr<Transport>> expired;
+    for (Shard& shard : mShards) {
+        std::lock_guard guard(shard.lock);
+        for (auto it = shard.store.begin(); it != shard.store.end();) {
+            auto& s = it->second;
+            const steady_clock::time_point lastUsed(
+                    steady_clock::duration(s->lastUsed.load(std::memory_order_relaxed)));
+            const std::chrono::milliseconds interval =
+                    s->transport.getQueryInterval().value_or(std::chrono::milliseconds(0));
+            const auto idleTimeout = std::clamp<std::chrono::milliseconds>(
+                    2 * interval, IDLE_TIMEOUT, MAX_IDLE_TIMEOUT);
+            if (s->useCount.load(std::memory_order_acquire) == 0 &&
+                now - lastUsed > idleTimeout) {
+                expired.push_back(std::move(s));
+                it = shard.store.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    expired.clear();
+
+    // Session caches outlive the transports, but once no transport uses them and all their
+    // sessions have expired, they are useless.
+    std::lock_guard guard(mLock);
+    for (auto it = mSessionCaches.begin(); it != mSessionCaches.end();) {
+        if (it->second.use_count() == 1 && it->second->getStats().sessions == 0) {
+            it = mSessionCaches.erase(it);
         } else {
             ++it;
         }
     }
-    mLastCleanup = now;
+}
+
+void DnsTlsDispatcher::cleanupLoop() {
+    setThreadName("TlsCleanup");
+    std::unique_lock lock(mLock);
+    ScopedLockAssertion assume_lock(mLock);
+    while (!mStopping) {
+        mCleanupCv.wait_for(lock, IDLE_TIMEOUT);
+        if (mStopping) break;
+        lock.unlock();
+        cleanup(std::chrono::steady_clock::now());
+        lock.lock();
+    }
 }
 
 }  // end of namespace net
@@ -17,15 +17,22 @@
 #ifndef _DNS_DNSTLSDISPATCHER_H
 #define _DNS_DNSTLSDISPATCHER_H
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <list>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 
 #include <android-base/thread_annotations.h>
 #include <netdutils/Slice.h>
 
 #include "DnsTlsServer.h"
+#include "DnsTlsSessionCache.h"
 #include "DnsTlsTransport.h"
 #include "IDnsTlsSocketFactory.h"
 #include "resolv_private.h"
@@ -41,14 +48,19 @@ class DnsTlsDispatcher {
     DnsTlsDispatcher();
 
     // Constructor with dependency injection for testing.
-    explicit DnsTlsDispatcher(std::unique_ptr<IDnsTlsSocketFactory> factory)
-        : mFactory(std::move(factory)) {}
+    explicit DnsTlsDispatcher(std::unique_ptr<IDnsTlsSocketFactory> factory);
+
+    ~DnsTlsDispatcher();
 
     // Enqueues |query| for resolution via the given |tlsServers| on the
     // network indicated by |mark|; writes the response into |ans|, and stores
     // the count of bytes written in |resplen|. Returns a success or error code.
     // The order in which servers from |tlsServers| are queried may not be the
-    // order passed in by the caller.
+    // order passed in by the caller.  Each server but the last is given until its transport's
+    // timeout to answer before the next one is tried.  No server is waited for beyond the time
+    // budget of the lookup of |statp|, or once its client has hung up.
+    // With the "dot_race_mode" experiment, the query is raced between the first two servers
+    // instead; see raceQuery().
     DnsTlsTransport::Response query(const std::list<DnsTlsServer>& tlsServers,
                                     res_state _Nonnull statp, const netdutils::Slice query,
                                     const netdutils::Slice ans, int* _Nonnull resplen);
@@ -57,49 +69,131 @@ class DnsTlsDispatcher {
     // and writes the response into |ans|, and indicates the number of bytes written in |resplen|.
     // If the whole procedure above triggers (or experiences) any new connection, |connectTriggered|
     // is set. Returns a success or error code.
+    // If |canTimeOut| is set, gives up with Response::timeout once the transport's timeout
+    // expires.  If |statp| is set, also gives up with Response::abandoned once the time budget
+    // of its lookup runs out, or its client hangs up.  The query itself is not cancelled.
     DnsTlsTransport::Response query(const DnsTlsServer& server, unsigned mark,
                                     const netdutils::Slice query, const netdutils::Slice ans,
-                                    int* _Nonnull resplen, bool* _Nonnull connectTriggered);
+                                    int* _Nonnull resplen, bool* _Nonnull connectTriggered,
+                                    bool canTimeOut = false, const ResState* statp = nullptr);
+
+    // Checks that |server| is fully working on |netId|, using the transport that queries on
+    // |mark| will use.  That way, the connection and TLS session set up for validation are
+    // reused by the first queries.
+    bool validate(const DnsTlsServer& server, unsigned netId, unsigned mark);
+
+    // Returns the TLS session resumption statistics of |server|, if it has been connected to.
+    std::optional<DnsTlsSessionCache::Stats> getSessionStats(const DnsTlsServer& server)
+            EXCLUDES(mLock);
+
+    // Returns the connection statistics of |server|, summed over the transports of all marks,
+    // and the longest of their idle timeouts.  Returns nullopt if there is no such transport.
+    std::optional<DnsTlsTransport::Stats> getTransportStats(const DnsTlsServer& server);
+
+    // Returns the dispatcher shared by the resolver and PrivateDnsConfiguration.
+    static DnsTlsDispatcher& getInstance();
 
   private:
-    // This lock is static so that it can be used to annotate the Transport struct.
-    // DnsTlsDispatcher is a singleton in practice, so making this static does not change
-    // the locking behavior.
-    static std::mutex sLock;
+    // Guards the state which is not on the path of every query.  Transports are looked up in
+    // mShards instead.
+    std::mutex mLock;
+
+    // Key = <normalized mark, server>, and its hash, which is computed only once per lookup.
+    struct Key {
+        Key(unsigned mark, const DnsTlsServer& server)
+            : mark(mark), server(server), hash(server.hash() * 31 + mark) {}
+        bool operator==(const Key& other) const {
+            return mark == other.mark && server == other.server;
+        }
+        const unsigned mark;
+        const DnsTlsServer server;
+        const size_t hash;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return key.hash; }
+    };
 
-    // Key = <mark, server>
-    typedef std::pair<unsigned, const DnsTlsServer> Key;
+    // Returns |mark| with only the bits that affect routing, so that queries whose marks only
+    // differ in other bits share a transport.
+    static unsigned normalizeMark(unsigned mark);
 
     // Transport is a thin wrapper around DnsTlsTransport, adding reference counting and
-    // usage monitoring so we can expire idle sessions from the cache.
+    // usage monitoring so we can expire idle sessions from the cache.  The counters are atomic,
+    // so that releasing a transport needs no lock.
     struct Transport {
-        Transport(const DnsTlsServer& server, unsigned mark, IDnsTlsSocketFactory* _Nonnull factory)
-            : transport(server, mark, factory) {}
+        Transport(const DnsTlsServer& server, unsigned mark, IDnsTlsSocketFactory* _Nonnull factory,
+                  std::shared_ptr<DnsTlsSessionCache> cache)
+            : transport(server, mark, factory, std::move(cache)) {}
         // DnsTlsTransport is thread-safe, so it doesn't need to be guarded.
         DnsTlsTransport transport;
         // This use counter and timestamp are used to ensure that only idle sessions are
-        // destroyed.
-        int useCount GUARDED_BY(sLock) = 0;
+        // destroyed.  useCount is only incremented with the lock of the shard held.
+        std::atomic<int> useCount = 0;
         // lastUsed is only guaranteed to be meaningful after useCount is decremented to zero.
-        std::chrono::time_point<std::chrono::steady_clock> lastUsed GUARDED_BY(sLock);
+        std::atomic<std::chrono::steady_clock::rep> lastUsed = 0;
     };
 
     // Cache of reusable DnsTlsTransports.  Transports stay in cache as long as
     // they are in use and for a few minutes after.
-    // The key is a (netid, server) pair.  The netid is first for lexicographic comparison speed.
-    std::map<Key, std::unique_ptr<Transport>> mStore GUARDED_BY(sLock);
+    // The cache is split in shards by key hash, so that queries to different servers don't
+    // contend for the same lock.
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<Key, std::unique_ptr<Transport>, KeyHash> store GUARDED_BY(lock);
+    };
+    static constexpr size_t kShardCount = 16;
+    std::array<Shard, kShardCount> mShards;
+    Shard& getShard(const Key& key) { return mShards[key.hash % kShardCount]; }
 
-    // The last time we did a cleanup.  For efficiency, we only perform a cleanup once every
-    // few minutes.
-    std::chrono::time_point<std::chrono::steady_clock> mLastCleanup GUARDED_BY(sLock);
+    // TLS sessions by server and TLS name, shared by the transports of all marks.  A cache is
+    // kept after its transports are gone, as long as it holds sessions which can be resumed.
+    std::map<DnsTlsServer, std::shared_ptr<DnsTlsSessionCache>> mSessionCaches GUARDED_BY(mLock);
 
     // Drop any cache entries whose useCount is zero and which have not been used recently.
-    // This function performs a linear scan of mStore.
-    void cleanup(std::chrono::time_point<std::chrono::steady_clock> now) REQUIRES(sLock);
+    // This function performs a linear scan of all the shards.  It runs on mCleanupThread, so
+    // that queries never pay for it, nor for destroying the transports.
+    void cleanup(std::chrono::steady_clock::time_point now) EXCLUDES(mLock);
+    void cleanupLoop() EXCLUDES(mLock);
+    std::thread mCleanupThread;
+    std::condition_variable mCleanupCv;
+    bool mStopping GUARDED_BY(mLock) = false;
+
+    // Returns the transport for |server| on |mark|, creating it if needed.  The transport is not
+    // destroyed until it is passed to releaseTransport().
+    Transport* _Nonnull acquireTransport(const DnsTlsServer& server, unsigned mark)
+            EXCLUDES(mLock);
+    static void releaseTransport(Transport* _Nonnull xport);
+
+    // Copies the response in |result| to |ans|.  Returns the code to report for |result|.
+    static DnsTlsTransport::Response copyResponse(const DnsTlsTransport::Result& result,
+                                                  const netdutils::Slice ans,
+                                                  int* _Nonnull resplen);
+
+    // Sends |query| to |first|, and if it hasn't answered successfully after its transport's
+    // race delay, to |second| as well.  The first successful response is written to |ans|.
+    // Returns the code of the winning query, or of the last failed one if neither succeeded.
+    // If |canTimeOut|, neither server is waited for beyond its transport's timeout.  Neither is
+    // waited for beyond the time budget of the lookup of |statp|, or once its client has hung up.
+    DnsTlsTransport::Response raceQuery(const DnsTlsServer& first, const DnsTlsServer& second,
+                                        res_state _Nonnull statp, const netdutils::Slice query,
+                                        const netdutils::Slice ans, int* _Nonnull resplen,
+                                        bool canTimeOut);
+
+    // Accounts for a race on |netId|.  Returns false if the network already has as many races
+    // in flight as allowed, in which case the query must not be raced.
+    bool startRace(unsigned netId) EXCLUDES(mLock);
+    void endRace(unsigned netId) EXCLUDES(mLock);
+
+    // Default limit of races in flight per network, so that a burst of queries can't double the
+    // load on the servers.  Overridden by the "dot_race_max_parallel" experiment.
+    static constexpr int kMaxRaces = 8;
+
+    // Number of races in flight, by netId.
+    std::map<unsigned, int> mRaces GUARDED_BY(mLock);
 
     // Return a sorted list of DnsTlsServers in preference order.
     std::list<DnsTlsServer> getOrderedServerList(const std::list<DnsTlsServer>& tlsServers,
-                                                 unsigned mark) const;
+                                                 unsigned mark, unsigned netId);
 
     // Trivial factory for DnsTlsSockets.  Dependency injection is only used for testing.
     std::unique_ptr<IDnsTlsSocketFactory> mFactory;
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "DnsTlsEventLoop.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include <android-base/logging.h>
+#include <netdutils/ThreadUtil.h>
+
+namespace android {
+
+using netdutils::setThreadName;
+
+namespace net {
+namespace {
+
+constexpr int kMaxEvents = 16;
+
+}  // namespace
+
+DnsTlsEventLoop* DnsTlsEventLoop::getInstance() {
+    static DnsTlsEventLoop* const instance = new DnsTlsEventLoop();
+    return instance;
+}
+
+DnsTlsEventLoop::DnsTlsEventLoop() : mEpollFd(epoll_create1(EPOLL_CLOEXEC)) {
+    if (mEpollFd == -1) {
+        PLOG(ERROR) << "Failed to create epoll fd";
+    }
+    std::thread loopThread(&DnsTlsEventLoop::loop, this);
+    mLoopThreadId = loopThread.get_id();
+    loopThread.detach();
+}
+
+bool DnsTlsEventLoop::add(int fd, uint32_t events, Handler* handler) {
+    std::lock_guard guard(mLock);
+    const uint64_t id = mNextId++;
+    epoll_event event = {.events = events, .data = {.u64 = id}};
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &event) == -1) {
+        PLOG(ERROR) << "Failed to watch fd " << fd;
+        return false;
+    }
+    mRegistrations[id] = {.fd = fd, .handler = handler};
+    mIds[fd] = id;
+    return true;
+}
+
+bool DnsTlsEventLoop::modify(int fd, uint32_t events) {
+    std::lock_guard guard(mLock);
+    const auto it = mIds.find(fd);
+    if (it == mIds.end()) return false;
+    epoll_event event = {.events = events, .data = {.u64 = it->second}};
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_MOD, fd, &event) == -1) {
+        PLOG(ERROR) << "Failed to change the events watched on fd " << fd;
+        return false;
+    }
+    return true;
+}
+
+void DnsTlsEventLoop::remove(int fd) {
+    std::lock_guard guard(mLock);
+    const auto it = mIds.find(fd);
+    if (it == mIds.end()) return;
+    epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+    mRegistrations.erase(it->second);
+    mIds.erase(it);
+}
+
+void DnsTlsEventLoop::loop() {
+    setThreadName("TlsListen");
+    epoll_event events[kMaxEvents];
+    while (true) {
+        const int n = TEMP_FAILURE_RETRY(epoll_wait(mEpollFd.get(), events, kMaxEvents, -1));
+        if (n < 0) {
+            PLOG(ERROR) << "epoll_wait failed, DoT connections are stuck";
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            Registration registration;
+            {
+                std::lock_guard guard(mLock);
+                const auto it = mRegistrations.find(events[i].data.u64);
+                // Removed by a handler which ran earlier in this batch.
+                if (it == mRegistrations.end()) continue;
+                registration = it->second;
+            }
+            registration.handler->onEvent(registration.fd, events[i].events);
+        }
+    }
+}
+
+}  // end of namespace net
+}  // end of namespace android
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace net {
+
+// A single thread which waits, with epoll, for I/O on the file descriptors of all the DoT
+// connections, and runs their handlers. Handlers run one at a time on that thread, so they must
+// never block; in particular, they must not wait for another handler to run.
+class DnsTlsEventLoop {
+  public:
+    class Handler {
+      public:
+        virtual ~Handler() = default;
+        // Called on the loop thread when |fd| has some of the watched |events| (or EPOLLERR,
+        // EPOLLHUP) ready.
+        virtual void onEvent(int fd, uint32_t events) = 0;
+    };
+
+    // Instantiated, and its thread started, on first use. Never destroyed, since it has to
+    // outlive the sockets that might still exist during static destruction.
+    static DnsTlsEventLoop* getInstance();
+
+    // Starts watching |fd| for |events| (a combination of EPOLLIN and EPOLLOUT). Events are
+    // level-triggered. Returns false if |fd| could not be watched.
+    bool add(int fd, uint32_t events, Handler* _Nonnull handler) EXCLUDES(mLock);
+
+    // Changes the events watched on |fd|. Passing 0 only reports errors.
+    bool modify(int fd, uint32_t events) EXCLUDES(mLock);
+
+    // Stops watching |fd|. Once this returns, no new call to the handler of |fd| starts, even
+    // for events that were already returned by epoll.
+    void remove(int fd) EXCLUDES(mLock);
+
+    // Returns true if called from a handler.
+    bool isLoopThread() const { return std::this_thread::get_id() == mLoopThreadId; }
+
+  private:
+    DnsTlsEventLoop();
+    void loop() EXCLUDES(mLock);
+
+    struct Registration {
+        int fd;
+        Handler* handler;
+    };
+
+    std::mutex mLock;
+    const base::unique_fd mEpollFd;
+    // Keyed by an ID which is never reused, so that an event returned for an fd which has been
+    // removed (and maybe reused by another connection) in the meantime is dropped.
+    std::map<uint64_t, Registration> mRegistrations GUARDED_BY(mLock);
+    std::map<int, uint64_t> mIds GUARDED_BY(mLock);
+    uint64_t mNextId GUARDED_BY(mLock) = 1;
+    std::thread::id mLoopThreadId;
+};
+
+}  // end of namespace net
+}  // end of namespace android
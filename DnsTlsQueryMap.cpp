@@ -18,133 +18,264 @@
 
 #include "DnsTlsQueryMap.h"
 
+#include <utility>
+
 #include <android-base/logging.h>
 
 namespace android {
+
+using base::ScopedLockAssertion;
+
 namespace net {
 
-std::unique_ptr<DnsTlsQueryMap::QueryFuture> DnsTlsQueryMap::recordQuery(
+DnsTlsQueryMap::Waiter& DnsTlsQueryMap::Waiter::operator=(Waiter&& other) noexcept {
+    if (this != &other) {
+        if (mMap != nullptr) mMap->abandon(mId);
+        mMap = std::exchange(other.mMap, nullptr);
+        mId = other.mId;
+        mReady = std::exchange(other.mReady, false);
+        mResult = std::move(other.mResult);
+    }
+    return *this;
+}
+
+DnsTlsQueryMap::Waiter::~Waiter() {
+    if (mMap != nullptr) mMap->abandon(mId);
+}
+
+DnsTlsQueryMap::Result DnsTlsQueryMap::Waiter::get() {
+    if (mMap != nullptr) {
+        mResult = std::exchange(mMap, nullptr)->take(mId);
+    } else if (!mReady) {
+        LOG(ERROR) << "Waiting for a result which has already been retrieved";
+        return {.code = Response::internal_error};
+    }
+    mReady = false;
+    return std::move(mResult);
+}
+
+void DnsTlsQueryMap::Waiter::setListener(Listener* listener) {
+    if (mMap != nullptr) {
+        mMap->setListener(mId, listener);
+    } else if (mReady) {
+        listener->onComplete();
+    }
+}
+
+DnsTlsQueryMap::DnsTlsQueryMap() {
+    std::lock_guard guard(mLock);
+    mFreeIds.fill(~uint64_t{0});
+    mFreeIdWords.fill(~uint64_t{0});
+}
+
+std::optional<DnsTlsQueryMap::QueryFuture> DnsTlsQueryMap::recordQuery(
         const netdutils::Slice query) {
     std::lock_guard guard(mLock);
 
     // Store the query so it can be matched to the response or reissued.
     if (query.size() < 2) {
         LOG(WARNING) << "Query is too short";
-        return nullptr;
+        return std::nullopt;
     }
     int32_t newId = getFreeId();
     if (newId < 0) {
         LOG(WARNING) << "All query IDs are in use";
-        return nullptr;
+        return std::nullopt;
+    }
+
+    std::unique_ptr<Page>& page = mPages[newId / kPageSize];
+    if (!page) {
+        page = std::make_unique<Page>();
     }
+    Slot* slot = &(*page)[newId % kPageSize];
+    mFreeIds[newId / 64] &= ~(uint64_t{1} << (newId % 64));
+    if (mFreeIds[newId / 64] == 0) {
+        mFreeIdWords[newId / 4096] &= ~(uint64_t{1} << (newId / 64 % 64));
+    }
+    mPendingCount++;
+
+    // Make a copy of the query.  This reuses the buffer of the previous query in this slot.
+    slot->query.assign(query.base(), query.base() + query.size());
+    slot->state = Slot::State::pending;
+    slot->abandoned = false;
+    slot->listener = nullptr;
+    slot->tries = 0;
+
+    const uint16_t id = static_cast<uint16_t>(newId);
+    return QueryFuture{.query = {.newId = id, .query = netdutils::makeSlice(slot->query)},
+                       .result = Waiter(this, id)};
+}
 
-    // Make a copy of the query.
-    std::vector<uint8_t> tmp(query.base(), query.base() + query.size());
-    Query q = {.newId = static_cast<uint16_t>(newId), .query = std::move(tmp)};
+DnsTlsQueryMap::Slot* DnsTlsQueryMap::findSlot(uint16_t id) {
+    const std::unique_ptr<Page>& page = mPages[id / kPageSize];
+    return page ? &(*page)[id % kPageSize] : nullptr;
+}
 
-    const auto [it, inserted] = mQueries.try_emplace(newId, q);
-    if (!inserted) {
-        LOG(ERROR) << "Failed to store pending query";
-        return nullptr;
+void DnsTlsQueryMap::complete(uint16_t id, Slot* slot, Result result) {
+    mPendingCount--;
+    if (slot->abandoned) {
+        release(id, slot);
+        return;
+    }
+    slot->state = Slot::State::done;
+    slot->result = std::move(result);
+    mCompleted[id % kNumWaitQueues].notify_all();
+    if (slot->listener != nullptr) {
+        slot->listener->onComplete();
+    }
+}
+
+void DnsTlsQueryMap::expire(uint16_t id, Slot* slot) {
+    complete(id, slot, {.code = Response::network_error});
+}
+
+void DnsTlsQueryMap::release(uint16_t id, Slot* slot) {
+    slot->state = Slot::State::free;
+    slot->result = {};
+    slot->listener = nullptr;
+    mFreeIds[id / 64] |= uint64_t{1} << (id % 64);
+    mFreeIdWords[id / 4096] |= uint64_t{1} << (id / 64 % 64);
+}
+
+DnsTlsQueryMap::Result DnsTlsQueryMap::take(uint16_t id) {
+    std::unique_lock lock(mLock);
+    ScopedLockAssertion assume_lock(mLock);
+    Slot* slot = findSlot(id);
+    mCompleted[id % kNumWaitQueues].wait(
+            lock, [slot] { return slot->state == Slot::State::done; });
+    Result result = std::move(slot->result);
+    release(id, slot);
+    return result;
+}
+
+bool DnsTlsQueryMap::waitFor(uint16_t id, std::chrono::nanoseconds timeout) {
+    std::unique_lock lock(mLock);
+    ScopedLockAssertion assume_lock(mLock);
+    Slot* slot = findSlot(id);
+    return mCompleted[id % kNumWaitQueues].wait_for(
+            lock, timeout,
+            [slot] { return slot->state == Slot::State::done; });
+}
+
+void DnsTlsQueryMap::setListener(uint16_t id, Listener* listener) {
+    std::lock_guard guard(mLock);
+    Slot* slot = findSlot(id);
+    if (slot->state == Slot::State::done) {
+        listener->onComplete();
+    } else {
+        slot->listener = listener;
     }
-    return std::make_unique<QueryFuture>(q, it->second.result.get_future());
 }
 
-void DnsTlsQueryMap::expire(QueryPromise* p) {
-    Result r = { .code = Response::network_error };
-    p->result.set_value(r);
+void DnsTlsQueryMap::abandon(uint16_t id) {
+    std::lock_guard guard(mLock);
+    Slot* slot = findSlot(id);
+    if (slot->state == Slot::State::done) {
+        release(id, slot);
+    } else {
+        // The query stays pending, and is released when it completes.
+        slot->abandoned = true;
+        slot->listener = nullptr;
+    }
 }
 
 void DnsTlsQueryMap::markTried(uint16_t newId) {
     std::lock_guard guard(mLock);
-    auto it = mQueries.find(newId);
-    if (it != mQueries.end()) {
-        it->second.tries++;
+    Slot* slot = findSlot(newId);
+    if (slot != nullptr && slot->state == Slot::State::pending) {
+        slot->tries++;
+        slot->sent = std::chrono::steady_clock::now();
     }
 }
 
 void DnsTlsQueryMap::cleanup() {
     std::lock_guard guard(mLock);
-    for (auto it = mQueries.begin(); it != mQueries.end();) {
-        auto& p = it->second;
-        if (p.tries >= kMaxTries) {
-            expire(&p);
-            it = mQueries.erase(it);
-        } else {
-            ++it;
+    for (size_t id = 0; id <= UINT16_MAX && mPendingCount > 0; ++id) {
+        Slot* slot = findSlot(id);
+        if (slot == nullptr) {
+            id += kPageSize - 1;
+            continue;
+        }
+        if (slot->state == Slot::State::pending && slot->tries >= kMaxTries) {
+            expire(id, slot);
         }
     }
 }
 
 int32_t DnsTlsQueryMap::getFreeId() {
-    if (mQueries.empty()) {
-        return 0;
-    }
-    uint16_t maxId = mQueries.rbegin()->first;
-    if (maxId < UINT16_MAX) {
-        return maxId + 1;
-    }
-    if (mQueries.size() == UINT16_MAX + 1) {
-        // Map is full.
-        return -1;
-    }
-    // Linear scan.
-    uint16_t nextId = 0;
-    for (auto& pair : mQueries) {
-        uint16_t id = pair.first;
-        if (id != nextId) {
-            // Found a gap.
-            return nextId;
-        }
-        nextId = id + 1;
+    // Hand out the lowest free ID, so that the table stays as small as possible.
+    for (size_t i = 0; i < mFreeIdWords.size(); ++i) {
+        if (mFreeIdWords[i] == 0) continue;
+        const size_t word = i * 64 + __builtin_ctzll(mFreeIdWords[i]);
+        return word * 64 + __builtin_ctzll(mFreeIds[word]);
     }
-    // Unreachable (but the compiler isn't smart enough to prove it).
+    // Map is full.
     return -1;
 }
 
 std::vector<DnsTlsQueryMap::Query> DnsTlsQueryMap::getAll() {
     std::lock_guard guard(mLock);
     std::vector<DnsTlsQueryMap::Query> queries;
-    for (auto& q : mQueries) {
-        queries.push_back(q.second.query);
+    for (size_t id = 0; id <= UINT16_MAX && queries.size() < mPendingCount; ++id) {
+        Slot* slot = findSlot(id);
+        if (slot == nullptr) {
+            id += kPageSize - 1;
+            continue;
+        }
+        if (slot->state == Slot::State::pending) {
+            queries.push_back({.newId = static_cast<uint16_t>(id),
+                               .query = netdutils::makeSlice(slot->query)});
+        }
     }
     return queries;
 }
 
 bool DnsTlsQueryMap::empty() {
     std::lock_guard guard(mLock);
-    return mQueries.empty();
+    return mPendingCount == 0;
 }
 
 void DnsTlsQueryMap::clear() {
     std::lock_guard guard(mLock);
-    for (auto& q : mQueries) {
-        expire(&q.second);
+    for (size_t id = 0; id <= UINT16_MAX && mPendingCount > 0; ++id) {
+        Slot* slot = findSlot(id);
+        if (slot == nullptr) {
+            id += kPageSize - 1;
+            continue;
+        }
+        if (slot->state == Slot::State::pending) {
+            expire(id, slot);
+        }
     }
-    mQueries.clear();
 }
 
-void DnsTlsQueryMap::onResponse(std::vector<uint8_t> response) {
+std::optional<std::chrono::microseconds> DnsTlsQueryMap::onResponse(
+        std::vector<uint8_t> response) {
     LOG(VERBOSE) << "Got response of size " << response.size();
     if (response.size() < 2) {
         LOG(WARNING) << "Response is too short";
-        return;
+        return std::nullopt;
     }
     uint16_t id = response[0] << 8 | response[1];
     std::lock_guard guard(mLock);
-    auto it = mQueries.find(id);
-    if (it == mQueries.end()) {
+    Slot* slot = findSlot(id);
+    if (slot == nullptr || slot->state != Slot::State::pending) {
         LOG(WARNING) << "Discarding response: unknown ID " << id;
-        return;
+        return std::nullopt;
+    }
+    std::optional<std::chrono::microseconds> rtt;
+    if (slot->tries == 1) {
+        rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - slot->sent);
     }
     Result r = { .code = Response::success, .response = std::move(response) };
     // Rewrite ID to match the query
-    const uint8_t* data = it->second.query.query.data();
+    const uint8_t* data = slot->query.data();
     r.response[0] = data[0];
     r.response[1] = data[1];
     LOG(DEBUG) << "Sending result to dispatcher";
-    it->second.result.set_value(std::move(r));
-    mQueries.erase(it);
+    complete(id, slot, std::move(r));
+    return rtt;
 }
 
 }  // end of namespace net
@@ -17,9 +17,13 @@
 #ifndef _DNS_DNSTLSQUERYMAP_H
 #define _DNS_DNSTLSQUERYMAP_H
 
+#include <array>
+#include <chrono>
+#include <condition_variable>
 #include <future>
-#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
@@ -31,16 +35,34 @@ namespace android {
 namespace net {
 
 // Keeps track of queries and responses.  This class matches responses with queries.
-// All methods are thread-safe and non-blocking.
+// All methods are thread-safe and non-blocking, except for waiting on a Waiter.
+// Queries are kept in a table indexed by their new ID, whose slots are allocated on first use
+// and then reused, so that recording a query and delivering its response don't allocate
+// memory in steady state.
 class DnsTlsQueryMap {
   public:
-    enum class Response : uint8_t { success, network_error, limit_error, internal_error };
+    enum class Response : uint8_t {
+        success,
+        network_error,
+        limit_error,
+        internal_error,
+        // The caller gave up waiting.  The query may still complete later.
+        timeout,
+        // The caller stopped waiting before the timeout, because its lookup was cancelled or
+        // ran out of time.  This says nothing about the server.
+        abandoned,
+    };
 
     struct Query {
         // The new ID number assigned to this query.
         uint16_t newId;
         // A query that has been passed to recordQuery(), with its original ID number.
-        const std::vector<uint8_t> query;
+        // It points into the slot of the query in the map, which isn't copied.  Once the query
+        // has completed, the slot can be reused, and the bytes overwritten, by any call to
+        // recordQuery(), which the map's own lock doesn't prevent.  So the Slice may only be
+        // used while calls to recordQuery() are excluded, and must not be kept: the user
+        // copies the bytes it needs before allowing them again.
+        netdutils::Slice query;
     };
 
     struct Result {
@@ -48,30 +70,83 @@ class DnsTlsQueryMap {
         std::vector<uint8_t> response;
     };
 
+    // Notified when a query completes, in addition to its Waiter.  This allows waiting for the
+    // first of several queries.  onComplete() is called with the map locked, so it must not
+    // call back into the map.
+    class Listener {
+      public:
+        virtual ~Listener() = default;
+        virtual void onComplete() = 0;
+    };
+
+    // A handle on the result of a query, in the manner of std::future.  The result is kept in
+    // the map until it is retrieved, so a Waiter must not outlive the map it came from.
+    class Waiter {
+      public:
+        Waiter() = default;
+        // Creates a Waiter which is already resolved to |result|.
+        explicit Waiter(Result result) : mReady(true), mResult(std::move(result)) {}
+        Waiter(Waiter&& other) noexcept { *this = std::move(other); }
+        Waiter& operator=(Waiter&& other) noexcept;
+        ~Waiter();
+
+        bool valid() const { return mMap != nullptr || mReady; }
+
+        // Blocks until the query completes, and returns its result.  The Waiter is no longer
+        // valid afterwards.
+        Result get();
+
+        // Registers |listener| to be notified when the query completes, or right away if it
+        // already has.  |listener| must outlive this Waiter.
+        void setListener(Listener* _Nonnull listener);
+
+        // Blocks until the query completes or |timeout| elapses.
+        template <class Rep, class Period>
+        std::future_status wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+            if (mMap == nullptr) return std::future_status::ready;
+            return mMap->waitFor(mId, std::chrono::duration_cast<std::chrono::nanoseconds>(timeout))
+                           ? std::future_status::ready
+                           : std::future_status::timeout;
+        }
+
+      private:
+        friend class DnsTlsQueryMap;
+        Waiter(DnsTlsQueryMap* map, uint16_t id) : mMap(map), mId(id) {}
+
+        DnsTlsQueryMap* mMap = nullptr;
+        uint16_t mId = 0;
+        bool mReady = false;
+        Result mResult = {};
+    };
+
     struct QueryFuture {
-        QueryFuture(Query query, std::future<Result> result)
-            : query(query), result(std::move(result)) {}
         Query query;
-        // A future which will resolve to the result of this query.
-        std::future<Result> result;
+        // Resolves to the result of this query.
+        Waiter result;
     };
 
+    DnsTlsQueryMap();
+
     // Returns an object containing everything needed to complete processing of
-    // this query, or null if the query could not be recorded.
-    std::unique_ptr<QueryFuture> recordQuery(const netdutils::Slice query);
+    // this query, or nothing if the query could not be recorded.  This may overwrite the bytes
+    // of any Query::query of a completed query; see Query.
+    std::optional<QueryFuture> recordQuery(const netdutils::Slice query);
 
     // Process a response, including a new ID.  If the response
     // is not recognized as matching any query, it will be ignored.
-    void onResponse(std::vector<uint8_t> response);
+    // Returns the round trip time of the query, unless it was sent more than once, in which
+    // case it's unknown which attempt was answered.
+    std::optional<std::chrono::microseconds> onResponse(std::vector<uint8_t> response);
 
     // Clear all map contents.  This causes all pending queries to resolve with failure.
     void clear();
 
-    // Get all pending queries.  This returns a shallow copy, mostly for thread-safety.
+    // Get all pending queries.  This returns a shallow copy, mostly for thread-safety: the
+    // bytes of the queries have the lifetime described in Query.
     std::vector<Query> getAll();
 
-    // Mark a query has having been retried.  If the query hits the retry limit, it will
-    // be expired at the next call to cleanup.
+    // Mark a query has having been sent, or retried.  If the query hits the retry limit, it
+    // will be expired at the next call to cleanup.
     void markTried(uint16_t newId);
     void cleanup();
 
@@ -84,24 +159,64 @@ class DnsTlsQueryMap {
   private:
     std::mutex mLock;
 
-    struct QueryPromise {
-        QueryPromise(Query query) : query(query) {}
-        Query query;
+    struct Slot {
+        enum class State : uint8_t { free, pending, done };
+        State state = State::free;
+        // Set when the Waiter is gone, so that nobody will collect the result.
+        bool abandoned = false;
         // Number of times the query has been tried.  Limited to kMaxTries.
-        int tries = 0;
-        // A promise whose future is returned by recordQuery()
-        // It is fulfilled by onResponse().
-        std::promise<Result> result;
+        uint8_t tries = 0;
+        // When the query was last sent.
+        std::chrono::steady_clock::time_point sent;
+        // The query, with its original ID.  Its capacity is kept when the slot is reused.
+        std::vector<uint8_t> query;
+        // Set by onResponse() or on failure, and collected by the Waiter.
+        Result result = {};
+        // Set by Waiter::setListener().
+        Listener* listener = nullptr;
     };
 
-    // Outstanding queries by newId.
-    std::map<uint16_t, QueryPromise> mQueries GUARDED_BY(mLock);
+    // Slots are allocated in pages of kPageSize, so that the table only takes as much memory
+    // as the largest ID in use requires.
+    static constexpr size_t kPageSize = 256;
+    static constexpr size_t kNumPages = (UINT16_MAX + 1) / kPageSize;
+    using Page = std::array<Slot, kPageSize>;
+    std::array<std::unique_ptr<Page>, kNumPages> mPages GUARDED_BY(mLock);
+
+    // Free IDs.  A set bit in mFreeIds means that the ID is free, and a set bit in
+    // mFreeIdWords means that the corresponding word of mFreeIds has a free ID.
+    static constexpr size_t kNumWords = (UINT16_MAX + 1) / 64;
+    std::array<uint64_t, kNumWords> mFreeIds GUARDED_BY(mLock);
+    std::array<uint64_t, kNumWords / 64> mFreeIdWords GUARDED_BY(mLock);
+
+    // Number of slots in the pending state.
+    size_t mPendingCount GUARDED_BY(mLock) = 0;
+
+    // Signalled when a query completes.  Waiters are spread over a few condition variables
+    // by ID, to limit spurious wakeups.
+    static constexpr size_t kNumWaitQueues = 16;
+    std::condition_variable mCompleted[kNumWaitQueues];
 
     // Get a "newId" number that is not currently in use.  Returns -1 if there are none.
     int32_t getFreeId() REQUIRES(mLock);
 
+    // Returns the slot of |id|, or null if its page has never been used.
+    Slot* findSlot(uint16_t id) REQUIRES(mLock);
+
+    // Resolve the query in |id| with |result|.
+    void complete(uint16_t id, Slot* _Nonnull slot, Result result) REQUIRES(mLock);
+
     // Fulfill the result with an error code.
-    static void expire(QueryPromise* _Nonnull p);
+    void expire(uint16_t id, Slot* _Nonnull slot) REQUIRES(mLock);
+
+    // Return the slot of |id| to the free IDs.
+    void release(uint16_t id, Slot* _Nonnull slot) REQUIRES(mLock);
+
+    // Implementation of Waiter.
+    Result take(uint16_t id) EXCLUDES(mLock);
+    bool waitFor(uint16_t id, std::chrono::nanoseconds timeout) EXCLUDES(mLock);
+    void setListener(uint16_t id, Listener* _Nonnull listener) EXCLUDES(mLock);
+    void abandon(uint16_t id) EXCLUDES(mLock);
 };
 
 }  // end of namespace net
@@ -17,6 +17,7 @@
 #include "DnsTlsServer.h"
 
 #include <algorithm>
+#include <functional>
 
 namespace {
 
@@ -109,7 +110,7 @@ bool AddressComparator::operator() (const DnsTlsServer& x, const DnsTlsServer& y
 
 // Returns a tuple of references to the elements of s.
 auto make_tie(const DnsTlsServer& s) {
-    return std::tie(s.ss, s.name, s.protocol, s.connectTimeout);
+    return std::tie(s.ss, s.name, s.protocol, s.dohPath, s.connectTimeout);
 }
 
 bool DnsTlsServer::operator <(const DnsTlsServer& other) const {
@@ -120,6 +121,26 @@ bool DnsTlsServer::operator ==(const DnsTlsServer& other) const {
     return make_tie(*this) == make_tie(other);
 }
 
+size_t DnsTlsServer::hash() const {
+    size_t h = std::hash<std::string>()(name);
+    const auto combine = [&h](size_t v) { h = h * 31 + v; };
+    combine(ss.ss_family);
+    if (ss.ss_family == AF_INET) {
+        const sockaddr_in& sin = reinterpret_cast<const sockaddr_in&>(ss);
+        combine(sin.sin_port);
+        combine(sin.sin_addr.s_addr);
+    } else if (ss.ss_family == AF_INET6) {
+        const sockaddr_in6& sin6 = reinterpret_cast<const sockaddr_in6&>(ss);
+        combine(sin6.sin6_port);
+        for (const uint8_t byte : sin6.sin6_addr.s6_addr) combine(byte);
+        combine(sin6.sin6_scope_id);
+    }
+    combine(protocol);
+    combine(std::hash<std::string>()(dohPath));
+    combine(connectTimeout.count());
+    return h;
+}
+
 bool DnsTlsServer::wasExplicitlyConfigured() const {
     return !name.empty();
 }
@@ -51,6 +51,11 @@ struct DnsTlsServer {
     // Placeholder.  More protocols might be defined in the future.
     int protocol = IPPROTO_TCP;
 
+    // The path of the DNS-over-HTTPS (RFC 8484) endpoint of the server, e.g. "/dns-query".
+    // If empty, the server is queried with DNS-over-TLS.
+    std::string dohPath;
+    bool isDoh() const { return !dohPath.empty(); }
+
     // The time to wait for the attempt on connecting to the server.
     // Set the default value 127 seconds to be consistent with TCP connect timeout.
     // (presume net.ipv4.tcp_syn_retries = 6)
@@ -61,6 +66,8 @@ struct DnsTlsServer {
     // Exact comparison of DnsTlsServer objects
     bool operator<(const DnsTlsServer& other) const;
     bool operator==(const DnsTlsServer& other) const;
+    // Consistent with operator==, for use in unordered containers.
+    size_t hash() const;
 
     bool wasExplicitlyConfigured() const;
 };
@@ -18,6 +18,8 @@
 
 #define LOG_TAG "resolv"
 
+#include <time.h>
+
 #include <android-base/logging.h>
 
 namespace android {
@@ -61,8 +63,26 @@ void DnsTlsSessionCache::recordSession(SSL_SESSION* session) {
     }
 }
 
+void DnsTlsSessionCache::dropExpiredSessions() {
+    // Sessions are added in order, but don't necessarily expire in order, since the server
+    // picks their lifetime.
+    const uint64_t now = time(nullptr);
+    for (auto it = mSessions.begin(); it != mSessions.end();) {
+        SSL_SESSION* session = it->get();
+        if (static_cast<uint64_t>(SSL_SESSION_get_time(session)) +
+                    SSL_SESSION_get_timeout(session) <=
+            now) {
+            LOG(DEBUG) << "Dropping expired session";
+            it = mSessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
 bssl::UniquePtr<SSL_SESSION> DnsTlsSessionCache::getSession() {
     std::lock_guard guard(mLock);
+    dropExpiredSessions();
     if (mSessions.size() == 0) {
         LOG(DEBUG) << "No known sessions";
         return nullptr;
@@ -72,5 +92,17 @@ bssl::UniquePtr<SSL_SESSION> DnsTlsSessionCache::getSession() {
     return ret;
 }
 
+void DnsTlsSessionCache::recordHandshake(bool resumed) {
+    std::lock_guard guard(mLock);
+    mHandshakes++;
+    if (resumed) mResumed++;
+}
+
+DnsTlsSessionCache::Stats DnsTlsSessionCache::getStats() {
+    std::lock_guard guard(mLock);
+    dropExpiredSessions();
+    return {.handshakes = mHandshakes, .resumed = mResumed, .sessions = mSessions.size()};
+}
+
 }  // end of namespace net
 }  // end of namespace android
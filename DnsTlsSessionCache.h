@@ -28,6 +28,8 @@ namespace android {
 namespace net {
 
 // Cache of recently seen SSL_SESSIONs.  This is used to support session tickets.
+// DnsTlsDispatcher keeps one cache per server and TLS name, which outlives the transports, so
+// that connections can be resumed after idle timeouts and network switches.
 // This class is thread-safe.
 class DnsTlsSessionCache {
   public:
@@ -41,17 +43,32 @@ class DnsTlsSessionCache {
     // gains ownership of the session.  (Here and throughout,
     // bssl::UniquePtr<SSL_SESSION> is actually serving as a reference counted
     // pointer.)
+    // Sessions past their lifetime are never returned.
     bssl::UniquePtr<SSL_SESSION> getSession() EXCLUDES(mLock);
 
+    // Counts a completed handshake, and whether it resumed a session.
+    void recordHandshake(bool resumed) EXCLUDES(mLock);
+
+    struct Stats {
+        int handshakes;
+        int resumed;
+        size_t sessions;
+    };
+    // Also drops the sessions which have expired.
+    Stats getStats() EXCLUDES(mLock);
+
   private:
     static constexpr size_t kMaxSize = 5;
     static int newSessionCallback(SSL* _Nullable ssl, SSL_SESSION* _Nullable session);
 
     std::mutex mLock;
     void recordSession(SSL_SESSION* _Nullable session) EXCLUDES(mLock);
+    void dropExpiredSessions() REQUIRES(mLock);
 
-    // Queue of sessions, from least recently added to most recently.
+    // Queue of sessions, from most recently added to least recently.
     std::deque<bssl::UniquePtr<SSL_SESSION>> mSessions GUARDED_BY(mLock);
+    int mHandshakes GUARDED_BY(mLock) = 0;
+    int mResumed GUARDED_BY(mLock) = 0;
 };
 
 }  // end of namespace net
@@ -21,21 +21,30 @@
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
 #include <errno.h>
+#include <linux/sockios.h>
 #include <linux/tcp.h>
+#include <netdb.h>
 #include <openssl/err.h>
 #include <openssl/sha.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <algorithm>
+#include <iterator>
 
 #include "DnsTlsSessionCache.h"
+#include "Experiments.h"
 #include "IDnsTlsSocketObserver.h"
+#include "QueryTrace.h"
+#include "TcpFastOpen.h"
 
+#include <Fwmark.h>
 #include <android-base/logging.h>
-#include <android-base/stringprintf.h>
+#include <netdutils/InternetAddresses.h>
 #include <netdutils/SocketOption.h>
-#include <netdutils/ThreadUtil.h>
 
 #include "netd_resolv/resolv.h"
 #include "private/android_filesystem_config.h"  // AID_DNS
@@ -43,11 +52,11 @@
 
 namespace android {
 
-using base::StringPrintf;
+using base::ScopedLockAssertion;
 using netdutils::enableSockopt;
 using netdutils::enableTcpKeepAlives;
+using netdutils::IPSockAddr;
 using netdutils::isOk;
-using netdutils::setThreadName;
 using netdutils::Slice;
 using netdutils::Status;
 
@@ -56,6 +65,31 @@ namespace {
 
 constexpr const char kCaCertDir[] = "/system/etc/security/cacerts";
 
+// The largest plaintext a TLS record can carry.  Queries are packed into records of at most
+// this size.
+constexpr size_t kMaxRecordSize = 16384;
+
+constexpr int kKeepaliveIdleSecs = 15;
+
+// The ALPN protocol list offered to DoH servers: only HTTP/2, in wire format.
+constexpr uint8_t kH2Alpn[] = {2, 'h', '2'};
+
+// Returns the authority to address DoH queries to: the name of the server if it has one, or
+// else its address.
+std::string dohAuthority(const DnsTlsServer& server) {
+    if (!server.name.empty()) return server.name;
+    char host[NI_MAXHOST] = {};
+    char port[NI_MAXSERV] = {};
+    if (getnameinfo(reinterpret_cast<const sockaddr*>(&server.ss), sizeof(server.ss), host,
+                    sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        return "";
+    }
+    const std::string address = (server.ss.ss_family == AF_INET6)
+                                        ? std::string("[") + host + "]"
+                                        : std::string(host);
+    return (strcmp(port, "443") == 0) ? address : address + ":" + port;
+}
+
 int waitForReading(int fd, int timeoutMs = -1) {
     pollfd fds = {.fd = fd, .events = POLLIN};
     return TEMP_FAILURE_RETRY(poll(&fds, 1, timeoutMs));
@@ -68,7 +102,8 @@ int waitForWriting(int fd, int timeoutMs = -1) {
 
 }  // namespace
 
-Status DnsTlsSocket::tcpConnect() {
+Status DnsTlsSocket::tcpConnect(bool fastOpen) {
+    ScopedQueryStage stage(QueryStage::SOCKET_SETUP);
     LOG(DEBUG) << mMark << " connecting TCP socket";
     int type = SOCK_NONBLOCK | SOCK_CLOEXEC;
     switch (mServer.protocol) {
@@ -94,20 +129,42 @@ Status DnsTlsSocket::tcpConnect() {
         return Status(errno);
     }
 
-    const Status tfo = enableSockopt(mSslFd.get(), SOL_TCP, TCP_FASTOPEN_CONNECT);
-    if (!isOk(tfo) && tfo.code() != ENOPROTOOPT) {
-        LOG(WARNING) << "Failed to enable TFO: " << tfo.msg();
+    // With TFO, connect() returns at once if the kernel has a cookie for the server, and the
+    // ClientHello leaves with the SYN.
+    mSynData = false;
+    if (fastOpen) {
+        const Status tfo = enableSockopt(mSslFd.get(), SOL_TCP, TCP_FASTOPEN_CONNECT);
+        if (!isOk(tfo) && tfo.code() != ENOPROTOOPT) {
+            LOG(WARNING) << "Failed to enable TFO: " << tfo.msg();
+        }
     }
 
-    // Send 5 keepalives, 3 seconds apart, after 15 seconds of inactivity.
-    enableTcpKeepAlives(mSslFd.get(), 15U, 5U, 3U).ignoreError();
+    // Send 5 keepalives, 3 seconds apart, after 15 seconds of inactivity, so that a dead server
+    // is noticed even while no query is waiting.  The "dot_keepalive_idle_s" flag changes the
+    // inactivity time, or turns keepalives off if 0, since each probe can wake up the radio.
+    const int keepaliveIdle =
+            Experiments::getInstance()->getFlag("dot_keepalive_idle_s", kKeepaliveIdleSecs);
+    if (keepaliveIdle > 0) {
+        enableTcpKeepAlives(mSslFd.get(), static_cast<unsigned>(keepaliveIdle), 5U, 3U)
+                .ignoreError();
+    }
+
+    // Only report the socket writable when less than one full record is waiting to be sent,
+    // so that pending queries are batched in userspace instead of queued in the kernel.
+    const int lowat = kMaxRecordSize;
+    if (setsockopt(mSslFd.get(), SOL_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == -1) {
+        PLOG(WARNING) << "Failed to set TCP_NOTSENT_LOWAT";
+    }
 
     if (connect(mSslFd.get(), reinterpret_cast<const struct sockaddr *>(&mServer.ss),
-                sizeof(mServer.ss)) != 0 &&
-            errno != EINPROGRESS) {
-        LOG(DEBUG) << "Socket failed to connect";
-        mSslFd.reset();
-        return Status(errno);
+                sizeof(mServer.ss)) != 0) {
+        if (errno != EINPROGRESS) {
+            LOG(DEBUG) << "Socket failed to connect";
+            mSslFd.reset();
+            return Status(errno);
+        }
+    } else {
+        mSynData = fastOpen;
     }
 
     return netdutils::status::ok;
@@ -169,25 +226,112 @@ bool DnsTlsSocket::initialize() {
     // Enable session cache
     mCache->prepareSslContext(mSslCtx.get());
 
+    // With TLS 1.3 0-RTT, queries sent on a resumed session leave with the ClientHello instead
+    // of waiting for the handshake.  Early data can be replayed, but DNS queries are
+    // idempotent.  If the server rejects it, the connection is closed and the transport sends
+    // the queries again on a new one.
+    if (Experiments::getInstance()->getFlag("dot_early_data", 0)) {
+        SSL_CTX_set_early_data_enabled(mSslCtx.get(), 1);
+    }
+
+    // DoH servers have to speak HTTP/2.
+    // Unlike most BoringSSL functions, SSL_CTX_set_alpn_protos() returns 0 on success.
+    if (mServer.isDoh() && SSL_CTX_set_alpn_protos(mSslCtx.get(), kH2Alpn, sizeof(kH2Alpn)) != 0) {
+        LOG(ERROR) << "Failed to set ALPN protocols";
+        return false;
+    }
+
     // Connect
-    Status status = tcpConnect();
+    Fwmark fwmark;
+    fwmark.intValue = mMark;
+    const unsigned netId = fwmark.netId;
+    const IPSockAddr serverAddr = IPSockAddr::toIPSockAddr(mServer.ss);
+    TcpFastOpenTracker* fastOpenTracker = TcpFastOpenTracker::getInstance();
+    const bool fastOpen = Experiments::getInstance()->getFlag("dot_fast_open", 1) &&
+                          fastOpenTracker->shouldTry(netId, serverAddr);
+    Status status = tcpConnect(fastOpen);
     if (!status.ok()) {
         return false;
     }
     mSsl = sslConnect(mSslFd.get());
+    // If the server answered anything, the SYN data got through, and the handshake failed for
+    // some other reason, which a connection without TFO wouldn't avoid.
+    if (mSynData && (mSsl || hasReceivedData(mSslFd.get()))) {
+        fastOpenTracker->report(netId, serverAddr,
+                                isSynDataAcked(mSslFd.get())
+                                        ? TcpFastOpenTracker::Outcome::ACCEPTED
+                                        : TcpFastOpenTracker::Outcome::REJECTED);
+    } else if (mSynData) {
+        fastOpenTracker->report(netId, serverAddr, TcpFastOpenTracker::Outcome::FAILED);
+        // The server answered the SYN, but nothing ever came back for the data sent with it,
+        // which the path may have dropped.  Try again the usual way.  If the SYN wasn't even
+        // answered, the server may well be down, and trying again would only wait for another
+        // timeout; the next connection goes without TFO anyway.
+        if (isHandshakeDone(mSslFd.get())) {
+            LOG(INFO) << "Connecting with TFO failed, retrying without";
+            mSslFd.reset();
+            status = tcpConnect(false);
+            if (!status.ok()) {
+                return false;
+            }
+            mSsl = sslConnect(mSslFd.get());
+        }
+    }
     if (!mSsl) {
         return false;
     }
+    if (mServer.isDoh() && !startDohSession()) {
+        sslDisconnect();
+        return false;
+    }
 
     mEventFd.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
-
-    // Start the I/O loop.
-    mLoopThread.reset(new std::thread(&DnsTlsSocket::loop, this));
+    mTimerFd.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (mEventFd == -1 || mTimerFd == -1) {
+        PLOG(ERROR) << "Failed to create eventfd or timerfd";
+        sslDisconnect();
+        return false;
+    }
+    armIdleTimer();
+
+    // Hand the connection over to the event loop.  It can't call onEvent() before this
+    // method returns, since that needs mLock.
+    DnsTlsEventLoop* eventLoop = DnsTlsEventLoop::getInstance();
+    if (!eventLoop->add(mSslFd.get(), EPOLLIN, this) ||
+        !eventLoop->add(mEventFd.get(), EPOLLIN, this) ||
+        !eventLoop->add(mTimerFd.get(), EPOLLIN, this)) {
+        eventLoop->remove(mSslFd.get());
+        eventLoop->remove(mEventFd.get());
+        eventLoop->remove(mTimerFd.get());
+        sslDisconnect();
+        return false;
+    }
+    mRegistered = true;
+    // The HTTP/2 connection preface has to be sent before any query.
+    updateEvents();
 
     return true;
 }
 
+bool DnsTlsSocket::startDohSession() {
+    const uint8_t* protocol;
+    unsigned protocolLength;
+    SSL_get0_alpn_selected(mSsl.get(), &protocol, &protocolLength);
+    if (protocolLength != sizeof(kH2Alpn) - 1 ||
+        memcmp(protocol, kH2Alpn + 1, protocolLength) != 0) {
+        LOG(WARNING) << "DoH server didn't negotiate HTTP/2";
+        return false;
+    }
+    // Responses are passed to the observer while mLock is held by the event loop thread, like
+    // DoT responses.
+    mDoh = std::make_unique<DohSession>(
+            dohAuthority(mServer), mServer.dohPath,
+            [this](std::vector<uint8_t> response) { mObserver->onResponse(std::move(response)); });
+    return mDoh->initialize();
+}
+
 bssl::UniquePtr<SSL> DnsTlsSocket::sslConnect(int fd) {
+    ScopedQueryStage stage(QueryStage::TLS_HANDSHAKE);
     if (!mSslCtx) {
         LOG(ERROR) << "Internal error: context is null in sslConnect";
         return nullptr;
@@ -265,11 +409,13 @@ bssl::UniquePtr<SSL> DnsTlsSocket::sslConnect(int fd) {
     }
 
     LOG(DEBUG) << mMark << " handshake complete";
+    mCache->recordHandshake(SSL_session_reused(ssl.get()) || SSL_in_early_data(ssl.get()));
 
     return ssl;
 }
 
 void DnsTlsSocket::sslDisconnect() {
+    mDoh.reset();
     if (mSsl) {
         SSL_shutdown(mSsl.get());
         mSsl.reset();
@@ -277,146 +423,195 @@ void DnsTlsSocket::sslDisconnect() {
     mSslFd.reset();
 }
 
-bool DnsTlsSocket::sslWrite(const Slice buffer) {
+int DnsTlsSocket::sslWrite(const Slice buffer) {
     LOG(DEBUG) << mMark << " Writing " << buffer.size() << " bytes";
-    for (;;) {
-        int ret = SSL_write(mSsl.get(), buffer.base(), buffer.size());
-        if (ret == int(buffer.size())) break;  // SSL write complete;
-
-        if (ret < 1) {
-            const int ssl_err = SSL_get_error(mSsl.get(), ret);
-            switch (ssl_err) {
-                case SSL_ERROR_WANT_WRITE:
-                    if (int err = waitForWriting(mSslFd.get()); err <= 0) {
-                        PLOG(WARNING) << "Poll failed in sslWrite, error " << err;
-                        return false;
-                    }
-                    continue;
-                case 0:
-                    break;  // SSL write complete;
-                default:
-                    LOG(DEBUG) << "SSL_write error " << ssl_err;
-                    return false;
-            }
-        }
+    const int ret = SSL_write(mSsl.get(), buffer.base(), buffer.size());
+    if (ret == int(buffer.size())) {
+        LOG(DEBUG) << mMark << " Wrote " << buffer.size() << " bytes";
+        return SSL_ERROR_NONE;
     }
-    LOG(DEBUG) << mMark << " Wrote " << buffer.size() << " bytes";
-    return true;
+    const int ssl_err = SSL_get_error(mSsl.get(), ret);
+    if (ssl_err != SSL_ERROR_WANT_WRITE) {
+        LOG(DEBUG) << "SSL_write error " << ssl_err;
+    }
+    return ssl_err;
 }
 
-void DnsTlsSocket::loop() {
+void DnsTlsSocket::onEvent(int fd, uint32_t events) {
     std::lock_guard guard(mLock);
-    std::deque<std::vector<uint8_t>> q;
-    const int timeout_msecs = DnsTlsSocket::kIdleTimeout.count() * 1000;
-
-    setThreadName(StringPrintf("TlsListen_%u", mMark & 0xffff).c_str());
-    while (true) {
-        // poll() ignores negative fds
-        struct pollfd fds[2] = { { .fd = -1 }, { .fd = -1 } };
-        enum { SSLFD = 0, EVENTFD = 1 };
-
-        // Always listen for a response from server.
-        fds[SSLFD].fd = mSslFd.get();
-        fds[SSLFD].events = POLLIN;
-
-        // If we have pending queries, wait for space to write one.
-        // Otherwise, listen for new queries.
-        // Note: This blocks the destructor until q is empty, i.e. until all pending
-        // queries are sent or have failed to send.
-        if (!q.empty()) {
-            fds[SSLFD].events |= POLLOUT;
-        } else {
-            fds[EVENTFD].fd = mEventFd.get();
-            fds[EVENTFD].events = POLLIN;
-        }
+    if (mClosed) return;
+    if (!handleEvent(fd, events)) {
+        closeConnection();
+    }
+}
 
-        const int s = TEMP_FAILURE_RETRY(poll(fds, std::size(fds), timeout_msecs));
-        if (s == 0) {
-            LOG(DEBUG) << "Idle timeout";
-            break;
-        }
-        if (s < 0) {
-            LOG(DEBUG) << "Poll failed: " << errno;
-            break;
-        }
-        if (fds[SSLFD].revents & (POLLIN | POLLERR | POLLHUP)) {
-            if (!readResponse()) {
+bool DnsTlsSocket::handleEvent(int fd, uint32_t events) {
+    if (fd == mTimerFd.get()) {
+        LOG(DEBUG) << "Idle timeout";
+        return false;
+    }
+    armIdleTimer();
+
+    if (fd == mSslFd.get()) {
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            if (!readResponses()) {
                 LOG(DEBUG) << "SSL remote close or read error.";
-                break;
+                return false;
             }
         }
-        if (fds[EVENTFD].revents & (POLLIN | POLLERR)) {
-            int64_t num_queries;
-            ssize_t res = read(mEventFd.get(), &num_queries, sizeof(num_queries));
-            if (res < 0) {
-                LOG(WARNING) << "Error during eventfd read";
-                break;
-            } else if (res == 0) {
-                LOG(WARNING) << "eventfd closed; disconnecting";
-                break;
-            } else if (res != sizeof(num_queries)) {
-                LOG(ERROR) << "Int size mismatch: " << res << " != " << sizeof(num_queries);
-                break;
-            } else if (num_queries < 0) {
-                LOG(DEBUG) << "Negative eventfd read indicates destructor-initiated shutdown";
-                break;
-            }
-            // Take ownership of all pending queries.  (q is always empty here.)
-            mQueue.swap(q);
-        } else if (fds[SSLFD].revents & POLLOUT) {
-            // q cannot be empty here.
-            // Sending the entire queue here would risk a TCP flow control deadlock, so
-            // we only send a single query on each cycle of this loop.
-            // TODO: Coalesce multiple pending queries if there is enough space in the
-            // write buffer.
-            if (!sendQuery(q.front())) {
-                break;
+        if ((events & EPOLLOUT) && hasDataToSend()) {
+            if (!sendQueries()) {
+                mBroken = true;
+                return false;
             }
-            q.pop_front();
         }
+    } else if (fd == mEventFd.get()) {
+        int64_t num_queries;
+        ssize_t res = read(mEventFd.get(), &num_queries, sizeof(num_queries));
+        if (res < 0) {
+            LOG(WARNING) << "Error during eventfd read";
+            mBroken = true;
+            return false;
+        } else if (res == 0) {
+            LOG(WARNING) << "eventfd closed; disconnecting";
+            mBroken = true;
+            return false;
+        } else if (res != sizeof(num_queries)) {
+            LOG(ERROR) << "Int size mismatch: " << res << " != " << sizeof(num_queries);
+            mBroken = true;
+            return false;
+        } else if (num_queries < 0) {
+            LOG(DEBUG) << "Negative eventfd read indicates destructor-initiated shutdown";
+            return false;
+        }
+        takeQueries();
     }
+    updateEvents();
+    return true;
+}
+
+void DnsTlsSocket::takeQueries() {
+    // Queries pushed from now on have to notify the loop again.  This synchronizes with the
+    // query() calls which found the flag set, so their queries are found below.
+    mWakeupPending.exchange(false, std::memory_order_acq_rel);
+
+    std::vector<uint8_t> buffer = takeSpareBuffer();
+    while (mQueue.pop(&buffer)) {
+        mPending.push_back(std::move(buffer));
+        buffer = takeSpareBuffer();
+    }
+    recycleBuffer(std::move(buffer));
+
+    std::deque<std::vector<uint8_t>> overflow;
+    mOverflow.swap(overflow);
+    std::move(overflow.begin(), overflow.end(), std::back_inserter(mPending));
+}
+
+std::vector<uint8_t> DnsTlsSocket::takeSpareBuffer() {
+    if (mSpareBuffers.empty()) return {};
+    std::vector<uint8_t> buffer = std::move(mSpareBuffers.back());
+    mSpareBuffers.pop_back();
+    return buffer;
+}
+
+void DnsTlsSocket::recycleBuffer(std::vector<uint8_t>&& buffer) {
+    if (buffer.capacity() == 0 || mSpareBuffers.size() >= kQueueSize) return;
+    buffer.clear();
+    mSpareBuffers.push_back(std::move(buffer));
+}
+
+bool DnsTlsSocket::hasDataToSend() {
+    if (!mWriteBuffer.empty()) return true;
+    if (mDoh) return mDoh->wantWrite() || (!mPending.empty() && mDoh->canSubmit());
+    return !mPending.empty();
+}
+
+void DnsTlsSocket::updateEvents() {
+    const bool sending = hasDataToSend();
+    if (sending == mSending) return;
+    mSending = sending;
+    // If we have pending queries, wait for space to write them.
+    // Otherwise, listen for new queries.
+    // Note: This blocks the destructor until mPending is empty, i.e. until all pending
+    // queries are sent or have failed to send.
+    DnsTlsEventLoop* eventLoop = DnsTlsEventLoop::getInstance();
+    eventLoop->modify(mSslFd.get(), sending ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+    eventLoop->modify(mEventFd.get(), sending ? 0 : EPOLLIN);
+}
+
+void DnsTlsSocket::armIdleTimer() {
+    const std::chrono::milliseconds timeout = mObserver->getIdleTimeout();
+    const itimerspec idle = {.it_value = {.tv_sec = timeout.count() / 1000,
+                                          .tv_nsec = (timeout.count() % 1000) * 1000000}};
+    if (timerfd_settime(mTimerFd.get(), 0, &idle, nullptr) == -1) {
+        PLOG(WARNING) << "Failed to arm the idle timer";
+    }
+}
+
+void DnsTlsSocket::closeConnection() {
+    DnsTlsEventLoop* eventLoop = DnsTlsEventLoop::getInstance();
+    eventLoop->remove(mSslFd.get());
+    eventLoop->remove(mEventFd.get());
+    eventLoop->remove(mTimerFd.get());
     LOG(DEBUG) << "Disconnecting";
     sslDisconnect();
     LOG(DEBUG) << "Calling onClosed";
-    mObserver->onClosed();
-    LOG(DEBUG) << "Ending loop";
+    mObserver->onClosed(mBroken);
+    mClosed = true;
+    mClosedCv.notify_all();
 }
 
 DnsTlsSocket::~DnsTlsSocket() {
     LOG(DEBUG) << "Destructor";
-    // This will trigger an orderly shutdown in loop().
+    // This will trigger an orderly shutdown on the event loop.
     requestLoopShutdown();
     {
         // Wait for the orderly shutdown to complete.
-        std::lock_guard guard(mLock);
-        if (mLoopThread && std::this_thread::get_id() == mLoopThread->get_id()) {
-            LOG(ERROR) << "Violation of re-entrance precondition";
-            return;
+        std::unique_lock lock(mLock);
+        ScopedLockAssertion assume_lock(mLock);
+        if (mRegistered && !mClosed) {
+            if (DnsTlsEventLoop::getInstance()->isLoopThread()) {
+                LOG(ERROR) << "Violation of re-entrance precondition";
+                return;
+            }
+            LOG(DEBUG) << "Waiting for the event loop to close the socket";
+            while (!mClosed) {
+                mClosedCv.wait(lock);
+            }
         }
     }
-    if (mLoopThread) {
-        LOG(DEBUG) << "Waiting for loop thread to terminate";
-        mLoopThread->join();
-        mLoopThread.reset();
-    }
     LOG(DEBUG) << "Destructor completed";
 }
 
-bool DnsTlsSocket::query(uint16_t id, const Slice query) {
+void DnsTlsSocket::composeQuery(uint16_t id, const Slice query, std::vector<uint8_t>* buffer) {
     // Compose the entire message in a single buffer, so that it can be
-    // sent as a single TLS record.
-    std::vector<uint8_t> buf(query.size() + 4);
-    // Write 2-byte length
-    uint16_t len = query.size() + 2;  // + 2 for the ID.
-    buf[0] = len >> 8;
-    buf[1] = len;
+    // sent as a single TLS record.  With DoH, HTTP/2 frames the message, so it has no length.
+    const size_t lengthSize = mServer.isDoh() ? 0 : 2;
+    std::vector<uint8_t>& buf = *buffer;
+    buf.resize(lengthSize + query.size() + 2);
+    if (lengthSize > 0) {
+        // Write 2-byte length
+        uint16_t len = query.size() + 2;  // + 2 for the ID.
+        buf[0] = len >> 8;
+        buf[1] = len;
+    }
     // Write 2-byte ID
-    buf[2] = id >> 8;
-    buf[3] = id;
+    buf[lengthSize] = id >> 8;
+    buf[lengthSize + 1] = id;
     // Copy body
-    std::memcpy(buf.data() + 4, query.base(), query.size());
+    std::memcpy(buf.data() + lengthSize + 2, query.base(), query.size());
+}
 
-    mQueue.push(std::move(buf));
+bool DnsTlsSocket::query(uint16_t id, const Slice query) {
+    if (!mQueue.push([&](std::vector<uint8_t>& buf) { composeQuery(id, query, &buf); })) {
+        std::vector<uint8_t> buf;
+        composeQuery(id, query, &buf);
+        mOverflow.push(std::move(buf));
+    }
+    // The loop thread takes all the queries at once, so it only has to be notified once.
+    if (mWakeupPending.exchange(true, std::memory_order_acq_rel)) {
+        return true;
+    }
     // Increment the mEventFd counter by 1.
     return incrementEventFd(1);
 }
@@ -441,81 +636,159 @@ bool DnsTlsSocket::incrementEventFd(const int64_t count) {
     return true;
 }
 
-// Read exactly len bytes into buffer or fail with an SSL error code
-int DnsTlsSocket::sslRead(const Slice buffer, bool wait) {
-    size_t remaining = buffer.size();
-    while (remaining > 0) {
-        int ret = SSL_read(mSsl.get(), buffer.limit() - remaining, remaining);
-        if (ret == 0) {
-            if (remaining < buffer.size())
-                LOG(WARNING) << "SSL closed with " << remaining << " of " << buffer.size()
-                             << " bytes remaining";
-            return SSL_ERROR_ZERO_RETURN;
-        }
+size_t DnsTlsSocket::sendBufferRoom() {
+    int sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+    int outq = 0;
+    if (getsockopt(mSslFd.get(), SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1 ||
+        ioctl(mSslFd.get(), SIOCOUTQ, &outq) == -1) {
+        return 0;
+    }
+    // The kernel doubles SO_SNDBUF to account for its own overhead.
+    sndbuf /= 2;
+    return (sndbuf > outq) ? sndbuf - outq : 0;
+}
 
-        if (ret < 0) {
-            const int ssl_err = SSL_get_error(mSsl.get(), ret);
-            if (wait && ssl_err == SSL_ERROR_WANT_READ) {
-                if (int err = waitForReading(mSslFd.get()); err <= 0) {
-                    PLOG(WARNING) << "Poll failed in sslRead, error " << err;
-                    return SSL_ERROR_SYSCALL;
-                }
-                continue;
-            } else {
-                LOG(DEBUG) << "SSL_read error " << ssl_err;
-                return ssl_err;
+bool DnsTlsSocket::sendQueries() {
+    if (mWriteBuffer.empty() && mDoh) {
+        while (!mPending.empty() && mDoh->canSubmit()) {
+            if (!mDoh->submit(netdutils::makeSlice(mPending.front()))) {
+                return false;
             }
+            recycleBuffer(std::move(mPending.front()));
+            mPending.pop_front();
+            mWriteBufferQueries++;
         }
-
-        remaining -= ret;
-        wait = true;  // Once a read is started, try to finish.
+        // As below, at least one frame is sent even if the socket seems full.
+        const size_t limit = std::max<size_t>(std::min(sendBufferRoom(), kMaxRecordSize), 1);
+        if (!mDoh->send(&mWriteBuffer, limit)) {
+            return false;
+        }
+        if (mWriteBuffer.empty()) {
+            mWriteBufferQueries = 0;
+            return true;
+        }
+    } else if (mWriteBuffer.empty()) {
+        // Pack as many pending queries as the socket can take right now into a single record.
+        // At least one query is sent, so that a full buffer can't stall the queue; the write
+        // doesn't block anyway, and responses keep being read while it waits for room.
+        // The queries are copied, so that mWriteBuffer and the query buffers are all reused.
+        const size_t limit = std::min(sendBufferRoom(), kMaxRecordSize);
+        mWriteBufferQueries = 0;
+        do {
+            std::vector<uint8_t>& next = mPending.front();
+            mWriteBuffer.insert(mWriteBuffer.end(), next.begin(), next.end());
+            recycleBuffer(std::move(next));
+            mPending.pop_front();
+            mWriteBufferQueries++;
+        } while (!mPending.empty() && mWriteBuffer.size() + mPending.front().size() <= limit);
+    }
+
+    const int err = sslWrite(netdutils::makeSlice(mWriteBuffer));
+    if (err == SSL_ERROR_WANT_WRITE) {
+        // SSL_write() will be retried with the same buffer once there is room.
+        return true;
     }
-    return SSL_ERROR_NONE;
-}
-
-bool DnsTlsSocket::sendQuery(const std::vector<uint8_t>& buf) {
-    if (!sslWrite(netdutils::makeSlice(buf))) {
+    if (err != SSL_ERROR_NONE) {
         return false;
     }
-    LOG(DEBUG) << mMark << " SSL_write complete";
+    LOG(DEBUG) << mMark << " SSL_write complete, " << mWriteBufferQueries << " queries";
+    mWriteBuffer.clear();
+    mWriteBufferQueries = 0;
     return true;
 }
 
-bool DnsTlsSocket::readResponse() {
-    LOG(DEBUG) << "reading response";
-    uint8_t responseHeader[2];
-    int err = sslRead(Slice(responseHeader, 2), false);
-    if (err == SSL_ERROR_WANT_READ) {
-        LOG(DEBUG) << "Ignoring spurious wakeup from server";
-        return true;
-    }
-    if (err != SSL_ERROR_NONE) {
-        return false;
-    }
+bool DnsTlsSocket::readResponses() {
     // Truncate responses larger than MAX_SIZE.  This is safe because a DNS packet is
     // always invalid when truncated, so the response will be treated as an error.
     constexpr uint16_t MAX_SIZE = 8192;
-    const uint16_t responseSize = (responseHeader[0] << 8) | responseHeader[1];
-    LOG(DEBUG) << mMark << " Expecting response of size " << responseSize;
-    std::vector<uint8_t> response(std::min(responseSize, MAX_SIZE));
-    if (sslRead(netdutils::makeSlice(response), true) != SSL_ERROR_NONE) {
-        LOG(DEBUG) << mMark << " Failed to read " << response.size() << " bytes";
-        return false;
+    constexpr size_t CHUNK_SIZE = 2048;
+    uint8_t discard[CHUNK_SIZE];
+
+    if (mDoh) {
+        return readDohResponses();
     }
-    uint16_t remainingBytes = responseSize - response.size();
-    while (remainingBytes > 0) {
-        constexpr uint16_t CHUNK_SIZE = 2048;
-        std::vector<uint8_t> discard(std::min(remainingBytes, CHUNK_SIZE));
-        if (sslRead(netdutils::makeSlice(discard), true) != SSL_ERROR_NONE) {
-            LOG(DEBUG) << mMark << " Failed to discard " << discard.size() << " bytes";
-            return false;
+
+    LOG(DEBUG) << "reading response";
+    for (;;) {
+        // Read whatever is still missing of the current response: first the 2-byte length,
+        // then the response itself, then the part of it which doesn't fit and is discarded.
+        Slice buffer;
+        if (mResponseHeaderRead < sizeof(mResponseHeader)) {
+            buffer = Slice(mResponseHeader + mResponseHeaderRead,
+                           sizeof(mResponseHeader) - mResponseHeaderRead);
+        } else if (mResponseRead < mResponse.size()) {
+            buffer = Slice(mResponse.data() + mResponseRead, mResponse.size() - mResponseRead);
+        } else if (mResponseDiscard > 0) {
+            buffer = Slice(discard, std::min(mResponseDiscard, CHUNK_SIZE));
+        }
+
+        if (buffer.size() > 0) {
+            const int ret = SSL_read(mSsl.get(), buffer.base(), buffer.size());
+            if (ret == 0) {
+                if (mResponseHeaderRead > 0) {
+                    LOG(WARNING) << "SSL closed in the middle of a response";
+                    mBroken = true;
+                }
+                return false;
+            }
+            if (ret < 0) {
+                const int ssl_err = SSL_get_error(mSsl.get(), ret);
+                if (ssl_err == SSL_ERROR_WANT_READ) {
+                    // Nothing more for now.  The rest will come with another event.
+                    return true;
+                }
+                LOG(DEBUG) << "SSL_read error " << ssl_err;
+                mBroken = true;
+                return false;
+            }
+            if (mResponseHeaderRead < sizeof(mResponseHeader)) {
+                mResponseHeaderRead += ret;
+                if (mResponseHeaderRead < sizeof(mResponseHeader)) continue;
+                const uint16_t responseSize = (mResponseHeader[0] << 8) | mResponseHeader[1];
+                LOG(DEBUG) << mMark << " Expecting response of size " << responseSize;
+                mResponse.resize(std::min(responseSize, MAX_SIZE));
+                mResponseRead = 0;
+                mResponseDiscard = responseSize - mResponse.size();
+            } else if (mResponseRead < mResponse.size()) {
+                mResponseRead += ret;
+            } else {
+                mResponseDiscard -= ret;
+            }
+            if (mResponseRead < mResponse.size() || mResponseDiscard > 0) continue;
         }
-        remainingBytes -= discard.size();
+
+        LOG(DEBUG) << mMark << " SSL_read complete";
+        mResponseHeaderRead = 0;
+        mResponseRead = 0;
+        mObserver->onResponse(std::move(mResponse));
+        mResponse.clear();
     }
-    LOG(DEBUG) << mMark << " SSL_read complete";
+}
 
-    mObserver->onResponse(std::move(response));
-    return true;
+bool DnsTlsSocket::readDohResponses() {
+    uint8_t buffer[kMaxRecordSize];
+    for (;;) {
+        const int ret = SSL_read(mSsl.get(), buffer, sizeof(buffer));
+        if (ret == 0) {
+            return false;
+        }
+        if (ret < 0) {
+            const int ssl_err = SSL_get_error(mSsl.get(), ret);
+            if (ssl_err == SSL_ERROR_WANT_READ) {
+                // Once the server has sent GOAWAY and the last streams are done, the session
+                // has nothing left to do, and the connection can be closed.
+                return mDoh->wantRead() || mDoh->wantWrite();
+            }
+            LOG(DEBUG) << "SSL_read error " << ssl_err;
+            mBroken = true;
+            return false;
+        }
+        if (!mDoh->receive(Slice(buffer, ret))) {
+            mBroken = true;
+            return false;
+        }
+    }
 }
 
 }  // end of namespace net
@@ -18,7 +18,10 @@
 #define _DNS_DNSTLSSOCKET_H
 
 #include <openssl/ssl.h>
-#include <future>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 
 #include <android-base/thread_annotations.h>
@@ -26,9 +29,12 @@
 #include <netdutils/Slice.h>
 #include <netdutils/Status.h>
 
+#include "DnsTlsEventLoop.h"
 #include "DnsTlsServer.h"
+#include "DohSession.h"
 #include "IDnsTlsSocket.h"
 #include "LockedQueue.h"
+#include "MpscRing.h"
 
 namespace android {
 namespace net {
@@ -38,13 +44,17 @@ class DnsTlsSessionCache;
 
 // A class for managing a TLS socket that sends and receives messages in
 // [length][value] format, with a 2-byte length (i.e. DNS-over-TCP format).
+// If the server is a DNS-over-HTTPS one, messages are exchanged over HTTP/2 instead.
 // This class is not aware of query-response pairing or anything else about DNS.
+// Once connected, the socket is driven by the shared DnsTlsEventLoop thread instead of a
+// thread of its own.
 // For the observer:
 // This class is not re-entrant: the observer is not permitted to wait for a call to query()
-// or the destructor in a callback.  Doing so will result in deadlocks.
+// or the destructor in a callback.  Doing so will result in deadlocks.  Since the callbacks run
+// on the event loop thread, they must not block at all.
 // This class may call the observer at any time after initialize(), until the destructor
 // returns (but not after).
-class DnsTlsSocket : public IDnsTlsSocket {
+class DnsTlsSocket : public IDnsTlsSocket, private DnsTlsEventLoop::Handler {
   public:
     DnsTlsSocket(const DnsTlsServer& server, unsigned mark,
                  IDnsTlsSocketObserver* _Nonnull observer, DnsTlsSessionCache* _Nonnull cache)
@@ -60,22 +70,47 @@ class DnsTlsSocket : public IDnsTlsSocket {
     // the body of a query, not including the ID header. This function will typically return before
     // the query is actually sent.  If this function fails, DnsTlsSocketObserver will be
     // notified that the socket is closed.
+    // Queries which are pending at the same time are sent together, in as few TLS records as
+    // possible.
     // Note that success here indicates successful sending, not receipt of a response.
     // Thread-safe.
     bool query(uint16_t id, const netdutils::Slice query) override EXCLUDES(mLock);
 
   private:
-    // Lock to be held by the SSL event loop thread.  This is not normally in contention.
+    // Lock to be held by the event loop thread while handling this socket.  This is not
+    // normally in contention.
     std::mutex mLock;
 
-    // Forwards queries and receives responses.  Blocks until the idle timeout.
-    void loop() EXCLUDES(mLock);
-    std::unique_ptr<std::thread> mLoopThread GUARDED_BY(mLock);
+    // Forwards queries and receives responses.  Called on the event loop thread.
+    void onEvent(int fd, uint32_t events) override EXCLUDES(mLock);
+    // Returns false if the connection has to be closed.
+    bool handleEvent(int fd, uint32_t events) REQUIRES(mLock);
+    // Updates the events the loop waits for, depending on whether queries are pending.
+    void updateEvents() REQUIRES(mLock);
+    // Returns true if there is anything that can be sent right away.
+    bool hasDataToSend() REQUIRES(mLock);
+    // Stops watching the socket, disconnects, and notifies the observer.
+    void closeConnection() REQUIRES(mLock);
+    // Restarts the idle timeout.
+    void armIdleTimer() REQUIRES(mLock);
+
+    // Set once the socket has been handed over to the event loop.
+    bool mRegistered GUARDED_BY(mLock) = false;
+    // Set once the loop is done with this socket.  The destructor waits for it.
+    bool mClosed GUARDED_BY(mLock) = false;
+    std::condition_variable mClosedCv;
+    // Set when the connection is closed because it broke, rather than in an orderly way.
+    bool mBroken GUARDED_BY(mLock) = false;
+    // True while the loop waits for room to send queries, rather than for new queries.
+    bool mSending GUARDED_BY(mLock) = false;
 
     // On success, sets mSslFd to a socket connected to mAddr (the
     // connection will likely be in progress if mProtocol is IPPROTO_TCP).
+    // If |fastOpen| is set, the first bytes written go with the SYN when possible, in which
+    // case mSynData is set.
     // On error, returns the errno.
-    netdutils::Status tcpConnect() REQUIRES(mLock);
+    netdutils::Status tcpConnect(bool fastOpen) REQUIRES(mLock);
+    bool mSynData GUARDED_BY(mLock) = false;
 
     // Connect an SSL session on the provided socket.  If connection fails, closing the
     // socket remains the caller's responsibility.
@@ -84,17 +119,26 @@ class DnsTlsSocket : public IDnsTlsSocket {
     // Disconnect the SSL session and close the socket.
     void sslDisconnect() REQUIRES(mLock);
 
-    // Writes a buffer to the socket.
-    bool sslWrite(const netdutils::Slice buffer) REQUIRES(mLock);
-
-    // Reads exactly the specified number of bytes from the socket, or fails.
-    // Returns SSL_ERROR_NONE on success.
-    // If |wait| is true, then this function always blocks.  Otherwise, it
-    // will return SSL_ERROR_WANT_READ if there is no data from the server to read.
-    int sslRead(const netdutils::Slice buffer, bool wait) REQUIRES(mLock);
-
-    bool sendQuery(const std::vector<uint8_t>& buf) REQUIRES(mLock);
-    bool readResponse() REQUIRES(mLock);
+    // Sets up mDoh, once the TLS handshake has negotiated HTTP/2.  Returns false on failure.
+    bool startDohSession() REQUIRES(mLock);
+
+    // Writes a buffer to the socket without blocking.  Returns SSL_ERROR_NONE on success, or
+    // SSL_ERROR_WANT_WRITE if there is no room for it yet, in which case the same buffer has to
+    // be written again once the socket is writable.
+    int sslWrite(const netdutils::Slice buffer) REQUIRES(mLock);
+
+    // Sends the pending queries, packed into as few TLS records as the socket has room for.
+    // With DoH, queries are sent as long as the server allows more concurrent streams, and the
+    // HTTP/2 control frames are sent along.
+    // Returns false if the connection is broken.
+    bool sendQueries() REQUIRES(mLock);
+    // Returns how many more bytes the socket send buffer can take, or 0 if unknown.
+    size_t sendBufferRoom() REQUIRES(mLock);
+    // Reads as much as is available without blocking, and passes complete responses to the
+    // observer.  Returns false if the connection is closed or broken.
+    bool readResponses() REQUIRES(mLock);
+    // The same for DoH, where HTTP/2 takes care of framing.
+    bool readDohResponses() REQUIRES(mLock);
 
     // It is only used for DNS-OVER-TLS internal test.
     bool setTestCaCertificate() REQUIRES(mLock);
@@ -108,24 +152,68 @@ class DnsTlsSocket : public IDnsTlsSocket {
     // This function sends a message to the loop thread by incrementing mEventFd.
     bool incrementEventFd(int64_t count) EXCLUDES(mLock);
 
-    // Queue of pending queries.  query() pushes items onto the queue and notifies
-    // the loop thread by incrementing mEventFd.  loop() reads items off the queue.
-    LockedQueue<std::vector<uint8_t>> mQueue;
-
-    // eventfd socket used for notifying the SSL thread when queries are ready to send.
+    // Composes the message for a query into |buffer|.
+    void composeQuery(uint16_t id, const netdutils::Slice query, std::vector<uint8_t>* buffer);
+
+    // Moves the queries of mQueue and mOverflow to mPending.
+    void takeQueries() REQUIRES(mLock);
+    // Keeps |buffer| for mQueue to reuse, if it doesn't have enough spare buffers yet.
+    void recycleBuffer(std::vector<uint8_t>&& buffer) REQUIRES(mLock);
+    // Returns a buffer kept by recycleBuffer(), or an empty one.
+    std::vector<uint8_t> takeSpareBuffer() REQUIRES(mLock);
+
+    // Queue of pending queries.  query() composes each query in place, in a buffer of the ring,
+    // and notifies the loop thread through mEventFd.  The loop thread moves them to mPending,
+    // and gives the ring buffers from mSpareBuffers in exchange, so that queries are queued
+    // without locking or allocating.
+    static constexpr size_t kQueueSize = 64;
+    // Enough for a query with a full-length name and EDNS padding.
+    static constexpr size_t kQueryBufferSize = 512;
+    MpscRing<std::vector<uint8_t>, kQueueSize> mQueue{
+            [](std::vector<uint8_t>& buffer) { buffer.reserve(kQueryBufferSize); }};
+    // Queries which didn't fit in mQueue, during a burst larger than the ring.
+    LockedQueue<std::vector<uint8_t>> mOverflow;
+    std::vector<std::vector<uint8_t>> mSpareBuffers GUARDED_BY(mLock);
+    // Set by the first query() after the loop thread took the queries, which is the only one
+    // that has to notify it.  Cleared by the loop thread before it takes them.
+    std::atomic<bool> mWakeupPending = false;
+    // Queries taken from mQueue which are not sent yet.  With DoH, they may have to wait for a
+    // stream to complete.
+    std::deque<std::vector<uint8_t>> mPending GUARDED_BY(mLock);
+    // Queries taken from mPending and packed into one record, which SSL_write() has not
+    // accepted yet.  It has to be retried with the same contents.
+    std::vector<uint8_t> mWriteBuffer GUARDED_BY(mLock);
+    size_t mWriteBufferQueries GUARDED_BY(mLock) = 0;
+
+    // eventfd socket used for notifying the loop thread when queries are ready to send.
     // This socket acts similarly to an atomic counter, incremented by query() and cleared
-    // by loop().  We have to use a socket because the SSL thread needs to wait in poll()
+    // by onEvent().  Only the first query of a batch increments it; see mWakeupPending.
+    // We have to use a socket because the loop thread needs to wait in epoll
     // for input from either a remote server or a query thread.  Since eventfd does not have
     // EOF, we indicate a close request by setting the counter to a negative number.
     // This file descriptor is opened by initialize(), and closed implicitly after
     // destruction.
     base::unique_fd mEventFd;
 
+    // timerfd which fires when the connection has been idle for the observer's idle timeout.
+    base::unique_fd mTimerFd;
+
+    // The response being read.  A response can be split across several TLS records, so it may
+    // take several events to read it.
+    uint8_t mResponseHeader[2] GUARDED_BY(mLock);
+    size_t mResponseHeaderRead GUARDED_BY(mLock) = 0;
+    std::vector<uint8_t> mResponse GUARDED_BY(mLock);
+    size_t mResponseRead GUARDED_BY(mLock) = 0;
+    // Bytes of an oversized response which are read and thrown away.
+    size_t mResponseDiscard GUARDED_BY(mLock) = 0;
+
     // SSL Socket fields.
     bssl::UniquePtr<SSL_CTX> mSslCtx GUARDED_BY(mLock);
     base::unique_fd mSslFd GUARDED_BY(mLock);
     bssl::UniquePtr<SSL> mSsl GUARDED_BY(mLock);
-    static constexpr std::chrono::seconds kIdleTimeout = std::chrono::seconds(20);
+
+    // The HTTP/2 session, if the server is a DoH one.  It is set up once connected.
+    std::unique_ptr<DohSession> mDoh GUARDED_BY(mLock);
 
     const unsigned mMark;  // Socket mark
     const DnsTlsServer mServer;
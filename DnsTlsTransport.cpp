@@ -22,31 +22,85 @@
 #include <android-base/stringprintf.h>
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
-#include <netdutils/ThreadUtil.h>
 
-#include "DnsTlsSocketFactory.h"
+#include <algorithm>
+
+#include "Experiments.h"
 #include "IDnsTlsSocketFactory.h"
+#include "TaskScheduler.h"
+#include "resolv_private.h"
+#include "util.h"
 
+using android::base::ScopedLockAssertion;
 using android::base::StringPrintf;
-using android::netdutils::setThreadName;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
 
 namespace android {
 namespace net {
 
-std::future<DnsTlsTransport::Result> DnsTlsTransport::query(const netdutils::Slice query) {
+namespace {
+
+constexpr milliseconds kMinTimeout{1000};
+constexpr milliseconds kDefaultTimeout{3000};
+constexpr milliseconds kMinRaceDelay{10};
+constexpr milliseconds kDefaultRaceDelay{500};
+// Caps the exponential backoff, so that the multiplication can't overflow.
+constexpr int kMaxBackoff = 8;
+
+constexpr milliseconds kDefaultMaxIdleTimeout{120000};
+// Queries closer than this belong to the same burst, e.g. A and AAAA lookups, and don't say
+// anything about how long the connection stays idle.
+constexpr milliseconds kMinQueryInterval{1000};
+// Longer intervals are counted as this, so that one long pause can't skew the average for good.
+constexpr milliseconds kMaxQueryInterval{3600 * 1000};
+
+milliseconds getMaxTimeout() {
+    const int val = getExperimentFlagInt("dot_query_timeout_ms", kDefaultTimeout.count());
+    return std::max(milliseconds(val), kMinTimeout);
+}
+
+milliseconds getMinIdleTimeout() {
+    const int val = Experiments::getInstance()->getFlag(
+            "dot_idle_timeout_min_ms", IDnsTlsSocketObserver::kDefaultIdleTimeout.count());
+    return std::max(milliseconds(val), kMinTimeout);
+}
+
+milliseconds getMaxIdleTimeout(milliseconds minIdleTimeout) {
+    const int val = Experiments::getInstance()->getFlag("dot_idle_timeout_max_ms",
+                                                        kDefaultMaxIdleTimeout.count());
+    return std::max(milliseconds(val), minIdleTimeout);
+}
+
+}  // namespace
+
+DnsTlsTransport::DnsTlsTransport(const DnsTlsServer& server, unsigned mark,
+                                 IDnsTlsSocketFactory* _Nonnull factory,
+                                 std::shared_ptr<DnsTlsSessionCache> cache)
+    : mMaxTimeout(getMaxTimeout()),
+      mMinIdleTimeout(getMinIdleTimeout()),
+      mMaxIdleTimeout(getMaxIdleTimeout(mMinIdleTimeout)),
+      mCache(cache ? std::move(cache) : std::make_shared<DnsTlsSessionCache>()),
+      mMark(mark),
+      mServer(server),
+      mFactory(factory) {}
+
+DnsTlsTransport::Waiter DnsTlsTransport::query(const netdutils::Slice query) {
+    addQueryArrival(std::chrono::steady_clock::now());
     std::lock_guard guard(mLock);
 
     auto record = mQueries.recordQuery(query);
     if (!record) {
-        return std::async(std::launch::deferred, []{
-            return (Result) { .code = Response::internal_error };
-        });
+        return Waiter(Result{.code = Response::internal_error});
     }
 
     if (!mSocket) {
         LOG(DEBUG) << "No socket for query.  Opening socket and sending.";
+        if (mBroken) mReconnectCounter++;
         doConnect();
     } else {
+        // mLock is held since recordQuery(), so the slot of the query can't be reused yet.
         sendQuery(record->query);
     }
 
@@ -58,9 +112,98 @@ int DnsTlsTransport::getConnectCounter() const {
     return mConnectCounter;
 }
 
+milliseconds DnsTlsTransport::getTimeout() const {
+    std::lock_guard guard(mRttLock);
+    if (!mHasRtt) {
+        return mMaxTimeout;
+    }
+    milliseconds timeout = std::clamp(duration_cast<milliseconds>(mSrtt + 4 * mRttVar),
+                                      kMinTimeout, mMaxTimeout);
+    timeout *= 1 << mBackoff;
+    return std::min(timeout, mMaxTimeout);
+}
+
+milliseconds DnsTlsTransport::getRaceDelay() const {
+    std::lock_guard guard(mRttLock);
+    if (!mHasRtt) {
+        return kDefaultRaceDelay;
+    }
+    return std::clamp(duration_cast<milliseconds>(mSrtt + 2 * mRttVar), kMinRaceDelay,
+                      mMaxTimeout);
+}
+
+void DnsTlsTransport::onTimeout() {
+    std::lock_guard guard(mRttLock);
+    if (mBackoff < kMaxBackoff) {
+        mBackoff++;
+    }
+}
+
+void DnsTlsTransport::addRttSample(microseconds rtt) {
+    std::lock_guard guard(mRttLock);
+    if (!mHasRtt) {
+        mSrtt = rtt;
+        mRttVar = rtt / 2;
+        mHasRtt = true;
+    } else {
+        const microseconds delta = (mSrtt > rtt) ? mSrtt - rtt : rtt - mSrtt;
+        mRttVar = (3 * mRttVar + delta) / 4;
+        mSrtt = (7 * mSrtt + rtt) / 8;
+    }
+    mBackoff = 0;
+}
+
+void DnsTlsTransport::addQueryArrival(std::chrono::steady_clock::time_point now) {
+    std::lock_guard guard(mRttLock);
+    const std::chrono::steady_clock::time_point last = mLastQuery;
+    mLastQuery = now;
+    if (last == std::chrono::steady_clock::time_point()) return;
+    const milliseconds interval =
+            std::min(duration_cast<milliseconds>(now - last), kMaxQueryInterval);
+    if (interval < kMinQueryInterval) return;
+    if (!mHasInterval) {
+        mInterval = interval;
+        mIntervalVar = interval / 2;
+        mHasInterval = true;
+    } else {
+        const milliseconds delta =
+                (mInterval > interval) ? mInterval - interval : interval - mInterval;
+        mIntervalVar = (3 * mIntervalVar + delta) / 4;
+        mInterval = (7 * mInterval + interval) / 8;
+    }
+}
+
+std::optional<milliseconds> DnsTlsTransport::getQueryInterval() const {
+    std::lock_guard guard(mRttLock);
+    if (!mHasInterval) return std::nullopt;
+    return mInterval;
+}
+
+milliseconds DnsTlsTransport::getIdleTimeout() const {
+    std::lock_guard guard(mRttLock);
+    // Waiting for a query which usually comes after the connection would be closed anyway
+    // only wastes the resources of both ends.
+    if (!mHasInterval || mInterval > mMaxIdleTimeout) {
+        return mMinIdleTimeout;
+    }
+    return std::clamp(mInterval + 4 * mIntervalVar, mMinIdleTimeout, mMaxIdleTimeout);
+}
+
+DnsTlsTransport::Stats DnsTlsTransport::getStats() const {
+    const milliseconds idleTimeout = getIdleTimeout();
+    std::lock_guard guard(mLock);
+    return {
+            .connects = mConnectCounter,
+            .reconnects = mReconnectCounter,
+            .idleTimeout = idleTimeout,
+    };
+}
+
 bool DnsTlsTransport::sendQuery(const DnsTlsQueryMap::Query& q) {
+    // q.query is only valid while mLock keeps recordQuery() from reusing its slot.  The socket
+    // copies it before this returns.
     // Strip off the ID number and send the new ID instead.
-    const bool sent = mSocket->query(q.newId, netdutils::drop(netdutils::makeSlice(q.query), 2));
+    const bool sent = mSocket->query(q.newId, netdutils::drop(q.query, 2));
     if (sent) {
         mQueries.markTried(q.newId);
     }
@@ -69,10 +212,12 @@ bool DnsTlsTransport::sendQuery(const DnsTlsQueryMap::Query& q) {
 
 void DnsTlsTransport::doConnect() {
     LOG(DEBUG) << "Constructing new socket";
-    mSocket = mFactory->createDnsTlsSocket(mServer, mMark, this, &mCache);
+    mSocket = mFactory->createDnsTlsSocket(mServer, mMark, this, mCache.get());
     mConnectCounter++;
+    mBroken = false;
 
     if (mSocket) {
+        // Valid as long as mLock is held; see sendQuery().
         auto queries = mQueries.getAll();
         LOG(DEBUG) << "Initialization succeeded.  Reissuing " << queries.size() << " queries.";
         for(auto& q : queries) {
@@ -89,38 +234,53 @@ void DnsTlsTransport::doConnect() {
 }
 
 void DnsTlsTransport::onResponse(std::vector<uint8_t> response) {
-    mQueries.onResponse(std::move(response));
+    // Responses to queries whose caller has timed out still count, so that the timeout can
+    // adapt to a slow server.
+    if (const auto rtt = mQueries.onResponse(std::move(response)); rtt) {
+        addRttSample(*rtt);
+    }
 }
 
-void DnsTlsTransport::onClosed() {
+void DnsTlsTransport::onClosed(bool error) {
     std::lock_guard guard(mLock);
     if (mClosing) {
         return;
     }
-    // Move remaining operations to a new thread.
+    if (error) mBroken = true;
+    // Move remaining operations to the task scheduler.
     // This is necessary because
-    // 1. onClosed is currently running on a thread that blocks mSocket's destructor
-    // 2. doReconnect will call that destructor
-    if (mReconnectThread) {
-        // Complete cleanup of a previous reconnect thread, if present.
-        mReconnectThread->join();
-        // Joining a thread that is trying to acquire mLock, while holding mLock,
-        // looks like it risks a deadlock.  However, a deadlock will not occur because
-        // once onClosed is called, it cannot be called again until after doReconnect
-        // acquires mLock.
+    // 1. onClosed is currently running on the event loop thread, which mSocket's destructor
+    //    waits for, and which must not block on a TLS handshake
+    // 2. doReconnect will call that destructor, and may connect again
+    // onClosed cannot be called again until after doReconnect acquires mLock, so at most one
+    // reconnect is pending at a time.
+    if (mReconnectPending) {
+        return;
     }
-    mReconnectThread.reset(new std::thread(&DnsTlsTransport::doReconnect, this));
+    mReconnectPending = true;
+    // The task isn't tied to the network of the transport, so that cancelling the tasks of a
+    // network can't drop it while the destructor waits for it.
+    TaskScheduler::getInstance()->schedule(
+            0, StringPrintf("TlsReconnect %s mark 0x%x", addrToString(&mServer.ss).c_str(), mMark),
+            milliseconds(0), [this]() -> std::optional<milliseconds> {
+                doReconnect();
+                return std::nullopt;
+            },
+            TaskScheduler::TaskClass::RECONNECT);
 }
 
 void DnsTlsTransport::doReconnect() {
     std::lock_guard guard(mLock);
-    setThreadName(StringPrintf("TlsReconn_%u", mMark & 0xffff).c_str());
+    // The destructor can only go on once mLock is released, after which |this| isn't used.
+    mReconnectPending = false;
+    mReconnectCv.notify_all();
     if (mClosing) {
         return;
     }
     mQueries.cleanup();
     if (!mQueries.empty()) {
         LOG(DEBUG) << "Fast reconnect to retry remaining queries";
+        mReconnectCounter++;
         doConnect();
     } else {
         LOG(DEBUG) << "No pending queries.  Going idle.";
@@ -131,18 +291,19 @@ void DnsTlsTransport::doReconnect() {
 DnsTlsTransport::~DnsTlsTransport() {
     LOG(DEBUG) << "Destructor";
     {
-        std::lock_guard guard(mLock);
+        std::unique_lock lock(mLock);
+        ScopedLockAssertion assume_lock(mLock);
         LOG(DEBUG) << "Locked destruction procedure";
         mQueries.clear();
         mClosing = true;
-    }
-    // It's possible that a reconnect thread was spawned and waiting for mLock.
-    // It's safe for that thread to run now because mClosing is true (and mQueries is empty),
-    // but we need to wait for it to finish before allowing destruction to proceed.
-    if (mReconnectThread) {
-        LOG(DEBUG) << "Waiting for reconnect thread to terminate";
-        mReconnectThread->join();
-        mReconnectThread.reset();
+        // It's possible that a reconnect task was scheduled and is waiting for a worker or
+        // for mLock.  It's safe for that task to run now because mClosing is true (and
+        // mQueries is empty), but we need to wait for it to finish before allowing destruction
+        // to proceed.
+        if (mReconnectPending) LOG(DEBUG) << "Waiting for reconnect task to run";
+        while (mReconnectPending) {
+            mReconnectCv.wait(lock);
+        }
     }
     // Ensure that the socket is destroyed, and can clean up its callback threads,
     // before any of this object's fields become invalid.
@@ -150,10 +311,7 @@ DnsTlsTransport::~DnsTlsTransport() {
     LOG(DEBUG) << "Destructor completed";
 }
 
-// static
-// TODO: Use this function to preheat the session cache.
-// That may require moving it to DnsTlsDispatcher.
-bool DnsTlsTransport::validate(const DnsTlsServer& server, unsigned netid, uint32_t mark) {
+bool DnsTlsTransport::validate(unsigned netid) {
     LOG(DEBUG) << "Beginning validation on " << netid;
     // Generate "<random>-dnsotls-ds.metric.gstatic.com", which we will lookup through |ss| in
     // order to prove that it is actually a working DNS over TLS server.
@@ -186,9 +344,7 @@ bool DnsTlsTransport::validate(const DnsTlsServer& server, unsigned netid, uint3
     const int qlen = std::size(query);
 
     int replylen = 0;
-    DnsTlsSocketFactory factory;
-    DnsTlsTransport transport(server, mark, &factory);
-    auto r = transport.query(netdutils::Slice(query, qlen)).get();
+    auto r = this->query(netdutils::Slice(query, qlen)).get();
     if (r.code != Response::success) {
         LOG(DEBUG) << "query failed";
         return false;
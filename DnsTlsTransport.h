@@ -17,9 +17,12 @@
 #ifndef _DNS_DNSTLSTRANSPORT_H
 #define _DNS_DNSTLSTRANSPORT_H
 
-#include <future>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
@@ -41,32 +44,93 @@ class IDnsTlsSocketFactory;
 // such as reopening the socket and reissuing pending queries.
 class DnsTlsTransport : public IDnsTlsSocketObserver {
   public:
+    // Sessions are resumed from |cache|, which can be shared with other transports to the same
+    // server.  If it's null, the transport uses a cache of its own.
     DnsTlsTransport(const DnsTlsServer& server, unsigned mark,
-                    IDnsTlsSocketFactory* _Nonnull factory)
-        : mMark(mark), mServer(server), mFactory(factory) {}
+                    IDnsTlsSocketFactory* _Nonnull factory,
+                    std::shared_ptr<DnsTlsSessionCache> cache = nullptr);
     ~DnsTlsTransport();
 
     using Response = DnsTlsQueryMap::Response;
     using Result = DnsTlsQueryMap::Result;
+    using Waiter = DnsTlsQueryMap::Waiter;
 
     // Given a |query|, this method sends it to the server and returns the result asynchronously.
-    std::future<Result> query(const netdutils::Slice query) EXCLUDES(mLock);
+    // The returned Waiter must not outlive this transport.
+    Waiter query(const netdutils::Slice query) EXCLUDES(mLock);
 
-    // Check that a given TLS server is fully working on the specified netid.
-    // This function is used in ResolverController to ensure that we don't enable DNS over TLS
-    // on networks where it doesn't actually work.
-    static bool validate(const DnsTlsServer& server, unsigned netid, uint32_t mark);
+    // Check that the TLS server of this transport is fully working on the specified netid.
+    // This function is used in PrivateDnsConfiguration to ensure that we don't enable DNS over
+    // TLS on networks where it doesn't actually work.  The connection it opens stays up for the
+    // queries which follow.
+    bool validate(unsigned netid) EXCLUDES(mLock);
 
     int getConnectCounter() const EXCLUDES(mLock);
 
+    // Returns how long to wait for a response before trying another server.  Like the TCP
+    // retransmission timer (RFC 6298), this is derived from the round trip times measured on
+    // this transport, and doubles after each timeout.  Before any measurement, and at most,
+    // it is the value of the "dot_query_timeout_ms" flag.
+    std::chrono::milliseconds getTimeout() const EXCLUDES(mRttLock);
+
+    // Returns how long to wait for a response before racing the query on another server.  This
+    // is about the longest RTT usually seen on this transport.
+    std::chrono::milliseconds getRaceDelay() const EXCLUDES(mRttLock);
+
+    // Notifies the transport that the caller stopped waiting for a query.
+    void onTimeout() EXCLUDES(mRttLock);
+
+    // Returns the smoothed time between two queries on this transport, or nullopt before the
+    // second query.
+    std::optional<std::chrono::milliseconds> getQueryInterval() const EXCLUDES(mRttLock);
+
+    struct Stats {
+        // Connections opened, including the first one.
+        int connects;
+        // Connections opened again for queries left outstanding by a closed one, or after one
+        // broke.  Connecting again after an orderly close, e.g. for being idle, doesn't count.
+        int reconnects;
+        std::chrono::milliseconds idleTimeout;
+    };
+    Stats getStats() const EXCLUDES(mLock, mRttLock);
+
     // Implement IDnsTlsSocketObserver
     void onResponse(std::vector<uint8_t> response) override;
-    void onClosed() override EXCLUDES(mLock);
+    void onClosed(bool error) override EXCLUDES(mLock);
+    // Keeps the connection open for about as long as the next query is usually awaited, within
+    // the bounds of the "dot_idle_timeout_min_ms" and "dot_idle_timeout_max_ms" flags.  If
+    // queries are further apart than that, the connection is closed after the minimum.
+    std::chrono::milliseconds getIdleTimeout() const override EXCLUDES(mRttLock);
 
   private:
     mutable std::mutex mLock;
 
-    DnsTlsSessionCache mCache;
+    // Protects the RTT estimate.  This is separate from mLock, which can be held during a
+    // handshake, because the estimate is updated on the event loop thread.
+    mutable std::mutex mRttLock;
+    bool mHasRtt GUARDED_BY(mRttLock) = false;
+    std::chrono::microseconds mSrtt GUARDED_BY(mRttLock) = {};
+    std::chrono::microseconds mRttVar GUARDED_BY(mRttLock) = {};
+    // Number of timeouts since the last RTT sample.
+    int mBackoff GUARDED_BY(mRttLock) = 0;
+    const std::chrono::milliseconds mMaxTimeout;
+
+    void addRttSample(std::chrono::microseconds rtt) EXCLUDES(mRttLock);
+
+    // The time between queries, smoothed like the RTT.  It is also guarded by mRttLock, since
+    // the event loop thread reads it each time the connection goes idle.
+    std::chrono::steady_clock::time_point mLastQuery GUARDED_BY(mRttLock);
+    bool mHasInterval GUARDED_BY(mRttLock) = false;
+    std::chrono::milliseconds mInterval GUARDED_BY(mRttLock) = {};
+    std::chrono::milliseconds mIntervalVar GUARDED_BY(mRttLock) = {};
+    const std::chrono::milliseconds mMinIdleTimeout;
+    const std::chrono::milliseconds mMaxIdleTimeout;
+
+    void addQueryArrival(std::chrono::steady_clock::time_point now) EXCLUDES(mRttLock);
+    // For testing.
+    friend class TransportTest;
+
+    const std::shared_ptr<DnsTlsSessionCache> mCache;
     DnsTlsQueryMap mQueries;
 
     const unsigned mMark;  // Socket mark
@@ -75,9 +139,12 @@ class DnsTlsTransport : public IDnsTlsSocketObserver {
 
     void doConnect() REQUIRES(mLock);
 
-    // doReconnect is used by onClosed.  It runs on the reconnect thread.
+    // doReconnect is used by onClosed.  It runs as a task of the TaskScheduler.
     void doReconnect() EXCLUDES(mLock);
-    std::unique_ptr<std::thread> mReconnectThread GUARDED_BY(mLock);
+    // Set while a reconnect task is scheduled or running.  The destructor waits for it on
+    // mReconnectCv.
+    bool mReconnectPending GUARDED_BY(mLock) = false;
+    std::condition_variable mReconnectCv;
 
     // Used to prevent onClosed from starting a reconnect during the destructor.
     bool mClosing GUARDED_BY(mLock) = false;
@@ -90,6 +157,10 @@ class DnsTlsTransport : public IDnsTlsSocketObserver {
 
     // The number of times an attempt to connect the nameserver.
     int mConnectCounter GUARDED_BY(mLock) = 0;
+    // The number of those attempts which were reconnects, as defined by Stats.
+    int mReconnectCounter GUARDED_BY(mLock) = 0;
+    // Set when a connection broke, until the next attempt to connect.
+    bool mBroken GUARDED_BY(mLock) = false;
 };
 
 }  // end of namespace net
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "DohSession.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+#include <android-base/logging.h>
+#include <nghttp2/nghttp2.h>
+
+namespace android {
+
+using netdutils::Slice;
+
+namespace net {
+namespace {
+
+constexpr char kDnsMessageType[] = "application/dns-message";
+
+// Responses are truncated to this size, like DNS-over-TLS responses.  This is safe because a
+// DNS packet is always invalid when truncated, so the response will be treated as an error.
+constexpr size_t kMaxResponseSize = 8192;
+
+// Size of a DNS header, which every query and response starts with.
+constexpr size_t kDnsHeaderSize = 12;
+constexpr uint8_t kServfail = 2;
+
+nghttp2_nv makeHeader(std::string_view name, std::string_view value) {
+    return {
+            .name = reinterpret_cast<uint8_t*>(const_cast<char*>(name.data())),
+            .value = reinterpret_cast<uint8_t*>(const_cast<char*>(value.data())),
+            .namelen = name.size(),
+            .valuelen = value.size(),
+            .flags = NGHTTP2_NV_FLAG_NONE,
+    };
+}
+
+}  // namespace
+
+struct DohSession::Callbacks {
+    static ssize_t readQuery(nghttp2_session*, int32_t streamId, uint8_t* buf, size_t length,
+                             uint32_t* dataFlags, nghttp2_data_source*, void* userData) {
+        auto* self = static_cast<DohSession*>(userData);
+        const auto it = self->mStreams.find(streamId);
+        if (it == self->mStreams.end()) return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        Stream& stream = it->second;
+        const size_t size = std::min(length, stream.query.size() - stream.sent);
+        std::memcpy(buf, stream.query.data() + stream.sent, size);
+        stream.sent += size;
+        if (stream.sent == stream.query.size()) *dataFlags |= NGHTTP2_DATA_FLAG_EOF;
+        return size;
+    }
+
+    static int onHeader(nghttp2_session*, const nghttp2_frame* frame, const uint8_t* name,
+                        size_t nameLength, const uint8_t* value, size_t valueLength, uint8_t,
+                        void* userData) {
+        auto* self = static_cast<DohSession*>(userData);
+        if (frame->hd.type != NGHTTP2_HEADERS) return 0;
+        const auto it = self->mStreams.find(frame->hd.stream_id);
+        if (it == self->mStreams.end()) return 0;
+
+        const std::string_view headerName(reinterpret_cast<const char*>(name), nameLength);
+        const std::string_view headerValue(reinterpret_cast<const char*>(value), valueLength);
+        if (headerName == ":status") {
+            it->second.status = atoi(std::string(headerValue).c_str());
+        } else if (headerName == "content-type") {
+            // Ignore parameters, if any.
+            it->second.isDnsMessage =
+                    headerValue.substr(0, headerValue.find(';')) == kDnsMessageType;
+        }
+        return 0;
+    }
+
+    static int onDataChunk(nghttp2_session*, uint8_t, int32_t streamId, const uint8_t* data,
+                           size_t length, void* userData) {
+        auto* self = static_cast<DohSession*>(userData);
+        const auto it = self->mStreams.find(streamId);
+        if (it == self->mStreams.end()) return 0;
+        std::vector<uint8_t>& response = it->second.response;
+        const size_t size = std::min(length, kMaxResponseSize - response.size());
+        response.insert(response.end(), data, data + size);
+        return 0;
+    }
+
+    static int onStreamClose(nghttp2_session* session, int32_t streamId, uint32_t errorCode,
+                             void* userData) {
+        auto* self = static_cast<DohSession*>(userData);
+        const auto it = self->mStreams.find(streamId);
+        if (it == self->mStreams.end()) return 0;
+        Stream& stream = it->second;
+
+        if (errorCode == NGHTTP2_REFUSED_STREAM &&
+            !nghttp2_session_check_request_allowed(session)) {
+            // The server is closing the connection without having processed the query.  It is
+            // sent again on the next connection, like the queries of a DNS-over-TLS connection
+            // which is closed.
+            LOG(DEBUG) << "Stream " << streamId << " refused by a closing server";
+        } else {
+            const bool ok = errorCode == NGHTTP2_NO_ERROR && stream.status == 200 &&
+                            stream.isDnsMessage && stream.response.size() >= kDnsHeaderSize;
+            if (!ok) {
+                LOG(WARNING) << "DoH query failed on stream " << streamId << ": status "
+                             << stream.status << ", error " << errorCode;
+            }
+            self->complete(stream, ok);
+        }
+        self->mStreams.erase(it);
+        return 0;
+    }
+};
+
+DohSession::DohSession(const std::string& authority, const std::string& path,
+                       ResponseCallback callback)
+    : mAuthority(authority), mPath(path), mCallback(std::move(callback)) {}
+
+DohSession::~DohSession() {
+    // Deleting the session doesn't call any callback.  Queries still waiting for a response
+    // are the caller's to retry.
+    nghttp2_session_del(mSession);
+}
+
+bool DohSession::initialize() {
+    nghttp2_session_callbacks* callbacks;
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) return false;
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, Callbacks::onHeader);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, Callbacks::onDataChunk);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, Callbacks::onStreamClose);
+    const int ret = nghttp2_session_client_new(&mSession, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+    if (ret != 0) {
+        LOG(ERROR) << "Failed to create HTTP/2 session: " << nghttp2_strerror(ret);
+        return false;
+    }
+
+    // The server has no reason to push anything.
+    const nghttp2_settings_entry settings[] = {
+            {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+            {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 0},
+    };
+    return nghttp2_submit_settings(mSession, NGHTTP2_FLAG_NONE, settings, std::size(settings)) == 0;
+}
+
+bool DohSession::canSubmit() const {
+    const uint32_t serverLimit = nghttp2_session_get_remote_settings(
+            mSession, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    return nghttp2_session_check_request_allowed(mSession) &&
+           mStreams.size() < std::min<size_t>(serverLimit, kMaxConcurrentStreams);
+}
+
+bool DohSession::submit(const Slice query) {
+    if (query.size() < kDnsHeaderSize) {
+        LOG(ERROR) << "Query too short: " << query.size() << " bytes";
+        return false;
+    }
+    Stream stream;
+    const uint8_t* bytes = query.base();
+    stream.id = (bytes[0] << 8) | bytes[1];
+    stream.query.assign(bytes, bytes + query.size());
+    // RFC 8484 section 4.1: the ID should be 0, so that identical queries can be cached.
+    stream.query[0] = 0;
+    stream.query[1] = 0;
+
+    const std::string contentLength = std::to_string(query.size());
+    const nghttp2_nv headers[] = {
+            makeHeader(":method", "POST"),
+            makeHeader(":scheme", "https"),
+            makeHeader(":authority", mAuthority),
+            makeHeader(":path", mPath),
+            makeHeader("accept", kDnsMessageType),
+            makeHeader("content-type", kDnsMessageType),
+            makeHeader("content-length", contentLength),
+    };
+    nghttp2_data_provider body = {.source = {}, .read_callback = Callbacks::readQuery};
+    const int32_t streamId =
+            nghttp2_submit_request(mSession, nullptr, headers, std::size(headers), &body, nullptr);
+    if (streamId < 0) {
+        LOG(WARNING) << "Failed to submit DoH query: " << nghttp2_strerror(streamId);
+        return false;
+    }
+    mStreams.emplace(streamId, std::move(stream));
+    return true;
+}
+
+bool DohSession::send(std::vector<uint8_t>* out, size_t limit) {
+    while (out->size() < limit) {
+        const uint8_t* data;
+        const ssize_t size = nghttp2_session_mem_send(mSession, &data);
+        if (size < 0) {
+            LOG(WARNING) << "HTTP/2 send error: " << nghttp2_strerror(size);
+            return false;
+        }
+        if (size == 0) break;
+        out->insert(out->end(), data, data + size);
+    }
+    return true;
+}
+
+bool DohSession::receive(const Slice data) {
+    const ssize_t ret = nghttp2_session_mem_recv(mSession, data.base(), data.size());
+    if (ret < 0) {
+        LOG(WARNING) << "HTTP/2 receive error: " << nghttp2_strerror(ret);
+        return false;
+    }
+    return true;
+}
+
+bool DohSession::wantWrite() const {
+    return nghttp2_session_want_write(mSession);
+}
+
+bool DohSession::wantRead() const {
+    return nghttp2_session_want_read(mSession);
+}
+
+void DohSession::complete(Stream& stream, bool ok) {
+    std::vector<uint8_t> response;
+    if (ok) {
+        response = std::move(stream.response);
+    } else {
+        // Turn the query into a SERVFAIL response, which matches the question.
+        response = std::move(stream.query);
+        response[2] |= 0x80;  // QR
+        response[3] = (response[3] & 0xf0) | kServfail;
+    }
+    response[0] = stream.id >> 8;
+    response[1] = stream.id;
+    mCallback(std::move(response));
+}
+
+}  // namespace net
+}  // namespace android
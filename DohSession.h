@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <netdutils/Slice.h>
+
+typedef struct nghttp2_session nghttp2_session;
+
+namespace android {
+namespace net {
+
+// The client side of an HTTP/2 connection carrying DNS-over-HTTPS (RFC 8484) queries.
+// Each query is POSTed on a stream of its own, so that a slow or lost response doesn't hold up
+// the others.  This class only deals with bytes: the caller moves them between the session and
+// the TLS connection, which has to have negotiated the "h2" protocol with ALPN.
+// Not thread-safe.
+class DohSession {
+  public:
+    // Called with each response.  Its ID is the one of the query, although the query is sent
+    // with ID 0 as RFC 8484 recommends.  A query which failed at the HTTP level is answered
+    // with SERVFAIL.
+    using ResponseCallback = std::function<void(std::vector<uint8_t> response)>;
+
+    // |authority| and |path| make up the URI of the endpoint, https://authority/path.
+    DohSession(const std::string& authority, const std::string& path, ResponseCallback callback);
+    ~DohSession();
+
+    DohSession(const DohSession&) = delete;
+    DohSession& operator=(const DohSession&) = delete;
+
+    // Sets up the session, and queues the connection preface.  Returns false on failure.
+    bool initialize();
+
+    // Returns true if the server accepts one more concurrent stream, and hasn't announced that
+    // it is closing the connection.
+    bool canSubmit() const;
+
+    // Queues |query|, a complete DNS message, on a new stream.  Returns false on failure.
+    bool submit(const netdutils::Slice query);
+
+    // Appends the bytes to send to the server to |out|, stopping once it holds at least |limit|
+    // bytes.  Returns false if the connection is broken.
+    bool send(std::vector<uint8_t>* out, size_t limit);
+
+    // Processes |data| received from the server.  Returns false if the connection is broken.
+    bool receive(const netdutils::Slice data);
+
+    // Return true if the session has something to send, or expects something from the server.
+    // Once both are false, the connection is over, e.g. after a GOAWAY from the server.
+    bool wantWrite() const;
+    bool wantRead() const;
+
+    // Number of streams waiting for a response.
+    size_t activeStreams() const { return mStreams.size(); }
+
+    // Limit on concurrent streams on top of the server's, which is often unlimited.  That's
+    // the minimum an HTTP/2 server should allow, according to RFC 7540 section 6.5.2.
+    static constexpr size_t kMaxConcurrentStreams = 100;
+
+  private:
+    struct Stream {
+        uint16_t id;
+        // The query, with ID 0.
+        std::vector<uint8_t> query;
+        size_t sent = 0;
+        int status = 0;
+        bool isDnsMessage = false;
+        std::vector<uint8_t> response;
+    };
+
+    // Answers the query on |stream| with its response, or with SERVFAIL if there is no usable
+    // response.
+    void complete(Stream& stream, bool ok);
+
+    // The nghttp2 callbacks, which are given the DohSession as user data.
+    struct Callbacks;
+    friend struct Callbacks;
+
+    const std::string mAuthority;
+    const std::string mPath;
+    const ResponseCallback mCallback;
+    nghttp2_session* mSession = nullptr;
+    // Streams waiting for a response, by stream ID.
+    std::map<int32_t, Stream> mStreams;
+};
+
+}  // namespace net
+}  // namespace android
@@ -60,6 +60,9 @@ void Experiments::updateInternal() {
     for (const auto& key : kExperimentFlagKeyList) {
         mFlagsMapInt[key] = mGetExperimentFlagIntFunction(key, Experiments::kFlagIntDefault);
     }
+    const int tracing = mFlagsMapInt["query_stage_tracing"];
+    mQueryStageTracing.store(tracing != Experiments::kFlagIntDefault && tracing != 0,
+                             std::memory_order_relaxed);
 }
 
 int Experiments::getFlag(std::string_view key, int defaultValue) const {
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <climits>
 #include <mutex>
 #include <string>
@@ -34,6 +35,11 @@ class Experiments {
     using GetExperimentFlagIntFunction = std::function<int(const std::string&, int)>;
     static Experiments* getInstance();
     int getFlag(std::string_view key, int defaultValue) const EXCLUDES(mMutex);
+    // Same as getFlag("query_stage_tracing", 0) != 0, but without taking the lock, since it is
+    // checked for every request.
+    bool isQueryStageTracingEnabled() const {
+        return mQueryStageTracing.load(std::memory_order_relaxed);
+    }
     void update();
     void dump(netdutils::DumpWriter& dw) const EXCLUDES(mMutex);
 
@@ -46,10 +52,16 @@ class Experiments {
     void updateInternal() EXCLUDES(mMutex);
     mutable std::mutex mMutex;
     std::unordered_map<std::string_view, int> mFlagsMapInt GUARDED_BY(mMutex);
+    // Refreshed along with mFlagsMapInt.
+    std::atomic<bool> mQueryStageTracing = false;
     // TODO: Migrate other experiment flags to here.
     // (retry_count, retransmission_time_interval, dot_connect_timeout_ms)
     static constexpr const char* const kExperimentFlagKeyList[] = {
-            "keep_listening_udp", "parallel_lookup", "parallel_lookup_sleep_time"};
+            "keep_listening_udp", "parallel_lookup", "parallel_lookup_sleep_time",
+            "lookup_coalescing", "dot_race_mode", "dot_race_max_parallel",
+            "dot_early_data", "dot_idle_timeout_min_ms", "dot_idle_timeout_max_ms",
+            "dot_keepalive_idle_s", "dot_fast_open", "tcp_fast_open", "query_stage_tracing",
+            "lookup_deadline_msec"};
     // This value is used in updateInternal as the default value if any flags can't be found.
     static constexpr int kFlagIntDefault = INT_MIN;
     // For testing.
@@ -137,6 +137,17 @@ TEST_F(ExperimentsTest, getDnsExperimentFlagIntDefaultValue) {
     }
 }
 
+TEST_F(ExperimentsTest, queryStageTracing) {
+    sFakeFlagsMapInt.clear();
+    mExperiments.update();
+    EXPECT_FALSE(mExperiments.isQueryStageTracingEnabled());
+    for (int testValue : {1, 0, 5}) {
+        setupFakeMap(testValue);
+        mExperiments.update();
+        EXPECT_EQ(testValue != 0, mExperiments.isQueryStageTracingEnabled());
+    }
+}
+
 TEST_F(ExperimentsTest, dump) {
     std::vector<int> testValues = {100, 37, 0, 30};
     for (int testValue : testValues) {
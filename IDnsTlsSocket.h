@@ -39,6 +39,7 @@ class IDnsTlsSocket {
     // the query is actually sent.  If this function fails, the observer will be
     // notified that the socket is closed.
     // Note that a true return value indicates successful sending, not receipt of a response.
+    // |query| is copied, so it only has to stay valid until this returns.
     virtual bool query(uint16_t id, const netdutils::Slice query) = 0;
 };
 
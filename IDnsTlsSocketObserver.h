@@ -17,6 +17,9 @@
 #ifndef _DNS_IDNSTLSSOCKETOBSERVER_H
 #define _DNS_IDNSTLSSOCKETOBSERVER_H
 
+#include <chrono>
+#include <vector>
+
 namespace android {
 namespace net {
 
@@ -29,7 +32,15 @@ class IDnsTlsSocketObserver {
     virtual ~IDnsTlsSocketObserver(){};
     virtual void onResponse(std::vector<uint8_t> response) = 0;
 
-    virtual void onClosed() = 0;
+    // |error| is false if the connection was closed in an orderly way, e.g. for being idle or
+    // by the server between responses, and true if it broke.
+    virtual void onClosed(bool error) = 0;
+
+    // Returns how long the socket may stay idle before it is closed.  It is asked again each
+    // time the socket goes idle, so that it can follow the query rate.
+    virtual std::chrono::milliseconds getIdleTimeout() const { return kDefaultIdleTimeout; }
+
+    static constexpr std::chrono::milliseconds kDefaultIdleTimeout{20000};
 };
 
 }  // namespace net
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace android {
+namespace net {
+
+// A histogram of latencies with log-linear buckets: latencies under 2 * kSubBuckets microseconds
+// have a bucket each, and each power of two above is split into kSubBuckets buckets of the same
+// width.  Percentiles are thus off by at most 1 / (2 * kSubBuckets), about 3%, whatever the
+// scale, and adding or removing a latency takes constant time and doesn't allocate.
+// Latencies of kMaxLatency or more fall into the last bucket.  Not thread-safe.
+class LatencyHistogram {
+  public:
+    void add(std::chrono::microseconds latency) {
+        mBuckets[bucketOf(latency)]++;
+        mCount++;
+    }
+
+    // Removes a latency which was added before.
+    void remove(std::chrono::microseconds latency) {
+        mBuckets[bucketOf(latency)]--;
+        mCount--;
+    }
+
+    void clear() {
+        mBuckets = {};
+        mCount = 0;
+    }
+
+    int count() const { return mCount; }
+
+    // Returns the latency which |percent|% of the latencies don't exceed, as the middle of its
+    // bucket.  Returns 0 if there are no latencies.
+    std::chrono::microseconds percentile(double percent) const {
+        if (mCount == 0) return std::chrono::microseconds(0);
+        const int64_t rank = std::max<int64_t>(std::ceil(mCount * percent / 100), 1);
+        int64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; i++) {
+            seen += mBuckets[i];
+            if (seen >= rank) return middleOf(i);
+        }
+        return middleOf(kBucketCount - 1);
+    }
+
+    static constexpr int kSubBucketBits = 4;
+    static constexpr int64_t kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kMaxLatencyBits = 27;
+    static constexpr std::chrono::microseconds kMaxLatency{int64_t(1) << kMaxLatencyBits};
+    static constexpr size_t kBucketCount = (kMaxLatencyBits + 1 - kSubBucketBits) * kSubBuckets;
+
+  private:
+    static size_t bucketOf(std::chrono::microseconds latency) {
+        const int64_t us = std::clamp<int64_t>(latency.count(), 0, kMaxLatency.count() - 1);
+        if (us < 2 * kSubBuckets) return us;
+        const int log2 = 63 - __builtin_clzll(us);
+        return (log2 - kSubBucketBits) * kSubBuckets + (us >> (log2 - kSubBucketBits));
+    }
+
+    static std::chrono::microseconds middleOf(size_t bucket) {
+        if (bucket < 2 * kSubBuckets) return std::chrono::microseconds(bucket);
+        const int shift = bucket / kSubBuckets - 1;
+        const int64_t lowest = (kSubBuckets + bucket % kSubBuckets) << shift;
+        return std::chrono::microseconds(lowest + ((int64_t(1) << shift) >> 1));
+    }
+
+    std::array<uint32_t, kBucketCount> mBuckets = {};
+    int mCount = 0;
+};
+
+}  // namespace net
+}  // namespace android
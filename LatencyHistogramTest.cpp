@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "LatencyHistogram.h"
+
+namespace android::net {
+
+using std::chrono::microseconds;
+
+TEST(LatencyHistogramTest, Empty) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(0, histogram.count());
+    EXPECT_EQ(microseconds(0), histogram.percentile(50));
+}
+
+TEST(LatencyHistogramTest, SmallLatenciesAreExact) {
+    LatencyHistogram histogram;
+    for (int us = 0; us < 2 * LatencyHistogram::kSubBuckets; us++) {
+        histogram.add(microseconds(us));
+    }
+    EXPECT_EQ(microseconds(0), histogram.percentile(0));
+    EXPECT_EQ(microseconds(15), histogram.percentile(50));
+    EXPECT_EQ(microseconds(31), histogram.percentile(100));
+}
+
+TEST(LatencyHistogramTest, RelativeError) {
+    // Whatever the scale, a single latency comes back within the width of its bucket.
+    for (int64_t us = 1; us < LatencyHistogram::kMaxLatency.count(); us = us * 3 / 2 + 1) {
+        LatencyHistogram histogram;
+        histogram.add(microseconds(us));
+        const int64_t error = std::abs(histogram.percentile(50).count() - us);
+        EXPECT_LE(error, us / (2 * LatencyHistogram::kSubBuckets)) << us;
+    }
+
+    // Latencies which are too large fall into the last bucket.
+    LatencyHistogram histogram;
+    histogram.add(std::chrono::hours(1));
+    EXPECT_LT(histogram.percentile(50), LatencyHistogram::kMaxLatency);
+    EXPECT_GT(histogram.percentile(50), LatencyHistogram::kMaxLatency * 15 / 16);
+}
+
+TEST(LatencyHistogramTest, Percentiles) {
+    LatencyHistogram histogram;
+    for (int i = 1; i <= 1000; i++) {
+        histogram.add(microseconds(i * 1000));
+    }
+    for (const int percent : {1, 10, 50, 90, 99}) {
+        const int64_t expected = percent * 10 * 1000;
+        EXPECT_NEAR(expected, histogram.percentile(percent).count(),
+                    expected / LatencyHistogram::kSubBuckets)
+                << percent;
+    }
+
+    // Removing latencies leaves the others.
+    for (int i = 1; i <= 500; i++) {
+        histogram.remove(microseconds(i * 1000));
+    }
+    EXPECT_EQ(500, histogram.count());
+    EXPECT_NEAR(750000, histogram.percentile(50).count(), 750000 / LatencyHistogram::kSubBuckets);
+
+    histogram.clear();
+    EXPECT_EQ(0, histogram.count());
+    EXPECT_EQ(microseconds(0), histogram.percentile(50));
+}
+
+}  // namespace android::net
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// LookupCoalescer lets concurrent callers that ask for the same Key share a single lookup.
+// The first caller (the leader) runs the lookup; callers arriving while it is in flight block
+// until it finishes, or until they give up, and then get the same immutable result. Nothing is
+// kept once the leader is done, so this is not a cache: a later caller with the same Key runs a
+// new lookup.
+//
+// Result must be default-constructible. It is filled in place and never moved, so it may hold
+// pointers into itself (e.g. a hostent pointing into its own buffer).
+template <typename Key, typename Result>
+class LookupCoalescer {
+  public:
+    using ResultPtr = std::shared_ptr<const Result>;
+    using LookupFunction = std::function<void(Result*)>;
+
+    // Returns the result of |lookup| for |key|. If a lookup for the same key is already in flight,
+    // |lookup| is not called; the in-flight result is returned and |*coalesced| is set to true.
+    //
+    // A caller waiting for the in-flight lookup gives up and gets nullptr once |deadline| passes,
+    // or once |shouldStop|, polled every kStopCheckInterval, returns true. The lookup carries on
+    // for the other callers.
+    ResultPtr run(const Key& key, const LookupFunction& lookup,
+                  std::chrono::steady_clock::time_point deadline,
+                  const std::function<bool()>& shouldStop = nullptr, bool* coalesced = nullptr)
+            EXCLUDES(mMutex) {
+        std::shared_ptr<InFlight> flight;
+        bool isLeader = false;
+        {
+            std::lock_guard guard(mMutex);
+            auto& slot = mInFlight[key];
+            if (slot == nullptr) {
+                slot = std::make_shared<InFlight>();
+                isLeader = true;
+            }
+            flight = slot;
+        }
+        if (coalesced != nullptr) *coalesced = !isLeader;
+
+        if (!isLeader) return waitForLeader(*flight, deadline, shouldStop);
+
+        auto result = std::make_shared<Result>();
+        lookup(result.get());
+        {
+            std::lock_guard guard(mMutex);
+            flight->result = std::move(result);
+            mInFlight.erase(key);
+            mLeaderCount++;
+        }
+        mCv.notify_all();
+        return flight->result;
+    }
+
+    // The number of lookups which were actually run.
+    uint64_t leaderCount() const EXCLUDES(mMutex) {
+        std::lock_guard guard(mMutex);
+        return mLeaderCount;
+    }
+
+    // The number of callers which were served by another caller's lookup.
+    uint64_t coalescedCount() const EXCLUDES(mMutex) {
+        std::lock_guard guard(mMutex);
+        return mCoalescedCount;
+    }
+
+    // The number of callers which gave up waiting for another caller's lookup.
+    uint64_t abandonedCount() const EXCLUDES(mMutex) {
+        std::lock_guard guard(mMutex);
+        return mAbandonedCount;
+    }
+
+    static constexpr std::chrono::milliseconds kStopCheckInterval{100};
+
+  private:
+    struct InFlight {
+        // Set by the leader exactly once, and never modified afterwards.
+        ResultPtr result;
+    };
+
+    ResultPtr waitForLeader(const InFlight& flight, std::chrono::steady_clock::time_point deadline,
+                            const std::function<bool()>& shouldStop) EXCLUDES(mMutex) {
+        std::unique_lock lock(mMutex);
+        android::base::ScopedLockAssertion assume_lock(mMutex);
+        while (flight.result == nullptr) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) break;
+            if (mCv.wait_until(lock, std::min(deadline, now + kStopCheckInterval)) ==
+                        std::cv_status::timeout &&
+                shouldStop) {
+                // Don't hold up the leader and the other callers while polling.
+                lock.unlock();
+                const bool stop = shouldStop();
+                lock.lock();
+                if (stop && flight.result == nullptr) break;
+            }
+        }
+        if (flight.result == nullptr) {
+            mAbandonedCount++;
+            return nullptr;
+        }
+        mCoalescedCount++;
+        return flight.result;
+    }
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCv;
+    std::map<Key, std::shared_ptr<InFlight>> mInFlight GUARDED_BY(mMutex);
+    uint64_t mLeaderCount GUARDED_BY(mMutex) = 0;
+    uint64_t mCoalescedCount GUARDED_BY(mMutex) = 0;
+    uint64_t mAbandonedCount GUARDED_BY(mMutex) = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "LookupCoalescer.h"
+
+using namespace std::chrono_literals;
+
+namespace android::net {
+
+namespace {
+
+struct TestResult {
+    int value = 0;
+};
+
+}  // namespace
+
+class LookupCoalescerTest : public ::testing::Test {
+  protected:
+    LookupCoalescer<std::string, TestResult> mCoalescer;
+    const std::chrono::steady_clock::time_point mDeadline = std::chrono::steady_clock::now() + 10s;
+};
+
+TEST_F(LookupCoalescerTest, SequentialLookupsAreNotShared) {
+    int calls = 0;
+    const auto lookup = [&calls](TestResult* r) { r->value = ++calls; };
+
+    bool coalesced = true;
+    EXPECT_EQ(1, mCoalescer.run("example.com", lookup, mDeadline, nullptr, &coalesced)->value);
+    EXPECT_FALSE(coalesced);
+    EXPECT_EQ(2, mCoalescer.run("example.com", lookup, mDeadline, nullptr, &coalesced)->value);
+    EXPECT_FALSE(coalesced);
+    EXPECT_EQ(2U, mCoalescer.leaderCount());
+    EXPECT_EQ(0U, mCoalescer.coalescedCount());
+}
+
+TEST_F(LookupCoalescerTest, ConcurrentLookupsAreShared) {
+    constexpr int kThreadNum = 10;
+    std::atomic<int> calls = 0;
+    std::atomic<bool> release = false;
+    std::atomic<int> waiting = 0;
+
+    // The leader blocks until all the other threads have started, so they have to join it.
+    std::thread leader([&]() {
+        mCoalescer.run(
+                "example.com",
+                [&](TestResult* r) {
+                    calls++;
+                    while (!release) std::this_thread::sleep_for(1ms);
+                    r->value = 42;
+                },
+                mDeadline);
+    });
+    while (calls == 0) std::this_thread::sleep_for(1ms);
+
+    std::vector<std::thread> threads(kThreadNum);
+    for (auto& thread : threads) {
+        thread = std::thread([&]() {
+            bool coalesced = false;
+            waiting++;
+            const auto result = mCoalescer.run(
+                    "example.com", [&](TestResult*) { calls++; }, mDeadline, nullptr, &coalesced);
+            EXPECT_TRUE(coalesced);
+            EXPECT_EQ(42, result->value);
+        });
+    }
+    while (waiting < kThreadNum) std::this_thread::sleep_for(1ms);
+    // Give the followers a chance to block on the in-flight lookup.
+    std::this_thread::sleep_for(50ms);
+    release = true;
+
+    leader.join();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ(1U, mCoalescer.leaderCount());
+    EXPECT_EQ(static_cast<uint64_t>(kThreadNum), mCoalescer.coalescedCount());
+}
+
+TEST_F(LookupCoalescerTest, DifferentKeysAreNotShared) {
+    std::atomic<bool> release = false;
+    std::atomic<bool> started = false;
+
+    std::thread leader([&]() {
+        mCoalescer.run(
+                "example.com",
+                [&](TestResult* r) {
+                    started = true;
+                    while (!release) std::this_thread::sleep_for(1ms);
+                    r->value = 1;
+                },
+                mDeadline);
+    });
+    while (!started) std::this_thread::sleep_for(1ms);
+
+    // A lookup for another key must not wait for the in-flight one.
+    bool coalesced = true;
+    const auto result =
+            mCoalescer.run("example.org", [](TestResult* r) { r->value = 2; }, mDeadline, nullptr,
+                           &coalesced);
+    EXPECT_FALSE(coalesced);
+    EXPECT_EQ(2, result->value);
+
+    release = true;
+    leader.join();
+    EXPECT_EQ(2U, mCoalescer.leaderCount());
+}
+
+TEST_F(LookupCoalescerTest, FollowersGiveUp) {
+    std::atomic<bool> release = false;
+    std::atomic<bool> started = false;
+
+    std::thread leader([&]() {
+        const auto result = mCoalescer.run(
+                "example.com",
+                [&](TestResult* r) {
+                    started = true;
+                    while (!release) std::this_thread::sleep_for(1ms);
+                    r->value = 42;
+                },
+                mDeadline);
+        // The leader still gets its answer after the followers have left.
+        EXPECT_EQ(42, result->value);
+    });
+    while (!started) std::this_thread::sleep_for(1ms);
+
+    // A follower stops waiting at its deadline.
+    bool coalesced = false;
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(nullptr,
+              mCoalescer.run("example.com", [](TestResult*) {}, start + 50ms, nullptr, &coalesced));
+    EXPECT_TRUE(coalesced);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 50ms);
+
+    // Or as soon as it is asked to stop.
+    std::atomic<int> checks = 0;
+    start = std::chrono::steady_clock::now();
+    EXPECT_EQ(nullptr, mCoalescer.run(
+                               "example.com", [](TestResult*) {}, mDeadline,
+                               [&checks]() { return ++checks == 2; }, &coalesced));
+    EXPECT_TRUE(coalesced);
+    EXPECT_EQ(2, checks);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 1s);
+
+    release = true;
+    leader.join();
+    EXPECT_EQ(1U, mCoalescer.leaderCount());
+    EXPECT_EQ(0U, mCoalescer.coalescedCount());
+    EXPECT_EQ(2U, mCoalescer.abandonedCount());
+}
+
+}  // namespace android::net
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace android {
+namespace net {
+
+// A bounded lock-free queue for any number of producer threads and a single consumer thread.
+// Items live in preallocated slots, which are filled in place by the producers and swapped out
+// by the consumer, so that neither side has to allocate if the consumer hands back buffers it
+// is done with.
+// Each slot carries a sequence number which tells whose turn it is: producers claim slots by
+// advancing mTail, and publish them by bumping the sequence; the consumer releases them for the
+// next round.  See Dmitry Vyukov's bounded MPMC queue, of which this is the single-consumer
+// case.
+template <typename T, size_t N>
+class MpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "The capacity must be a power of 2");
+
+  public:
+    MpscRing() {
+        for (size_t i = 0; i < N; i++) {
+            mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Calls |init| on the item of each slot, e.g. to reserve buffers.
+    template <typename Init>
+    explicit MpscRing(Init init) : MpscRing() {
+        for (Slot& slot : mSlots) init(slot.item);
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    // Claims a slot, and calls |fill| on its item.  Returns false without calling |fill| if the
+    // ring is full.  Thread-safe.
+    template <typename Fill>
+    bool push(Fill&& fill) {
+        size_t pos = mTail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &mSlots[pos % N];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (mTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                // The slot still holds the item of the previous round.
+                return false;
+            } else {
+                // Another producer claimed the slot first.
+                pos = mTail.load(std::memory_order_relaxed);
+            }
+        }
+        fill(slot->item);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Swaps the oldest item with |*item|, which leaves the previous contents of |*item| in the
+    // slot for reuse.  Returns false if the ring is empty, or if the oldest item is still being
+    // filled; it is then found by a later call.  Must only be called by the consumer thread.
+    bool pop(T* item) {
+        Slot& slot = mSlots[mHead % N];
+        if (slot.sequence.load(std::memory_order_acquire) != mHead + 1) return false;
+        std::swap(slot.item, *item);
+        slot.sequence.store(mHead + N, std::memory_order_release);
+        mHead++;
+        return true;
+    }
+
+    static constexpr size_t capacity() { return N; }
+
+  private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    std::array<Slot, N> mSlots;
+    // Producers and the consumer are kept on separate cache lines.
+    alignas(64) std::atomic<size_t> mTail = 0;
+    alignas(64) size_t mHead = 0;
+};
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "MpscRing.h"
+
+namespace android::net {
+
+TEST(MpscRingTest, Basic) {
+    MpscRing<int, 4> ring;
+    int item = 0;
+    EXPECT_FALSE(ring.pop(&item));
+
+    for (int i = 1; i <= 4; i++) {
+        EXPECT_TRUE(ring.push([i](int& slot) { slot = i; }));
+    }
+    // Full: the item is not filled.
+    EXPECT_FALSE(ring.push([](int&) { FAIL() << "Filled a slot of a full ring"; }));
+
+    // Items come out in order, and each pop makes room for one more push.
+    EXPECT_TRUE(ring.pop(&item));
+    EXPECT_EQ(1, item);
+    EXPECT_TRUE(ring.push([](int& slot) { slot = 5; }));
+    for (int i = 2; i <= 5; i++) {
+        EXPECT_TRUE(ring.pop(&item));
+        EXPECT_EQ(i, item);
+    }
+    EXPECT_FALSE(ring.pop(&item));
+}
+
+TEST(MpscRingTest, BuffersAreReused) {
+    MpscRing<std::vector<uint8_t>, 2> ring(
+            [](std::vector<uint8_t>& buffer) { buffer.reserve(64); });
+    ASSERT_TRUE(ring.push([](std::vector<uint8_t>& buffer) {
+        EXPECT_GE(buffer.capacity(), 64U);
+        buffer.assign({1, 2, 3});
+    }));
+
+    // The consumer gets the buffer of the slot, and leaves its own in exchange.
+    std::vector<uint8_t> spare;
+    spare.reserve(128);
+    const uint8_t* const spareData = spare.data();
+    ASSERT_TRUE(ring.pop(&spare));
+    EXPECT_EQ(std::vector<uint8_t>({1, 2, 3}), spare);
+
+    ASSERT_TRUE(ring.push([](std::vector<uint8_t>&) {}));
+    ASSERT_TRUE(ring.push([spareData](std::vector<uint8_t>& buffer) {
+        EXPECT_EQ(spareData, buffer.data());
+    }));
+}
+
+TEST(MpscRingTest, ConcurrentProducers) {
+    constexpr int kProducers = 8;
+    constexpr int kItemsPerProducer = 10000;
+    MpscRing<int, 64> ring;
+
+    std::atomic<bool> start = false;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&ring, &start, p] {
+            while (!start) std::this_thread::yield();
+            for (int i = 0; i < kItemsPerProducer; i++) {
+                const int value = p * kItemsPerProducer + i;
+                while (!ring.push([value](int& slot) { slot = value; })) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    start = true;
+
+    // Every item comes out exactly once, and the items of each producer come out in order.
+    std::vector<int> next(kProducers, 0);
+    int received = 0;
+    while (received < kProducers * kItemsPerProducer) {
+        int value = 0;
+        if (!ring.pop(&value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        const int producer = value / kItemsPerProducer;
+        EXPECT_EQ(next[producer], value % kItemsPerProducer);
+        next[producer]++;
+        received++;
+    }
+    for (auto& producer : producers) producer.join();
+    int value = 0;
+    EXPECT_FALSE(ring.pop(&value));
+}
+
+}  // namespace android::net
@@ -19,20 +19,19 @@
 #include "PrivateDnsConfiguration.h"
 
 #include <android-base/logging.h>
-#include <android-base/stringprintf.h>
 #include <netdb.h>
-#include <netdutils/ThreadUtil.h>
 #include <sys/socket.h>
 
-#include "DnsTlsTransport.h"
+#include "DnsTlsDispatcher.h"
 #include "ResolverEventReporter.h"
+#include "TaskScheduler.h"
 #include "netd_resolv/resolv.h"
 #include "netdutils/BackoffSequence.h"
 #include "resolv_cache.h"
 #include "util.h"
 
-using android::base::StringPrintf;
-using android::netdutils::setThreadName;
+using android::base::ScopedLockAssertion;
+using android::netdutils::IPSockAddr;
 using std::chrono::milliseconds;
 
 namespace android {
@@ -72,6 +71,39 @@ bool parseServer(const char* server, sockaddr_storage* parsed) {
     return true;
 }
 
+namespace {
+
+// Public resolvers which serve DNS-over-HTTPS at https://<address or name>/dns-query, on the
+// addresses where they serve DNS-over-TLS.
+constexpr const char* kDohProviders[] = {
+        // Google Public DNS
+        "8.8.8.8", "8.8.4.4", "2001:4860:4860::8888", "2001:4860:4860::8844",
+        // Cloudflare
+        "1.1.1.1", "1.0.0.1", "2606:4700:4700::1111", "2606:4700:4700::1001",
+};
+constexpr char kDohPath[] = "/dns-query";
+constexpr uint16_t kDohPort = 443;
+
+// Switches |server| to DNS-over-HTTPS if it is one of kDohProviders.
+void useDohIfKnown(DnsTlsServer* server) {
+    const AddressComparator less;
+    for (const char* provider : kDohProviders) {
+        DnsTlsServer known;
+        if (!parseServer(provider, &known.ss)) continue;
+        if (less(*server, known) || less(known, *server)) continue;
+
+        server->dohPath = kDohPath;
+        if (server->ss.ss_family == AF_INET) {
+            reinterpret_cast<sockaddr_in*>(&server->ss)->sin_port = htons(kDohPort);
+        } else {
+            reinterpret_cast<sockaddr_in6*>(&server->ss)->sin6_port = htons(kDohPort);
+        }
+        return;
+    }
+}
+
+}  // namespace
+
 int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
                                  const std::vector<std::string>& servers, const std::string& name,
                                  const std::string& caCert) {
@@ -79,6 +111,7 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
                << ", " << servers.size() << ", " << name << ")";
 
     // Parse the list of servers that has been passed in
+    const bool dohEnabled = getExperimentFlagInt("doh", 0);
     std::set<DnsTlsServer> tlsServers;
     for (const auto& s : servers) {
         sockaddr_storage parsed;
@@ -90,11 +123,16 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
         server.certificate = caCert;
         server.connectTimeout =
                 getExperimentTimeout("dot_connect_timeout_ms", DnsTlsServer::kDotConnectTimeoutMs);
+        if (dohEnabled) {
+            useDohIfKnown(&server);
+        }
         tlsServers.insert(server);
         LOG(DEBUG) << "Set DoT connect timeout " << server.connectTimeout.count() << "ms for " << s;
     }
 
     std::lock_guard guard(mPrivateDnsLock);
+    // Queries waiting for a validated server have to re-check the mode and the servers.
+    notifyWaiters(netId);
     if (!name.empty()) {
         mPrivateDnsModes[netId] = PrivateDnsMode::STRICT;
     } else if (!tlsServers.empty()) {
@@ -102,12 +140,11 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
     } else {
         mPrivateDnsModes[netId] = PrivateDnsMode::OFF;
         mPrivateDnsTransports.erase(netId);
+        publishStatus(netId);
         resolv_stats_set_servers_for_dot(netId, {});
         mPrivateDnsValidateThreads.erase(netId);
-        // TODO: As mPrivateDnsValidateThreads is reset, validation threads which haven't yet
-        // finished are considered outdated. Consider signaling the outdated validation threads to
-        // stop them from updating the state of PrivateDnsConfiguration (possibly disallow them to
-        // report onPrivateDnsValidationEvent).
+        // Validations in progress complete, but aren't retried.
+        TaskScheduler::getInstance()->cancel(netId, kValidationTaskTag);
         return 0;
     }
 
@@ -140,32 +177,95 @@ int PrivateDnsConfiguration::set(int32_t netId, uint32_t mark,
         }
     }
 
-    return resolv_stats_set_servers_for_dot(netId, servers);
+    publishStatus(netId);
+    // Register the servers on the port they are queried on, or the stats of the ones switched to
+    // DNS-over-HTTPS would be dropped.
+    std::vector<IPSockAddr> statsServers;
+    statsServers.reserve(tlsServers.size());
+    for (const auto& server : tlsServers) {
+        statsServers.push_back(IPSockAddr::toIPSockAddr(server.ss));
+    }
+    return resolv_stats_set_servers_for_dot(netId, statsServers);
 }
 
-PrivateDnsStatus PrivateDnsConfiguration::getStatus(unsigned netId) {
-    PrivateDnsStatus status{PrivateDnsMode::OFF, {}};
-    std::lock_guard guard(mPrivateDnsLock);
+std::shared_ptr<const PrivateDnsStatus> PrivateDnsConfiguration::getStatus(unsigned netId) const {
+    static const auto* const kOff = new std::shared_ptr<const PrivateDnsStatus>(
+            std::make_shared<const PrivateDnsStatus>(PrivateDnsMode::OFF, PrivateDnsTracker()));
+
+    const auto statuses = std::atomic_load(&mStatuses);
+    const auto it = statuses->find(netId);
+    return (it == statuses->end()) ? *kOff : it->second;
+}
+
+void PrivateDnsConfiguration::publishStatus(unsigned netId) {
+    auto statuses = std::make_shared<StatusMap>(*mStatuses);
+    const auto mode = mPrivateDnsModes.find(netId);
+    if (mode == mPrivateDnsModes.end()) {
+        statuses->erase(netId);
+    } else {
+        const auto netPair = mPrivateDnsTransports.find(netId);
+        (*statuses)[netId] = std::make_shared<const PrivateDnsStatus>(
+                mode->second, (netPair == mPrivateDnsTransports.end()) ? PrivateDnsTracker()
+                                                                       : netPair->second);
+    }
+    std::atomic_store(&mStatuses, std::shared_ptr<const StatusMap>(std::move(statuses)));
+}
+
+std::shared_ptr<const PrivateDnsStatus> PrivateDnsConfiguration::waitForValidatedServer(
+        unsigned netId, milliseconds timeout, const std::function<bool()>& shouldStop) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    {
+        std::unique_lock lock(mPrivateDnsLock);
+        ScopedLockAssertion assume_lock(mPrivateDnsLock);
+        auto& waiters = mStrictModeWaiters[netId];
+        if (waiters.count >= kMaxStrictModeWaiters) {
+            LOG(WARNING) << "Too many queries waiting for private DNS validation on netId "
+                         << netId;
+        } else {
+            waiters.count++;
+            while (isAwaitingValidation(netId)) {
+                const auto now = std::chrono::steady_clock::now();
+                if (now >= deadline) break;
+                if (waiters.cv.wait_until(lock, std::min(deadline, now + kStopCheckInterval)) ==
+                    std::cv_status::timeout) {
+                    // Don't hold up validation and the other queries while polling.
+                    lock.unlock();
+                    const bool stop = shouldStop();
+                    lock.lock();
+                    if (stop) break;
+                }
+            }
+            waiters.count--;
+        }
+        if (waiters.count == 0) mStrictModeWaiters.erase(netId);
+    }
+    return getStatus(netId);
+}
 
+bool PrivateDnsConfiguration::isAwaitingValidation(unsigned netId) {
     const auto mode = mPrivateDnsModes.find(netId);
-    if (mode == mPrivateDnsModes.end()) return status;
-    status.mode = mode->second;
+    if (mode == mPrivateDnsModes.end() || mode->second != PrivateDnsMode::STRICT) return false;
 
     const auto netPair = mPrivateDnsTransports.find(netId);
-    if (netPair != mPrivateDnsTransports.end()) {
-        for (const auto& serverPair : netPair->second) {
-            status.serversMap.emplace(serverPair.first, serverPair.second);
-        }
+    if (netPair == mPrivateDnsTransports.end()) return true;
+    for (const auto& serverPair : netPair->second) {
+        if (serverPair.second == Validation::success) return false;
     }
+    return true;
+}
 
-    return status;
+void PrivateDnsConfiguration::notifyWaiters(unsigned netId) {
+    const auto it = mStrictModeWaiters.find(netId);
+    if (it != mStrictModeWaiters.end()) it->second.cv.notify_all();
 }
 
 void PrivateDnsConfiguration::clear(unsigned netId) {
     LOG(DEBUG) << "PrivateDnsConfiguration::clear(" << netId << ")";
     std::lock_guard guard(mPrivateDnsLock);
+    notifyWaiters(netId);
     mPrivateDnsModes.erase(netId);
     mPrivateDnsTransports.erase(netId);
+    publishStatus(netId);
     mPrivateDnsValidateThreads.erase(netId);
 }
 
@@ -180,50 +280,44 @@ void PrivateDnsConfiguration::validatePrivateDnsProvider(const DnsTlsServer& ser
         return;
     }
 
-    // Note that capturing |server| and |netId| in this lambda create copies.
-    std::thread validate_thread([this, server, netId, mark] {
-        setThreadName(StringPrintf("TlsVerify_%u", netId).c_str());
-
-        // cat /proc/sys/net/ipv4/tcp_syn_retries yields "6".
-        //
-        // Start with a 1 minute delay and backoff to once per hour.
-        //
-        // Assumptions:
-        //     [1] Each TLS validation is ~10KB of certs+handshake+payload.
-        //     [2] Network typically provision clients with <=4 nameservers.
-        //     [3] Average month has 30 days.
-        //
-        // Each validation pass in a given hour is ~1.2MB of data. And 24
-        // such validation passes per day is about ~30MB per month, in the
-        // worst case. Otherwise, this will cost ~600 SYNs per month
-        // (6 SYNs per ip, 4 ips per validation pass, 24 passes per day).
-        auto backoff = netdutils::BackoffSequence<>::Builder()
-                               .withInitialRetransmissionTime(std::chrono::seconds(60))
-                               .withMaximumRetransmissionTime(std::chrono::seconds(3600))
-                               .build();
-
-        while (true) {
-            // ::validate() is a blocking call that performs network operations.
-            // It can take milliseconds to minutes, up to the SYN retry limit.
-            LOG(WARNING) << "Validating DnsTlsServer on netId " << netId;
-            const bool success = DnsTlsTransport::validate(server, netId, mark);
-            LOG(DEBUG) << "validateDnsTlsServer returned " << success << " for "
-                       << addrToString(&server.ss);
-
-            const bool needs_reeval = this->recordPrivateDnsValidation(server, netId, success);
-            if (!needs_reeval) {
-                break;
-            }
+    // cat /proc/sys/net/ipv4/tcp_syn_retries yields "6".
+    //
+    // Start with a 1 minute delay and backoff to once per hour.
+    //
+    // Assumptions:
+    //     [1] Each TLS validation is ~10KB of certs+handshake+payload.
+    //     [2] Network typically provision clients with <=4 nameservers.
+    //     [3] Average month has 30 days.
+    //
+    // Each validation pass in a given hour is ~1.2MB of data. And 24
+    // such validation passes per day is about ~30MB per month, in the
+    // worst case. Otherwise, this will cost ~600 SYNs per month
+    // (6 SYNs per ip, 4 ips per validation pass, 24 passes per day).
+    auto backoff = std::make_shared<netdutils::BackoffSequence<>>(
+            netdutils::BackoffSequence<>::Builder()
+                    .withInitialRetransmissionTime(std::chrono::seconds(60))
+                    .withMaximumRetransmissionTime(std::chrono::seconds(3600))
+                    .build());
 
-            if (backoff.hasNextTimeout()) {
-                std::this_thread::sleep_for(backoff.getNextTimeout());
-            } else {
-                break;
-            }
-        }
-        this->cleanValidateThreadTracker(server, netId);
-    });
-    validate_thread.detach();
+    // Note that capturing |server| and |netId| in this lambda create copies.
+    TaskScheduler::getInstance()->schedule(
+            netId, kValidationTaskTag + addrToString(&server.ss), milliseconds(0),
+            [this, server, netId, mark, backoff]() -> std::optional<milliseconds> {
+                // ::validate() is a blocking call that performs network operations.
+                // It can take milliseconds to minutes, up to the SYN retry limit.
+                LOG(WARNING) << "Validating DnsTlsServer on netId " << netId;
+                const bool success = DnsTlsDispatcher::getInstance().validate(server, netId, mark);
+                LOG(DEBUG) << "validateDnsTlsServer returned " << success << " for "
+                           << addrToString(&server.ss);
+
+                const bool needs_reeval = this->recordPrivateDnsValidation(server, netId, success);
+                if (needs_reeval && backoff->hasNextTimeout()) {
+                    return backoff->getNextTimeout();
+                }
+                this->cleanValidateThreadTracker(server, netId);
+                return std::nullopt;
+            },
+            TaskScheduler::TaskClass::VALIDATION);
 }
 
 bool PrivateDnsConfiguration::recordPrivateDnsValidation(const DnsTlsServer& server, unsigned netId,
@@ -284,6 +378,7 @@ bool PrivateDnsConfiguration::recordPrivateDnsValidation(const DnsTlsServer& ser
 
     if (success) {
         tracker[server] = Validation::success;
+        notifyWaiters(netId);
     } else {
         // Validation failure is expected if a user is on a captive portal.
         // TODO: Trigger a second validation attempt after captive portal login
@@ -291,6 +386,7 @@ bool PrivateDnsConfiguration::recordPrivateDnsValidation(const DnsTlsServer& ser
         tracker[server] = (reevaluationStatus == NEEDS_REEVALUATION) ? Validation::in_process
                                                                      : Validation::fail;
     }
+    publishStatus(netId);
     LOG(WARNING) << "Validation " << (success ? "success" : "failed");
 
     return reevaluationStatus;
@@ -16,8 +16,12 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <vector>
 
@@ -34,20 +38,25 @@ enum class PrivateDnsMode : uint8_t { OFF, OPPORTUNISTIC, STRICT };
 // Validation status of a DNS over TLS server (on a specific netId).
 enum class Validation : uint8_t { in_process, success, fail, unknown_server, unknown_netid };
 
+// An immutable snapshot of the private DNS state of a network.
 struct PrivateDnsStatus {
-    PrivateDnsMode mode;
-    std::map<DnsTlsServer, Validation, AddressComparator> serversMap;
-
-    std::list<DnsTlsServer> validatedServers() const {
-        std::list<DnsTlsServer> servers;
-
-        for (const auto& pair : serversMap) {
+    PrivateDnsStatus(PrivateDnsMode mode,
+                     std::map<DnsTlsServer, Validation, AddressComparator> serversMap)
+        : mode(mode), serversMap(std::move(serversMap)) {
+        for (const auto& pair : this->serversMap) {
             if (pair.second == Validation::success) {
-                servers.push_back(pair.first);
+                mValidatedServers.push_back(pair.first);
             }
         }
-        return servers;
     }
+
+    const PrivateDnsMode mode;
+    const std::map<DnsTlsServer, Validation, AddressComparator> serversMap;
+
+    const std::list<DnsTlsServer>& validatedServers() const { return mValidatedServers; }
+
+  private:
+    std::list<DnsTlsServer> mValidatedServers;
 };
 
 class PrivateDnsConfiguration {
@@ -55,7 +64,17 @@ class PrivateDnsConfiguration {
     int set(int32_t netId, uint32_t mark, const std::vector<std::string>& servers,
             const std::string& name, const std::string& caCert) EXCLUDES(mPrivateDnsLock);
 
-    PrivateDnsStatus getStatus(unsigned netId) EXCLUDES(mPrivateDnsLock);
+    // Returns the current status of |netId|, never null.  This doesn't take mPrivateDnsLock nor
+    // allocate, so it's cheap enough to call for every query.
+    std::shared_ptr<const PrivateDnsStatus> getStatus(unsigned netId) const;
+
+    // Blocks until |netId| has a validated server or is no longer in strict mode, for at most
+    // |timeout|.  |shouldStop| is called every kStopCheckInterval without the lock held, and
+    // ends the wait if it returns true.  Only kMaxStrictModeWaiters threads can wait on one
+    // network at a time; any more return right away.  Returns the status at the end of the wait.
+    std::shared_ptr<const PrivateDnsStatus> waitForValidatedServer(
+            unsigned netId, std::chrono::milliseconds timeout,
+            const std::function<bool()>& shouldStop) EXCLUDES(mPrivateDnsLock);
 
     void clear(unsigned netId) EXCLUDES(mPrivateDnsLock);
 
@@ -77,12 +96,45 @@ class PrivateDnsConfiguration {
     // thread running are marked as being Validation::in_process.
     bool needsValidation(const PrivateDnsTracker& tracker, const DnsTlsServer& server);
 
+    // Builds a new status for |netId| and publishes it for getStatus().  Has to be called after
+    // every change of the mode or the tracker of a network.
+    void publishStatus(unsigned netId) REQUIRES(mPrivateDnsLock);
+
+    // Returns true if |netId| is in strict mode but none of its servers is validated yet.
+    bool isAwaitingValidation(unsigned netId) REQUIRES(mPrivateDnsLock);
+
+    // Wakes up the threads waiting for a validated server on |netId|, if any.
+    void notifyWaiters(unsigned netId) REQUIRES(mPrivateDnsLock);
+
+    // Prefix of the tags of the validation tasks in the TaskScheduler, followed by the address
+    // of the server.
+    static constexpr char kValidationTaskTag[] = "TlsVerify ";
+
+    static constexpr std::chrono::milliseconds kStopCheckInterval{100};
+    static constexpr int kMaxStrictModeWaiters = 64;
+
     std::mutex mPrivateDnsLock;
     std::map<unsigned, PrivateDnsMode> mPrivateDnsModes GUARDED_BY(mPrivateDnsLock);
     // Structure for tracking the validation status of servers on a specific netId.
     // Using the AddressComparator ensures at most one entry per IP address.
     std::map<unsigned, PrivateDnsTracker> mPrivateDnsTransports GUARDED_BY(mPrivateDnsLock);
     std::map<unsigned, ThreadTracker> mPrivateDnsValidateThreads GUARDED_BY(mPrivateDnsLock);
+    // Threads in waitForValidatedServer(), by netId.  |cv| is notified whenever a server of the
+    // network is validated or its configuration changes.  An entry only exists while |count| is
+    // non-zero, and map nodes are stable, so waiters can keep a reference to it.
+    struct StrictModeWaiters {
+        std::condition_variable cv;
+        int count = 0;
+    };
+    std::map<unsigned, StrictModeWaiters> mStrictModeWaiters GUARDED_BY(mPrivateDnsLock);
+
+    // Statuses published by publishStatus(), by netId.  The map is never modified in place:
+    // publishStatus() replaces it with an updated copy, atomically, so that readers need no lock.
+    using StatusMap = std::map<unsigned, std::shared_ptr<const PrivateDnsStatus>>;
+    std::shared_ptr<const StatusMap> mStatuses = std::make_shared<const StatusMap>();
+
+    // For testing.
+    friend class PrivateDnsConfigurationTest;
 };
 
 extern PrivateDnsConfiguration gPrivateDnsConfiguration;
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+
+#include "PrivateDnsConfiguration.h"
+
+using namespace std::chrono_literals;
+using std::chrono::milliseconds;
+
+namespace android::net {
+
+namespace {
+
+constexpr unsigned kNetId = 30;
+constexpr unsigned kOtherNetId = 31;
+
+// Polls |condition| until it holds, for up to |timeout|.
+template <typename Predicate>
+bool waitFor(Predicate condition, milliseconds timeout = 2s) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) return false;
+        std::this_thread::sleep_for(5ms);
+    }
+    return true;
+}
+
+DnsTlsServer makeServer(const char* address) {
+    sockaddr_storage ss = {};
+    auto* sin = reinterpret_cast<sockaddr_in*>(&ss);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(853);
+    EXPECT_EQ(1, inet_pton(AF_INET, address, &sin->sin_addr));
+    DnsTlsServer server(ss);
+    server.name = "dns.example.com";
+    return server;
+}
+
+}  // namespace
+
+class PrivateDnsConfigurationTest : public ::testing::Test {
+  protected:
+    // Puts |netId| in strict mode with |server| being validated, without starting a validation.
+    void setStrictMode(unsigned netId, const DnsTlsServer& server) {
+        std::lock_guard guard(mPdc.mPrivateDnsLock);
+        mPdc.mPrivateDnsModes[netId] = PrivateDnsMode::STRICT;
+        mPdc.mPrivateDnsTransports[netId][server] = Validation::in_process;
+        mPdc.publishStatus(netId);
+    }
+
+    void validate(const DnsTlsServer& server, unsigned netId) {
+        mPdc.recordPrivateDnsValidation(server, netId, true);
+    }
+
+    int waiterCount(unsigned netId) {
+        std::lock_guard guard(mPdc.mPrivateDnsLock);
+        const auto it = mPdc.mStrictModeWaiters.find(netId);
+        return (it == mPdc.mStrictModeWaiters.end()) ? 0 : it->second.count;
+    }
+
+    static constexpr int kMaxStrictModeWaiters = PrivateDnsConfiguration::kMaxStrictModeWaiters;
+
+    PrivateDnsConfiguration mPdc;
+};
+
+TEST_F(PrivateDnsConfigurationTest, WaiterReleasedOnValidation) {
+    const DnsTlsServer server = makeServer("127.0.0.3");
+    setStrictMode(kNetId, server);
+
+    std::atomic<bool> done = false;
+    size_t validatedServers = 0;
+    std::thread waiter([&] {
+        const auto status = mPdc.waitForValidatedServer(kNetId, 10s, [] { return false; });
+        validatedServers = status->validatedServers().size();
+        done = true;
+    });
+    ASSERT_TRUE(waitFor([&] { return waiterCount(kNetId) == 1; }));
+    EXPECT_FALSE(done);
+
+    validate(server, kNetId);
+    EXPECT_TRUE(waitFor([&] { return done.load(); }));
+    waiter.join();
+    EXPECT_EQ(1U, validatedServers);
+    EXPECT_EQ(0, waiterCount(kNetId));
+}
+
+TEST_F(PrivateDnsConfigurationTest, WaiterNotReleasedByOtherNetwork) {
+    const DnsTlsServer server = makeServer("127.0.0.3");
+    const DnsTlsServer otherServer = makeServer("127.0.0.4");
+    setStrictMode(kNetId, server);
+    setStrictMode(kOtherNetId, otherServer);
+
+    std::atomic<bool> done = false;
+    std::thread waiter([&] {
+        mPdc.waitForValidatedServer(kNetId, 10s, [] { return false; });
+        done = true;
+    });
+    ASSERT_TRUE(waitFor([&] { return waiterCount(kNetId) == 1; }));
+
+    validate(otherServer, kOtherNetId);
+    std::this_thread::sleep_for(200ms);
+    EXPECT_FALSE(done);
+    EXPECT_EQ(1, waiterCount(kNetId));
+    EXPECT_EQ(0, waiterCount(kOtherNetId));
+
+    validate(server, kNetId);
+    EXPECT_TRUE(waitFor([&] { return done.load(); }));
+    waiter.join();
+}
+
+TEST_F(PrivateDnsConfigurationTest, TooManyWaiters) {
+    const DnsTlsServer server = makeServer("127.0.0.3");
+    setStrictMode(kNetId, server);
+
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> waiters;
+    for (int i = 0; i < kMaxStrictModeWaiters; i++) {
+        waiters.emplace_back([&] {
+            mPdc.waitForValidatedServer(kNetId, 10s, [&] { return stop.load(); });
+        });
+    }
+    ASSERT_TRUE(waitFor([&] { return waiterCount(kNetId) == kMaxStrictModeWaiters; }));
+
+    // One more waiter is turned away right away, with the status as it is.
+    const auto start = std::chrono::steady_clock::now();
+    const auto status = mPdc.waitForValidatedServer(kNetId, 10s, [] { return false; });
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 1s);
+    EXPECT_EQ(PrivateDnsMode::STRICT, status->mode);
+    EXPECT_TRUE(status->validatedServers().empty());
+    EXPECT_EQ(kMaxStrictModeWaiters, waiterCount(kNetId));
+
+    stop = true;
+    for (auto& waiter : waiters) waiter.join();
+    EXPECT_EQ(0, waiterCount(kNetId));
+}
+
+}  // namespace android::net
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_NETWORK
+
+#include "QueryTrace.h"
+
+#include <atomic>
+#include <iterator>
+
+#include <cutils/trace.h>
+
+#include "Experiments.h"
+
+namespace android {
+namespace net {
+
+using std::chrono::steady_clock;
+
+namespace {
+
+thread_local QueryTrace* sCurrentTrace = nullptr;
+
+std::atomic<int32_t> sNextCookie = 0;
+
+constexpr const char* kQueryStageNames[] = {
+        "handler_start", "query_limiter", "cache_lookup", "socket_setup", "network_rtt",
+        "tls_handshake", "parsing",       "rfc6724_sort", "dns64",        "ipc_write",
+};
+
+static_assert(std::size(kQueryStageNames) == kQueryStageCount);
+
+}  // namespace
+
+const char* queryStageName(QueryStage stage) {
+    return kQueryStageNames[static_cast<size_t>(stage)];
+}
+
+QueryTrace::QueryTrace(bool enabled)
+    : mEnabled(enabled),
+      mDispatched(enabled ? steady_clock::now() : steady_clock::time_point()),
+      mCookie(enabled ? sNextCookie++ : 0) {
+    if (mEnabled) ATRACE_ASYNC_BEGIN(queryStageName(QueryStage::HANDLER_START), mCookie);
+}
+
+// static
+QueryTrace* QueryTrace::current() {
+    return sCurrentTrace;
+}
+
+// static
+bool QueryTrace::isEnabled() {
+    return ATRACE_ENABLED() || Experiments::getInstance()->isQueryStageTracingEnabled();
+}
+
+void QueryTrace::add(QueryStage stage, steady_clock::duration duration) {
+    mStages |= 1u << static_cast<size_t>(stage);
+    mDurations[static_cast<size_t>(stage)] += duration;
+}
+
+ScopedQueryTrace::ScopedQueryTrace(QueryTrace* trace, QueryTraceStats* stats)
+    : mTrace(trace->enabled() ? trace : nullptr), mStats(stats), mPrevious(sCurrentTrace) {
+    if (mTrace == nullptr) return;
+    ATRACE_ASYNC_END(queryStageName(QueryStage::HANDLER_START), mTrace->mCookie);
+    mTrace->add(QueryStage::HANDLER_START, steady_clock::now() - mTrace->mDispatched);
+    sCurrentTrace = mTrace;
+}
+
+ScopedQueryTrace::~ScopedQueryTrace() {
+    if (mTrace == nullptr) return;
+    sCurrentTrace = mPrevious;
+    mStats->add(*mTrace);
+}
+
+void ScopedQueryStage::begin() {
+    ATRACE_BEGIN(queryStageName(mStage));
+    mStart = steady_clock::now();
+}
+
+void ScopedQueryStage::end() {
+    mTrace->add(mStage, steady_clock::now() - mStart);
+    ATRACE_END();
+}
+
+// static
+QueryTraceStats* QueryTraceStats::getInstance() {
+    static QueryTraceStats* const instance = new QueryTraceStats();
+    return instance;
+}
+
+void QueryTraceStats::add(const QueryTrace& trace) {
+    std::lock_guard guard(mLock);
+    for (size_t i = 0; i < kQueryStageCount; i++) {
+        const QueryStage stage = static_cast<QueryStage>(i);
+        if (trace.has(stage)) mLatencies[i].add(trace.duration(stage));
+    }
+}
+
+void QueryTraceStats::dump(netdutils::DumpWriter& dw) {
+    std::lock_guard guard(mLock);
+    dw.println("Query stages (requests, latency p50/p90/p99):");
+    dw.incIndent();
+    for (size_t i = 0; i < kQueryStageCount; i++) {
+        const LatencyHistogram& latencies = mLatencies[i];
+        dw.println("%s: %d, %lld/%lld/%lldus", queryStageName(static_cast<QueryStage>(i)),
+                   latencies.count(), static_cast<long long>(latencies.percentile(50).count()),
+                   static_cast<long long>(latencies.percentile(90).count()),
+                   static_cast<long long>(latencies.percentile(99).count()));
+    }
+    dw.decIndent();
+}
+
+}  // namespace net
+}  // namespace android
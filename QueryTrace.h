@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/DumpWriter.h>
+
+#include "LatencyHistogram.h"
+
+namespace android {
+namespace net {
+
+// The stages a request from a client goes through, roughly in order.  A stage can happen more
+// than once per request, e.g. once per server tried.
+enum class QueryStage {
+    // From the listener dispatching the request to its handler thread running it.
+    HANDLER_START,
+    // Checking the limit of outstanding queries of the client UID.
+    QUERY_LIMITER,
+    // Looking up the cache, including waiting for an identical query in flight.
+    CACHE_LOOKUP,
+    // Opening and connecting sockets to DNS servers.
+    SOCKET_SETUP,
+    // Waiting for the answers of DNS servers.
+    NETWORK_RTT,
+    // Private DNS handshakes.
+    TLS_HANDSHAKE,
+    // Parsing answers into addrinfo or hostent.
+    PARSING,
+    // Sorting getaddrinfo answers in RFC 6724 order.
+    RFC6724_SORT,
+    // Synthesizing IPv6 answers from IPv4 ones.
+    DNS64,
+    // Sending the answer to the client.
+    IPC_WRITE,
+};
+
+constexpr size_t kQueryStageCount = static_cast<size_t>(QueryStage::IPC_WRITE) + 1;
+
+const char* queryStageName(QueryStage stage);
+
+// How long a request spent in each stage.  A request is traced if the "query_stage_tracing"
+// experiment flag is set, or if atrace captures the network category: each stage then shows as
+// a trace section, and adds to the stage latencies of QueryTraceStats.
+//
+// The stages run on the thread which handles the request, and find the trace there, so that it
+// doesn't have to be passed down through the resolver.  When the request isn't traced, a stage
+// costs a thread-local read.  Not thread-safe.
+class QueryTrace {
+  public:
+    // Constructed when the request is dispatched, which is where handler startup starts.
+    explicit QueryTrace(bool enabled = isEnabled());
+
+    // Returns the trace of the request the calling thread handles, or nullptr if it's not traced.
+    static QueryTrace* current();
+
+    // Returns whether requests dispatched now should be traced.
+    static bool isEnabled();
+
+    bool enabled() const { return mEnabled; }
+
+    // Returns whether the request went through |stage|, and how long it spent there in total.
+    bool has(QueryStage stage) const { return mStages & (1u << static_cast<size_t>(stage)); }
+    std::chrono::microseconds duration(QueryStage stage) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                mDurations[static_cast<size_t>(stage)]);
+    }
+
+  private:
+    friend class ScopedQueryTrace;
+    friend class ScopedQueryStage;
+
+    void add(QueryStage stage, std::chrono::steady_clock::duration duration);
+
+    const bool mEnabled;
+    const std::chrono::steady_clock::time_point mDispatched;
+    // Identifies the async trace section of the handler startup.
+    const int32_t mCookie;
+    uint32_t mStages = 0;
+    std::array<std::chrono::steady_clock::duration, kQueryStageCount> mDurations = {};
+};
+
+// The latencies of each stage over the traced requests.  Thread-safe.
+class QueryTraceStats {
+  public:
+    // Returns the stats of all the requests of the resolver.
+    static QueryTraceStats* getInstance();
+
+    void add(const QueryTrace& trace) EXCLUDES(mLock);
+    void dump(netdutils::DumpWriter& dw) EXCLUDES(mLock);
+
+  private:
+    std::mutex mLock;
+    std::array<LatencyHistogram, kQueryStageCount> mLatencies GUARDED_BY(mLock);
+};
+
+// Makes |trace| the trace of the calling thread while in scope, starting with the handler
+// startup, and adds it to |stats| when done.
+class ScopedQueryTrace {
+  public:
+    explicit ScopedQueryTrace(QueryTrace* trace,
+                              QueryTraceStats* stats = QueryTraceStats::getInstance());
+    ~ScopedQueryTrace();
+
+    ScopedQueryTrace(const ScopedQueryTrace&) = delete;
+    ScopedQueryTrace& operator=(const ScopedQueryTrace&) = delete;
+
+  private:
+    QueryTrace* const mTrace;
+    QueryTraceStats* const mStats;
+    QueryTrace* const mPrevious;
+};
+
+// Records the time until the end of the scope as |stage| of the trace of the calling thread.
+class ScopedQueryStage {
+  public:
+    explicit ScopedQueryStage(QueryStage stage) : mTrace(QueryTrace::current()), mStage(stage) {
+        if (mTrace != nullptr) begin();
+    }
+    ~ScopedQueryStage() {
+        if (mTrace != nullptr) end();
+    }
+
+    ScopedQueryStage(const ScopedQueryStage&) = delete;
+    ScopedQueryStage& operator=(const ScopedQueryStage&) = delete;
+
+  private:
+    void begin();
+    void end();
+
+    QueryTrace* const mTrace;
+    const QueryStage mStage;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "QueryTrace.h"
+
+using namespace std::chrono_literals;
+
+namespace android::net {
+
+namespace {
+
+std::string captureDumpOutput(QueryTraceStats* stats) {
+    netdutils::DumpWriter dw(STDOUT_FILENO);
+    CapturedStdout captured;
+    stats->dump(dw);
+    return captured.str();
+}
+
+}  // namespace
+
+TEST(QueryTraceTest, Stages) {
+    QueryTraceStats stats;
+    QueryTrace trace(true);
+    std::this_thread::sleep_for(10ms);
+    {
+        ScopedQueryTrace scopedTrace(&trace, &stats);
+        EXPECT_EQ(&trace, QueryTrace::current());
+        {
+            ScopedQueryStage stage(QueryStage::NETWORK_RTT);
+            std::this_thread::sleep_for(10ms);
+        }
+        // A stage which happens again adds up.
+        {
+            ScopedQueryStage stage(QueryStage::NETWORK_RTT);
+            std::this_thread::sleep_for(10ms);
+        }
+    }
+    EXPECT_EQ(nullptr, QueryTrace::current());
+
+    EXPECT_TRUE(trace.has(QueryStage::HANDLER_START));
+    EXPECT_GE(trace.duration(QueryStage::HANDLER_START), 10ms);
+    EXPECT_TRUE(trace.has(QueryStage::NETWORK_RTT));
+    EXPECT_GE(trace.duration(QueryStage::NETWORK_RTT), 20ms);
+    EXPECT_FALSE(trace.has(QueryStage::PARSING));
+    EXPECT_EQ(0us, trace.duration(QueryStage::PARSING));
+
+    // The request counts once in each stage it went through.
+    const std::string output = captureDumpOutput(&stats);
+    EXPECT_NE(output.find("handler_start: 1, "), std::string::npos) << output;
+    EXPECT_NE(output.find("network_rtt: 1, "), std::string::npos) << output;
+    EXPECT_NE(output.find("parsing: 0, 0/0/0us"), std::string::npos) << output;
+}
+
+TEST(QueryTraceTest, Disabled) {
+    QueryTraceStats stats;
+    QueryTrace trace(false);
+    {
+        ScopedQueryTrace scopedTrace(&trace, &stats);
+        EXPECT_EQ(nullptr, QueryTrace::current());
+        ScopedQueryStage stage(QueryStage::NETWORK_RTT);
+    }
+    EXPECT_FALSE(trace.has(QueryStage::HANDLER_START));
+    EXPECT_FALSE(trace.has(QueryStage::NETWORK_RTT));
+    const std::string output = captureDumpOutput(&stats);
+    EXPECT_NE(output.find("handler_start: 0, "), std::string::npos) << output;
+}
+
+TEST(QueryTraceTest, PerThread) {
+    QueryTraceStats stats;
+    QueryTrace trace(true);
+    ScopedQueryTrace scopedTrace(&trace, &stats);
+
+    // Stages on other threads, e.g. the DoT event loop, belong to no request.
+    std::thread([] {
+        EXPECT_EQ(nullptr, QueryTrace::current());
+        ScopedQueryStage stage(QueryStage::TLS_HANDSHAKE);
+    }).join();
+    EXPECT_FALSE(trace.has(QueryStage::TLS_HANDSHAKE));
+}
+
+}  // namespace android::net
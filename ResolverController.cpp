@@ -18,6 +18,7 @@
 
 #include "ResolverController.h"
 
+#include <cmath>
 #include <set>
 #include <string>
 #include <vector>
@@ -30,9 +31,12 @@
 
 #include "Dns64Configuration.h"
 #include "DnsResolver.h"
+#include "DnsTlsDispatcher.h"
 #include "PrivateDnsConfiguration.h"
 #include "ResolverEventReporter.h"
 #include "ResolverStats.h"
+#include "TaskScheduler.h"
+#include "TcpFastOpen.h"
 #include "resolv_cache.h"
 #include "stats.h"
 
@@ -159,6 +163,7 @@ int getDnsInfo(unsigned netId, std::vector<std::string>* servers, std::vector<st
                                         &cur_stats.timeouts, &cur_stats.internal_errors,
                                         &cur_stats.rtt_avg, &cur_stats.last_sample_time);
         cur_stats.usable = valid_servers[i];
+        if (cur_stats.successes > 0) cur_stats.rtt_ewma = std::lround(res_stats[i].rtt_ewma);
     }
 
     // Convert the stack-allocated search domain strings to std::string.
@@ -185,6 +190,8 @@ void ResolverController::destroyNetworkCache(unsigned netId) {
     resolv_delete_cache_for_net(netId);
     mDns64Configuration.stopPrefixDiscovery(netId);
     gPrivateDnsConfiguration.clear(netId);
+    TaskScheduler::getInstance()->cancel(netId);
+    TcpFastOpenTracker::getInstance()->clear(netId);
 }
 
 int ResolverController::createNetworkCache(unsigned netId) {
@@ -255,7 +262,7 @@ int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>*
     ResolverStats::encodeAll(res_stats, stats);
 
     const auto privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
-    for (const auto& pair : privateDnsStatus.serversMap) {
+    for (const auto& pair : privateDnsStatus->serversMap) {
         tlsServers->push_back(addrToString(&pair.first.ss));
     }
 
@@ -269,6 +276,39 @@ int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>*
     return 0;
 }
 
+int ResolverController::getServerLatencies(int32_t netId, int32_t protocol,
+                                           std::vector<std::string>* servers,
+                                           std::vector<int32_t>* latencies) {
+    using aidl::android::net::IDnsResolver;
+    static_assert(IDnsResolver::PROTOCOL_UDP == PROTO_UDP &&
+                  IDnsResolver::PROTOCOL_TCP == PROTO_TCP &&
+                  IDnsResolver::PROTOCOL_DOT == PROTO_DOT);
+    if (protocol != IDnsResolver::PROTOCOL_UDP && protocol != IDnsResolver::PROTOCOL_TCP &&
+        protocol != IDnsResolver::PROTOCOL_DOT) {
+        return -EINVAL;
+    }
+    std::vector<StatsData> stats;
+    const int ret = resolv_stats_get(netId, static_cast<Protocol>(protocol), &stats);
+    if (ret != 0) return ret;
+
+    // Serialize the information for binder.
+    servers->clear();
+    latencies->clear();
+    for (const auto& data : stats) {
+        servers->push_back(data.serverSockAddr.ip().toString());
+        const auto percentile = [&data](double percent) {
+            return static_cast<int32_t>(data.latencies.percentile(percent).count());
+        };
+        int32_t entry[IDnsResolver::RESOLVER_LATENCY_COUNT];
+        entry[IDnsResolver::RESOLVER_LATENCY_SAMPLES] = data.latencies.count();
+        entry[IDnsResolver::RESOLVER_LATENCY_P50_USEC] = percentile(50);
+        entry[IDnsResolver::RESOLVER_LATENCY_P90_USEC] = percentile(90);
+        entry[IDnsResolver::RESOLVER_LATENCY_P99_USEC] = percentile(99);
+        latencies->insert(latencies->end(), std::begin(entry), std::end(entry));
+    }
+    return 0;
+}
+
 void ResolverController::startPrefix64Discovery(int32_t netId) {
     mDns64Configuration.startPrefixDiscovery(netId);
 }
@@ -311,7 +351,7 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
                        android::base::Join(resolv_cache_dump_subsampling_map(netId), ' '));
             dw.println(
                     "DNS servers: # IP (total, successes, errors, timeouts, internal errors, "
-                    "RTT avg, last sample)");
+                    "RTT avg, RTT ewma, last sample)");
             dw.incIndent();
             for (size_t i = 0; i < servers.size(); ++i) {
                 if (i < stats.size()) {
@@ -319,9 +359,9 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
                     int total = s.successes + s.errors + s.timeouts + s.internal_errors;
                     if (total > 0) {
                         int time_delta = (s.last_sample_time > 0) ? now - s.last_sample_time : -1;
-                        dw.println("%s (%d, %d, %d, %d, %d, %dms, %ds)%s", servers[i].c_str(),
+                        dw.println("%s (%d, %d, %d, %d, %d, %dms, %dms, %ds)%s", servers[i].c_str(),
                                    total, s.successes, s.errors, s.timeouts, s.internal_errors,
-                                   s.rtt_avg, time_delta, s.usable ? "" : " BROKEN");
+                                   s.rtt_avg, s.rtt_ewma, time_delta, s.usable ? "" : " BROKEN");
                     } else {
                         dw.println("%s <no data>", servers[i].c_str());
                     }
@@ -341,27 +381,50 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
             dw.println(
                     "DNS parameters: sample validity = %us, success threshold = %u%%, "
                     "samples (min, max) = (%u, %u), base_timeout = %dmsec, retry count = "
-                    "%dtimes",
+                    "%dtimes, deadline = %dmsec",
                     params.sample_validity, params.success_threshold, params.min_samples,
-                    params.max_samples, params.base_timeout_msec, params.retry_count);
+                    params.max_samples, params.base_timeout_msec, params.retry_count,
+                    params.deadline_msec);
         }
 
         mDns64Configuration.dump(dw, netId);
         const auto privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
-        dw.println("Private DNS mode: %s", getPrivateDnsModeString(privateDnsStatus.mode));
-        if (privateDnsStatus.serversMap.size() == 0) {
+        dw.println("Private DNS mode: %s", getPrivateDnsModeString(privateDnsStatus->mode));
+        if (privateDnsStatus->serversMap.size() == 0) {
             dw.println("No Private DNS servers configured");
         } else {
             dw.println("Private DNS configuration (%u entries)",
-                       static_cast<uint32_t>(privateDnsStatus.serversMap.size()));
+                       static_cast<uint32_t>(privateDnsStatus->serversMap.size()));
             dw.incIndent();
-            for (const auto& pair : privateDnsStatus.serversMap) {
+            for (const auto& pair : privateDnsStatus->serversMap) {
                 dw.println("%s name{%s} status{%s}", addrToString(&pair.first.ss).c_str(),
                            pair.first.name.c_str(), validationStatusToString(pair.second));
             }
             dw.decIndent();
+            dw.println("Private DNS session resumption:");
+            dw.incIndent();
+            for (const auto& pair : privateDnsStatus->serversMap) {
+                const auto stats = DnsTlsDispatcher::getInstance().getSessionStats(pair.first);
+                if (!stats) continue;
+                dw.println("%s name{%s} resumed{%d/%d} sessions{%zu}",
+                           addrToString(&pair.first.ss).c_str(), pair.first.name.c_str(),
+                           stats->resumed, stats->handshakes, stats->sessions);
+            }
+            dw.decIndent();
+            dw.println("Private DNS connections:");
+            dw.incIndent();
+            for (const auto& pair : privateDnsStatus->serversMap) {
+                const auto stats = DnsTlsDispatcher::getInstance().getTransportStats(pair.first);
+                if (!stats) continue;
+                dw.println("%s name{%s} connects{%d} reconnects{%d} idleTimeout{%lldms}",
+                           addrToString(&pair.first.ss).c_str(), pair.first.name.c_str(),
+                           stats->connects, stats->reconnects,
+                           static_cast<long long>(stats->idleTimeout.count()));
+            }
+            dw.decIndent();
         }
         dw.println("Concurrent DNS query timeout: %d", wait_for_pending_req_timeout_count[0]);
+        TcpFastOpenTracker::getInstance()->dump(dw, netId);
         resolv_netconfig_dump(dw, netId);
     }
     dw.decIndent();
@@ -49,6 +49,9 @@ class ResolverController {
                         std::vector<int32_t>* params, std::vector<int32_t>* stats,
                         std::vector<int32_t>* wait_for_pending_req_timeout_count);
 
+    int getServerLatencies(int32_t netId, int32_t protocol, std::vector<std::string>* servers,
+                           std::vector<int32_t>* latencies);
+
     // Start or stop NAT64 prefix discovery.
     void startPrefix64Discovery(int32_t netId);
     void stopPrefix64Discovery(int32_t netId);
@@ -45,6 +45,9 @@ struct ResolverStats {
     int rtt_avg{-1};
     time_t last_sample_time{0};
     bool usable{false};
+    // Moving average of the round-trip-time, weighted towards recent samples. Only for dumps, it
+    // is not serialized.
+    int rtt_ewma{-1};
 
     // Serialize the resolver stats to the end of |out|.
     void encode(std::vector<int32_t>* out) const;
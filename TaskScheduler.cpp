@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <netdutils/ThreadUtil.h>
+
+namespace android {
+namespace net {
+
+using android::base::ScopedLockAssertion;
+using android::netdutils::setThreadName;
+using std::chrono::milliseconds;
+
+TaskScheduler::~TaskScheduler() {
+    std::unique_lock lock(mLock);
+    ScopedLockAssertion assume_lock(mLock);
+    mStopping = true;
+    mPending.clear();
+    mCv.notify_all();
+    while (mWorkers > 0) {
+        mCv.wait(lock);
+    }
+}
+
+// static
+TaskScheduler* TaskScheduler::getInstance() {
+    static TaskScheduler* const instance = new TaskScheduler();
+    return instance;
+}
+
+void TaskScheduler::schedule(unsigned netId, const std::string& tag, milliseconds delay,
+                             Task task, TaskClass taskClass) {
+    LOG(DEBUG) << "Scheduling " << tag << " on netId " << netId << " in " << delay.count()
+               << "ms";
+    std::lock_guard guard(mLock);
+    if (mStopping) return;
+    mPending.emplace(Clock::now() + delay,
+                     std::make_shared<Entry>(Entry{
+                             .netId = netId, .tag = tag, .task = task, .taskClass = taskClass}));
+    startWorkerIfNeeded();
+    // Idle workers have to wait for a new deadline.
+    mCv.notify_all();
+}
+
+void TaskScheduler::cancel(unsigned netId, const std::string& tagPrefix) {
+    const auto matches = [&](const std::shared_ptr<Entry>& entry) {
+        return entry->netId == netId && entry->tag.compare(0, tagPrefix.size(), tagPrefix) == 0;
+    };
+    std::lock_guard guard(mLock);
+    for (auto it = mPending.begin(); it != mPending.end();) {
+        if (matches(it->second)) {
+            LOG(DEBUG) << "Cancelling " << it->second->tag << " on netId " << netId;
+            it = mPending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (const auto& entry : mRunning) {
+        if (matches(entry)) entry->cancelled = true;
+    }
+}
+
+void TaskScheduler::dump(netdutils::DumpWriter& dw) {
+    std::lock_guard guard(mLock);
+    dw.println("Background tasks: %zu pending, %zu running, %d threads", mPending.size(),
+               mRunning.size(), mWorkers);
+    dw.incIndent();
+    for (const auto& entry : mRunning) {
+        dw.println("netId %u %s: running", entry->netId, entry->tag.c_str());
+    }
+    const auto now = Clock::now();
+    for (const auto& [time, entry] : mPending) {
+        const auto delay = std::chrono::duration_cast<milliseconds>(time - now);
+        dw.println("netId %u %s: in %lldms", entry->netId, entry->tag.c_str(),
+                   static_cast<long long>(std::max(delay.count(), milliseconds::rep(0))));
+    }
+    dw.decIndent();
+}
+
+void TaskScheduler::startWorkerIfNeeded() {
+    if (mIdleWorkers > 0 || mWorkers >= kMaxWorkers) return;
+    // The new worker counts as idle from now on, so that no other one is started for the same
+    // task.
+    mWorkers++;
+    mIdleWorkers++;
+    std::thread(&TaskScheduler::workerLoop, this).detach();
+}
+
+// static
+int TaskScheduler::maxWorkers(TaskClass taskClass) {
+    switch (taskClass) {
+        case TaskClass::VALIDATION:
+            return kMaxValidationWorkers;
+        case TaskClass::RECONNECT:
+            return kMaxReconnectWorkers;
+        case TaskClass::DEFAULT:
+            break;
+    }
+    return kMaxDefaultWorkers;
+}
+
+TaskScheduler::PendingMap::iterator TaskScheduler::findRunnable() {
+    std::map<TaskClass, int> running;
+    for (const auto& entry : mRunning) {
+        running[entry->taskClass]++;
+    }
+    return std::find_if(mPending.begin(), mPending.end(), [&running](const auto& pending) {
+        const TaskClass taskClass = pending.second->taskClass;
+        return running[taskClass] < maxWorkers(taskClass);
+    });
+}
+
+void TaskScheduler::workerLoop() {
+    setThreadName("TaskScheduler");
+    std::unique_lock lock(mLock);
+    ScopedLockAssertion assume_lock(mLock);
+    while (!mStopping) {
+        const auto runnable = findRunnable();
+        if (runnable == mPending.end()) {
+            // Either nothing is pending, or only tasks whose class has no thread to spare.  The
+            // worker which completes a run of that class looks for the next task by itself.
+            if (mCv.wait_for(lock, kIdleTimeout) == std::cv_status::timeout && mPending.empty()) {
+                break;
+            }
+            continue;
+        }
+        if (runnable->first > Clock::now()) {
+            mCv.wait_until(lock, runnable->first);
+            continue;
+        }
+
+        std::shared_ptr<Entry> entry = std::move(runnable->second);
+        mPending.erase(runnable);
+        mRunning.push_back(entry);
+        mIdleWorkers--;
+        // Someone has to keep waiting for the next task.
+        if (!mPending.empty()) startWorkerIfNeeded();
+
+        lock.unlock();
+        LOG(DEBUG) << "Running " << entry->tag << " on netId " << entry->netId;
+        const std::optional<milliseconds> next = entry->task();
+        lock.lock();
+
+        mRunning.erase(std::find(mRunning.begin(), mRunning.end(), entry));
+        mIdleWorkers++;
+        if (next && !entry->cancelled && !mStopping) {
+            mPending.emplace(Clock::now() + *next, std::move(entry));
+        }
+    }
+    mIdleWorkers--;
+    mWorkers--;
+    mCv.notify_all();
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/DumpWriter.h>
+
+namespace android {
+namespace net {
+
+// Runs the background work of the resolver, such as private DNS validation and DNS64 prefix
+// discovery, on a small pool of threads.  A task which has to be retried later returns the delay
+// until its next run, and doesn't hold a thread in the meantime.  Worker threads are started on
+// demand, and exit after a while without work.
+// Thread-safe.
+class TaskScheduler {
+  public:
+    // Returns the delay until the next run of the task, or nullopt once it is done.
+    using Task = std::function<std::optional<std::chrono::milliseconds>()>;
+
+    // Tasks of different classes don't compete for worker threads, so that a class of slow
+    // tasks can't hold up the others.
+    enum class TaskClass {
+        // Private DNS validation, which can block for minutes on an unreachable server.
+        VALIDATION,
+        // Reconnection of a DNS-over-TLS transport, which pending queries, including those of
+        // validations, wait for.
+        RECONNECT,
+        // Everything else, such as DNS64 prefix discovery.
+        DEFAULT,
+    };
+
+    // How many worker threads the tasks of each class can use at a time.  The validation
+    // threads are enough to validate a few private DNS servers in parallel, even if their
+    // connections time out.  Further tasks wait for a free thread of their class.
+    static constexpr int kMaxValidationWorkers = 6;
+    static constexpr int kMaxReconnectWorkers = 2;
+    static constexpr int kMaxDefaultWorkers = 2;
+
+    TaskScheduler() = default;
+    // Cancels all the tasks, and waits for the runs in progress.
+    ~TaskScheduler();
+
+    // Instantiated on first use.  Never destroyed, since it would have to wait for tasks which
+    // can block for minutes.
+    static TaskScheduler* getInstance();
+
+    // Runs |task| after |delay|, and again after each delay it returns.  |netId| and |tag|
+    // identify the task in cancel() and dump().
+    void schedule(unsigned netId, const std::string& tag, std::chrono::milliseconds delay,
+                  Task task, TaskClass taskClass = TaskClass::DEFAULT) EXCLUDES(mLock);
+
+    // Cancels the tasks of |netId| whose tag starts with |tagPrefix|; by default, all of them.
+    // A run in progress completes, but the task is not run again.
+    void cancel(unsigned netId, const std::string& tagPrefix = "") EXCLUDES(mLock);
+
+    void dump(netdutils::DumpWriter& dw) EXCLUDES(mLock);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        unsigned netId;
+        std::string tag;
+        Task task;
+        TaskClass taskClass;
+        bool cancelled = false;
+    };
+    using PendingMap = std::multimap<Clock::time_point, std::shared_ptr<Entry>>;
+
+    // Starts a worker thread, unless one is idle or there are kMaxWorkers already.
+    void startWorkerIfNeeded() REQUIRES(mLock);
+    void workerLoop() EXCLUDES(mLock);
+    // Returns the next pending task whose class has a thread to spare, or mPending.end().
+    PendingMap::iterator findRunnable() REQUIRES(mLock);
+    static int maxWorkers(TaskClass taskClass);
+
+    // The sum of the limits of all classes, so that a class under its limit always finds a
+    // thread.
+    static constexpr int kMaxWorkers =
+            kMaxValidationWorkers + kMaxReconnectWorkers + kMaxDefaultWorkers;
+    static constexpr std::chrono::seconds kIdleTimeout{60};
+
+    std::mutex mLock;
+    // Signalled when a task is scheduled, and when a worker exits.
+    std::condition_variable mCv;
+    // Tasks waiting for their next run, by time of that run.
+    PendingMap mPending GUARDED_BY(mLock);
+    std::vector<std::shared_ptr<Entry>> mRunning GUARDED_BY(mLock);
+    int mWorkers GUARDED_BY(mLock) = 0;
+    int mIdleWorkers GUARDED_BY(mLock) = 0;
+    bool mStopping GUARDED_BY(mLock) = false;
+};
+
+}  // namespace net
+}  // namespace android
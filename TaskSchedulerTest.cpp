@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "TaskScheduler.h"
+
+using namespace std::chrono_literals;
+using std::chrono::milliseconds;
+
+namespace android::net {
+
+namespace {
+
+constexpr unsigned kNetId = 30;
+constexpr unsigned kOtherNetId = 31;
+
+// Polls |condition| until it holds, for up to |timeout|.
+template <typename Predicate>
+bool waitFor(Predicate condition, milliseconds timeout = 2s) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) return false;
+        std::this_thread::sleep_for(5ms);
+    }
+    return true;
+}
+
+}  // namespace
+
+class TaskSchedulerTest : public ::testing::Test {
+  protected:
+    std::string captureDumpOutput() {
+        netdutils::DumpWriter dw(STDOUT_FILENO);
+        CapturedStdout captured;
+        mScheduler.dump(dw);
+        return captured.str();
+    }
+
+    TaskScheduler mScheduler;
+};
+
+TEST_F(TaskSchedulerTest, RunsUntilDone) {
+    std::atomic<int> runs = 0;
+    mScheduler.schedule(kNetId, "test", 0ms, [&runs]() -> std::optional<milliseconds> {
+        if (++runs < 3) return 10ms;
+        return std::nullopt;
+    });
+    EXPECT_TRUE(waitFor([&runs] { return runs == 3; }));
+
+    // The task is done, so it must not run again.
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(3, runs);
+    EXPECT_EQ(0U, captureDumpOutput().find("Background tasks: 0 pending, 0 running"));
+}
+
+TEST_F(TaskSchedulerTest, RunsInOrderOfDelay) {
+    std::mutex lock;
+    std::vector<int> order;
+    const auto record = [&](int id) {
+        return [&, id]() -> std::optional<milliseconds> {
+            std::lock_guard guard(lock);
+            order.push_back(id);
+            return std::nullopt;
+        };
+    };
+    mScheduler.schedule(kNetId, "late", 100ms, record(2));
+    mScheduler.schedule(kNetId, "early", 20ms, record(1));
+    EXPECT_TRUE(waitFor([&] {
+        std::lock_guard guard(lock);
+        return order.size() == 2;
+    }));
+    std::lock_guard guard(lock);
+    EXPECT_EQ(std::vector<int>({1, 2}), order);
+}
+
+TEST_F(TaskSchedulerTest, CancelPending) {
+    std::atomic<int> runs = 0;
+    const auto task = [&runs]() -> std::optional<milliseconds> {
+        runs++;
+        return std::nullopt;
+    };
+    mScheduler.schedule(kNetId, "TlsVerify 1.2.3.4", 200ms, task);
+    mScheduler.schedule(kNetId, "Nat64Prefix", 200ms, task);
+    mScheduler.schedule(kOtherNetId, "TlsVerify 1.2.3.4", 200ms, task);
+
+    std::string dump = captureDumpOutput();
+    EXPECT_NE(std::string::npos, dump.find("3 pending")) << dump;
+    EXPECT_NE(std::string::npos, dump.find("netId 30 Nat64Prefix: in ")) << dump;
+
+    // Only the validation on kNetId is cancelled.
+    mScheduler.cancel(kNetId, "TlsVerify");
+    EXPECT_NE(std::string::npos, captureDumpOutput().find("2 pending"));
+    EXPECT_TRUE(waitFor([&runs] { return runs == 2; }));
+
+    // Cancelling by netId alone cancels all the tasks of the network.
+    mScheduler.schedule(kNetId, "TlsVerify 1.2.3.4", 200ms, task);
+    mScheduler.schedule(kNetId, "Nat64Prefix", 200ms, task);
+    mScheduler.cancel(kNetId);
+    EXPECT_NE(std::string::npos, captureDumpOutput().find("0 pending"));
+    std::this_thread::sleep_for(300ms);
+    EXPECT_EQ(2, runs);
+}
+
+TEST_F(TaskSchedulerTest, CancelRunning) {
+    std::atomic<bool> started = false;
+    std::atomic<bool> release = false;
+    std::atomic<int> runs = 0;
+    mScheduler.schedule(kNetId, "test", 0ms, [&]() -> std::optional<milliseconds> {
+        runs++;
+        started = true;
+        while (!release) std::this_thread::sleep_for(5ms);
+        return 10ms;
+    });
+    EXPECT_TRUE(waitFor([&started] { return started.load(); }));
+    EXPECT_NE(std::string::npos, captureDumpOutput().find("netId 30 test: running"));
+
+    // The run in progress completes, but the task is not rescheduled.
+    mScheduler.cancel(kNetId);
+    release = true;
+    EXPECT_TRUE(waitFor([this] {
+        return captureDumpOutput().find("0 pending, 0 running") != std::string::npos;
+    }));
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(1, runs);
+}
+
+TEST_F(TaskSchedulerTest, LongTaskDoesNotDelayOthers) {
+    std::atomic<bool> release = false;
+    std::atomic<bool> done = false;
+    mScheduler.schedule(kNetId, "slow", 0ms, [&release]() -> std::optional<milliseconds> {
+        while (!release) std::this_thread::sleep_for(5ms);
+        return std::nullopt;
+    });
+    mScheduler.schedule(kOtherNetId, "fast", 10ms, [&done]() -> std::optional<milliseconds> {
+        done = true;
+        return std::nullopt;
+    });
+    EXPECT_TRUE(waitFor([&done] { return done.load(); }));
+    release = true;
+    // The slow task refers to |release|, so it has to complete before the test returns.
+    EXPECT_TRUE(waitFor([this] {
+        return captureDumpOutput().find("0 pending, 0 running") != std::string::npos;
+    }));
+}
+
+TEST_F(TaskSchedulerTest, ValidationsDoNotDelayOtherTasks) {
+    using TaskClass = TaskScheduler::TaskClass;
+    constexpr int kValidations = TaskScheduler::kMaxValidationWorkers;
+    std::atomic<bool> release = false;
+    std::atomic<int> started = 0;
+    std::atomic<bool> done = false;
+    const auto validation = [&]() -> std::optional<milliseconds> {
+        started++;
+        while (!release) std::this_thread::sleep_for(5ms);
+        return std::nullopt;
+    };
+    // One more validation than there are threads for them.
+    for (int i = 0; i <= kValidations; i++) {
+        mScheduler.schedule(kNetId, "TlsVerify " + std::to_string(i), 0ms, validation,
+                            TaskClass::VALIDATION);
+    }
+    EXPECT_TRUE(waitFor([&started] { return started == kValidations; }));
+
+    mScheduler.schedule(kNetId, "Nat64Prefix", 0ms, [&done]() -> std::optional<milliseconds> {
+        done = true;
+        return std::nullopt;
+    });
+    EXPECT_TRUE(waitFor([&done] { return done.load(); }));
+    // The last validation still waits for a thread of its class.
+    EXPECT_EQ(kValidations, started);
+
+    release = true;
+    EXPECT_TRUE(waitFor([&started] { return started == kValidations + 1; }));
+    // The validations refer to |release|, so they have to complete before the test returns.
+    EXPECT_TRUE(waitFor([this] {
+        return captureDumpOutput().find("0 pending, 0 running") != std::string::npos;
+    }));
+}
+
+}  // namespace android::net
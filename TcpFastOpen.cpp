@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "TcpFastOpen.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace net {
+
+using netdutils::IPSockAddr;
+using std::chrono::duration_cast;
+using std::chrono::minutes;
+
+// static
+TcpFastOpenTracker* TcpFastOpenTracker::getInstance() {
+    static TcpFastOpenTracker* const instance = new TcpFastOpenTracker();
+    return instance;
+}
+
+bool TcpFastOpenTracker::shouldTry(unsigned netId, const IPSockAddr& server,
+                                   Clock::time_point now) {
+    std::lock_guard guard(mLock);
+    const auto it = mServers.find({netId, server});
+    return it == mServers.end() || now >= it->second.retryAfter;
+}
+
+void TcpFastOpenTracker::report(unsigned netId, const IPSockAddr& server, Outcome outcome,
+                                Clock::time_point now) {
+    std::lock_guard guard(mLock);
+    ServerState& state = mServers[{netId, server}];
+    switch (outcome) {
+        case Outcome::ACCEPTED:
+            state.accepted++;
+            state.rejectionsInARow = 0;
+            state.backoffs = 0;
+            break;
+        case Outcome::REJECTED:
+            state.rejected++;
+            if (++state.rejectionsInARow >= kMaxRejections) {
+                LOG(INFO) << "TFO rejected by " << server.toString() << " on netId " << netId;
+                backOff(&state, now);
+            }
+            break;
+        case Outcome::FAILED:
+            state.failed++;
+            LOG(INFO) << "TFO connection to " << server.toString() << " failed on netId "
+                      << netId;
+            backOff(&state, now);
+            break;
+    }
+}
+
+void TcpFastOpenTracker::backOff(ServerState* state, Clock::time_point now) {
+    // The shift is capped, so that it can't overflow however long TFO keeps failing.
+    const Clock::duration backoff = std::min<Clock::duration>(
+            kMinBackoff * (1 << std::min(state->backoffs, 16)), kMaxBackoff);
+    state->retryAfter = now + backoff;
+    state->rejectionsInARow = 0;
+    state->backoffs++;
+}
+
+void TcpFastOpenTracker::clear(unsigned netId) {
+    std::lock_guard guard(mLock);
+    for (auto it = mServers.begin(); it != mServers.end();) {
+        if (it->first.first == netId) {
+            it = mServers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void TcpFastOpenTracker::dump(netdutils::DumpWriter& dw, unsigned netId) {
+    std::lock_guard guard(mLock);
+    const auto now = Clock::now();
+    dw.println("TCP Fast Open:");
+    dw.incIndent();
+    for (const auto& [key, state] : mServers) {
+        if (key.first != netId) continue;
+        const long long retryIn =
+                (state.retryAfter > now) ? duration_cast<minutes>(state.retryAfter - now).count()
+                                         : 0;
+        dw.println("%s accepted{%d} rejected{%d} failed{%d} disabled{%lldmin}",
+                   key.second.toString().c_str(), state.accepted, state.rejected, state.failed,
+                   retryIn);
+    }
+    dw.decIndent();
+}
+
+bool isSynDataAcked(int fd) {
+    tcp_info info = {};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        PLOG(WARNING) << "Failed to get TCP_INFO";
+        return false;
+    }
+    return info.tcpi_options & TCPI_OPT_SYN_DATA;
+}
+
+bool hasReceivedData(int fd) {
+    tcp_info info = {};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        PLOG(WARNING) << "Failed to get TCP_INFO";
+        return false;
+    }
+    return info.tcpi_bytes_received > 0;
+}
+
+bool isHandshakeDone(int fd) {
+    tcp_info info = {};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        PLOG(WARNING) << "Failed to get TCP_INFO";
+        return false;
+    }
+    // A socket still waits for the SYN-ACK in SYN_SENT, and is in CLOSE before connecting or
+    // once reset.  Every other state comes after the handshake.
+    return info.tcpi_state != TCP_SYN_SENT && info.tcpi_state != TCP_CLOSE;
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <android-base/thread_annotations.h>
+#include <netdutils/DumpWriter.h>
+#include <netdutils/InternetAddresses.h>
+
+namespace android {
+namespace net {
+
+// Remembers how TCP Fast Open (RFC 7413) fares with each DNS server on each network, so that
+// DNS-over-TCP and DNS-over-TLS connections only send data with the SYN where it can work.
+// The kernel caches the TFO cookies, but can't tell a server which ignores the data from a
+// path which drops SYNs carrying data: the first costs a retransmission, the second a connect
+// timeout.  A server which does either is left alone for a while, longer after each failure.
+// Thread-safe.
+class TcpFastOpenTracker {
+  public:
+    enum class Outcome {
+        // The server acknowledged the data sent with the SYN.
+        ACCEPTED,
+        // The connection worked, but the data sent with the SYN had to be sent again.
+        REJECTED,
+        // The connection failed after data was sent with the SYN.
+        FAILED,
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    // Returns the tracker shared by all networks.
+    static TcpFastOpenTracker* getInstance();
+
+    // Returns true if connections to |server| on |netId| should try TFO, as far as the server
+    // is concerned.  Whether TFO is enabled at all is up to the caller: the "dot_fast_open"
+    // experiment flag enables it for DNS-over-TLS, which is the default, and "tcp_fast_open"
+    // for DNS-over-TCP.
+    bool shouldTry(unsigned netId, const netdutils::IPSockAddr& server,
+                   Clock::time_point now = Clock::now()) EXCLUDES(mLock);
+
+    // Records the outcome of a connection to |server| on |netId| which sent data with the SYN.
+    // Connections which had no cookie to send data with the SYN tell nothing, and don't have
+    // to be reported.
+    void report(unsigned netId, const netdutils::IPSockAddr& server, Outcome outcome,
+                Clock::time_point now = Clock::now()) EXCLUDES(mLock);
+
+    // Forgets what is known about the servers of |netId|.
+    void clear(unsigned netId) EXCLUDES(mLock);
+
+    void dump(netdutils::DumpWriter& dw, unsigned netId) EXCLUDES(mLock);
+
+    // TFO is given up on a server after this many rejections in a row.
+    static constexpr int kMaxRejections = 3;
+    // How long a server is left alone after the first failure.  This doubles after each
+    // failure, up to kMaxBackoff.
+    static constexpr std::chrono::minutes kMinBackoff{5};
+    static constexpr std::chrono::hours kMaxBackoff{24};
+
+  private:
+    struct ServerState {
+        int accepted = 0;
+        int rejected = 0;
+        int failed = 0;
+        int rejectionsInARow = 0;
+        // Number of times TFO was given up on the server, which sets the backoff.
+        int backoffs = 0;
+        Clock::time_point retryAfter = {};
+    };
+
+    void backOff(ServerState* state, Clock::time_point now) REQUIRES(mLock);
+
+    std::mutex mLock;
+    std::map<std::pair<unsigned, netdutils::IPSockAddr>, ServerState> mServers GUARDED_BY(mLock);
+};
+
+// Returns true if the server acknowledged the data sent with the SYN on the connected socket
+// |fd|.
+bool isSynDataAcked(int fd);
+
+// Returns true if any data has been received from the server on the socket |fd|.
+bool hasReceivedData(int fd);
+
+// Returns true if the server answered the SYN sent on the socket |fd|, i.e. the TCP handshake
+// completed, whether or not the connection was closed since.  A reset connection doesn't count.
+bool isHandshakeDone(int fd);
+
+}  // namespace net
+}  // namespace android
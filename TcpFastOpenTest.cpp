@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "TcpFastOpen.h"
+
+namespace android::net {
+
+using netdutils::IPSockAddr;
+using Outcome = TcpFastOpenTracker::Outcome;
+
+namespace {
+
+constexpr unsigned kNetId = 30;
+constexpr unsigned kOtherNetId = 31;
+
+}  // namespace
+
+class TcpFastOpenTest : public ::testing::Test {
+  protected:
+    TcpFastOpenTracker mTracker;
+    const IPSockAddr mServer = IPSockAddr::toIPSockAddr("127.0.0.3", 853);
+    const TcpFastOpenTracker::Clock::time_point mStart = TcpFastOpenTracker::Clock::now();
+};
+
+TEST_F(TcpFastOpenTest, UnknownServer) {
+    EXPECT_TRUE(mTracker.shouldTry(kNetId, mServer, mStart));
+}
+
+TEST_F(TcpFastOpenTest, Rejections) {
+    // A few rejections can happen, e.g. when the server rotates its cookie key.
+    for (int i = 0; i < TcpFastOpenTracker::kMaxRejections - 1; i++) {
+        mTracker.report(kNetId, mServer, Outcome::REJECTED, mStart);
+    }
+    mTracker.report(kNetId, mServer, Outcome::ACCEPTED, mStart);
+    for (int i = 0; i < TcpFastOpenTracker::kMaxRejections - 1; i++) {
+        mTracker.report(kNetId, mServer, Outcome::REJECTED, mStart);
+    }
+    EXPECT_TRUE(mTracker.shouldTry(kNetId, mServer, mStart));
+
+    // One more in a row, and the server is left alone for a while.
+    mTracker.report(kNetId, mServer, Outcome::REJECTED, mStart);
+    EXPECT_FALSE(mTracker.shouldTry(kNetId, mServer, mStart));
+    EXPECT_FALSE(mTracker.shouldTry(kNetId, mServer, mStart + std::chrono::minutes(4)));
+    EXPECT_TRUE(mTracker.shouldTry(kNetId, mServer, mStart + TcpFastOpenTracker::kMinBackoff));
+}
+
+TEST_F(TcpFastOpenTest, FailureBackoff) {
+    auto now = mStart;
+    auto backoff = std::chrono::duration_cast<TcpFastOpenTracker::Clock::duration>(
+            TcpFastOpenTracker::kMinBackoff);
+    for (int i = 0; i < 20; i++) {
+        mTracker.report(kNetId, mServer, Outcome::FAILED, now);
+        EXPECT_FALSE(mTracker.shouldTry(kNetId, mServer, now + backoff - std::chrono::seconds(1)));
+        EXPECT_TRUE(mTracker.shouldTry(kNetId, mServer, now + backoff));
+        now += backoff;
+        backoff = std::min<TcpFastOpenTracker::Clock::duration>(2 * backoff,
+                                                                TcpFastOpenTracker::kMaxBackoff);
+    }
+
+    // Once TFO works again, the next failure starts over with the shortest backoff.
+    mTracker.report(kNetId, mServer, Outcome::ACCEPTED, now);
+    mTracker.report(kNetId, mServer, Outcome::FAILED, now);
+    EXPECT_TRUE(mTracker.shouldTry(kNetId, mServer, now + TcpFastOpenTracker::kMinBackoff));
+}
+
+TEST_F(TcpFastOpenTest, PerNetwork) {
+    const IPSockAddr otherServer = IPSockAddr::toIPSockAddr("127.0.0.4", 853);
+    mTracker.report(kNetId, mServer, Outcome::FAILED, mStart);
+    EXPECT_FALSE(mTracker.shouldTry(kNetId, mServer, mStart));
+    EXPECT_TRUE(mTracker.shouldTry(kNetId, otherServer, mStart));
+    EXPECT_TRUE(mTracker.shouldTry(kOtherNetId, mServer, mStart));
+
+    mTracker.clear(kNetId);
+    EXPECT_TRUE(mTracker.shouldTry(kNetId, mServer, mStart));
+}
+
+TEST(TcpFastOpenSocketTest, HandshakeDone) {
+    base::unique_fd listener(socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    ASSERT_NE(-1, listener.get());
+    sockaddr_in6 addr = {.sin6_family = AF_INET6, .sin6_addr = in6addr_loopback};
+    socklen_t addrlen = sizeof(addr);
+    ASSERT_EQ(0, bind(listener.get(), reinterpret_cast<sockaddr*>(&addr), addrlen));
+    ASSERT_EQ(0, listen(listener.get(), 1));
+    ASSERT_EQ(0, getsockname(listener.get(), reinterpret_cast<sockaddr*>(&addr), &addrlen));
+
+    base::unique_fd client(socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    ASSERT_NE(-1, client.get());
+    EXPECT_FALSE(isHandshakeDone(client.get()));
+    ASSERT_EQ(0, connect(client.get(), reinterpret_cast<sockaddr*>(&addr), addrlen));
+    EXPECT_TRUE(isHandshakeDone(client.get()));
+    EXPECT_FALSE(hasReceivedData(client.get()));
+
+    // The server closing the connection doesn't undo the handshake.
+    base::unique_fd accepted(accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC));
+    ASSERT_NE(-1, accepted.get());
+    accepted.reset();
+    EXPECT_TRUE(isHandshakeDone(client.get()));
+}
+
+}  // namespace android::net
@@ -59,6 +59,7 @@
 #include <android-base/logging.h>
 
 #include "Experiments.h"
+#include "QueryTrace.h"
 #include "netd_resolv/resolv.h"
 #include "res_comp.h"
 #include "res_debug.h"
@@ -131,6 +132,9 @@ static int str2number(const char*);
 static int explore_fqdn(const struct addrinfo*, const char*, const char*, struct addrinfo**,
                         const struct android_net_context*, NetworkDnsEventReported* event);
 static int explore_null(const struct addrinfo*, const char*, struct addrinfo**);
+static int explore_numeric_host(const addrinfo&, const char*, const char*, addrinfo**);
+static int explore_fqdns(const addrinfo&, const char*, const char*, addrinfo**,
+                         const android_net_context*, NetworkDnsEventReported*);
 static int explore_numeric(const struct addrinfo*, const char*, const char*, struct addrinfo**,
                            const char*);
 static int explore_numeric_scope(const struct addrinfo*, const char*, const char*,
@@ -334,7 +338,6 @@ int android_getaddrinfofornetcontext(const char* hostname, const char* servname,
     assert(event != nullptr);
 
     addrinfo sentinel = {};
-    addrinfo* cur = &sentinel;
     int error = 0;
 
     do {
@@ -346,43 +349,7 @@ int android_getaddrinfofornetcontext(const char* hostname, const char* servname,
         if (hints && (error = validateHints(hints))) break;
         addrinfo ai = hints ? *hints : addrinfo{};
 
-        // Check for special cases:
-        // (1) numeric servname is disallowed if socktype/protocol are left unspecified.
-        // (2) servname is disallowed for raw and other inet{,6} sockets.
-        if (MATCH_FAMILY(ai.ai_family, PF_INET, 1) || MATCH_FAMILY(ai.ai_family, PF_INET6, 1)) {
-            addrinfo tmp = ai;
-            if (tmp.ai_family == PF_UNSPEC) {
-                tmp.ai_family = PF_INET6;
-            }
-            error = get_portmatch(&tmp, servname);
-            if (error) break;
-        }
-
-        // NULL hostname, or numeric hostname
-        for (const Explore& ex : explore_options) {
-            /* PF_UNSPEC entries are prepared for DNS queries only */
-            if (ex.e_af == PF_UNSPEC) continue;
-
-            if (!MATCH_FAMILY(ai.ai_family, ex.e_af, WILD_AF(ex))) continue;
-            if (!MATCH(ai.ai_socktype, ex.e_socktype, WILD_SOCKTYPE(ex))) continue;
-            if (!MATCH(ai.ai_protocol, ex.e_protocol, WILD_PROTOCOL(ex))) continue;
-
-            addrinfo tmp = ai;
-            if (tmp.ai_family == PF_UNSPEC) tmp.ai_family = ex.e_af;
-            if (tmp.ai_socktype == ANY && ex.e_socktype != ANY) tmp.ai_socktype = ex.e_socktype;
-            if (tmp.ai_protocol == ANY && ex.e_protocol != ANY) tmp.ai_protocol = ex.e_protocol;
-
-            LOG(DEBUG) << __func__ << ": explore_numeric: ai_family=" << tmp.ai_family
-                       << " ai_socktype=" << tmp.ai_socktype << " ai_protocol=" << tmp.ai_protocol;
-            if (hostname == nullptr)
-                error = explore_null(&tmp, servname, &cur->ai_next);
-            else
-                error = explore_numeric_scope(&tmp, hostname, servname, &cur->ai_next);
-
-            if (error) break;
-
-            while (cur->ai_next) cur = cur->ai_next;
-        }
+        error = explore_numeric_host(ai, hostname, servname, &sentinel.ai_next);
         if (error) break;
 
         // If numeric representation of AF1 can be interpreted as FQDN
@@ -428,10 +395,82 @@ int resolv_getaddrinfo(const char* _Nonnull hostname, const char* servname, cons
         return error;
     }
 
-    addrinfo ai = hints ? *hints : addrinfo{};
+    const addrinfo ai = hints ? *hints : addrinfo{};
+    return explore_fqdns(ai, hostname, servname, res, netcontext, event);
+}
+
+bool resolv_getaddrinfo_numeric(const char* _Nonnull hostname, const char* servname,
+                                const addrinfo* hints, addrinfo** _Nonnull res) {
+    assert(res != nullptr);
+    *res = nullptr;
+
+    // Leave invalid hints to resolv_getaddrinfo(), which reports the proper error.
+    if (hostname == nullptr || (hints && validateHints(hints))) return false;
+
+    const addrinfo ai = hints ? *hints : addrinfo{};
+    return explore_numeric_host(ai, hostname, servname, res) == 0 && *res != nullptr;
+}
+
+// Numeric hostname, or NULL hostname.  Leaves |*res| null without error if |hostname| isn't
+// numeric.
+static int explore_numeric_host(const addrinfo& ai, const char* hostname, const char* servname,
+                                addrinfo** res) {
+    assert(res != nullptr);
+    *res = nullptr;
+
+    // Check for special cases:
+    // (1) numeric servname is disallowed if socktype/protocol are left unspecified.
+    // (2) servname is disallowed for raw and other inet{,6} sockets.
+    if (MATCH_FAMILY(ai.ai_family, PF_INET, 1) || MATCH_FAMILY(ai.ai_family, PF_INET6, 1)) {
+        addrinfo tmp = ai;
+        if (tmp.ai_family == PF_UNSPEC) {
+            tmp.ai_family = PF_INET6;
+        }
+        if (int error = get_portmatch(&tmp, servname)) return error;
+    }
+
     addrinfo sentinel = {};
     addrinfo* cur = &sentinel;
-    // hostname as alphanumeric name.
+    for (const Explore& ex : explore_options) {
+        /* PF_UNSPEC entries are prepared for DNS queries only */
+        if (ex.e_af == PF_UNSPEC) continue;
+
+        if (!MATCH_FAMILY(ai.ai_family, ex.e_af, WILD_AF(ex))) continue;
+        if (!MATCH(ai.ai_socktype, ex.e_socktype, WILD_SOCKTYPE(ex))) continue;
+        if (!MATCH(ai.ai_protocol, ex.e_protocol, WILD_PROTOCOL(ex))) continue;
+
+        addrinfo tmp = ai;
+        if (tmp.ai_family == PF_UNSPEC) tmp.ai_family = ex.e_af;
+        if (tmp.ai_socktype == ANY && ex.e_socktype != ANY) tmp.ai_socktype = ex.e_socktype;
+        if (tmp.ai_protocol == ANY && ex.e_protocol != ANY) tmp.ai_protocol = ex.e_protocol;
+
+        LOG(DEBUG) << __func__ << ": explore_numeric: ai_family=" << tmp.ai_family
+                   << " ai_socktype=" << tmp.ai_socktype << " ai_protocol=" << tmp.ai_protocol;
+        int error;
+        if (hostname == nullptr)
+            error = explore_null(&tmp, servname, &cur->ai_next);
+        else
+            error = explore_numeric_scope(&tmp, hostname, servname, &cur->ai_next);
+
+        if (error) {
+            freeaddrinfo(sentinel.ai_next);
+            return error;
+        }
+
+        while (cur->ai_next) cur = cur->ai_next;
+    }
+    *res = sentinel.ai_next;
+    return 0;
+}
+
+// hostname as alphanumeric name, for each socket type and protocol |ai| allows.
+static int explore_fqdns(const addrinfo& ai, const char* hostname, const char* servname,
+                         addrinfo** res, const android_net_context* netcontext,
+                         NetworkDnsEventReported* event) {
+    assert(res != nullptr);
+    addrinfo sentinel = {};
+    addrinfo* cur = &sentinel;
+    int error = EAI_FAIL;
     // We would like to prefer AF_INET6 over AF_INET, so we'll make a outer loop by AFs.
     for (const Explore& ex : explore_options) {
         // Require exact match for family field
@@ -843,6 +882,7 @@ static int ip6_str2scopeid(const char* scope, struct sockaddr_in6* sin6, uint32_
 
 static struct addrinfo* getanswer(const std::vector<uint8_t>& answer, int anslen, const char* qname,
                                   int qtype, const struct addrinfo* pai, int* herrno) {
+    ScopedQueryStage stage(QueryStage::PARSING);
     struct addrinfo sentinel = {};
     struct addrinfo *cur;
     struct addrinfo ai;
@@ -1349,6 +1389,7 @@ static int _find_src_addr(const struct sockaddr* addr, struct sockaddr* src_addr
  */
 
 static void _rfc6724_sort(struct addrinfo* list_sentinel, unsigned mark, uid_t uid) {
+    ScopedQueryStage stage(QueryStage::RFC6724_SORT);
     struct addrinfo* cur;
     int nelem = 0, i;
     struct addrinfo_sort_elem* elems;
@@ -1596,6 +1637,8 @@ int getHerrnoFromRcode(int rcode) {
         case RCODE_TIMEOUT:
             // DNS metrics monitors DNS query timeout.
             return NETD_RESOLV_H_ERRNO_EXT_TIMEOUT;  // extended h_errno.
+        case RCODE_DEADLINE_EXCEEDED:
+            return NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED;  // extended h_errno.
         // Defined in RFC 1035 section 4.1.1.
         case NXDOMAIN:
             return HOST_NOT_FOUND;
@@ -1656,7 +1699,8 @@ QueryResult doQuery(const char* name, res_target* t, res_state res,
 
     int rcode = NOERROR;
     n = res_nsend(&res_temp, buf, n, t->answer.data(), anslen, &rcode, 0, sleepTimeMs);
-    if (n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
+    if ((n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) &&
+        rcode != RCODE_DEADLINE_EXCEEDED) {
         // if the query choked with EDNS0, retry without EDNS0
         if ((res_temp.netcontext_flags &
              (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
@@ -1685,6 +1729,9 @@ static int res_queryN_parallel(const char* name, res_target* target, res_state r
     results.reserve(2);
     std::chrono::milliseconds sleepTimeMs{};
     for (res_target* t = target; t; t = t->next) {
+        // Don't start another query if the client is gone. The queries already started notice it
+        // by themselves, since their ResState copies share the client socket.
+        if (res->isCancelled()) break;
         results.emplace_back(std::async(std::launch::async, doQuery, name, t, res, sleepTimeMs));
         // Avoiding gateways drop packets if queries are sent too close together
         // Only needed if we have multiple queries in a row.
@@ -1707,7 +1754,8 @@ static int res_queryN_parallel(const char* name, res_target* target, res_state r
         }
         res->event->MergeFrom(r.event);
         ancount += r.ancount;
-        rcode = r.rcode;
+        // Running out of time is what the lookup failed of, whatever the other query got.
+        if (rcode != RCODE_DEADLINE_EXCEEDED) rcode = r.rcode;
     }
 
     if (ancount == 0) {
@@ -1776,6 +1824,14 @@ static int res_queryN(const char* name, res_target* target, res_state res, int*
         }
 
         n = res_nsend(res, buf, n, t->answer.data(), anslen, &rcode, 0);
+        if (n == -ECANCELED) {
+            *herrno = NO_RECOVERY;
+            return -1;
+        }
+        if (rcode == RCODE_DEADLINE_EXCEEDED) {
+            *herrno = NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED;
+            return -1;
+        }
         if (n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
             // Record rcode from DNS response header only if no timeout.
             // Keep rcode timeout for reporting later if any.
@@ -1838,6 +1894,7 @@ static int res_searchN(const char* name, res_target* target, res_state res, int*
     if (dots >= res->ndots) {
         ret = res_querydomainN(name, NULL, target, res, herrno);
         if (ret > 0) return (ret);
+        if (*herrno == NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED) return -1;
         saved_herrno = *herrno;
         tried_as_is++;
     }
@@ -1860,6 +1917,17 @@ static int res_searchN(const char* name, res_target* target, res_state res, int*
             ret = res_querydomainN(name, domain.c_str(), target, res, herrno);
             if (ret > 0) return ret;
 
+            // Nobody is waiting for the answer anymore, don't try the other domains.
+            if (res->isCancelled()) {
+                *herrno = NO_RECOVERY;
+                return -1;
+            }
+            // Neither if there is no time left to wait for them.
+            if (res->deadlineExceeded()) {
+                *herrno = NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED;
+                return -1;
+            }
+
             /*
              * If no server present, give up.
              * If name isn't found in this domain,
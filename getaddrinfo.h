@@ -29,3 +29,9 @@ int android_getaddrinfofornetcontext(const char* hostname, const char* servname,
 int resolv_getaddrinfo(const char* hostname, const char* servname, const addrinfo* hints,
                        const android_net_context* netcontext, addrinfo** res,
                        android::net::NetworkDnsEventReported*);
+
+// Answers a getaddrinfo() request for a numeric hostname by parsing it, without any lookup.
+// Returns true and sets |*res| if |hostname| is an address literal that the hints and service
+// allow; returns false otherwise, in which case resolv_getaddrinfo() must be used.
+bool resolv_getaddrinfo_numeric(const char* hostname, const char* servname, const addrinfo* hints,
+                                addrinfo** res);
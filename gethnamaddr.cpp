@@ -72,6 +72,7 @@
 #include <functional>
 #include <vector>
 
+#include "QueryTrace.h"
 #include "hostent.h"
 #include "netd_resolv/resolv.h"
 #include "res_comp.h"
@@ -127,6 +128,7 @@ static int dns_gethtbyname(ResState* res, const char* name, int af, getnamaddr*
 
 static struct hostent* getanswer(const querybuf* answer, int anslen, const char* qname, int qtype,
                                  struct hostent* hent, char* buf, size_t buflen, int* he) {
+    ScopedQueryStage stage(QueryStage::PARSING);
     const HEADER* hp;
     const uint8_t* cp;
     int n;
@@ -766,6 +768,8 @@ int herrnoToAiErrno(int he) {
         // extended h_errno
         case NETD_RESOLV_H_ERRNO_EXT_TIMEOUT:
             return NETD_RESOLV_TIMEOUT;
+        case NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED:
+            return NETD_RESOLV_DEADLINE_EXCEEDED;
         // legacy h_errno
         case NETDB_SUCCESS:
             return 0;
@@ -25,7 +25,8 @@
  * This error code, including EAI_*, returned from android_getaddrinfofornetcontext()
  * and resolv_gethostbyname() are used for DNS metrics.
  */
-#define NETD_RESOLV_TIMEOUT 255  // consistent with RCODE_TIMEOUT
+#define NETD_RESOLV_DEADLINE_EXCEEDED 253  // consistent with RCODE_DEADLINE_EXCEEDED
+#define NETD_RESOLV_TIMEOUT 255            // consistent with RCODE_TIMEOUT
 
 // This is the entry point for the gethostbyname() family of legacy calls.
 int resolv_gethostbyname(const char* name, int af, hostent* hp, char* buf, size_t buflen,
@@ -65,6 +65,9 @@ struct android_net_context {
     unsigned flags;
     // Variable to store the pid of the application sending DNS query.
     pid_t pid = NET_CONTEXT_INVALID_PID;
+    // Socket of the client waiting for the answer, or -1. If the client hangs up, the lookup is
+    // abandoned since nobody is waiting for the answer anymore.
+    int client_fd = -1;
 };
 
 #define NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS 0x00000001
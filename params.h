@@ -32,4 +32,5 @@ struct res_params {
     uint8_t max_samples;        // max # samples taken into account for statistics
     int base_timeout_msec;      // base query retry timeout (if 0, use RES_TIMEOUT)
     int retry_count;            // number of retries
+    int deadline_msec;          // time budget of a whole lookup (if 0, use RES_DEADLINE_MSEC)
 };
@@ -60,6 +60,8 @@
 #include <server_configurable_flags/get_flags.h>
 
 #include "DnsStats.h"
+#include "Experiments.h"
+#include "QueryTrace.h"
 #include "res_comp.h"
 #include "res_debug.h"
 #include "resolv_private.h"
@@ -69,6 +71,7 @@ using aidl::android::net::IDnsResolver;
 using android::base::StringAppendF;
 using android::net::DnsQueryEvent;
 using android::net::DnsStats;
+using android::net::Experiments;
 using android::net::PROTO_DOT;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
@@ -1187,6 +1190,7 @@ static NetConfig* find_netconfig_locked(unsigned netid) REQUIRES(cache_mutex);
 
 ResolvCacheStatus resolv_cache_lookup(unsigned netid, const void* query, int querylen, void* answer,
                                       int answersize, int* answerlen, uint32_t flags) {
+    ScopedQueryStage stage(QueryStage::CACHE_LOOKUP);
     // Skip cache lookup, return RESOLV_CACHE_NOTFOUND directly so that it is
     // possible to cache the answer of this query.
     // If ANDROID_RESOLV_NO_CACHE_STORE is set, return RESOLV_CACHE_SKIP to skip possible cache
@@ -1509,6 +1513,11 @@ static void resolv_set_experiment_params(res_params* params) {
         params->base_timeout_msec =
                 getExperimentFlagInt("retransmission_time_interval", RES_TIMEOUT);
     }
+
+    if (params->deadline_msec == 0) {
+        params->deadline_msec =
+                Experiments::getInstance()->getFlag("lookup_deadline_msec", RES_DEADLINE_MSEC);
+    }
 }
 
 android::net::NetworkType resolv_get_network_types_for_net(unsigned netid) {
@@ -1686,29 +1695,15 @@ void resolv_populate_res_for_net(ResState* statp) {
     statp->search_domains = info->search_domains;
     statp->tc_mode = info->tc_mode;
     statp->enforce_dns_uid = info->enforceDnsUid;
+    // The first time the lookup needs the network is when its time budget starts.
+    statp->startDeadline(info->params.deadline_msec);
 }
 
 /* Resolver reachability statistics. */
 
-static void res_cache_add_stats_sample_locked(res_stats* stats, const res_sample& sample,
-                                              int max_samples) {
-    // Note: This function expects max_samples > 0, otherwise a (harmless) modification of the
-    // allocated but supposedly unused memory for samples[0] will happen
-    LOG(INFO) << __func__ << ": adding sample to stats, next = " << unsigned(stats->sample_next)
-              << ", count = " << unsigned(stats->sample_count);
-    stats->samples[stats->sample_next] = sample;
-    if (stats->sample_count < max_samples) {
-        ++stats->sample_count;
-    }
-    if (++stats->sample_next >= max_samples) {
-        stats->sample_next = 0;
-    }
-}
-
 static void res_cache_clear_stats_locked(NetConfig* netconfig) {
     for (int i = 0; i < MAXNS; ++i) {
-        netconfig->nsstats[i].sample_count = 0;
-        netconfig->nsstats[i].sample_next = 0;
+        _res_stats_clear_samples(&netconfig->nsstats[i]);
     }
 
     // Increment the revision id to ensure that sample state is not written back if the
@@ -1787,6 +1782,13 @@ uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code) {
     return denom;
 }
 
+int resolv_cache_get_deadline_msec(unsigned netid) {
+    std::lock_guard guard(cache_mutex);
+    NetConfig* netconfig = find_netconfig_locked(netid);
+    if (netconfig == nullptr || netconfig->params.deadline_msec <= 0) return RES_DEADLINE_MSEC;
+    return netconfig->params.deadline_msec;
+}
+
 int resolv_cache_get_resolver_stats(unsigned netid, res_params* params, res_stats stats[MAXNS],
                                     const std::vector<IPSockAddr>& serverSockAddrs) {
     std::lock_guard guard(cache_mutex);
@@ -1816,6 +1818,40 @@ int resolv_cache_get_resolver_stats(unsigned netid, res_params* params, res_stat
     return info->revision_id;
 }
 
+int resolv_cache_get_usable_servers(unsigned netid, res_params* params,
+                                    const std::vector<IPSockAddr>& serverSockAddrs,
+                                    bool usable_servers[MAXNS], int* usable_count) {
+    std::lock_guard guard(cache_mutex);
+    NetConfig* info = find_netconfig_locked(netid);
+    if (!info) return -1;
+
+    const int nscount = std::min(MAXNS, static_cast<int>(serverSockAddrs.size()));
+    const int serverNum = std::min(MAXNS, static_cast<int>(info->nameserverSockAddrs.size()));
+    int found = 0;
+    for (int i = 0; i < nscount; i++) {
+        // A server which is not found, e.g. because a new list of nameservers was set after this
+        // lookup started, is kept usable as-is.
+        bool usable = true;
+        for (int j = 0; j < serverNum; j++) {
+            if (info->nameserverSockAddrs[j] == serverSockAddrs[i]) {
+                usable = android_net_res_stats_usable_server(&info->params, &info->nsstats[j]);
+                break;
+            }
+        }
+        usable_servers[i] = usable;
+        if (usable) ++found;
+    }
+    // If there are no usable servers, consider all of them usable.
+    if (found == 0) {
+        std::fill_n(usable_servers, nscount, true);
+        found = nscount;
+    }
+
+    *params = info->params;
+    *usable_count = found;
+    return info->revision_id;
+}
+
 void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id,
                                             const IPSockAddr& serverSockAddr,
                                             const res_sample& sample, int max_samples) {
@@ -1828,7 +1864,7 @@ void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id,
         const int serverNum = std::min(MAXNS, static_cast<int>(info->nameserverSockAddrs.size()));
         for (int ns = 0; ns < serverNum; ns++) {
             if (serverSockAddr == info->nameserverSockAddrs[ns]) {
-                res_cache_add_stats_sample_locked(&info->nsstats[ns], sample, max_samples);
+                android_net_res_stats_add_sample(&info->nsstats[ns], sample, max_samples);
                 return;
             }
         }
@@ -1874,19 +1910,13 @@ int resolv_cache_get_expiration(unsigned netid, const std::vector<char>& query,
     return 0;
 }
 
-int resolv_stats_set_servers_for_dot(unsigned netid, const std::vector<std::string>& servers) {
+int resolv_stats_set_servers_for_dot(unsigned netid, const std::vector<IPSockAddr>& servers) {
     std::lock_guard guard(cache_mutex);
     const auto info = find_netconfig_locked(netid);
 
     if (info == nullptr) return -ENONET;
 
-    std::vector<IPSockAddr> serverSockAddrs;
-    serverSockAddrs.reserve(servers.size());
-    for (const auto& server : servers) {
-        serverSockAddrs.push_back(IPSockAddr::toIPSockAddr(server, 853));
-    }
-
-    if (!info->dnsStats.setServers(serverSockAddrs, android::net::PROTO_DOT)) {
+    if (!info->dnsStats.setServers(servers, android::net::PROTO_DOT)) {
         LOG(WARNING) << __func__ << ": netid = " << netid << ", failed to set dns stats";
         return -EINVAL;
     }
@@ -1905,6 +1935,33 @@ bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& serv
     return false;
 }
 
+std::vector<IPSockAddr> resolv_stats_rank_servers(unsigned netid, android::net::Protocol protocol,
+                                                  const std::vector<IPSockAddr>& servers,
+                                                  const std::set<IPSockAddr>& connected) {
+    std::lock_guard guard(cache_mutex);
+    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+        return info->dnsStats.rankServers(protocol, servers, connected);
+    }
+    return servers;
+}
+
+void resolv_stats_add_race_win(unsigned netid, const IPSockAddr& winner,
+                               android::net::Protocol protocol) {
+    std::lock_guard guard(cache_mutex);
+    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+        info->dnsStats.addRaceWin(winner, protocol);
+    }
+}
+
+int resolv_stats_get(unsigned netid, android::net::Protocol protocol,
+                     std::vector<android::net::StatsData>* stats) {
+    std::lock_guard guard(cache_mutex);
+    const auto info = find_netconfig_locked(netid);
+    if (info == nullptr) return -ENONET;
+    *stats = info->dnsStats.getStats(protocol);
+    return 0;
+}
+
 static const char* tc_mode_to_str(const int mode) {
     switch (mode) {
         case aidl::android::net::IDnsResolver::TC_MODE_DEFAULT:
@@ -2002,6 +2059,7 @@ void resolv_netconfig_dump(DumpWriter& dw, unsigned netid) {
     std::lock_guard guard(cache_mutex);
     if (const auto info = find_netconfig_locked(netid); info != nullptr) {
         info->dnsStats.dump(dw);
+        info->dnsStats.dumpRankings(dw);
         // TODO: dump info->hosts
         dw.println("TC mode: %s", tc_mode_to_str(info->tc_mode));
         dw.println("TransportType: %s", transport_type_to_str(info->transportTypes));
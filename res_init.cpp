@@ -85,6 +85,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -108,6 +109,7 @@ void res_init(ResState* statp, const struct android_net_context* _Nonnull netcon
     statp->tcp_nssock.reset();
     statp->event = event;
     statp->netcontext_flags = netcontext->flags;
+    statp->client_fd = netcontext->client_fd;
 }
 
 // TODO: Have some proper constructors for ResState instead of this method and res_init().
@@ -129,5 +131,24 @@ ResState fromResState(const ResState& other, android::net::NetworkDnsEventReport
     resOutput.tcp_nssock.reset();
     resOutput.event = event;
     resOutput.netcontext_flags = other.netcontext_flags;
+    resOutput.client_fd = other.client_fd;
+    resOutput.deadline = other.deadline;
     return resOutput;
 }
+
+bool ResState::isCancelled() const {
+    if (client_fd < 0) return false;
+    // POLLHUP is only reported once the client has closed its end entirely. A client that merely
+    // shut down its writing side is still waiting for the answer.
+    pollfd fds = {.fd = client_fd, .events = 0};
+    return poll(&fds, 1, 0) == 1 && (fds.revents & (POLLHUP | POLLERR));
+}
+
+void ResState::startDeadline(int msec) {
+    if (deadline != std::chrono::steady_clock::time_point::max() || msec <= 0) return;
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(msec);
+}
+
+bool ResState::deadlineExceeded() const {
+    return std::chrono::steady_clock::now() >= deadline;
+}
@@ -130,6 +130,11 @@ again:
         return n;
     }
     n = res_nsend(statp, buf, n, answer, anslen, &rcode, 0);
+    if (n < 0 && rcode == RCODE_DEADLINE_EXCEEDED) {
+        LOG(DEBUG) << __func__ << ": deadline exceeded";
+        *herrno = NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED;  // extended h_errno.
+        return n;
+    }
     if (n < 0) {
         // If the query choked with EDNS0, retry without EDNS0 that when the server
         // has no response, resovler won't retry and do nothing. Even fallback to UDP,
@@ -231,6 +236,7 @@ int res_nsearch(res_state statp, const char* name, /* domain name */
     if (dots >= statp->ndots || trailing_dot) {
         ret = res_nquerydomain(statp, name, NULL, cl, type, answer, anslen, herrno);
         if (ret > 0 || trailing_dot) return ret;
+        if (*herrno == NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED) return -1;
         saved_herrno = *herrno;
         tried_as_is++;
     }
@@ -258,6 +264,17 @@ int res_nsearch(res_state statp, const char* name, /* domain name */
             ret = res_nquerydomain(statp, name, domain.c_str(), cl, type, answer, anslen, herrno);
             if (ret > 0) return ret;
 
+            // Nobody is waiting for the answer anymore, don't try the other domains.
+            if (statp->isCancelled()) {
+                *herrno = NO_RECOVERY;
+                return -1;
+            }
+            // Neither if there is no time left to wait for them.
+            if (statp->deadlineExceeded()) {
+                *herrno = NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED;
+                return -1;
+            }
+
             /*
              * If no server present, give up.
              * If name isn't found in this domain,
@@ -77,6 +77,8 @@
 #define LOG_TAG "resolv"
 
 #include <chrono>
+#include <iterator>
+#include <vector>
 
 #include <sys/param.h>
 #include <sys/socket.h>
@@ -106,6 +108,8 @@
 #include "DnsTlsTransport.h"
 #include "Experiments.h"
 #include "PrivateDnsConfiguration.h"
+#include "QueryTrace.h"
+#include "TcpFastOpen.h"
 #include "netd_resolv/resolv.h"
 #include "private/android_filesystem_config.h"
 
@@ -140,11 +144,13 @@ using android::net::PrivateDnsModes;
 using android::net::PrivateDnsStatus;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
+using android::net::TcpFastOpenTracker;
 using android::netdutils::IPSockAddr;
 using android::netdutils::Slice;
 using android::netdutils::Stopwatch;
 
-static DnsTlsDispatcher sDnsTlsDispatcher;
+// How long a query waits for a validated server when private DNS is in strict mode.
+static constexpr std::chrono::milliseconds kStrictModeWaitTime{4200};
 
 static int send_vc(res_state statp, res_params* params, const uint8_t* buf, int buflen,
                    uint8_t* ans, int anssiz, int* terrno, size_t ns, time_t* at, int* rcode,
@@ -157,8 +163,13 @@ static void dump_error(const char*, const struct sockaddr*, int);
 
 static int sock_eq(struct sockaddr*, struct sockaddr*);
 static int connect_with_timeout(int sock, const struct sockaddr* nsap, socklen_t salen,
-                                const struct timespec timeout);
-static int retrying_poll(const int sock, short events, const struct timespec* finish);
+                                const struct timespec timeout, int cancelFd);
+static int connect_fast_open(int sock, const struct sockaddr* nsap, socklen_t salen,
+                             const iovec* iov, int iovcnt, const struct timespec timeout,
+                             int cancelFd, size_t* sent);
+static ssize_t writev_from(int sock, const iovec* iov, int iovcnt, size_t offset);
+static int retrying_poll(const int sock, short events, const struct timespec* finish,
+                         int cancelFd = -1);
 static int res_tls_send(res_state, const Slice query, const Slice answer, int* rcode,
                         bool* fallback);
 
@@ -411,6 +422,30 @@ static DnsQueryEvent* addDnsQueryEvent(NetworkDnsEventReported* event) {
     return event->mutable_dns_query_events()->add_dns_query_event();
 }
 
+// Gives up a query whose client has gone away.
+static int abandon_query(res_state statp, const uint8_t* buf, int buflen, uint32_t flags) {
+    LOG(INFO) << __func__ << ": client gone, abandoning query";
+    // Tell the cache the query failed, so that anyone else asking the same question doesn't
+    // wait for PENDING_REQUEST_TIMEOUT seconds.
+    _resolv_cache_query_failed(statp->netid, buf, buflen, flags);
+    statp->closeSockets();
+    // TODO: Remove errno once callers stop using it
+    errno = ECANCELED;
+    return -ECANCELED;
+}
+
+// Gives up a query whose lookup has used up its time budget.
+static int expire_query(res_state statp, const uint8_t* buf, int buflen, uint32_t flags,
+                        int* rcode) {
+    LOG(INFO) << __func__ << ": lookup deadline exceeded, giving up";
+    _resolv_cache_query_failed(statp->netid, buf, buflen, flags);
+    statp->closeSockets();
+    *rcode = RCODE_DEADLINE_EXCEEDED;
+    // TODO: Remove errno once callers stop using it
+    errno = ETIMEDOUT;
+    return -ETIMEDOUT;
+}
+
 static bool isNetworkRestricted(int terrno) {
     // It's possible that system was in some network restricted mode, which blocked
     // the operation of sending packet and resulted in EPERM errno.
@@ -461,6 +496,9 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
         return -ESRCH;
     }
 
+    if (statp->isCancelled()) return abandon_query(statp, buf, buflen, flags);
+    if (statp->deadlineExceeded()) return expire_query(statp, buf, buflen, flags, rcode);
+
     // If parallel_lookup is enabled, it might be required to wait some time to avoid
     // gateways drop packets if queries are sent too close together
     if (sleepTimeMs != 0ms) {
@@ -480,22 +518,23 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
             return resplen;
         }
         if (!fallback) {
+            if (statp->isCancelled()) return abandon_query(statp, buf, buflen, flags);
+            if (statp->deadlineExceeded()) return expire_query(statp, buf, buflen, flags, rcode);
             _resolv_cache_query_failed(statp->netid, buf, buflen, flags);
             return -ETIMEDOUT;
         }
     }
 
-    res_stats stats[MAXNS]{};
     res_params params;
-    int revision_id = resolv_cache_get_resolver_stats(statp->netid, &params, stats, statp->nsaddrs);
+    bool usable_servers[MAXNS];
+    int usableServersCount = 0;
+    int revision_id = resolv_cache_get_usable_servers(statp->netid, &params, statp->nsaddrs,
+                                                      usable_servers, &usableServersCount);
     if (revision_id < 0) {
         // TODO: Remove errno once callers stop using it
         errno = ESRCH;
         return -ESRCH;
     }
-    bool usable_servers[MAXNS];
-    int usableServersCount = android_net_res_stats_get_usable_servers(
-            &params, stats, statp->nameserverCount(), usable_servers);
 
     if ((flags & ANDROID_RESOLV_NO_RETRY) && usableServersCount > 1) {
         auto hp = reinterpret_cast<const HEADER*>(buf);
@@ -515,6 +554,8 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
     for (int attempt = 0; attempt < retryTimes; ++attempt) {
         for (size_t ns = 0; ns < statp->nsaddrs.size(); ++ns) {
             if (!usable_servers[ns]) continue;
+            if (statp->isCancelled()) return abandon_query(statp, buf, buflen, flags);
+            if (statp->deadlineExceeded()) return expire_query(statp, buf, buflen, flags, rcode);
 
             *rcode = RCODE_INTERNAL_ERROR;
 
@@ -555,6 +596,12 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
                 retry_count_for_event = attempt;
                 LOG(INFO) << __func__ << ": used send_dg " << resplen << " terrno: " << terrno;
             }
+            // Don't record an aborted wait as a failure of the server.
+            if (terrno == ECANCELED) return abandon_query(statp, buf, buflen, flags);
+            // A wait cut short by the deadline says nothing about the server either, but the
+            // query is still reported, so that the event shows why the lookup gave up.
+            const bool expired = (resplen <= 0 && statp->deadlineExceeded());
+            if (expired) *rcode = RCODE_DEADLINE_EXCEEDED;
 
             const IPSockAddr& receivedServerAddr = statp->nsaddrs[actualNs];
             DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
@@ -576,7 +623,7 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
             // Only record stats the first time we try a query. This ensures that
             // queries that deterministically fail (e.g., a name that always returns
             // SERVFAIL or times out) do not unduly affect the stats.
-            if (shouldRecordStats) {
+            if (shouldRecordStats && !expired) {
                 // (b/151166599): This is a workaround to prevent that DnsResolver calculates the
                 // reliability of DNS servers from being broken when network restricted mode is
                 // enabled.
@@ -593,6 +640,7 @@ int res_nsend(res_state statp, const uint8_t* buf, int buflen, uint8_t* ans, int
                 resolv_stats_add(statp->netid, receivedServerAddr, dnsQueryEvent);
             }
 
+            if (expired) return expire_query(statp, buf, buflen, flags, rcode);
             if (resplen == 0) continue;
             if (fallbackTCP) {
                 ns--;
@@ -646,6 +694,17 @@ static struct timespec get_timeout(res_state statp, const res_params* params, co
     return result;
 }
 
+// Returns |timeout|, shortened to what is left of the time budget of the lookup.
+static struct timespec clamp_timeout(res_state statp, const struct timespec timeout) {
+    if (statp->deadline == std::chrono::steady_clock::time_point::max()) return timeout;
+    const auto now = std::chrono::steady_clock::now();
+    if (statp->deadline <= now) return evConsTime(0L, 0L);
+    const auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(statp->deadline - now);
+    const struct timespec remaining = evConsTime(left.count() / 1000000000L,
+                                                 left.count() % 1000000000L);
+    return (evCmpTime(remaining, timeout) < 0) ? remaining : timeout;
+}
+
 static int send_vc(res_state statp, res_params* params, const uint8_t* buf, int buflen,
                    uint8_t* ans, int anssiz, int* terrno, size_t ns, time_t* at, int* rcode,
                    int* delay) {
@@ -671,12 +730,24 @@ static int send_vc(res_state statp, res_params* params, const uint8_t* buf, int
     nsap = reinterpret_cast<sockaddr*>(&ss);
     nsaplen = sockaddrSize(nsap);
 
+    TcpFastOpenTracker* fastOpenTracker = TcpFastOpenTracker::getInstance();
+    bool fastOpen = Experiments::getInstance()->getFlag("tcp_fast_open", 0) &&
+                    fastOpenTracker->shouldTry(statp->netid, IPSockAddr::toIPSockAddr(ss));
+
     connreset = 0;
 same_ns:
     truncating = 0;
 
     struct timespec start_time = evNowTime();
 
+    uint16_t len = htons(static_cast<uint16_t>(buflen));
+    const iovec iov[] = {
+            {.iov_base = &len, .iov_len = INT16SZ},
+            {.iov_base = const_cast<uint8_t*>(buf), .iov_len = static_cast<size_t>(buflen)},
+    };
+    // Bytes of |iov| which a new connection sent with the SYN.
+    size_t sent = 0;
+
     /* Are we still talking to whom we want to talk to? */
     if (statp->tcp_nssock >= 0 && (statp->_flags & RES_F_VC) != 0) {
         struct sockaddr_storage peer;
@@ -692,6 +763,7 @@ same_ns:
     }
 
     if (statp->tcp_nssock < 0 || (statp->_flags & RES_F_VC) == 0) {
+        ScopedQueryStage stage(QueryStage::SOCKET_SETUP);
         if (statp->tcp_nssock >= 0) statp->closeSockets();
 
         statp->tcp_nssock.reset(socket(nsap->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0));
@@ -724,11 +796,27 @@ same_ns:
             statp->closeSockets();
             return (0);
         }
-        if (connect_with_timeout(statp->tcp_nssock, nsap, (socklen_t)nsaplen,
-                                 get_timeout(statp, params, ns)) < 0) {
+        const timespec timeout = clamp_timeout(statp, get_timeout(statp, params, ns));
+        const int res = fastOpen ? connect_fast_open(statp->tcp_nssock, nsap, (socklen_t)nsaplen,
+                                                     iov, std::size(iov), timeout,
+                                                     statp->client_fd, &sent)
+                                 : connect_with_timeout(statp->tcp_nssock, nsap,
+                                                        (socklen_t)nsaplen, timeout,
+                                                        statp->client_fd);
+        if (res < 0) {
             *terrno = errno;
             dump_error("connect/vc", nsap, nsaplen);
             statp->closeSockets();
+            // A cancelled lookup, or one out of time, says nothing about the server.
+            if (sent > 0 && *terrno != ECANCELED && !statp->deadlineExceeded()) {
+                fastOpenTracker->report(statp->netid, IPSockAddr::toIPSockAddr(ss),
+                                        TcpFastOpenTracker::Outcome::FAILED);
+                fastOpen = false;
+                // A reset may come from a path which rejects SYNs carrying data.  Try again
+                // the usual way.  Other failures, such as timeouts, may as well come from a
+                // dead server, and trying again would only wait for another timeout.
+                if (*terrno == ECONNREFUSED || *terrno == ECONNRESET) goto same_ns;
+            }
             /*
              * The way connect_with_timeout() is implemented prevents us from reliably
              * determining whether this was really a timeout or e.g. ECONNREFUSED. Since
@@ -740,18 +828,24 @@ same_ns:
             *rcode = RCODE_TIMEOUT;
             return (0);
         }
+        if (sent > 0) {
+            fastOpenTracker->report(statp->netid, IPSockAddr::toIPSockAddr(ss),
+                                    isSynDataAcked(statp->tcp_nssock)
+                                            ? TcpFastOpenTracker::Outcome::ACCEPTED
+                                            : TcpFastOpenTracker::Outcome::REJECTED);
+        }
         statp->_flags |= RES_F_VC;
     }
 
+    // The round trip starts with the SYN when it carries the query, but that's hard to tell
+    // apart from the connection setup.
+    ScopedQueryStage rtt(QueryStage::NETWORK_RTT);
     /*
-     * Send length & message
+     * Send length & message, or what the SYN didn't carry of them
      */
-    uint16_t len = htons(static_cast<uint16_t>(buflen));
-    const iovec iov[] = {
-            {.iov_base = &len, .iov_len = INT16SZ},
-            {.iov_base = const_cast<uint8_t*>(buf), .iov_len = static_cast<size_t>(buflen)},
-    };
-    if (writev(statp->tcp_nssock, iov, 2) != (INT16SZ + buflen)) {
+    if (sent < INT16SZ + static_cast<size_t>(buflen) &&
+        writev_from(statp->tcp_nssock, iov, std::size(iov), sent) !=
+                static_cast<ssize_t>(INT16SZ + buflen - sent)) {
         *terrno = errno;
         PLOG(DEBUG) << __func__ << ": write failed: ";
         statp->closeSockets();
@@ -763,6 +857,19 @@ same_ns:
 read_len:
     cp = ans;
     len = INT16SZ;
+    // The reads below block, so don't start them before the answer is there or the lookup
+    // would outlive its deadline.
+    if (statp->deadline != std::chrono::steady_clock::time_point::max()) {
+        // retrying_poll() works on the clock of evNowTime().
+        const timespec finish =
+                evAddTime(evNowTime(), clamp_timeout(statp, evConsTime(INT32_MAX, 0L)));
+        if (retrying_poll(statp->tcp_nssock, POLLIN, &finish, statp->client_fd) <= 0) {
+            *terrno = errno;
+            PLOG(DEBUG) << __func__ << ": poll failed: ";
+            statp->closeSockets();
+            return (0);
+        }
+    }
     while ((n = read(statp->tcp_nssock, (char*)cp, (size_t)len)) > 0) {
         cp += n;
         if ((len -= n) == 0) break;
@@ -861,7 +968,7 @@ read_len:
 
 /* return -1 on error (errno set), 0 on success */
 static int connect_with_timeout(int sock, const sockaddr* nsap, socklen_t salen,
-                                const timespec timeout) {
+                                const timespec timeout, int cancelFd) {
     int res, origflags;
 
     origflags = fcntl(sock, F_GETFL, 0);
@@ -876,7 +983,7 @@ static int connect_with_timeout(int sock, const sockaddr* nsap, socklen_t salen,
         timespec now = evNowTime();
         timespec finish = evAddTime(now, timeout);
         LOG(INFO) << __func__ << ": " << sock << " send_vc";
-        res = retrying_poll(sock, POLLIN | POLLOUT, &finish);
+        res = retrying_poll(sock, POLLIN | POLLOUT, &finish, cancelFd);
         if (res <= 0) {
             res = -1;
         }
@@ -887,7 +994,72 @@ done:
     return res;
 }
 
-static int retrying_poll(const int sock, const short events, const struct timespec* finish) {
+/*
+ * Like connect_with_timeout(), but sends as much of |iov| as the kernel can with the SYN, using
+ * TCP Fast Open, and stores the number of bytes sent in |sent|.  That is 0 if the kernel had no
+ * TFO cookie for the server yet, in which case the SYN only asks for one.
+ * return -1 on error (errno set), 0 on success
+ */
+static int connect_fast_open(int sock, const sockaddr* nsap, socklen_t salen, const iovec* iov,
+                             int iovcnt, const timespec timeout, int cancelFd, size_t* sent) {
+    *sent = 0;
+    const int origflags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, origflags | O_NONBLOCK);
+
+    msghdr msg = {};
+    msg.msg_name = const_cast<sockaddr*>(nsap);
+    msg.msg_namelen = salen;
+    msg.msg_iov = const_cast<iovec*>(iov);
+    msg.msg_iovlen = iovcnt;
+    int res = 0;
+    const ssize_t n = sendmsg(sock, &msg, MSG_FASTOPEN | MSG_NOSIGNAL);
+    if (n >= 0) {
+        *sent = n;
+    } else if (errno == EOPNOTSUPP) {
+        // TFO is disabled in the kernel.
+        fcntl(sock, F_SETFL, origflags);
+        return connect_with_timeout(sock, nsap, salen, timeout, cancelFd);
+    } else if (errno != EINPROGRESS) {
+        res = -1;
+    }
+    if (res == 0) {
+        const timespec finish = evAddTime(evNowTime(), timeout);
+        res = (retrying_poll(sock, POLLIN | POLLOUT, &finish, cancelFd) > 0) ? 0 : -1;
+    }
+    // The poll can end with POLLHUP alone, e.g. if the SYN was reset, without the connection
+    // error having been collected.
+    if (res == 0) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            res = -1;
+        } else if (error) {
+            errno = error;
+            res = -1;
+        }
+    }
+    fcntl(sock, F_SETFL, origflags);
+    LOG(INFO) << __func__ << ": " << sock << " returning " << res << ", sent " << *sent;
+    return res;
+}
+
+// Writes |iov|, skipping its first |offset| bytes.  Returns the number of bytes written, or -1.
+static ssize_t writev_from(int sock, const iovec* iov, int iovcnt, size_t offset) {
+    while (iovcnt > 0 && offset >= iov->iov_len) {
+        offset -= iov->iov_len;
+        iov++;
+        iovcnt--;
+    }
+    if (offset == 0) return writev(sock, iov, iovcnt);
+    std::vector<iovec> rest(iov, iov + iovcnt);
+    rest[0].iov_base = static_cast<uint8_t*>(rest[0].iov_base) + offset;
+    rest[0].iov_len -= offset;
+    return writev(sock, rest.data(), rest.size());
+}
+
+// If |cancelFd| is hung up while waiting, returns -1 with errno set to ECANCELED.
+static int retrying_poll(const int sock, const short events, const struct timespec* finish,
+                         int cancelFd) {
     struct timespec now, timeout;
 
 retry:
@@ -898,8 +1070,10 @@ retry:
         timeout = evSubTime(*finish, now);
     else
         timeout = evConsTime(0L, 0L);
-    struct pollfd fds = {.fd = sock, .events = events};
-    int n = ppoll(&fds, 1, &timeout, /*__mask=*/NULL);
+    // poll() ignores the second entry if cancelFd is negative.
+    struct pollfd pfds[] = {{.fd = sock, .events = events}, {.fd = cancelFd, .events = 0}};
+    const struct pollfd& fds = pfds[0];
+    int n = ppoll(pfds, 2, &timeout, /*__mask=*/NULL);
     if (n == 0) {
         LOG(INFO) << __func__ << ": " << sock << " retrying_poll timeout";
         errno = ETIMEDOUT;
@@ -910,6 +1084,11 @@ retry:
         PLOG(INFO) << __func__ << ": " << sock << " retrying_poll failed";
         return n;
     }
+    if (pfds[1].revents & (POLLHUP | POLLERR)) {
+        LOG(INFO) << __func__ << ": " << sock << " retrying_poll cancelled";
+        errno = ECANCELED;
+        return -1;
+    }
     if (fds.revents & (POLLIN | POLLOUT | POLLERR)) {
         int error;
         socklen_t len = sizeof(error);
@@ -938,6 +1117,9 @@ static Result<std::vector<int>> udpRetryingPoll(res_state statp, const timespec*
         timespec timeout = (evCmpTime(*finish, start_time) > 0) ? evSubTime(*finish, start_time)
                                                                 : evConsTime(0L, 0L);
         std::vector<pollfd> fdset = extractUdpFdset(statp);
+        // Also watch the client socket, so that the wait ends as soon as the client is gone.
+        // poll() ignores it if client_fd is negative.
+        fdset.push_back({.fd = statp->client_fd, .events = 0});
         const int n = ppoll(fdset.data(), fdset.size(), &timeout, /*__mask=*/nullptr);
         if (n <= 0) {
             if (errno == EINTR && n < 0) continue;
@@ -945,6 +1127,12 @@ static Result<std::vector<int>> udpRetryingPoll(res_state statp, const timespec*
             PLOG(INFO) << __func__ << ": failed";
             return ErrnoError();
         }
+        if (fdset.back().revents & (POLLHUP | POLLERR)) {
+            LOG(INFO) << __func__ << ": cancelled";
+            errno = ECANCELED;
+            return ErrnoError();
+        }
+        fdset.pop_back();
         std::vector<int> fdsToRead;
         for (const auto& pollfd : fdset) {
             if (pollfd.revents & (POLLIN | POLLERR)) {
@@ -963,7 +1151,7 @@ static Result<std::vector<int>> udpRetryingPollWrapper(res_state statp, int ns,
             android::net::Experiments::getInstance()->getFlag("keep_listening_udp", 0);
     if (keepListeningUdp) return udpRetryingPoll(statp, finish);
 
-    if (int n = retrying_poll(statp->nssocks[ns], POLLIN, finish); n <= 0) {
+    if (int n = retrying_poll(statp->nssocks[ns], POLLIN, finish, statp->client_fd); n <= 0) {
         return ErrnoError();
     }
     return std::vector<int>{statp->nssocks[ns]};
@@ -1008,6 +1196,7 @@ static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int
     const int nsaplen = sockaddrSize(nsap);
 
     if (statp->nssocks[*ns] == -1) {
+        ScopedQueryStage stage(QueryStage::SOCKET_SETUP);
         statp->nssocks[*ns].reset(socket(nsap->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0));
         if (statp->nssocks[*ns] < 0) {
             *terrno = errno;
@@ -1050,6 +1239,7 @@ static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int
         }
         LOG(DEBUG) << __func__ << ": new DG socket";
     }
+    ScopedQueryStage rtt(QueryStage::NETWORK_RTT);
     if (send(statp->nssocks[*ns], (const char*)buf, (size_t)buflen, 0) != buflen) {
         *terrno = errno;
         PLOG(DEBUG) << __func__ << ": send: ";
@@ -1057,7 +1247,7 @@ static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int
         return 0;
     }
 
-    timespec timeout = get_timeout(statp, params, *ns);
+    timespec timeout = clamp_timeout(statp, get_timeout(statp, params, *ns));
     timespec start_time = evNowTime();
     timespec finish = evAddTime(start_time, timeout);
     for (;;) {
@@ -1067,7 +1257,7 @@ static int send_dg(res_state statp, res_params* params, const uint8_t* buf, int
         if (!result.has_value()) {
             const bool isTimeout = (result.error().code() == ETIMEDOUT);
             *rcode = (isTimeout) ? RCODE_TIMEOUT : *rcode;
-            *terrno = (isTimeout) ? ETIMEDOUT : errno;
+            *terrno = (isTimeout) ? ETIMEDOUT : result.error().code();
             *gotsomewhere = (isTimeout) ? 1 : *gotsomewhere;
             // Leave the UDP sockets open on timeout so we can keep listening for
             // a late response from this server while retrying on the next server.
@@ -1203,41 +1393,31 @@ static int res_tls_send(res_state statp, const Slice query, const Slice answer,
     int resplen = 0;
     const unsigned netId = statp->netid;
 
-    PrivateDnsStatus privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
-    statp->event->set_private_dns_modes(convertEnumType(privateDnsStatus.mode));
+    auto privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
+    statp->event->set_private_dns_modes(convertEnumType(privateDnsStatus->mode));
 
-    if (privateDnsStatus.mode == PrivateDnsMode::OFF) {
+    if (privateDnsStatus->mode == PrivateDnsMode::OFF) {
         *fallback = true;
         return -1;
     }
 
-    if (privateDnsStatus.validatedServers().empty()) {
-        if (privateDnsStatus.mode == PrivateDnsMode::OPPORTUNISTIC) {
+    if (privateDnsStatus->validatedServers().empty()) {
+        if (privateDnsStatus->mode == PrivateDnsMode::OPPORTUNISTIC) {
             *fallback = true;
             return -1;
         } else {
-            // Sleep and iterate some small number of times checking for the
-            // arrival of resolved and validated server IP addresses, instead
-            // of returning an immediate error.
+            // Wait a few seconds for the arrival of resolved and validated server IP addresses,
+            // instead of returning an immediate error.
             // This is needed because as soon as a network becomes the default network, apps will
             // send DNS queries on that network. If no servers have yet validated, and we do not
             // block those queries, they would immediately fail, causing application-visible errors.
             // Note that this can happen even before the network validates, since an unvalidated
             // network can become the default network if no validated networks are available.
-            //
-            // TODO: see if there is a better way to address this problem, such as buffering the
-            // queries in a queue or only blocking queries for the first few seconds after a default
-            // network change.
-            for (int i = 0; i < 42; i++) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                // Calling getStatus() to merely check if there's any validated server seems
-                // wasteful. Consider adding a new method in PrivateDnsConfiguration for speed ups.
-                if (!gPrivateDnsConfiguration.getStatus(netId).validatedServers().empty()) {
-                    privateDnsStatus = gPrivateDnsConfiguration.getStatus(netId);
-                    break;
-                }
-            }
-            if (privateDnsStatus.validatedServers().empty()) {
+            // The queries are released as soon as the first server validates.
+            privateDnsStatus = gPrivateDnsConfiguration.waitForValidatedServer(
+                    netId, kStrictModeWaitTime,
+                    [statp] { return statp->isCancelled() || statp->deadlineExceeded(); });
+            if (privateDnsStatus->validatedServers().empty()) {
                 return -1;
             }
         }
@@ -1245,12 +1425,12 @@ static int res_tls_send(res_state statp, const Slice query, const Slice answer,
 
     LOG(INFO) << __func__ << ": performing query over TLS";
 
-    const auto response = sDnsTlsDispatcher.query(privateDnsStatus.validatedServers(), statp, query,
-                                                  answer, &resplen);
+    const auto response = DnsTlsDispatcher::getInstance().query(
+            privateDnsStatus->validatedServers(), statp, query, answer, &resplen);
 
     LOG(INFO) << __func__ << ": TLS query result: " << static_cast<int>(response);
 
-    if (privateDnsStatus.mode == PrivateDnsMode::OPPORTUNISTIC) {
+    if (privateDnsStatus->mode == PrivateDnsMode::OPPORTUNISTIC) {
         // In opportunistic mode, handle falling back to cleartext in some
         // cases (DNS shouldn't fail if a validated opportunistic mode server
         // becomes unreachable for some reason).
@@ -1259,6 +1439,7 @@ static int res_tls_send(res_state statp, const Slice query, const Slice answer,
                 *rcode = reinterpret_cast<HEADER*>(answer.base())->rcode;
                 return resplen;
             case DnsTlsTransport::Response::network_error:
+            case DnsTlsTransport::Response::timeout:
                 // No need to set the error timeout here since it will fallback to UDP.
             case DnsTlsTransport::Response::internal_error:
                 // Note: this will cause cleartext queries to be emitted, with
@@ -1275,6 +1456,8 @@ static int res_tls_send(res_state statp, const Slice query, const Slice answer,
                 *rcode = reinterpret_cast<HEADER*>(answer.base())->rcode;
                 return resplen;
             case DnsTlsTransport::Response::network_error:
+            case DnsTlsTransport::Response::timeout:
+            case DnsTlsTransport::Response::abandoned:
                 // This case happens when the query stored in DnsTlsTransport is expired since
                 // either 1) the query has been tried for 3 times but no response or 2) fail to
                 // establish the connection with the server.
@@ -33,7 +33,7 @@ int res_stats_calculate_rtt(const timespec* t1, const timespec* t0) {
 
 // Create a sample for calculating server reachability statistics.
 void res_stats_set_sample(res_sample* sample, time_t now, int rcode, int rtt) {
-    LOG(INFO) << __func__ << ": rcode = " << rcode << ", sec = " << rtt;
+    LOG(DEBUG) << __func__ << ": rcode = " << rcode << ", rtt = " << rtt;
     sample->at = now;
     sample->rcode = rcode;
     sample->rtt = rtt;
@@ -42,112 +42,129 @@ void res_stats_set_sample(res_sample* sample, time_t now, int rcode, int rtt) {
 /* Clears all stored samples for the given server. */
 void _res_stats_clear_samples(res_stats* stats) {
     stats->sample_count = stats->sample_next = 0;
+    stats->successes = stats->errors = stats->timeouts = stats->internal_errors = 0;
+    stats->rtt_sum = 0;
+    stats->rtt_ewma = 0;
 }
 
-/* Aggregates the reachability statistics for the given server based on on the stored samples. */
-void android_net_res_stats_aggregate(res_stats* stats, int* successes, int* errors, int* timeouts,
-                                     int* internal_errors, int* rtt_avg, time_t* last_sample_time) {
-    int s = 0;   // successes
-    int e = 0;   // errors
-    int t = 0;   // timouts
-    int ie = 0;  // internal errors
-    long rtt_sum = 0;
-    time_t last = 0;
-    int rtt_count = 0;
-    for (int i = 0; i < stats->sample_count; ++i) {
-        // Treat everything as an error that the code in send_dg() already considers a
-        // rejection by the server, i.e. SERVFAIL, NOTIMP and REFUSED. Assume that NXDOMAIN
-        // and NOTAUTH can actually occur for user queries. NOERROR with empty answer section
-        // is not treated as an error here either. FORMERR seems to sometimes be returned by
-        // some versions of BIND in response to DNSSEC or EDNS0. Whether to treat such responses
-        // as an indication of a broken server is unclear, though. For now treat such responses,
-        // as well as unknown codes as errors.
-        switch (stats->samples[i].rcode) {
-            case NOERROR:
-            case NOTAUTH:
-            case NXDOMAIN:
-                ++s;
-                rtt_sum += stats->samples[i].rtt;
-                ++rtt_count;
-                break;
-            case RCODE_TIMEOUT:
-                ++t;
-                break;
-            case RCODE_INTERNAL_ERROR:
-                ++ie;
-                break;
-            case SERVFAIL:
-            case NOTIMP:
-            case REFUSED:
-            default:
-                ++e;
-                break;
-        }
+namespace {
+
+// The weight of the latest RTT in res_stats::rtt_ewma.
+constexpr float kRttEwmaWeight = 1.0f / 8;
+
+bool res_stats_is_success(int rcode) {
+    // Treat everything as an error that the code in send_dg() already considers a
+    // rejection by the server, i.e. SERVFAIL, NOTIMP and REFUSED. Assume that NXDOMAIN
+    // and NOTAUTH can actually occur for user queries. NOERROR with empty answer section
+    // is not treated as an error here either. FORMERR seems to sometimes be returned by
+    // some versions of BIND in response to DNSSEC or EDNS0. Whether to treat such responses
+    // as an indication of a broken server is unclear, though. For now treat such responses,
+    // as well as unknown codes as errors.
+    return rcode == NOERROR || rcode == NOTAUTH || rcode == NXDOMAIN;
+}
+
+// Returns the aggregate of |stats| which counts samples with |rcode|.
+uint8_t* res_stats_counter(res_stats* stats, int rcode) {
+    if (res_stats_is_success(rcode)) return &stats->successes;
+    switch (rcode) {
+        case RCODE_TIMEOUT:
+            return &stats->timeouts;
+        case RCODE_INTERNAL_ERROR:
+            return &stats->internal_errors;
+        case SERVFAIL:
+        case NOTIMP:
+        case REFUSED:
+        default:
+            return &stats->errors;
     }
-    *successes = s;
-    *errors = e;
-    *timeouts = t;
-    *internal_errors = ie;
-    /* If there was at least one successful sample, calculate average RTT. */
-    if (rtt_count) {
-        *rtt_avg = rtt_sum / rtt_count;
-    } else {
-        *rtt_avg = -1;
+}
+
+time_t res_stats_last_sample_time(const res_stats* stats) {
+    if (stats->sample_count == 0) return 0;
+    if (stats->sample_next > 0) return stats->samples[stats->sample_next - 1].at;
+    return stats->samples[stats->sample_count - 1].at;
+}
+
+enum class ServerHealth { USABLE, BROKEN, STALE };
+
+// A server is usable if the success rate is not lower than the threshold for the stored samples.
+// If not enough samples are stored, the server is considered usable. If the samples of a server
+// which isn't usable are older than the sample validity, they are stale and the server is worth
+// retrying.
+ServerHealth res_stats_check_server(const res_params* params, const res_stats* stats) {
+    const int total = stats->successes + stats->errors + stats->timeouts + stats->internal_errors;
+    if (total == 0 || total < params->min_samples) return ServerHealth::USABLE;
+    const int success_rate = stats->successes * 100 / total;
+    if (success_rate >= params->success_threshold) return ServerHealth::USABLE;
+
+    // Note: It might be worth considering to expire old servers after their expiry date has been
+    // reached, however the code for returning the ring buffer to its previous non-circular state
+    // would induce additional complexity.
+    if (time(nullptr) - res_stats_last_sample_time(stats) > params->sample_validity) {
+        return ServerHealth::STALE;
     }
-    /* If we had at least one sample, populate last sample time. */
-    if (stats->sample_count > 0) {
-        if (stats->sample_next > 0) {
-            last = stats->samples[stats->sample_next - 1].at;
+    LOG(DEBUG) << __func__ << ": success rate " << success_rate << " of " << total
+               << " samples, ignoring server";
+    return ServerHealth::BROKEN;
+}
+
+}  // namespace
+
+void android_net_res_stats_add_sample(res_stats* stats, const res_sample& sample,
+                                      int max_samples) {
+    // Note: This function expects max_samples > 0, otherwise a (harmless) modification of the
+    // allocated but supposedly unused memory for samples[0] will happen
+    if (stats->sample_next < stats->sample_count) {
+        const res_sample& old = stats->samples[stats->sample_next];
+        --*res_stats_counter(stats, old.rcode);
+        if (res_stats_is_success(old.rcode)) stats->rtt_sum -= old.rtt;
+    }
+    stats->samples[stats->sample_next] = sample;
+    ++*res_stats_counter(stats, sample.rcode);
+    if (res_stats_is_success(sample.rcode)) {
+        stats->rtt_sum += sample.rtt;
+        if (stats->rtt_ewma == 0) {
+            stats->rtt_ewma = sample.rtt;
         } else {
-            last = stats->samples[stats->sample_count - 1].at;
+            stats->rtt_ewma += kRttEwmaWeight * (sample.rtt - stats->rtt_ewma);
         }
     }
-    *last_sample_time = last;
-}
 
-// Returns true if the server is considered usable, i.e. if the success rate is not lower than the
-// threshold for the stored stored samples. If not enough samples are stored, the server is
-// considered usable.
-static bool res_stats_usable_server(const res_params* params, res_stats* stats) {
-    int successes = -1;
-    int errors = -1;
-    int timeouts = -1;
-    int internal_errors = -1;
-    int rtt_avg = -1;
-    time_t last_sample_time = 0;
-    android_net_res_stats_aggregate(stats, &successes, &errors, &timeouts, &internal_errors,
-                                    &rtt_avg, &last_sample_time);
-    if (successes >= 0 && errors >= 0 && timeouts >= 0) {
-        int total = successes + errors + timeouts + internal_errors;
-        LOG(INFO) << __func__ << ": NS stats: S " << successes << " + E " << errors << " + T "
-                  << timeouts << " + I " << internal_errors << " = " << total
-                  << ", rtt = " << rtt_avg << ", min_samples = " << unsigned(params->min_samples);
-        if (total >= params->min_samples) {
-            int success_rate = successes * 100 / total;
-            LOG(INFO) << __func__ << ": success rate " << success_rate;
-            if (success_rate < params->success_threshold) {
-                time_t now = time(NULL);
-                if (now - last_sample_time > params->sample_validity) {
-                    // Note: It might be worth considering to expire old servers after their expiry
-                    // date has been reached, however the code for returning the ring buffer to its
-                    // previous non-circular state would induce additional complexity.
-                    LOG(INFO) << __func__ << ": samples stale, retrying server";
-                    _res_stats_clear_samples(stats);
-                } else {
-                    LOG(INFO) << __func__ << ": too many resolution errors, ignoring server";
-                    return 0;
-                }
-            }
-        }
+    if (stats->sample_count < max_samples) {
+        ++stats->sample_count;
+    }
+    if (++stats->sample_next >= max_samples) {
+        stats->sample_next = 0;
     }
-    return 1;
+}
+
+/* Aggregates the reachability statistics for the given server based on on the stored samples. */
+void android_net_res_stats_aggregate(res_stats* stats, int* successes, int* errors, int* timeouts,
+                                     int* internal_errors, int* rtt_avg, time_t* last_sample_time) {
+    *successes = stats->successes;
+    *errors = stats->errors;
+    *timeouts = stats->timeouts;
+    *internal_errors = stats->internal_errors;
+    /* If there was at least one successful sample, calculate average RTT. */
+    *rtt_avg = (stats->successes > 0) ? int(stats->rtt_sum / stats->successes) : -1;
+    /* If we had at least one sample, populate last sample time. */
+    *last_sample_time = res_stats_last_sample_time(stats);
+}
+
+bool android_net_res_stats_usable_server(const res_params* params, const res_stats* stats) {
+    return res_stats_check_server(params, stats) != ServerHealth::BROKEN;
 }
 
 int android_net_res_stats_get_usable_servers(const res_params* params, res_stats stats[],
                                              int nscount, bool usable_servers[]) {
     unsigned usable_servers_found = 0;
     for (int ns = 0; ns < nscount; ns++) {
-        bool usable = res_stats_usable_server(params, &stats[ns]);
+        const ServerHealth health = res_stats_check_server(params, &stats[ns]);
+        if (health == ServerHealth::STALE) {
+            LOG(DEBUG) << __func__ << ": samples stale, retrying server";
+            _res_stats_clear_samples(&stats[ns]);
+        }
+        const bool usable = health != ServerHealth::BROKEN;
         if (usable) {
             ++usable_servers_found;
         }
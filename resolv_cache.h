@@ -28,6 +28,7 @@
 
 #pragma once
 
+#include <set>
 #include <unordered_map>
 #include <vector>
 
@@ -38,6 +39,7 @@
 #include <netdutils/InternetAddresses.h>
 #include <stats.pb.h>
 
+#include "DnsStats.h"
 #include "ResolverStats.h"
 #include "params.h"
 #include "stats.h"
@@ -56,6 +58,9 @@ std::vector<unsigned> resolv_list_caches();
 std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid);
 uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code);
 
+// Returns the time budget of a lookup on the given netid, or RES_DEADLINE_MSEC if it has none.
+int resolv_cache_get_deadline_msec(unsigned netid);
+
 typedef enum {
     RESOLV_CACHE_UNSUPPORTED, /* the cache can't handle that kind of queries */
                               /* or the answer buffer is too small */
@@ -109,13 +114,31 @@ bool has_named_cache(unsigned netid);
 // returned if the expiration time can't be acquired.
 int resolv_cache_get_expiration(unsigned netid, const std::vector<char>& query, time_t* expiration);
 
-// Set private DNS servers to DnsStats for a given network.
-int resolv_stats_set_servers_for_dot(unsigned netid, const std::vector<std::string>& servers);
+// Set private DNS servers to DnsStats for a given network. The servers are identified by their
+// address and the port they are queried on, which is 443 for servers queried with DNS-over-HTTPS.
+int resolv_stats_set_servers_for_dot(unsigned netid,
+                                     const std::vector<android::netdutils::IPSockAddr>& servers);
 
 // Add a statistics record to DnsStats for a given network.
 bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& server,
                       const android::net::DnsQueryEvent* record);
 
+// Sort |servers| by their expected latency over |protocol| on a given network, best first.
+// |connected| are the servers which already have a connection.  See DnsStats::rankServers().
+std::vector<android::netdutils::IPSockAddr> resolv_stats_rank_servers(
+        unsigned netid, android::net::Protocol protocol,
+        const std::vector<android::netdutils::IPSockAddr>& servers,
+        const std::set<android::netdutils::IPSockAddr>& connected);
+
+// Count a race between servers over |protocol| on a given network that |winner| won.
+void resolv_stats_add_race_win(unsigned netid, const android::netdutils::IPSockAddr& winner,
+                               android::net::Protocol protocol);
+
+// Get a copy of the stats of the servers over |protocol| on a given network. Return 0 on success,
+// or -ENONET if there's no such network.
+int resolv_stats_get(unsigned netid, android::net::Protocol protocol,
+                     std::vector<android::net::StatsData>* stats);
+
 /* Retrieve a local copy of the stats for the given netid. The buffer must have space for
  * MAXNS __resolver_stats. Returns the revision id of the resolvers used.
  */
@@ -123,6 +146,15 @@ int resolv_cache_get_resolver_stats(
         unsigned netid, res_params* params, res_stats stats[MAXNS],
         const std::vector<android::netdutils::IPSockAddr>& serverSockAddrs);
 
+/* Retrieve the params for the given netid, and which of |serverSockAddrs| are considered usable
+ * based on their stats, without copying the stats. The number of usable servers is stored in
+ * |usable_count|. Returns the revision id of the resolvers used, or -1 if there's no such network.
+ */
+int resolv_cache_get_usable_servers(
+        unsigned netid, res_params* params,
+        const std::vector<android::netdutils::IPSockAddr>& serverSockAddrs,
+        bool usable_servers[MAXNS], int* usable_count);
+
 /* Add a sample to the shared struct for the given netid and server, provided that the
  * revision_id of the stored servers has not changed.
  */
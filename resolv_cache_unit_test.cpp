@@ -935,6 +935,91 @@ class ScopedCacheCreate {
 
 }  // namespace
 
+TEST_F(ResolvCacheTest, GetUsableServers) {
+    const std::vector<IPSockAddr> nameserverSockAddrs = {
+            IPSockAddr::toIPSockAddr("127.0.0.1", DNS_PORT),
+            IPSockAddr::toIPSockAddr("127.0.0.2", DNS_PORT),
+    };
+    const SetupParams setup = {
+            .servers = {"127.0.0.1", "127.0.0.2"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    const int revision_id = 1;
+    const time_t now = time(nullptr);
+    for (int i = 1; i <= kParams.max_samples; i++) {
+        const res_sample timeout = {.at = now, .rtt = 1000, .rcode = RCODE_TIMEOUT};
+        const res_sample success = {.at = now, .rtt = uint16_t(i * 10), .rcode = ns_r_noerror};
+        cacheAddStats(TEST_NETID, revision_id, nameserverSockAddrs[0], timeout,
+                      kParams.max_samples);
+        cacheAddStats(TEST_NETID, revision_id, nameserverSockAddrs[1], success,
+                      kParams.max_samples);
+    }
+
+    res_params params;
+    bool usable[MAXNS];
+    int usableCount = 0;
+    EXPECT_EQ(revision_id, resolv_cache_get_usable_servers(TEST_NETID, &params,
+                                                           nameserverSockAddrs, usable,
+                                                           &usableCount));
+    EXPECT_TRUE(params == kParams);
+    EXPECT_FALSE(usable[0]);
+    EXPECT_TRUE(usable[1]);
+    EXPECT_EQ(1, usableCount);
+
+    // The aggregates follow the samples as the oldest ones are overwritten.
+    const auto expectAggregates = [&](int successes, int timeouts, int rtt_avg) {
+        res_stats stats[MAXNS]{};
+        resolv_cache_get_resolver_stats(TEST_NETID, &params, stats, {nameserverSockAddrs[1]});
+        int s, e, t, ie, rtt;
+        time_t last;
+        android_net_res_stats_aggregate(&stats[0], &s, &e, &t, &ie, &rtt, &last);
+        EXPECT_EQ(successes, s);
+        EXPECT_EQ(0, e);
+        EXPECT_EQ(timeouts, t);
+        EXPECT_EQ(0, ie);
+        EXPECT_EQ(rtt_avg, rtt);
+        EXPECT_EQ(now, last);
+    };
+    expectAggregates(8, 0, 45);
+    cacheAddStats(TEST_NETID, revision_id, nameserverSockAddrs[1],
+                  {.at = now, .rtt = 1000, .rcode = RCODE_TIMEOUT}, kParams.max_samples);
+    expectAggregates(7, 1, 50);
+
+    // If no server is usable, all of them are.
+    for (int i = 0; i < kParams.max_samples; i++) {
+        cacheAddStats(TEST_NETID, revision_id, nameserverSockAddrs[1],
+                      {.at = now, .rtt = 1000, .rcode = RCODE_TIMEOUT}, kParams.max_samples);
+    }
+    expectAggregates(0, 8, -1);
+    EXPECT_EQ(revision_id, resolv_cache_get_usable_servers(TEST_NETID, &params,
+                                                           nameserverSockAddrs, usable,
+                                                           &usableCount));
+    EXPECT_TRUE(usable[0]);
+    EXPECT_TRUE(usable[1]);
+    EXPECT_EQ(2, usableCount);
+
+    // A server whose samples are stale is retried.
+    const res_sample staleTimeout = {
+            .at = now - kParams.sample_validity - 1, .rtt = 1000, .rcode = RCODE_TIMEOUT};
+    for (int i = 0; i < kParams.max_samples; i++) {
+        cacheAddStats(TEST_NETID, revision_id, nameserverSockAddrs[0], staleTimeout,
+                      kParams.max_samples);
+    }
+    for (int i = 0; i < kParams.max_samples; i++) {
+        cacheAddStats(TEST_NETID, revision_id, nameserverSockAddrs[1],
+                      {.at = now, .rtt = 10, .rcode = ns_r_noerror}, kParams.max_samples);
+    }
+    EXPECT_EQ(revision_id, resolv_cache_get_usable_servers(TEST_NETID, &params,
+                                                           nameserverSockAddrs, usable,
+                                                           &usableCount));
+    EXPECT_TRUE(usable[0]);
+    EXPECT_TRUE(usable[1]);
+    EXPECT_EQ(2, usableCount);
+}
+
 TEST_F(ResolvCacheTest, DnsEventSubsampling) {
     // Test defaults, default flag is "default:1 0:100 7:10" if no experiment flag is set
     {
@@ -52,6 +52,7 @@
 #include <android-base/unique_fd.h>
 #include <net/if.h>
 #include <time.h>
+#include <chrono>
 #include <string>
 #include <vector>
 
@@ -72,6 +73,7 @@
  */
 #define RES_TIMEOUT 5000 /* min. milliseconds between retries */
 #define RES_DFLRETRY 2    /* Default #/tries. */
+#define RES_DEADLINE_MSEC 30000 /* Default time budget of a whole lookup. */
 
 // Flags for res_state->_flags
 #define RES_F_VC 0x00000001        // socket is TCP
@@ -97,6 +99,16 @@ struct ResState {
 
     int nameserverCount() { return nsaddrs.size(); }
 
+    // Returns true if the client waiting for the answer has hung up. Lookups check this between
+    // steps and give up with ECANCELED, so that they don't keep retrying for nobody.
+    bool isCancelled() const;
+
+    // Starts the time budget of the lookup, unless it was already started. All the queries sent
+    // for the lookup, including retries and search domains, have to fit into |msec|.
+    void startDeadline(int msec);
+    // Returns true if the time budget of the lookup has run out.
+    bool deadlineExceeded() const;
+
     // clang-format off
     unsigned netid;                             // NetId: cache key and socket mark
     uid_t uid;                                  // uid of the app that sent the DNS lookup
@@ -113,6 +125,10 @@ struct ResState {
     uint32_t netcontext_flags;
     int tc_mode = 0;
     bool enforce_dns_uid = false;
+    int client_fd = -1;                         // See android_net_context::client_fd
+    // When the time budget of the lookup runs out, or time_point::max() if not started yet.
+    // It's on the steady clock, so that changing the wall clock doesn't change the budget.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
     // clang-format on
 };
 
@@ -130,6 +146,7 @@ typedef ResState* res_state;
  * TODO: Consider mapping legacy and extended h_errno into a unified resolver error code mapping.
  */
 #define NETD_RESOLV_H_ERRNO_EXT_TIMEOUT RCODE_TIMEOUT
+#define NETD_RESOLV_H_ERRNO_EXT_DEADLINE_EXCEEDED RCODE_DEADLINE_EXCEEDED
 
 extern const char* const _res_opcodes[];
 
@@ -17,24 +17,38 @@
 #define LOG_TAG "resolv"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
+#include <Fwmark.h>
 #include <android-base/logging.h>
 #include <android-base/macros.h>
 #include <gtest/gtest.h>
 #include <netdutils/Slice.h>
+#include <nghttp2/nghttp2.h>
 
 #include "DnsTlsDispatcher.h"
+#include "DnsTlsEventLoop.h"
 #include "DnsTlsQueryMap.h"
 #include "DnsTlsServer.h"
 #include "DnsTlsSessionCache.h"
 #include "DnsTlsSocket.h"
+#include "DnsTlsSocketFactory.h"
 #include "DnsTlsTransport.h"
+#include "DohSession.h"
 #include "IDnsTlsSocket.h"
 #include "IDnsTlsSocketFactory.h"
 #include "IDnsTlsSocketObserver.h"
+#include "tests/dns_responder/dns_responder.h"
 #include "tests/dns_responder/dns_tls_frontend.h"
+#include "tests/dns_responder/doh_frontend.h"
 
 namespace android {
 namespace net {
@@ -98,6 +112,7 @@ bytevec make_query(uint16_t id, size_t size) {
 }
 
 // Query constants
+const unsigned NETID = 30;
 const unsigned MARK = 123;
 const uint16_t ID = 52;
 const uint16_t SIZE = 22;
@@ -139,7 +154,13 @@ class FakeSocketEcho : public IDnsTlsSocket {
     IDnsTlsSocketObserver* const mObserver;
 };
 
-class TransportTest : public BaseTest {};
+class TransportTest : public BaseTest {
+  protected:
+    static void addQueryArrival(DnsTlsTransport* transport,
+                                std::chrono::steady_clock::time_point now) {
+        transport->addQueryArrival(now);
+    }
+};
 
 TEST_F(TransportTest, Query) {
     FakeSocketFactory<FakeSocketEcho> factory;
@@ -180,7 +201,7 @@ TEST_F(TransportTest, IdReuse) {
     DnsTlsTransport transport(SERVER1, MARK, &factory);
     for (int i = 0; i < 100; ++i) {
         // Send a query.
-        std::future<DnsTlsTransport::Result> f = transport.query(makeSlice(QUERY));
+        DnsTlsTransport::Waiter f = transport.query(makeSlice(QUERY));
         // Wait for the response.
         DnsTlsTransport::Result r = f.get();
         EXPECT_EQ(DnsTlsTransport::Response::success, r.code);
@@ -197,7 +218,7 @@ TEST_F(TransportTest, IdReuse) {
 TEST_F(TransportTest, RacingQueries_10000) {
     FakeSocketFactory<FakeSocketEcho> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     // Fewer than 65536 queries to avoid ID exhaustion.
     const int num_queries = 10000;
     results.reserve(num_queries);
@@ -264,7 +285,7 @@ TEST_F(TransportTest, ParallelColliding) {
     FakeSocketDelay::sReverse = false;
     FakeSocketFactory<FakeSocketDelay> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     // Fewer than 65536 queries to avoid ID exhaustion.
     results.reserve(FakeSocketDelay::sDelay);
     for (size_t i = 0; i < FakeSocketDelay::sDelay; ++i) {
@@ -283,7 +304,7 @@ TEST_F(TransportTest, ParallelColliding_Max) {
     FakeSocketDelay::sReverse = false;
     FakeSocketFactory<FakeSocketDelay> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     // Exactly 65536 queries should still be possible in parallel,
     // even if they all have the same original ID.
     results.reserve(FakeSocketDelay::sDelay);
@@ -304,7 +325,7 @@ TEST_F(TransportTest, ParallelUnique) {
     FakeSocketFactory<FakeSocketDelay> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
     std::vector<bytevec> queries(FakeSocketDelay::sDelay);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     results.reserve(FakeSocketDelay::sDelay);
     for (size_t i = 0; i < FakeSocketDelay::sDelay; ++i) {
         queries[i] = make_query(i, SIZE);
@@ -324,7 +345,7 @@ TEST_F(TransportTest, ParallelUnique_Max) {
     FakeSocketFactory<FakeSocketDelay> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
     std::vector<bytevec> queries(FakeSocketDelay::sDelay);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     // Exactly 65536 queries should still be possible in parallel,
     // and they should all be mapped correctly back to the original ID.
     results.reserve(FakeSocketDelay::sDelay);
@@ -348,7 +369,7 @@ TEST_F(TransportTest, IdExhaustion) {
     FakeSocketDelay::sReverse = false;
     FakeSocketFactory<FakeSocketDelay> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     // Issue the maximum number of queries.
     results.reserve(num_queries);
     for (int i = 0; i < num_queries; ++i) {
@@ -376,7 +397,7 @@ TEST_F(TransportTest, ReverseOrder) {
     FakeSocketFactory<FakeSocketDelay> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
     std::vector<bytevec> queries(FakeSocketDelay::sDelay);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     results.reserve(FakeSocketDelay::sDelay);
     for (size_t i = 0; i < FakeSocketDelay::sDelay; ++i) {
         queries[i] = make_query(i, SIZE);
@@ -396,7 +417,7 @@ TEST_F(TransportTest, ReverseOrder_Max) {
     FakeSocketFactory<FakeSocketDelay> factory;
     DnsTlsTransport transport(SERVER1, MARK, &factory);
     std::vector<bytevec> queries(FakeSocketDelay::sDelay);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     results.reserve(FakeSocketDelay::sDelay);
     for (size_t i = 0; i < FakeSocketDelay::sDelay; ++i) {
         queries[i] = make_query(i, SIZE);
@@ -433,12 +454,86 @@ TEST_F(TransportTest, ConnectFail) {
     EXPECT_EQ(transport.getConnectCounter(), 1);
 }
 
+TEST_F(TransportTest, AdaptiveTimeout) {
+    FakeSocketFactory<FakeSocketEcho> factory;
+    DnsTlsTransport transport(SERVER1, MARK, &factory);
+    // Without any measurement, the timeout is the configured maximum.
+    const auto maxTimeout = transport.getTimeout();
+    EXPECT_GE(maxTimeout, std::chrono::seconds(1));
+
+    auto waitForTimeout = [&transport](std::chrono::milliseconds expected) {
+        // The RTT is recorded right after the result is delivered, so it may take a moment.
+        for (int i = 0; i < 100 && transport.getTimeout() != expected; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return transport.getTimeout();
+    };
+
+    // The fake server answers right away, so the timeout drops to the minimum.
+    EXPECT_EQ(DnsTlsTransport::Response::success, transport.query(makeSlice(QUERY)).get().code);
+    EXPECT_EQ(std::chrono::seconds(1), waitForTimeout(std::chrono::seconds(1)));
+
+    // Each timeout doubles it, up to the maximum.
+    transport.onTimeout();
+    EXPECT_EQ(std::min<std::chrono::milliseconds>(std::chrono::seconds(2), maxTimeout),
+              transport.getTimeout());
+    for (int i = 0; i < 10; i++) {
+        transport.onTimeout();
+    }
+    EXPECT_EQ(maxTimeout, transport.getTimeout());
+
+    // The next answer resets the backoff.
+    EXPECT_EQ(DnsTlsTransport::Response::success, transport.query(makeSlice(QUERY)).get().code);
+    EXPECT_EQ(std::chrono::seconds(1), waitForTimeout(std::chrono::seconds(1)));
+}
+
+TEST_F(TransportTest, AdaptiveIdleTimeout) {
+    using std::chrono::milliseconds;
+    using std::chrono::seconds;
+    FakeSocketFactory<FakeSocketEcho> factory;
+    DnsTlsTransport transport(SERVER1, MARK, &factory);
+    // Until the query rate is known, connections are closed after the minimum.
+    EXPECT_EQ(IDnsTlsSocketObserver::kDefaultIdleTimeout, transport.getIdleTimeout());
+    EXPECT_FALSE(transport.getQueryInterval());
+
+    const auto start = std::chrono::steady_clock::now();
+    addQueryArrival(&transport, start);
+    // Queries of the same burst don't count.
+    addQueryArrival(&transport, start + milliseconds(100));
+    EXPECT_FALSE(transport.getQueryInterval());
+
+    // A query every 10s: the connection is kept for the interval, plus 4 times its variation.
+    addQueryArrival(&transport, start + seconds(10));
+    ASSERT_TRUE(transport.getQueryInterval());
+    EXPECT_EQ(seconds(10), *transport.getQueryInterval());
+    EXPECT_EQ(seconds(10 + 4 * 5), transport.getIdleTimeout());
+    for (int i = 2; i < 30; i++) {
+        addQueryArrival(&transport, start + seconds(10 * i));
+    }
+    EXPECT_EQ(seconds(10), *transport.getQueryInterval());
+    EXPECT_EQ(IDnsTlsSocketObserver::kDefaultIdleTimeout, transport.getIdleTimeout());
+
+    // Once queries are further apart than the maximum, keeping the connection is useless.
+    auto last = start + seconds(300);
+    for (int i = 0; i < 30; i++) {
+        last += std::chrono::minutes(10);
+        addQueryArrival(&transport, last);
+    }
+    EXPECT_LT(seconds(120), *transport.getQueryInterval());
+    EXPECT_EQ(IDnsTlsSocketObserver::kDefaultIdleTimeout, transport.getIdleTimeout());
+
+    EXPECT_EQ(DnsTlsTransport::Response::success, transport.query(makeSlice(QUERY)).get().code);
+    const DnsTlsTransport::Stats stats = transport.getStats();
+    EXPECT_EQ(1, stats.connects);
+    EXPECT_EQ(0, stats.reconnects);
+}
+
 // Simulate a socket that connects but then immediately receives a server
 // close notification.
 class FakeSocketClose : public IDnsTlsSocket {
   public:
     explicit FakeSocketClose(IDnsTlsSocketObserver* observer)
-        : mCloser(&IDnsTlsSocketObserver::onClosed, observer) {}
+        : mCloser(&IDnsTlsSocketObserver::onClosed, observer, false) {}
     ~FakeSocketClose() { mCloser.join(); }
     bool query(uint16_t id ATTRIBUTE_UNUSED,
                const Slice query ATTRIBUTE_UNUSED) override {
@@ -459,6 +554,7 @@ TEST_F(TransportTest, CloseRetryFail) {
 
     // Reconnections are triggered since DnsTlsQueryMap is not empty.
     EXPECT_EQ(transport.getConnectCounter(), DnsTlsQueryMap::kMaxTries);
+    EXPECT_EQ(DnsTlsQueryMap::kMaxTries - 1, transport.getStats().reconnects);
 }
 
 // Simulate a server that occasionally closes the connection and silently
@@ -520,7 +616,7 @@ class FakeSocketLimited : public IDnsTlsSocket {
             }
             mThreads.clear();
         }
-        mObserver->onClosed();
+        mObserver->onClosed(false);
     }
     std::mutex mLock;
     IDnsTlsSocketObserver* const mObserver;
@@ -541,7 +637,7 @@ TEST_F(TransportTest, SilentDrop) {
     // Queue up 10 queries.  They will all be ignored, and after the 10th,
     // the socket will close.  Transport will retry them all, until they
     // all hit the retry limit and expire.
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     results.reserve(FakeSocketLimited::sLimit);
     for (int i = 0; i < FakeSocketLimited::sLimit; ++i) {
         results.push_back(transport.query(makeSlice(QUERY)));
@@ -566,7 +662,7 @@ TEST_F(TransportTest, PartialDrop) {
     // which will be dropped.
     const int num_queries = 10 * FakeSocketLimited::sLimit;
     std::vector<bytevec> queries(num_queries);
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     results.reserve(num_queries);
     for (int i = 0; i < num_queries; ++i) {
         queries[i] = make_query(i, SIZE + (i % 2));
@@ -593,7 +689,7 @@ TEST_F(TransportTest, ConnectCounter) {
     EXPECT_EQ(transport.getConnectCounter(), 0);
 
     const int num_queries = 10;
-    std::vector<std::future<DnsTlsTransport::Result>> results;
+    std::vector<DnsTlsTransport::Waiter> results;
     results.reserve(num_queries);
     for (int i = 0; i < num_queries; i++) {
         // Reconnections take place every two queries.
@@ -691,6 +787,80 @@ TEST_F(DispatcherTest, AnswerTooLarge) {
     EXPECT_TRUE(connectTriggered);
 }
 
+TEST_F(DispatcherTest, Validate) {
+    bytevec ans(4096);
+    int resplen = 0;
+    bool connectTriggered = false;
+
+    auto factory = std::make_unique<FakeSocketFactory<FakeSocketEcho>>();
+    DnsTlsDispatcher dispatcher(std::move(factory));
+    EXPECT_TRUE(dispatcher.validate(SERVER1, NETID, MARK));
+
+    // Expect the first query to reuse the connection opened for validation.
+    auto r = dispatcher.query(SERVER1, MARK, makeSlice(QUERY), makeSlice(ans), &resplen,
+                              &connectTriggered);
+    EXPECT_EQ(DnsTlsTransport::Response::success, r);
+    EXPECT_FALSE(connectTriggered);
+}
+
+TEST_F(DispatcherTest, Timeout) {
+    // The server never answers a lone query.
+    FakeSocketDelay::sDelay = 2;
+    FakeSocketDelay::sReverse = false;
+    bytevec ans(4096);
+    int resplen = 0;
+    bool connectTriggered = false;
+
+    auto factory = std::make_unique<FakeSocketFactory<FakeSocketDelay>>();
+    DnsTlsDispatcher dispatcher(std::move(factory));
+    const auto start = std::chrono::steady_clock::now();
+    auto r = dispatcher.query(SERVER1, MARK, makeSlice(QUERY), makeSlice(ans), &resplen,
+                              &connectTriggered, true);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(DnsTlsTransport::Response::timeout, r);
+    EXPECT_TRUE(connectTriggered);
+    EXPECT_GE(elapsed, std::chrono::seconds(1));
+    EXPECT_LT(elapsed, std::chrono::seconds(20));
+}
+
+TEST_F(DispatcherTest, LookupDeadline) {
+    // The server never answers a lone query, and there is no server to fail over to.
+    FakeSocketDelay::sDelay = 2;
+    FakeSocketDelay::sReverse = false;
+    bytevec ans(4096);
+    int resplen = 0;
+    bool connectTriggered = false;
+
+    auto factory = std::make_unique<FakeSocketFactory<FakeSocketDelay>>();
+    DnsTlsDispatcher dispatcher(std::move(factory));
+
+    // The query is given up once the lookup runs out of time.
+    ResState statp;
+    statp.startDeadline(200);
+    auto start = std::chrono::steady_clock::now();
+    auto r = dispatcher.query(SERVER1, MARK, makeSlice(QUERY), makeSlice(ans), &resplen,
+                              &connectTriggered, false, &statp);
+    EXPECT_EQ(DnsTlsTransport::Response::abandoned, r);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+
+    // Or once its client hangs up.  This takes another transport, as a second query would
+    // release the first one.
+    DnsTlsDispatcher dispatcher2(std::make_unique<FakeSocketFactory<FakeSocketDelay>>());
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    base::unique_fd clientFd(fds[0]);
+    close(fds[1]);
+    ResState cancelled;
+    cancelled.client_fd = clientFd.get();
+    start = std::chrono::steady_clock::now();
+    r = dispatcher2.query(SERVER1, MARK, makeSlice(QUERY), makeSlice(ans), &resplen,
+                          &connectTriggered, false, &cancelled);
+    EXPECT_EQ(DnsTlsTransport::Response::abandoned, r);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+}
+
 template<class T>
 class TrackingFakeSocketFactory : public IDnsTlsSocketFactory {
   public:
@@ -699,12 +869,14 @@ class TrackingFakeSocketFactory : public IDnsTlsSocketFactory {
             const DnsTlsServer& server,
             unsigned mark,
             IDnsTlsSocketObserver* observer,
-            DnsTlsSessionCache* cache ATTRIBUTE_UNUSED) override {
+            DnsTlsSessionCache* cache) override {
         std::lock_guard guard(mLock);
         keys.emplace(mark, server);
+        caches.insert(cache);
         return std::make_unique<T>(observer);
     }
     std::multiset<std::pair<unsigned, DnsTlsServer>> keys;
+    std::set<DnsTlsSessionCache*> caches;
 
   private:
     std::mutex mLock;
@@ -754,6 +926,42 @@ TEST_F(DispatcherTest, Dispatching) {
     }
 }
 
+TEST_F(DispatcherTest, EquivalentMarks) {
+    auto factory = std::make_unique<TrackingFakeSocketFactory<FakeSocketEcho>>();
+    auto* weak_factory = factory.get();  // Valid as long as dispatcher is in scope.
+    DnsTlsDispatcher dispatcher(std::move(factory));
+
+    Fwmark fwmark;
+    fwmark.netId = NETID;
+    fwmark.protectedFromVpn = true;
+    Fwmark explicitlySelected = fwmark;
+    explicitlySelected.explicitlySelected = true;
+    Fwmark privileged = fwmark;
+    privileged.permission = PERMISSION_SYSTEM;
+    Fwmark otherNetwork = fwmark;
+    otherNetwork.netId = NETID + 1;
+    Fwmark unprotected = fwmark;
+    unprotected.protectedFromVpn = false;
+
+    bytevec ans(4096);
+    int resplen = 0;
+    bool connectTriggered = false;
+    for (const Fwmark mark : {fwmark, explicitlySelected, privileged, otherNetwork, unprotected}) {
+        auto r = dispatcher.query(SERVER1, mark.intValue, makeSlice(QUERY), makeSlice(ans),
+                                  &resplen, &connectTriggered);
+        EXPECT_EQ(DnsTlsTransport::Response::success, r);
+    }
+
+    // Marks which only differ in bits that don't affect routing share a connection.
+    // The permission is matched by routing rules, so it isn't one of them.
+    EXPECT_EQ(4U, weak_factory->keys.size());
+    EXPECT_EQ(1U, weak_factory->keys.count(std::make_pair(fwmark.intValue, SERVER1)));
+    EXPECT_EQ(0U, weak_factory->keys.count(std::make_pair(explicitlySelected.intValue, SERVER1)));
+    EXPECT_EQ(1U, weak_factory->keys.count(std::make_pair(privileged.intValue, SERVER1)));
+    // All the connections to a server resume sessions from the same cache.
+    EXPECT_EQ(1U, weak_factory->caches.size());
+}
+
 // Check DnsTlsServer's comparison logic.
 AddressComparator ADDRESS_COMPARATOR;
 bool isAddressEqual(const DnsTlsServer& s1, const DnsTlsServer& s2) {
@@ -847,6 +1055,17 @@ TEST_F(ServerTest, Name) {
     EXPECT_TRUE(s2.wasExplicitlyConfigured());
 }
 
+TEST_F(ServerTest, DohPath) {
+    DnsTlsServer s1(V4ADDR1), s2(V4ADDR1);
+    EXPECT_FALSE(s1.isDoh());
+    s1.dohPath = "/dns-query";
+    EXPECT_TRUE(s1.isDoh());
+    checkUnequal(s1, s2);
+    s2.dohPath = "/dns-query";
+    EXPECT_EQ(s1, s2);
+    EXPECT_TRUE(isAddressEqual(s1, s2));
+}
+
 TEST_F(ServerTest, Timeout) {
     DnsTlsServer s1(V4ADDR1), s2(V4ADDR1);
     s1.connectTimeout = std::chrono::milliseconds(4000);
@@ -859,6 +1078,216 @@ TEST_F(ServerTest, Timeout) {
     EXPECT_FALSE(s2.wasExplicitlyConfigured());
 }
 
+// The server side of an HTTP/2 connection, which answers DoH queries with the query itself,
+// flagged as a response.  Bytes are exchanged with a DohSession in memory.
+class FakeDohServer {
+  public:
+    explicit FakeDohServer(uint32_t maxConcurrentStreams) {
+        nghttp2_session_callbacks* callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, onHeader);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, onDataChunk);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, onFrame);
+        nghttp2_session_server_new(&mSession, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+        const nghttp2_settings_entry settings[] = {
+                {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, maxConcurrentStreams}};
+        nghttp2_submit_settings(mSession, NGHTTP2_FLAG_NONE, settings, std::size(settings));
+    }
+    ~FakeDohServer() { nghttp2_session_del(mSession); }
+
+    // Moves bytes both ways until neither side has anything to send.
+    void exchange(DohSession* client) {
+        for (;;) {
+            std::vector<uint8_t> toServer;
+            ASSERT_TRUE(client->send(&toServer, SIZE_MAX));
+            if (!toServer.empty()) {
+                ASSERT_GE(nghttp2_session_mem_recv(mSession, toServer.data(), toServer.size()),
+                          0);
+            }
+            std::vector<uint8_t> toClient;
+            const uint8_t* data;
+            ssize_t size;
+            while ((size = nghttp2_session_mem_send(mSession, &data)) > 0) {
+                toClient.insert(toClient.end(), data, data + size);
+            }
+            if (!toClient.empty()) {
+                ASSERT_TRUE(client->receive(makeSlice(toClient)));
+            }
+            if (toServer.empty() && toClient.empty()) return;
+        }
+    }
+
+    void goAway() {
+        nghttp2_submit_goaway(mSession, NGHTTP2_FLAG_NONE,
+                              nghttp2_session_get_last_proc_stream_id(mSession), NGHTTP2_NO_ERROR,
+                              nullptr, 0);
+    }
+
+    // The queries received, with their ID.
+    std::vector<std::vector<uint8_t>> queries;
+    std::string lastPath;
+    std::string lastAuthority;
+    // If set, queries are answered with this status, and no DNS message.
+    int failWithStatus = 0;
+    // If set, queries are left unanswered.
+    bool hold = false;
+
+  private:
+    struct Request {
+        std::vector<uint8_t> body;
+        size_t sent = 0;
+    };
+
+    static int onHeader(nghttp2_session*, const nghttp2_frame* frame, const uint8_t* name,
+                        size_t nameLength, const uint8_t* value, size_t valueLength, uint8_t,
+                        void* userData) {
+        auto* self = static_cast<FakeDohServer*>(userData);
+        const std::string headerName(reinterpret_cast<const char*>(name), nameLength);
+        const std::string headerValue(reinterpret_cast<const char*>(value), valueLength);
+        if (headerName == ":path") self->lastPath = headerValue;
+        if (headerName == ":authority") self->lastAuthority = headerValue;
+        self->mRequests[frame->hd.stream_id];
+        return 0;
+    }
+
+    static int onDataChunk(nghttp2_session*, uint8_t, int32_t streamId, const uint8_t* data,
+                           size_t length, void* userData) {
+        auto* self = static_cast<FakeDohServer*>(userData);
+        std::vector<uint8_t>& body = self->mRequests[streamId].body;
+        body.insert(body.end(), data, data + length);
+        return 0;
+    }
+
+    static int onFrame(nghttp2_session* session, const nghttp2_frame* frame, void* userData) {
+        auto* self = static_cast<FakeDohServer*>(userData);
+        const bool isRequestFrame =
+                frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA;
+        if (!isRequestFrame || !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM) || self->hold) {
+            return 0;
+        }
+        const int32_t streamId = frame->hd.stream_id;
+        Request& request = self->mRequests[streamId];
+        self->queries.push_back(request.body);
+        if (self->failWithStatus) {
+            const std::string status = std::to_string(self->failWithStatus);
+            const nghttp2_nv headers[] = {makeNv(":status", status.c_str())};
+            return nghttp2_submit_response(session, streamId, headers, std::size(headers),
+                                           nullptr);
+        }
+        request.body[2] |= 0x80;  // QR
+        const nghttp2_nv headers[] = {makeNv(":status", "200"),
+                                      makeNv("content-type", "application/dns-message")};
+        nghttp2_data_provider body = {.source = {}, .read_callback = readBody};
+        return nghttp2_submit_response(session, streamId, headers, std::size(headers), &body);
+    }
+
+    static ssize_t readBody(nghttp2_session*, int32_t streamId, uint8_t* buf, size_t length,
+                            uint32_t* dataFlags, nghttp2_data_source*, void* userData) {
+        auto* self = static_cast<FakeDohServer*>(userData);
+        Request& request = self->mRequests[streamId];
+        const size_t size = std::min(length, request.body.size() - request.sent);
+        memcpy(buf, request.body.data() + request.sent, size);
+        request.sent += size;
+        if (request.sent == request.body.size()) *dataFlags |= NGHTTP2_DATA_FLAG_EOF;
+        return size;
+    }
+
+    static nghttp2_nv makeNv(const char* name, const char* value) {
+        return {reinterpret_cast<uint8_t*>(const_cast<char*>(name)),
+                reinterpret_cast<uint8_t*>(const_cast<char*>(value)), strlen(name),
+                strlen(value), NGHTTP2_NV_FLAG_NONE};
+    }
+
+    nghttp2_session* mSession;
+    std::map<int32_t, Request> mRequests;
+};
+
+class DohSessionTest : public ::testing::Test {
+  protected:
+    void SetUp() override { ASSERT_TRUE(mSession.initialize()); }
+
+    std::vector<std::vector<uint8_t>> mResponses;
+    DohSession mSession{"dns.example", "/dns-query",
+                        [this](std::vector<uint8_t> response) {
+                            mResponses.push_back(std::move(response));
+                        }};
+};
+
+TEST_F(DohSessionTest, Query) {
+    FakeDohServer server(100);
+    const std::vector<uint8_t> query = make_query(0x1234, SIZE);
+    ASSERT_TRUE(mSession.submit(makeSlice(query)));
+    EXPECT_EQ(1U, mSession.activeStreams());
+    server.exchange(&mSession);
+
+    EXPECT_EQ("/dns-query", server.lastPath);
+    EXPECT_EQ("dns.example", server.lastAuthority);
+    // The query is sent with ID 0, and the response comes back with the original ID.
+    ASSERT_EQ(1U, server.queries.size());
+    EXPECT_EQ(0, server.queries[0][0]);
+    EXPECT_EQ(0, server.queries[0][1]);
+    ASSERT_EQ(1U, mResponses.size());
+    EXPECT_EQ(query.size(), mResponses[0].size());
+    EXPECT_EQ(0x12, mResponses[0][0]);
+    EXPECT_EQ(0x34, mResponses[0][1]);
+    EXPECT_EQ(0x80, mResponses[0][2] & 0x80);
+    EXPECT_EQ(0U, mSession.activeStreams());
+}
+
+TEST_F(DohSessionTest, ConcurrencyLimit) {
+    constexpr int kMaxStreams = 3;
+    FakeDohServer server(kMaxStreams);
+    // The server's settings are only known after the preface exchange.
+    server.exchange(&mSession);
+
+    server.hold = true;
+    int submitted = 0;
+    while (mSession.canSubmit()) {
+        ASSERT_TRUE(mSession.submit(makeSlice(make_query(submitted, SIZE))));
+        submitted++;
+        ASSERT_LE(submitted, kMaxStreams);
+    }
+    EXPECT_EQ(kMaxStreams, submitted);
+    server.exchange(&mSession);
+    EXPECT_TRUE(mResponses.empty());
+    EXPECT_FALSE(mSession.canSubmit());
+}
+
+TEST_F(DohSessionTest, HttpError) {
+    FakeDohServer server(100);
+    server.failWithStatus = 500;
+    const std::vector<uint8_t> query = make_query(0x1234, SIZE);
+    ASSERT_TRUE(mSession.submit(makeSlice(query)));
+    server.exchange(&mSession);
+
+    // The query is answered with SERVFAIL.
+    ASSERT_EQ(1U, mResponses.size());
+    ASSERT_EQ(query.size(), mResponses[0].size());
+    EXPECT_EQ(0x12, mResponses[0][0]);
+    EXPECT_EQ(0x34, mResponses[0][1]);
+    EXPECT_EQ(0x80, mResponses[0][2] & 0x80);
+    EXPECT_EQ(2, mResponses[0][3] & 0x0f);
+}
+
+TEST_F(DohSessionTest, GoAway) {
+    FakeDohServer server(100);
+    server.exchange(&mSession);
+    EXPECT_TRUE(mSession.canSubmit());
+
+    // The query crosses the GOAWAY, which tells that it wasn't processed.
+    server.goAway();
+    ASSERT_TRUE(mSession.submit(makeSlice(make_query(1, SIZE))));
+    server.exchange(&mSession);
+
+    // It isn't answered, so that it is sent again on the next connection.  This one is over.
+    EXPECT_TRUE(mResponses.empty());
+    EXPECT_EQ(0U, mSession.activeStreams());
+    EXPECT_FALSE(mSession.canSubmit());
+    EXPECT_FALSE(mSession.wantRead());
+    EXPECT_FALSE(mSession.wantWrite());
+}
+
 TEST(QueryMapTest, Basic) {
     DnsTlsQueryMap map;
 
@@ -887,9 +1316,9 @@ TEST(QueryMapTest, Basic) {
     EXPECT_EQ(1, all[1].newId);
     EXPECT_EQ(2, all[2].newId);
 
-    EXPECT_EQ(q0, all[0].query);
-    EXPECT_EQ(q1, all[1].query);
-    EXPECT_EQ(q2, all[2].query);
+    EXPECT_EQ(q0, bytevec(all[0].query.base(), all[0].query.base() + all[0].query.size()));
+    EXPECT_EQ(q1, bytevec(all[1].query.base(), all[1].query.base() + all[1].query.size()));
+    EXPECT_EQ(q2, bytevec(all[2].query.base(), all[2].query.base() + all[2].query.size()));
 
     bytevec a0 = make_query(0, SIZE);
     bytevec a1 = make_query(1, SIZE);
@@ -926,7 +1355,7 @@ TEST(QueryMapTest, Basic) {
 
 TEST(QueryMapTest, FillHole) {
     DnsTlsQueryMap map;
-    std::vector<std::unique_ptr<DnsTlsQueryMap::QueryFuture>> futures(UINT16_MAX + 1);
+    std::vector<std::optional<DnsTlsQueryMap::QueryFuture>> futures(UINT16_MAX + 1);
     for (uint32_t i = 0; i <= UINT16_MAX; ++i) {
         futures[i] = map.recordQuery(makeSlice(QUERY));
         ASSERT_TRUE(futures[i]);  // answers[i] should be nonnull.
@@ -959,12 +1388,71 @@ TEST(QueryMapTest, FillHole) {
     EXPECT_FALSE(map.recordQuery(makeSlice(QUERY)));
 }
 
+TEST(QueryMapTest, AbandonedQuery) {
+    DnsTlsQueryMap map;
+    auto f0 = map.recordQuery(makeSlice(QUERY));
+    ASSERT_TRUE(f0);
+    EXPECT_EQ(0, f0->query.newId);
+
+    // Dropping the result doesn't cancel the query.  Its ID stays in use until it's answered.
+    f0.reset();
+    EXPECT_FALSE(map.empty());
+    auto f1 = map.recordQuery(makeSlice(QUERY));
+    ASSERT_TRUE(f1);
+    EXPECT_EQ(1, f1->query.newId);
+
+    map.onResponse(make_query(0, SIZE));
+    auto f2 = map.recordQuery(makeSlice(QUERY));
+    ASSERT_TRUE(f2);
+    EXPECT_EQ(0, f2->query.newId);
+
+    // A query which has failed keeps its result until it's retrieved.
+    map.clear();
+    EXPECT_TRUE(map.empty());
+    EXPECT_EQ(std::future_status::ready, f1->result.wait_for(std::chrono::seconds(0)));
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f1->result.get().code);
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f2->result.get().code);
+}
+
+class CompletionListener : public DnsTlsQueryMap::Listener {
+  public:
+    int completed = 0;
+    void onComplete() override { completed++; }
+};
+
+TEST(QueryMapTest, Listener) {
+    DnsTlsQueryMap map;
+    CompletionListener listener;
+    auto f0 = map.recordQuery(makeSlice(QUERY));
+    auto f1 = map.recordQuery(makeSlice(QUERY));
+    ASSERT_TRUE(f0);
+    ASSERT_TRUE(f1);
+
+    f0->result.setListener(&listener);
+    EXPECT_EQ(0, listener.completed);
+    map.onResponse(make_query(0, SIZE));
+    EXPECT_EQ(1, listener.completed);
+
+    // A listener set on a completed query is called right away.
+    map.onResponse(make_query(1, SIZE));
+    f1->result.setListener(&listener);
+    EXPECT_EQ(2, listener.completed);
+
+    // Failures complete queries too.
+    auto f2 = map.recordQuery(makeSlice(QUERY));
+    ASSERT_TRUE(f2);
+    f2->result.setListener(&listener);
+    map.clear();
+    EXPECT_EQ(3, listener.completed);
+    EXPECT_EQ(DnsTlsQueryMap::Response::network_error, f2->result.get().code);
+}
+
 class StubObserver : public IDnsTlsSocketObserver {
   public:
     bool closed = false;
     void onResponse(std::vector<uint8_t>) override {}
 
-    void onClosed() override { closed = true; }
+    void onClosed(bool) override { closed = true; }
 };
 
 TEST(DnsTlsSocketTest, SlowDestructor) {
@@ -998,5 +1486,246 @@ TEST(DnsTlsSocketTest, SlowDestructor) {
     EXPECT_LT(delay, std::chrono::seconds{5});
 }
 
+TEST(DnsTlsSocketTest, SharedEventLoop) {
+    constexpr char tls_addr[] = "127.0.0.3";
+    constexpr char tls_port[] = "8530";
+    constexpr char backend_addr[] = "192.0.2.1";
+    constexpr char backend_port[] = "1";
+
+    test::DnsTlsFrontend tls(tls_addr, tls_port, backend_addr, backend_port);
+    ASSERT_TRUE(tls.startServer());
+
+    DnsTlsServer server;
+    parseServer(tls_addr, 8530, &server.ss);
+
+    // Several connections don't need a thread each: closing one of them, from the server side
+    // or by destroying it, doesn't disturb the others.
+    StubObserver observer1, observer2, observer3;
+    DnsTlsSessionCache cache;
+    auto socket1 = std::make_unique<DnsTlsSocket>(server, MARK, &observer1, &cache);
+    auto socket2 = std::make_unique<DnsTlsSocket>(server, MARK, &observer2, &cache);
+    auto socket3 = std::make_unique<DnsTlsSocket>(server, MARK, &observer3, &cache);
+    ASSERT_TRUE(socket1->initialize());
+    ASSERT_TRUE(socket2->initialize());
+    ASSERT_TRUE(socket3->initialize());
+
+    socket2.reset();
+    EXPECT_TRUE(observer2.closed);
+    EXPECT_FALSE(observer1.closed);
+    EXPECT_FALSE(observer3.closed);
+
+    socket1.reset();
+    socket3.reset();
+    EXPECT_TRUE(observer1.closed);
+    EXPECT_TRUE(observer3.closed);
+}
+
+class CountingObserver : public IDnsTlsSocketObserver {
+  public:
+    void onResponse(std::vector<uint8_t> response) override {
+        std::lock_guard guard(mLock);
+        mResponses++;
+        // A response which is too short or isn't NOERROR.
+        if (response.size() < 4 || (response[3] & 0x0f) != 0) mErrors++;
+        mCv.notify_all();
+    }
+
+    void onClosed(bool) override {}
+
+    bool waitForResponses(int count) {
+        std::unique_lock lock(mLock);
+        return mCv.wait_for(lock, std::chrono::seconds(5), [&] { return mResponses >= count; });
+    }
+
+    int errors() {
+        std::lock_guard guard(mLock);
+        return mErrors;
+    }
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCv;
+    int mResponses = 0;
+    int mErrors = 0;
+};
+
+// The body of an A query for example.com, without the ID.
+const bytevec EXAMPLE_COM_QUERY = {
+        0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x07, 'e',  'x',  'a',  'm',  'p',  'l',  'e',  0x03, 'c',
+        'o',  'm',  0x00, 0x00, 0x01, 0x00, 0x01,
+};
+
+TEST(DnsTlsSocketTest, BurstOfQueries) {
+    constexpr char tls_addr[] = "127.0.0.3";
+    constexpr char tls_port[] = "8530";
+    constexpr char backend_addr[] = "127.0.0.3";
+    constexpr char backend_port[] = "8531";
+    constexpr char host_name[] = "example.com.";
+
+    test::DNSResponder dns(backend_addr, backend_port);
+    dns.addMapping(host_name, ns_type::ns_t_a, "1.2.3.4");
+    ASSERT_TRUE(dns.startServer());
+    test::DnsTlsFrontend tls(tls_addr, tls_port, backend_addr, backend_port);
+    ASSERT_TRUE(tls.startServer());
+
+    DnsTlsServer server;
+    parseServer(tls_addr, 8530, &server.ss);
+
+    CountingObserver observer;
+    DnsTlsSessionCache cache;
+    auto socket = std::make_unique<DnsTlsSocket>(server, MARK, &observer, &cache);
+    ASSERT_TRUE(socket->initialize());
+
+    // Queries issued back to back are likely to be packed into shared records.  Every one of
+    // them must still get through.
+    constexpr int kNumQueries = 100;
+    for (int i = 0; i < kNumQueries; i++) {
+        ASSERT_TRUE(socket->query(i, makeSlice(EXAMPLE_COM_QUERY)));
+    }
+    EXPECT_TRUE(observer.waitForResponses(kNumQueries));
+    socket.reset();
+    EXPECT_TRUE(tls.waitForQueries(kNumQueries));
+}
+
+class DohSocketTest : public ::testing::Test {
+  protected:
+    static constexpr char kDohAddr[] = "127.0.0.3";
+    static constexpr char kDohPort[] = "8443";  // High-numbered port so root isn't required.
+    static constexpr char kBackendAddr[] = "127.0.0.3";
+    static constexpr char kBackendPort[] = "8531";
+    static constexpr char kHostName[] = "example.com.";
+
+    void SetUp() override {
+        mDns.addMapping(kHostName, ns_type::ns_t_a, "1.2.3.4");
+        ASSERT_TRUE(mDns.startServer());
+        parseServer(kDohAddr, 8443, &mServer.ss);
+        mServer.dohPath = "/dns-query";
+    }
+
+    test::DNSResponder mDns{kBackendAddr, kBackendPort};
+    test::DohFrontend mDoh{kDohAddr, kDohPort, kBackendAddr, kBackendPort};
+    DnsTlsServer mServer;
+    DnsTlsSessionCache mCache;
+};
+
+TEST_F(DohSocketTest, Query) {
+    ASSERT_TRUE(mDoh.startServer());
+
+    CountingObserver observer;
+    auto socket = std::make_unique<DnsTlsSocket>(mServer, MARK, &observer, &mCache);
+    // The handshake negotiates HTTP/2, and the session starts with the connection preface.
+    ASSERT_TRUE(socket->initialize());
+    ASSERT_TRUE(socket->query(1, makeSlice(EXAMPLE_COM_QUERY)));
+    EXPECT_TRUE(observer.waitForResponses(1));
+    EXPECT_EQ(0, observer.errors());
+    EXPECT_TRUE(mDoh.waitForQueries(1));
+    EXPECT_EQ("/dns-query", mDoh.lastPath());
+}
+
+TEST_F(DohSocketTest, NoHttp2) {
+    // A server which doesn't select "h2" with ALPN can't be queried with DoH.
+    mDoh.setAlpnH2(false);
+    ASSERT_TRUE(mDoh.startServer());
+
+    StubObserver observer;
+    auto socket = std::make_unique<DnsTlsSocket>(mServer, MARK, &observer, &mCache);
+    EXPECT_FALSE(socket->initialize());
+    EXPECT_EQ(1, mDoh.acceptConnectionsCount());
+    EXPECT_EQ(0, mDoh.queries());
+}
+
+TEST_F(DohSocketTest, StreamLimit) {
+    constexpr int kMaxStreams = 2;
+    mDoh.setMaxConcurrentStreams(kMaxStreams);
+    ASSERT_TRUE(mDoh.startServer());
+
+    CountingObserver observer;
+    auto socket = std::make_unique<DnsTlsSocket>(mServer, MARK, &observer, &mCache);
+    ASSERT_TRUE(socket->initialize());
+    // The server's settings are only known once it has answered.
+    ASSERT_TRUE(socket->query(0, makeSlice(EXAMPLE_COM_QUERY)));
+    ASSERT_TRUE(observer.waitForResponses(1));
+
+    // The queries beyond the limit wait for a stream to be free, rather than being refused.
+    constexpr int kNumQueries = 20;
+    for (int i = 1; i <= kNumQueries; i++) {
+        ASSERT_TRUE(socket->query(i, makeSlice(EXAMPLE_COM_QUERY)));
+    }
+    EXPECT_TRUE(observer.waitForResponses(kNumQueries + 1));
+    EXPECT_EQ(0, observer.errors());
+    EXPECT_LE(mDoh.maxOpenStreams(), kMaxStreams);
+    EXPECT_TRUE(mDoh.waitForQueries(kNumQueries + 1));
+}
+
+TEST_F(DohSocketTest, GoAway) {
+    // The server closes the first connection after the second query.
+    mDoh.setGoAwayAfterQueries(2);
+    ASSERT_TRUE(mDoh.startServer());
+
+    DnsTlsSocketFactory factory;
+    DnsTlsTransport transport(mServer, MARK, &factory);
+    bytevec query = make_query(0, EXAMPLE_COM_QUERY.size() + 2);
+    std::copy(EXAMPLE_COM_QUERY.begin(), EXAMPLE_COM_QUERY.end(), query.begin() + 2);
+    EXPECT_EQ(DnsTlsTransport::Response::success, transport.query(makeSlice(query)).get().code);
+
+    // At most one of these is answered on the first connection.  The others are refused by
+    // the GOAWAY, and sent again on a new connection.
+    constexpr int kNumQueries = 4;
+    std::vector<DnsTlsTransport::Waiter> waiters;
+    for (int i = 0; i < kNumQueries; i++) {
+        waiters.push_back(transport.query(makeSlice(query)));
+    }
+    for (auto& waiter : waiters) {
+        const DnsTlsTransport::Result result = waiter.get();
+        EXPECT_EQ(DnsTlsTransport::Response::success, result.code);
+        ASSERT_GE(result.response.size(), 4U);
+        EXPECT_EQ(0, result.response[3] & 0x0f);
+    }
+    EXPECT_EQ(2, mDoh.acceptConnectionsCount());
+    EXPECT_EQ(2, transport.getConnectCounter());
+    EXPECT_TRUE(mDoh.waitForQueries(kNumQueries + 1));
+}
+
+class PipeHandler : public DnsTlsEventLoop::Handler {
+  public:
+    void onEvent(int fd, uint32_t) override {
+        char c;
+        EXPECT_EQ(1, read(fd, &c, 1));
+        onLoopThread = DnsTlsEventLoop::getInstance()->isLoopThread();
+        events++;
+    }
+    std::atomic<int> events = 0;
+    std::atomic<bool> onLoopThread = false;
+};
+
+TEST(DnsTlsEventLoopTest, AddRemove) {
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_CLOEXEC | O_NONBLOCK));
+    base::unique_fd readFd(fds[0]), writeFd(fds[1]);
+    DnsTlsEventLoop* eventLoop = DnsTlsEventLoop::getInstance();
+    EXPECT_FALSE(eventLoop->isLoopThread());
+
+    PipeHandler handler;
+    ASSERT_TRUE(eventLoop->add(readFd.get(), EPOLLIN, &handler));
+    ASSERT_EQ(1, write(writeFd.get(), "x", 1));
+    for (int i = 0; i < 100 && handler.events == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(1, handler.events);
+    EXPECT_TRUE(handler.onLoopThread);
+
+    // Not watched, the fd stays readable without calling the handler.
+    ASSERT_TRUE(eventLoop->modify(readFd.get(), 0));
+    ASSERT_EQ(1, write(writeFd.get(), "x", 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(1, handler.events);
+
+    eventLoop->remove(readFd.get());
+    EXPECT_FALSE(eventLoop->modify(readFd.get(), EPOLLIN));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(1, handler.events);
+}
+
 } // end of namespace net
 } // end of namespace android
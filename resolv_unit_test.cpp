@@ -18,12 +18,16 @@
 
 #include <aidl/android/net/IDnsResolver.h>
 #include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
 #include <arpa/inet.h>
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest.h>
 #include <netdb.h>
 #include <netdutils/InternetAddresses.h>
 #include <resolv_stats_test_utils.h>
+#include <sys/socket.h>
+
+#include <thread>
 
 #include "dns_responder.h"
 #include "getaddrinfo.h"
@@ -39,6 +43,7 @@ namespace net {
 
 using aidl::android::net::IDnsResolver;
 using android::base::StringPrintf;
+using android::base::unique_fd;
 using android::net::NetworkDnsEventReported;
 using android::netdutils::ScopedAddrinfo;
 
@@ -853,6 +858,70 @@ TEST_F(ResolvGetAddrInfoTest, ServerTimeout) {
     EXPECT_EQ(NETD_RESOLV_TIMEOUT, rv);
 }
 
+TEST_F(ResolvGetAddrInfoTest, ClientGone) {
+    constexpr char host_name[] = "hello.example.com.";
+    test::DNSResponder dns(static_cast<ns_rcode>(-1) /*no response*/);
+    dns.addMapping(host_name, ns_type::ns_t_a, "1.2.3.4");
+    dns.setResponseProbability(0.0);  // always ignore requests and don't response
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    unique_fd serverFd(fds[0]);
+    unique_fd clientFd(fds[1]);
+    android_net_context netcontext = mNetcontext;
+    netcontext.client_fd = serverFd.get();
+
+    // Without cancellation, the lookup would wait for all the 16 queries to time out.
+    std::thread hangUp([&clientFd]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        clientFd.reset();
+    });
+    const auto start = std::chrono::steady_clock::now();
+    addrinfo* result = nullptr;
+    const addrinfo hints = {.ai_family = AF_UNSPEC};
+    NetworkDnsEventReported event;
+    int rv = resolv_getaddrinfo("hello", nullptr, &hints, &netcontext, &result, &event);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    hangUp.join();
+    ScopedAddrinfo result_cleanup(result);
+
+    EXPECT_NE(0, rv);
+    EXPECT_TRUE(result == nullptr);
+    EXPECT_LT(elapsed, std::chrono::milliseconds(1500));
+}
+
+TEST_F(ResolvGetAddrInfoTest, DeadlineExceeded) {
+    constexpr char host_name[] = "hello.example.com.";
+    test::DNSResponder dns(static_cast<ns_rcode>(-1) /*no response*/);
+    dns.addMapping(host_name, ns_type::ns_t_a, "1.2.3.4");
+    dns.setResponseProbability(0.0);  // always ignore requests and don't response
+    ASSERT_TRUE(dns.startServer());
+    res_params deadlineParams = params;
+    deadlineParams.deadline_msec = 1500;
+    ASSERT_EQ(0, resolv_set_nameservers(TEST_NETID, servers, domains, deadlineParams));
+
+    // Without the deadline, the lookup would wait for all the queries to time out, one second
+    // each. The second attempt is cut short instead, and nothing else is tried.
+    const auto start = std::chrono::steady_clock::now();
+    addrinfo* result = nullptr;
+    const addrinfo hints = {.ai_family = AF_INET};
+    NetworkDnsEventReported event;
+    int rv = resolv_getaddrinfo("hello", nullptr, &hints, &mNetcontext, &result, &event);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    ScopedAddrinfo result_cleanup(result);
+
+    EXPECT_EQ(NETD_RESOLV_DEADLINE_EXCEEDED, rv);
+    EXPECT_TRUE(result == nullptr);
+    EXPECT_GE(elapsed, std::chrono::milliseconds(1500));
+    EXPECT_LT(elapsed, std::chrono::milliseconds(2500));
+    EXPECT_EQ(2U, GetNumQueries(dns, host_name));
+    const auto& queryEvents = event.dns_query_events().dns_query_event();
+    ASSERT_FALSE(queryEvents.empty());
+    EXPECT_EQ(NS_R_DEADLINE_EXCEEDED, queryEvents.rbegin()->rcode());
+}
+
 TEST_F(ResolvGetAddrInfoTest, CnamesNoIpAddress) {
     constexpr char ACNAME[] = "acname";  // expect a cname in answer
     constexpr char CNAMES[] = "cnames";  // expect cname chain in answer
@@ -1175,6 +1244,60 @@ TEST_F(ResolvGetAddrInfoTest, OverlengthResp) {
     EXPECT_EQ(GetNumQueriesForProtocol(dns, IPPROTO_TCP, kHelloExampleCom), 2U);
 }
 
+TEST_F(ResolvGetAddrInfoTest, NumericLookup) {
+    constexpr char custAddr[] = "1.2.3.4";
+    constexpr char custHostname[] = "cust.example.com";
+    test::DNSResponder dns;
+    ASSERT_TRUE(dns.startServer());
+    const aidl::android::net::ResolverOptionsParcel& resolverOptions = {
+            {{custAddr, custHostname}}, aidl::android::net::IDnsResolver::TC_MODE_DEFAULT};
+    const std::vector<int32_t>& transportTypes = {IDnsResolver::TRANSPORT_WIFI};
+    ASSERT_EQ(0, resolv_set_nameservers(TEST_NETID, servers, domains, params, resolverOptions,
+                                        transportTypes));
+
+    static const struct TestConfig {
+        const char* hostname;
+        int ai_family;
+        bool expected_numeric;
+        const std::string expected_addr;
+    } testConfigs[]{
+            {"5.6.7.8", AF_UNSPEC, true, "5.6.7.8"},
+            {"5.6.7.8", AF_INET, true, "5.6.7.8"},
+            {"2001:db8::1", AF_INET6, true, "2001:db8::1"},
+            // A numeric IPv4 hostname can't be answered for AF_INET6.
+            {"5.6.7.8", AF_INET6, false, ""},
+            // Names are left to resolv_getaddrinfo(), even if the hosts file or the customized
+            // hosts table has them.
+            {"localhost", AF_INET, false, ""},
+            {custHostname, AF_INET, false, ""},
+            {"sawadee.example.com", AF_INET, false, ""},
+    };
+
+    for (const auto& config : testConfigs) {
+        SCOPED_TRACE(StringPrintf("%s, family: %d", config.hostname, config.ai_family));
+
+        addrinfo* result = nullptr;
+        const addrinfo hints = {.ai_family = config.ai_family};
+        EXPECT_EQ(config.expected_numeric,
+                  resolv_getaddrinfo_numeric(config.hostname, nullptr, &hints, &result));
+        ScopedAddrinfo result_cleanup(result);
+        if (config.expected_numeric) {
+            EXPECT_EQ(config.expected_addr, ToString(result));
+        } else {
+            EXPECT_TRUE(result == nullptr);
+        }
+    }
+
+    // The service is checked against the socket type.
+    addrinfo* result = nullptr;
+    const addrinfo rawHints = {.ai_family = AF_INET, .ai_socktype = SOCK_RAW};
+    EXPECT_FALSE(resolv_getaddrinfo_numeric("5.6.7.8", "80", &rawHints, &result));
+    EXPECT_TRUE(result == nullptr);
+
+    // resolv_getaddrinfo_numeric() never sends a query.
+    EXPECT_EQ(0U, dns.queries().size());
+}
+
 TEST_F(GetHostByNameForNetContextTest, AlphabeticalHostname) {
     constexpr char host_name[] = "jiababuei.example.com.";
     constexpr char v4addr[] = "1.2.3.4";
@@ -23,6 +23,7 @@
 
 #include "params.h"
 
+#define RCODE_DEADLINE_EXCEEDED 253
 #define RCODE_INTERNAL_ERROR 254
 #define RCODE_TIMEOUT 255
 
@@ -40,12 +41,34 @@ struct res_stats {
     uint8_t sample_count;
     // The next sample to modify.
     uint8_t sample_next;
+    // Aggregates of the stored samples, updated as samples are added and overwritten, so that
+    // checking a server doesn't have to go through the samples.
+    uint8_t successes;
+    uint8_t errors;
+    uint8_t timeouts;
+    uint8_t internal_errors;
+    // The sum of the RTTs of the successful samples, in ms.
+    uint32_t rtt_sum;
+    // The moving average of the RTTs of the successful samples, in ms, weighted towards the
+    // latest ones. Unlike the aggregates above, older samples keep a small weight after they are
+    // overwritten. 0 until there is a successful sample.
+    float rtt_ewma;
 };
 
+// Clears all stored samples, and their aggregates, for the given server.
+void _res_stats_clear_samples(res_stats* stats);
+
+// Adds |sample| to |stats|, overwriting the oldest sample once |max_samples| are stored.
+void android_net_res_stats_add_sample(res_stats* stats, const res_sample& sample, int max_samples);
+
 // Aggregates the reachability statistics for the given server based on on the stored samples.
 void android_net_res_stats_aggregate(res_stats* stats, int* successes, int* errors, int* timeouts,
                                      int* internal_errors, int* rtt_avg, time_t* last_sample_time);
 
+// Returns true if the server with the given stats is considered usable. Unlike
+// android_net_res_stats_get_usable_servers(), this leaves stale samples in place.
+bool android_net_res_stats_usable_server(const res_params* params, const res_stats* stats);
+
 int android_net_res_stats_get_info_for_net(unsigned netid, int* nscount,
                                            sockaddr_storage servers[MAXNS], int* dcount,
                                            char domains[MAXDNSRCH][MAXDNSRCHPATH],
@@ -271,7 +271,9 @@ int DnsTlsFrontend::handleRequests(SSL* ssl, int clientFd) {
             return queryCounts;
         }
         ++queryCounts;
-    } while (poll(&fds, 1, 1) > 0);
+        // Several queries can arrive in a single TLS record, in which case the next one is
+        // already buffered by |ssl| and poll() doesn't see it.
+    } while (SSL_pending(ssl) > 0 || poll(&fds, 1, 1) > 0);
 
     LOG(DEBUG) << __func__ << " return: " << queryCounts;
     return queryCounts;
@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "doh_frontend.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <nghttp2/nghttp2.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#define LOG_TAG "DohFrontend"
+#include <android-base/logging.h>
+#include <netdutils/InternetAddresses.h>
+#include <netdutils/SocketOption.h>
+#include "dns_tls_certificate.h"
+
+using android::netdutils::enableSockopt;
+using android::netdutils::ScopedAddrinfo;
+
+namespace {
+
+bssl::UniquePtr<X509> stringToX509Certs(const char* certs) {
+    bssl::UniquePtr<BIO> bio(BIO_new_mem_buf(certs, strlen(certs)));
+    return bssl::UniquePtr<X509>(PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr));
+}
+
+// Convert a string buffer containing an RSA Private Key into an OpenSSL RSA struct.
+bssl::UniquePtr<RSA> stringToRSAPrivateKey(const char* key) {
+    bssl::UniquePtr<BIO> bio(BIO_new_mem_buf(key, strlen(key)));
+    return bssl::UniquePtr<RSA>(PEM_read_bio_RSAPrivateKey(bio.get(), nullptr, nullptr, nullptr));
+}
+
+std::string addr2str(const sockaddr* sa, socklen_t sa_len) {
+    char host_str[NI_MAXHOST] = {0};
+    int rv = getnameinfo(sa, sa_len, host_str, sizeof(host_str), nullptr, 0, NI_NUMERICHOST);
+    if (rv == 0) return std::string(host_str);
+    return std::string();
+}
+
+nghttp2_nv makeNv(const char* name, const char* value) {
+    return {reinterpret_cast<uint8_t*>(const_cast<char*>(name)),
+            reinterpret_cast<uint8_t*>(const_cast<char*>(value)), strlen(name), strlen(value),
+            NGHTTP2_NV_FLAG_NONE};
+}
+
+}  // namespace
+
+namespace test {
+
+// The server side of an HTTP/2 connection.  The requests completed by the bytes received
+// together are answered together, so that their streams are open at the same time.
+class DohFrontend::Connection {
+  public:
+    Connection(DohFrontend* frontend, bool first) : frontend_(frontend), first_(first) {}
+    ~Connection() { nghttp2_session_del(session_); }
+
+    // Sets up the session, and queues the server's settings.
+    bool initialize() {
+        nghttp2_session_callbacks* callbacks;
+        if (nghttp2_session_callbacks_new(&callbacks) != 0) return false;
+        nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, onBeginHeaders);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, onHeader);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, onDataChunk);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, onFrame);
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, onStreamClose);
+        const int rv = nghttp2_session_server_new(&session_, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+        if (rv != 0) return false;
+        const nghttp2_settings_entry settings[] = {
+                {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, frontend_->max_concurrent_streams_}};
+        return nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, settings,
+                                       std::size(settings)) == 0;
+    }
+
+    // Processes the bytes received from the client, and answers the requests they complete.
+    bool receive(const uint8_t* data, size_t size) {
+        if (nghttp2_session_mem_recv(session_, data, size) < 0) return false;
+        std::vector<int32_t> completed;
+        completed.swap(completed_);
+        for (const int32_t streamId : completed) {
+            if (!answer(streamId)) return false;
+        }
+        return true;
+    }
+
+    // Writes the bytes queued by the session to |ssl|.
+    bool flush(SSL* ssl) {
+        const uint8_t* data;
+        ssize_t size;
+        while ((size = nghttp2_session_mem_send(session_, &data)) > 0) {
+            if (SSL_write(ssl, data, size) != size) return false;
+        }
+        return size == 0;
+    }
+
+    bool wantIo() const {
+        return nghttp2_session_want_read(session_) || nghttp2_session_want_write(session_);
+    }
+
+  private:
+    struct Stream {
+        std::vector<uint8_t> body;
+        std::vector<uint8_t> response;
+        size_t sent = 0;
+    };
+
+    // Forwards the query on |streamId| to the backend, and submits the backend's response.
+    bool answer(int32_t streamId) {
+        if (going_away_) return true;
+        const auto it = streams_.find(streamId);
+        if (it == streams_.end()) return true;
+        Stream& stream = it->second;
+
+        const int backendFd = frontend_->backend_socket_.get();
+        const ssize_t sent = send(backendFd, stream.body.data(), stream.body.size(), 0);
+        if (sent != static_cast<ssize_t>(stream.body.size())) {
+            LOG(INFO) << "Failed to send query";
+            return false;
+        }
+        constexpr size_t max_size = 4096;
+        stream.response.resize(max_size);
+        const ssize_t rlen = recv(backendFd, stream.response.data(), max_size, 0);
+        if (rlen <= 0) {
+            LOG(INFO) << "Failed to receive response";
+            return false;
+        }
+        stream.response.resize(rlen);
+
+        const nghttp2_nv headers[] = {makeNv(":status", "200"),
+                                      makeNv("content-type", "application/dns-message")};
+        nghttp2_data_provider body = {.source = {}, .read_callback = readBody};
+        if (nghttp2_submit_response(session_, streamId, headers, std::size(headers), &body) != 0) {
+            LOG(INFO) << "Failed to submit response";
+            return false;
+        }
+        frontend_->queries_++;
+        answered_++;
+
+        const int goAwayAfter = frontend_->goaway_after_queries_;
+        if (first_ && goAwayAfter > 0 && answered_ >= goAwayAfter) {
+            // The client sends the streams after this one again on another connection.
+            LOG(DEBUG) << "Sending GOAWAY after stream " << streamId;
+            nghttp2_submit_goaway(session_, NGHTTP2_FLAG_NONE, streamId, NGHTTP2_NO_ERROR,
+                                  nullptr, 0);
+            going_away_ = true;
+        }
+        return true;
+    }
+
+    // The nghttp2 callbacks, which are given the Connection as user data.
+    static int onBeginHeaders(nghttp2_session*, const nghttp2_frame* frame, void* userData) {
+        auto* self = static_cast<Connection*>(userData);
+        if (frame->hd.type != NGHTTP2_HEADERS) return 0;
+        self->streams_[frame->hd.stream_id];
+        const int open = self->streams_.size();
+        if (open > self->frontend_->max_open_streams_) self->frontend_->max_open_streams_ = open;
+        return 0;
+    }
+
+    static int onHeader(nghttp2_session*, const nghttp2_frame*, const uint8_t* name,
+                        size_t nameLength, const uint8_t* value, size_t valueLength, uint8_t,
+                        void* userData) {
+        auto* self = static_cast<Connection*>(userData);
+        if (std::string(reinterpret_cast<const char*>(name), nameLength) == ":path") {
+            std::lock_guard lock(self->frontend_->path_mutex_);
+            self->frontend_->last_path_.assign(reinterpret_cast<const char*>(value), valueLength);
+        }
+        return 0;
+    }
+
+    static int onDataChunk(nghttp2_session*, uint8_t, int32_t streamId, const uint8_t* data,
+                           size_t length, void* userData) {
+        auto* self = static_cast<Connection*>(userData);
+        const auto it = self->streams_.find(streamId);
+        if (it == self->streams_.end()) return 0;
+        it->second.body.insert(it->second.body.end(), data, data + length);
+        return 0;
+    }
+
+    static int onFrame(nghttp2_session*, const nghttp2_frame* frame, void* userData) {
+        auto* self = static_cast<Connection*>(userData);
+        const bool isRequestFrame =
+                frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA;
+        if (isRequestFrame && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+            self->completed_.push_back(frame->hd.stream_id);
+        }
+        return 0;
+    }
+
+    static int onStreamClose(nghttp2_session*, int32_t streamId, uint32_t, void* userData) {
+        auto* self = static_cast<Connection*>(userData);
+        self->streams_.erase(streamId);
+        return 0;
+    }
+
+    static ssize_t readBody(nghttp2_session*, int32_t streamId, uint8_t* buf, size_t length,
+                            uint32_t* dataFlags, nghttp2_data_source*, void* userData) {
+        auto* self = static_cast<Connection*>(userData);
+        const auto it = self->streams_.find(streamId);
+        if (it == self->streams_.end()) return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        Stream& stream = it->second;
+        const size_t size = std::min(length, stream.response.size() - stream.sent);
+        memcpy(buf, stream.response.data() + stream.sent, size);
+        stream.sent += size;
+        if (stream.sent == stream.response.size()) *dataFlags |= NGHTTP2_DATA_FLAG_EOF;
+        return size;
+    }
+
+    DohFrontend* const frontend_;
+    // Whether this is the first connection of the frontend.
+    const bool first_;
+    nghttp2_session* session_ = nullptr;
+    // Open streams, by stream ID.
+    std::map<int32_t, Stream> streams_;
+    // Streams whose request has been received entirely, and which are waiting for an answer.
+    std::vector<int32_t> completed_;
+    int answered_ = 0;
+    bool going_away_ = false;
+};
+
+bool DohFrontend::startServer() {
+    OpenSSL_add_ssl_algorithms();
+
+    // reset queries_ to 0 every time startServer called
+    // which would help us easy to check queries_ via calling waitForQueries
+    queries_ = 0;
+
+    ctx_.reset(SSL_CTX_new(TLS_server_method()));
+    if (!ctx_) {
+        LOG(ERROR) << "SSL context creation failed";
+        return false;
+    }
+
+    SSL_CTX_set_ecdh_auto(ctx_.get(), 1);
+    SSL_CTX_set_alpn_select_cb(ctx_.get(), selectAlpn, this);
+
+    bssl::UniquePtr<X509> ca_certs(stringToX509Certs(kCertificate));
+    if (!ca_certs) {
+        LOG(ERROR) << "StringToX509Certs failed";
+        return false;
+    }
+
+    if (SSL_CTX_use_certificate(ctx_.get(), ca_certs.get()) <= 0) {
+        LOG(ERROR) << "SSL_CTX_use_certificate failed";
+        return false;
+    }
+
+    bssl::UniquePtr<RSA> private_key(stringToRSAPrivateKey(kPrivatekey));
+    if (SSL_CTX_use_RSAPrivateKey(ctx_.get(), private_key.get()) <= 0) {
+        LOG(ERROR) << "Error loading client RSA Private Key data.";
+        return false;
+    }
+
+    // Set up TCP server socket for clients.
+    addrinfo frontend_ai_hints{
+            .ai_flags = AI_PASSIVE,
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+    };
+    addrinfo* frontend_ai_res = nullptr;
+    int rv = getaddrinfo(listen_address_.c_str(), listen_service_.c_str(), &frontend_ai_hints,
+                         &frontend_ai_res);
+    ScopedAddrinfo frontend_ai_res_cleanup(frontend_ai_res);
+    if (rv) {
+        LOG(ERROR) << "frontend getaddrinfo(" << listen_address_.c_str() << ", "
+                   << listen_service_.c_str() << ") failed: " << gai_strerror(rv);
+        return false;
+    }
+
+    for (const addrinfo* ai = frontend_ai_res; ai; ai = ai->ai_next) {
+        android::base::unique_fd s(socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+        if (s.get() < 0) {
+            PLOG(INFO) << "ignore creating socket failed " << s.get();
+            continue;
+        }
+        enableSockopt(s.get(), SOL_SOCKET, SO_REUSEPORT).ignoreError();
+        enableSockopt(s.get(), SOL_SOCKET, SO_REUSEADDR).ignoreError();
+        std::string host_str = addr2str(ai->ai_addr, ai->ai_addrlen);
+        if (bind(s.get(), ai->ai_addr, ai->ai_addrlen)) {
+            PLOG(INFO) << "failed to bind TCP " << host_str.c_str() << ":"
+                       << listen_service_.c_str();
+            continue;
+        }
+        LOG(INFO) << "bound to TCP " << host_str.c_str() << ":" << listen_service_.c_str();
+        socket_ = std::move(s);
+        break;
+    }
+
+    if (listen(socket_.get(), 1) < 0) {
+        PLOG(INFO) << "failed to listen socket " << socket_.get();
+        return false;
+    }
+
+    // Set up UDP client socket to backend.
+    addrinfo backend_ai_hints{.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+    addrinfo* backend_ai_res = nullptr;
+    rv = getaddrinfo(backend_address_.c_str(), backend_service_.c_str(), &backend_ai_hints,
+                     &backend_ai_res);
+    ScopedAddrinfo backend_ai_res_cleanup(backend_ai_res);
+    if (rv) {
+        LOG(ERROR) << "backend getaddrinfo(" << backend_address_.c_str() << ", "
+                   << backend_service_.c_str() << ") failed: " << gai_strerror(rv);
+        return false;
+    }
+    backend_socket_.reset(socket(backend_ai_res->ai_family, backend_ai_res->ai_socktype,
+                                 backend_ai_res->ai_protocol));
+    if (backend_socket_.get() < 0) {
+        PLOG(INFO) << "backend socket " << backend_socket_.get() << " creation failed";
+        return false;
+    }
+    // As in DnsTlsFrontend, tests which send no query may have no backend.
+    connect(backend_socket_.get(), backend_ai_res->ai_addr, backend_ai_res->ai_addrlen);
+
+    // Set up eventfd socket.
+    event_fd_.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if (event_fd_.get() == -1) {
+        PLOG(INFO) << "failed to create eventfd " << event_fd_.get();
+        return false;
+    }
+
+    {
+        std::lock_guard lock(update_mutex_);
+        handler_thread_ = std::thread(&DohFrontend::requestHandler, this);
+    }
+    LOG(INFO) << "server started successfully";
+    return true;
+}
+
+int DohFrontend::selectAlpn(SSL*, const uint8_t** out, uint8_t* outLength, const uint8_t* in,
+                            unsigned inLength, void* arg) {
+    auto* self = static_cast<DohFrontend*>(arg);
+    if (!self->alpn_h2_) return SSL_TLSEXT_ERR_NOACK;
+    // Returns 1 only if "h2" is in the list offered by the client.
+    if (nghttp2_select_next_protocol(const_cast<uint8_t**>(out), outLength, in, inLength) != 1) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void DohFrontend::requestHandler() {
+    LOG(DEBUG) << "Request handler started";
+    enum { EVENT_FD = 0, LISTEN_FD = 1 };
+    pollfd fds[2] = {{.fd = event_fd_.get(), .events = POLLIN},
+                     {.fd = socket_.get(), .events = POLLIN}};
+
+    while (true) {
+        int poll_code = poll(fds, std::size(fds), -1);
+        if (poll_code <= 0) {
+            PLOG(WARNING) << "Poll failed with error " << poll_code;
+            break;
+        }
+
+        if (fds[EVENT_FD].revents & (POLLIN | POLLERR)) {
+            handleEventFd();
+            break;
+        }
+        if (fds[LISTEN_FD].revents & (POLLIN | POLLERR)) {
+            sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+
+            LOG(DEBUG) << "Trying to accept a client";
+            android::base::unique_fd client(
+                    accept4(socket_.get(), reinterpret_cast<sockaddr*>(&addr), &len, SOCK_CLOEXEC));
+            if (client.get() < 0) {
+                // Stop
+                PLOG(INFO) << "failed to accept client socket " << client.get();
+                break;
+            }
+            const bool first = (++accept_connection_count_ == 1);
+
+            bssl::UniquePtr<SSL> ssl(SSL_new(ctx_.get()));
+            SSL_set_fd(ssl.get(), client.get());
+
+            LOG(DEBUG) << "Doing SSL handshake";
+            if (SSL_accept(ssl.get()) <= 0) {
+                LOG(INFO) << "SSL negotiation failure";
+            } else {
+                LOG(DEBUG) << "SSL handshake complete";
+                handleConnection(ssl.get(), client.get(), first);
+            }
+        }
+    }
+    LOG(DEBUG) << "Ending loop";
+}
+
+void DohFrontend::handleConnection(SSL* ssl, int clientFd, bool first) {
+    Connection connection(this, first);
+    if (!connection.initialize()) {
+        LOG(ERROR) << "HTTP/2 session creation failed";
+        return;
+    }
+
+    enum { EVENT_FD = 0, CLIENT_FD = 1 };
+    pollfd fds[2] = {{.fd = event_fd_.get(), .events = POLLIN},
+                     {.fd = clientFd, .events = POLLIN}};
+    uint8_t buffer[16384];
+    while (connection.flush(ssl) && connection.wantIo()) {
+        // Data already decrypted by |ssl| doesn't show up in poll().
+        if (SSL_pending(ssl) == 0) {
+            if (poll(fds, std::size(fds), -1) <= 0) {
+                PLOG(WARNING) << "Poll failed";
+                return;
+            }
+            // The termination signal is left for requestHandler().
+            if (fds[EVENT_FD].revents & (POLLIN | POLLERR)) return;
+        }
+        const int ret = SSL_read(ssl, buffer, sizeof(buffer));
+        if (ret <= 0) {
+            LOG(DEBUG) << "Connection closed";
+            return;
+        }
+        if (!connection.receive(buffer, ret)) {
+            LOG(INFO) << "Error while processing requests";
+            return;
+        }
+    }
+    LOG(DEBUG) << "HTTP/2 session over";
+}
+
+std::string DohFrontend::lastPath() const {
+    std::lock_guard lock(path_mutex_);
+    return last_path_;
+}
+
+bool DohFrontend::stopServer() {
+    std::lock_guard lock(update_mutex_);
+    if (!running()) {
+        LOG(INFO) << "server not running";
+        return false;
+    }
+
+    LOG(INFO) << "stopping frontend";
+    if (!sendToEventFd()) {
+        return false;
+    }
+    handler_thread_.join();
+    socket_.reset();
+    backend_socket_.reset();
+    event_fd_.reset();
+    ctx_.reset();
+    LOG(INFO) << "frontend stopped successfully";
+    return true;
+}
+
+bool DohFrontend::waitForQueries(int expected_count) const {
+    constexpr int intervalMs = 20;
+    constexpr int timeoutMs = 5000;
+    int limit = timeoutMs / intervalMs;
+    for (int count = 0; count <= limit; ++count) {
+        if (queries_ >= expected_count) return true;
+        usleep(intervalMs * 1000);
+    }
+    return false;
+}
+
+bool DohFrontend::sendToEventFd() {
+    const uint64_t data = 1;
+    if (const ssize_t rt = write(event_fd_.get(), &data, sizeof(data)); rt != sizeof(data)) {
+        PLOG(INFO) << "failed to write eventfd, rt=" << rt;
+        return false;
+    }
+    return true;
+}
+
+void DohFrontend::handleEventFd() {
+    int64_t data;
+    if (const ssize_t rt = read(event_fd_.get(), &data, sizeof(data)); rt != sizeof(data)) {
+        PLOG(INFO) << "ignore reading eventfd failed, rt=" << rt;
+    }
+}
+
+}  // namespace test
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef DOH_FRONTEND_H
+#define DOH_FRONTEND_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <openssl/ssl.h>
+
+namespace test {
+
+/*
+ * Simple DNS-over-HTTPS (RFC 8484) reverse proxy that forwards to a UDP backend.
+ * It negotiates HTTP/2 with ALPN, and serves a single connection at a time.
+ */
+class DohFrontend {
+  public:
+    DohFrontend(const std::string& listen_address = kDefaultListenAddr,
+                const std::string& listen_service = kDefaultListenService,
+                const std::string& backend_address = kDefaultBackendAddr,
+                const std::string& backend_service = kDefaultBackendService)
+        : listen_address_(listen_address),
+          listen_service_(listen_service),
+          backend_address_(backend_address),
+          backend_service_(backend_service) {}
+    ~DohFrontend() { stopServer(); }
+    const std::string& listen_address() const { return listen_address_; }
+    const std::string& listen_service() const { return listen_service_; }
+    bool running() const { return socket_ != -1; }
+    bool startServer();
+    bool stopServer();
+
+    int queries() const { return queries_; }
+    bool waitForQueries(int expected_count) const;
+    int acceptConnectionsCount() const { return accept_connection_count_; }
+    // The most streams that were open at the same time on a connection.
+    int maxOpenStreams() const { return max_open_streams_; }
+    std::string lastPath() const EXCLUDES(path_mutex_);
+
+    // If false, the server doesn't select "h2" with ALPN, like a DNS-over-TLS server.
+    void setAlpnH2(bool alpnH2) { alpn_h2_ = alpnH2; }
+    // The SETTINGS_MAX_CONCURRENT_STREAMS announced by the server.
+    void setMaxConcurrentStreams(uint32_t max) { max_concurrent_streams_ = max; }
+    // If positive, the first connection is sent a GOAWAY once the server has answered
+    // |count| queries, and the queries that follow on that connection are left unprocessed.
+    void setGoAwayAfterQueries(int count) { goaway_after_queries_ = count; }
+
+    static constexpr char kDefaultListenAddr[] = "127.0.0.3";
+    static constexpr char kDefaultListenService[] = "443";
+    static constexpr char kDefaultBackendAddr[] = "127.0.0.3";
+    static constexpr char kDefaultBackendService[] = "53";
+
+  private:
+    class Connection;
+
+    void requestHandler();
+    // Serves the HTTP/2 connection on |ssl| until it is closed.
+    void handleConnection(SSL* ssl, int clientFd, bool first);
+
+    // Trigger the handler thread to terminate.
+    bool sendToEventFd();
+
+    // Used in the handler thread for the termination signal.
+    void handleEventFd();
+
+    static int selectAlpn(SSL* ssl, const uint8_t** out, uint8_t* outLength, const uint8_t* in,
+                          unsigned inLength, void* arg);
+
+    std::string listen_address_;
+    std::string listen_service_;
+    std::string backend_address_;
+    std::string backend_service_;
+    bssl::UniquePtr<SSL_CTX> ctx_;
+    // Socket on which the server is listening for a TCP connection with a client.
+    android::base::unique_fd socket_;
+    // Socket used to communicate with the backend DNS server.
+    android::base::unique_fd backend_socket_;
+    // Eventfd used to signal for the handler thread termination.
+    android::base::unique_fd event_fd_;
+    std::atomic<int> queries_ = 0;
+    std::atomic<int> accept_connection_count_ = 0;
+    std::atomic<int> max_open_streams_ = 0;
+    std::thread handler_thread_ GUARDED_BY(update_mutex_);
+    std::mutex update_mutex_;
+    mutable std::mutex path_mutex_;
+    std::string last_path_ GUARDED_BY(path_mutex_);
+    std::atomic<bool> alpn_h2_ = true;
+    std::atomic<uint32_t> max_concurrent_streams_ = 100;
+    std::atomic<int> goaway_after_queries_ = 0;
+};
+
+}  // namespace test
+
+#endif  // DOH_FRONTEND_H
@@ -329,6 +329,35 @@ TEST_F(DnsResolverBinderTest, GetResolverInfo) {
     EXPECT_THAT(res_domains, testing::UnorderedElementsAreArray(domains));
 }
 
+TEST_F(DnsResolverBinderTest, GetServerLatencies) {
+    SKIP_IF_REMOTE_VERSION_LESS_THAN(mDnsResolver.get(), 7);
+    const std::vector<std::string> servers = {"127.0.0.1", "127.0.0.2"};
+    const auto resolverParams = DnsResponderClient::makeResolverParamsParcel(
+            TEST_NETID, kDefaultParams, servers, {"example.com"}, "", {});
+    ::ndk::ScopedAStatus status = mDnsResolver->setResolverConfiguration(resolverParams);
+    EXPECT_TRUE(status.isOk()) << status.getMessage();
+
+    std::vector<std::string> resServers;
+    std::vector<int32_t> latencies;
+    status = mDnsResolver->getServerLatencies(TEST_NETID, IDnsResolver::PROTOCOL_UDP, &resServers,
+                                              &latencies);
+    EXPECT_TRUE(status.isOk()) << status.getMessage();
+    EXPECT_THAT(resServers, testing::UnorderedElementsAreArray(servers));
+    ASSERT_EQ(servers.size() * IDnsResolver::RESOLVER_LATENCY_COUNT, latencies.size());
+    // No queries yet.
+    for (size_t i = 0; i < servers.size(); i++) {
+        EXPECT_EQ(0, latencies[i * IDnsResolver::RESOLVER_LATENCY_COUNT +
+                               IDnsResolver::RESOLVER_LATENCY_SAMPLES]);
+    }
+
+    EXPECT_EQ(EINVAL, mDnsResolver->getServerLatencies(TEST_NETID, 0, &resServers, &latencies)
+                              .getServiceSpecificError());
+    EXPECT_EQ(ENONET,
+              mDnsResolver->getServerLatencies(-1, IDnsResolver::PROTOCOL_UDP, &resServers,
+                                               &latencies)
+                      .getServiceSpecificError());
+}
+
 TEST_F(DnsResolverBinderTest, CreateDestroyNetworkCache) {
     // Must not be the same as TEST_NETID
     const int ANOTHER_TEST_NETID = TEST_NETID + 1;
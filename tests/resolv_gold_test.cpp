@@ -128,9 +128,8 @@ class TestBase : public ::testing::Test {
         constexpr milliseconds timeoutMs{3000};
         android::base::Timer t;
         while (t.duration() < timeoutMs) {
-            const auto& validatedServers =
-                    gPrivateDnsConfiguration.getStatus(TEST_NETID).validatedServers();
-            for (const auto& server : validatedServers) {
+            const auto status = gPrivateDnsConfiguration.getStatus(TEST_NETID);
+            for (const auto& server : status->validatedServers()) {
                 if (serverAddr == ToString(&server.ss)) return true;
             }
             std::this_thread::sleep_for(retryIntervalMs);